@@ -0,0 +1,169 @@
+#include "brush_tip.h"
+#include "tiff_io.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Average 2x2 blocks of a level into the next one. The last row or column
+   of an odd size is its own neighbour. */
+static void
+tip_level_downsample (const TipLevel *source, TipLevel *target)
+{
+  int x, y;
+  target->width = (source->width + 1) / 2;
+  target->height = (source->height + 1) / 2;
+  target->coverage
+      = malloc (sizeof (float) * target->width * target->height);
+  for (y = 0; y < target->height; ++y)
+    {
+      const float *a = source->coverage + 2 * y * source->width;
+      const float *b
+          = source->coverage
+            + min (2 * y + 1, source->height - 1) * source->width;
+      float *out = target->coverage + y * target->width;
+      for (x = 0; x < target->width; ++x)
+        {
+          const int right = min (2 * x + 1, source->width - 1);
+          out[x] = 0.25f * (a[2 * x] + a[right] + b[2 * x] + b[right]);
+        }
+    }
+}
+
+BrushTip *
+brush_tip_new_from_image (const image_t *image)
+{
+  BrushTip *tip = malloc (sizeof (BrushTip));
+  TipLevel *level;
+  int width = image->width, height = image->height;
+  unsigned int x, y;
+  tip->level_count = 1;
+  tip->references = 1;
+  while (width > 1 || height > 1)
+    {
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+      tip->level_count += 1;
+    }
+  tip->levels = malloc (sizeof (TipLevel) * tip->level_count);
+  level = tip->levels;
+  level->width = image->width;
+  level->height = image->height;
+  level->coverage = malloc (sizeof (float) * image->width * image->height);
+  for (y = 0; y < image->height; ++y)
+    {
+      for (x = 0; x < image->width; ++x)
+        {
+          const color *pixel = image_pixel (image, x, y);
+          const float lightness
+              = (pixel->red + pixel->green + pixel->blue) / 3;
+          level->coverage[y * image->width + x]
+              = fminf (fmaxf (pixel->alpha * (1 - lightness), 0), 1);
+        }
+    }
+  for (level = tip->levels + 1; level < tip->levels + tip->level_count;
+       ++level)
+    {
+      tip_level_downsample (level - 1, level);
+    }
+  return tip;
+}
+
+BrushTip *
+brush_tip_load (const char *file_name)
+{
+  unsigned int pages = 0, page;
+  image_t **images = tiff_io_load (file_name, &pages);
+  BrushTip *tip = NULL;
+  if (pages > 0)
+    {
+      tip = brush_tip_new_from_image (images[0]);
+    }
+  else
+    {
+      fprintf (stderr, "%s: could not be loaded as a brush tip\n",
+               file_name);
+    }
+  for (page = 0; page < pages; ++page)
+    {
+      image_del (images[page]);
+    }
+  free (images);
+  return tip;
+}
+
+void
+brush_tip_del (BrushTip *tip)
+{
+  int level;
+  if (tip == NULL || --tip->references > 0)
+    {
+      return;
+    }
+  for (level = 0; level < tip->level_count; ++level)
+    {
+      free (tip->levels[level].coverage);
+    }
+  free (tip->levels);
+  free (tip);
+}
+
+BrushTip *
+brush_tip_ref (BrushTip *tip)
+{
+  if (tip != NULL)
+    {
+      tip->references += 1;
+    }
+  return tip;
+}
+
+static float
+tip_level_texel (const TipLevel *level, int x, int y)
+{
+  return x >= 0 && y >= 0 && x < level->width && y < level->height
+             ? level->coverage[y * level->width + x]
+             : 0;
+}
+
+/* Bilinear, at a position from 0 to 1 across the level either way. */
+static float
+tip_level_sample (const TipLevel *level, double s, double t)
+{
+  const double u = s * level->width - 0.5;
+  const double v = t * level->height - 0.5;
+  const int x = floor (u), y = floor (v);
+  const float fx = u - x, fy = v - y;
+  const float top = tip_level_texel (level, x, y) * (1 - fx)
+                    + tip_level_texel (level, x + 1, y) * fx;
+  const float bottom = tip_level_texel (level, x, y + 1) * (1 - fx)
+                       + tip_level_texel (level, x + 1, y + 1) * fx;
+  return top * (1 - fy) + bottom * fy;
+}
+
+void
+brush_tip_row (const BrushTip *tip, double x, double y, double radius,
+               int i, int j, int n, float *coverage)
+{
+  /* Texels of level 0 per canvas pixel decide the levels. */
+  const double size = 2 * radius;
+  const double lod
+      = fmin (fmax (log2 (max (tip->levels[0].width, tip->levels[0].height)
+                          / size),
+                    0),
+              tip->level_count - 1);
+  const int level = lod;
+  const float between = lod - level;
+  const TipLevel *fine = tip->levels + level;
+  const TipLevel *coarse = tip->levels + min (level + 1, tip->level_count - 1);
+  const double t = (j - y + radius) / size;
+  int k;
+  for (k = 0; k < n; ++k)
+    {
+      const double s = (i + k - x + radius) / size;
+      const float a = tip_level_sample (fine, s, t);
+      coverage[k] = between > 0
+                        ? a + (tip_level_sample (coarse, s, t) - a) * between
+                        : a;
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "drawing.h"
+
+/* Bitmap brush tips: the shape of a dab taken from an image instead of the
+   round falloff. The image is prefiltered into a mip chain of coverage
+   once when it is loaded, so a dab of any radius samples the one or two
+   levels closest to its size and costs as much as its area, not the
+   image's. */
+
+typedef struct TipLevel TipLevel;
+
+struct TipLevel
+{
+  float *coverage;
+  int width, height;
+};
+
+struct BrushTip
+{
+  TipLevel *levels; /* Level 0 is the image, each next one half of it. */
+  int level_count;
+  int references; /* Brushes and recorded strokes holding it. */
+};
+
+/* A tip from the first page of a TIFF file. Dark opaque pixels paint, white
+   or transparent ones do not. Returns NULL if it cannot be read. A new tip
+   has one reference, brush_tip_del drops one and frees the tip with the
+   last. */
+BrushTip *brush_tip_load (const char *file_name);
+BrushTip *brush_tip_new_from_image (const image_t *image);
+void brush_tip_del (BrushTip *tip);
+
+/* Another reference to a tip, which may be NULL. Returns it. */
+BrushTip *brush_tip_ref (BrushTip *tip);
+
+/* The coverage of n pixels of row j from column i, for a dab centered at
+   x, y that fits the tip in a square of twice the radius. */
+void brush_tip_row (const BrushTip *tip, double x, double y, double radius,
+                    int i, int j, int n, float *coverage);
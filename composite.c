@@ -0,0 +1,289 @@
+#include "composite.h"
+#include "tile_cache.h"
+#include "trace.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THUMBNAIL_CHUNK 64 /* Thumbnail columns per task. */
+
+/* Composite a row of a premultiplied layer onto a row of the scratch
+   buffer with its blend mode, in spans that are contiguous in the layer's
+   tiles. */
+static void
+composite_row_premultiplied (color *row, const FloatingLayer *layer, int x,
+                             int y, int width)
+{
+  const image_t *image = layer->image;
+  const float opacity = layer->alpha;
+  const int end = min (width, (int)image->width - x);
+  int j = max (-x, 0);
+  while (j < end)
+    {
+      const int span
+          = min (end - j, IMAGE_TILE_SIZE - ((x + j) & IMAGE_TILE_MASK));
+      if (!tile_cache_is_blank (image, image_tile_index (image, x + j, y)))
+        { /* Rather than bring back transparent tiles. */
+          color_blend_modes[layer->mode].span (
+              row + j, image_pixel (image, x + j, y), 1, &opacity, 0, span);
+        }
+      j += span;
+    }
+}
+
+/* The same for 16 bit layers, into a row of 16 bit pixels. */
+static void
+composite_row_uint16 (uint16_t *row, const FloatingLayer *layer, int x, int y,
+                      int width)
+{
+  const image_t *image = layer->image;
+  const uint16_t opacity = lrint (layer->alpha * 65535);
+  const int end = min (width, (int)image->width - x);
+  int j = max (-x, 0);
+  while (j < end)
+    {
+      const int span
+          = min (end - j, IMAGE_TILE_SIZE - ((x + j) & IMAGE_TILE_MASK));
+      if (!tile_cache_is_blank (image, image_tile_index (image, x + j, y)))
+        {
+          pixel16_span_over_mode (layer->mode, row + 4 * j,
+                                  image_pixel16 (image, x + j, y), opacity,
+                                  span);
+        }
+      j += span;
+    }
+}
+
+/* Composite a band of rows of 16 bit layers without going through
+   floats. */
+static void
+composite_band_uint16 (FloatingDrawing *drawing, uint16_t *scratch, int x,
+                       int y, int width, int height, int image_height)
+{
+  int layer, i;
+  memset ((void *)scratch, 0, 4 * sizeof (uint16_t) * width * height);
+  for (layer = 0; layer < drawing->layer_count; ++layer)
+    {
+      const FloatingLayer *current = drawing->layers[layer];
+      if (!current->is_visible)
+        {
+          continue;
+        }
+      tile_cache_touch (current->image, x, y, width, height);
+#pragma omp parallel
+      {
+        trace_begin ("composite worker");
+#pragma omp for nowait
+        for (i = 0; i < height; ++i)
+          {
+            if (y + i >= 0 && y + i < image_height)
+              {
+                composite_row_uint16 (scratch + 4 * i * width, current, x,
+                                      y + i, width);
+              }
+          }
+        trace_end ("composite worker");
+      }
+    }
+}
+
+void
+composite_band (FloatingDrawing *drawing, color *scratch, int x, int y,
+                int width, int height, int image_width, int image_height)
+{
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  if (drawing->layer_format == LAYER_FORMAT_UINT16)
+    {
+      composite_band_uint16 (drawing, (uint16_t *)scratch, x, y, width,
+                             height, image_height);
+      return;
+    }
+  memset ((void *)scratch, 0, sizeof (color) * width * height);
+  const FloatingLayer *bottom = NULL;
+  int layer;
+
+  for (layer = 0; layer < drawing->layer_count; ++layer)
+    {
+      const FloatingLayer *current = drawing->layers[layer];
+      if (!current->is_visible)
+        {
+          continue;
+        }
+      if (bottom == NULL)
+        {
+          bottom = current;
+        }
+      tile_cache_touch (current->image, x, y, width, height);
+      int i;
+#pragma omp parallel
+      {
+        trace_begin ("composite worker");
+#pragma omp for nowait
+        for (i = 0; i < height; ++i)
+          {
+            if (is_premultiplied)
+              { /* Plain over, no division. */
+                if (y + i >= 0 && y + i < image_height)
+                  {
+                    composite_row_premultiplied (scratch + i * width,
+                                                 current, x, y + i,
+                                                 width);
+                  }
+                continue;
+              }
+            int j;
+#pragma omp parallel for
+            for (j = 0; j < width; ++j)
+              {
+                unsigned int scratch_index = i * width + j;
+                if (x + j >= 0 && x + j < image_width
+                    && y + i < image_height && y + i >= 0)
+                  {
+                    color final_color = scratch[scratch_index];
+                    color current_color
+                        = *image_pixel (current->image, x + j, y + i);
+                    if (current->mode != BLEND_MODE_NORMAL)
+                      { /* Through the premultiplied kernel. */
+                        const float opacity = current->alpha;
+                        color_span_premultiply (&final_color, 1);
+                        color_span_premultiply (&current_color, 1);
+                        color_blend_modes[current->mode].span (
+                            &final_color, &current_color, 0,
+                            &opacity, 0, 1);
+                        color_span_unpremultiply (&final_color, 1);
+                      }
+                    else if (current != bottom)
+                      {
+                        if (current->alpha > 0
+                            && current_color.alpha > 0)
+                          {
+                            const float alpha = final_color.alpha;
+                            const float current_alpha
+                                = current_color.alpha;
+                            const float inv_alpha
+                                = 1
+                                  / (alpha * (1 - current_alpha)
+                                     + current->alpha * current_alpha);
+                            color_multiply_single_struct (
+                                final_color.alpha, final_color.vector,
+                                &final_color);
+                            color_multiply_single_struct (
+                                current->alpha, current_color.vector,
+                                &current_color);
+                            color_blend_absorb_single (
+                                current_alpha, &final_color,
+                                &current_color, &final_color);
+                            color_multiply_single_struct (
+                                inv_alpha, final_color.vector,
+                                &final_color);
+                            final_color.alpha = fmin (
+                                1.0,
+                                alpha + current->alpha * current_alpha);
+                          }
+                      }
+                    else
+                      {
+                        final_color = current_color;
+                        final_color.alpha
+                            = current->alpha * final_color.alpha;
+                      }
+                    scratch[scratch_index] = final_color;
+                  }
+              }
+          }
+        trace_end ("composite worker");
+      }
+    }
+}
+
+Thumbnail *
+thumbnail_new (int image_width, int image_height, int size)
+{
+  Thumbnail *thumbnail = malloc (sizeof (Thumbnail));
+  const int longest = max (image_width, image_height);
+  thumbnail->factor = max (1, (longest + size - 1) / size);
+  thumbnail->width = (image_width + thumbnail->factor - 1) / thumbnail->factor;
+  thumbnail->height
+      = (image_height + thumbnail->factor - 1) / thumbnail->factor;
+  thumbnail->image_width = image_width;
+  thumbnail->image_height = image_height;
+  thumbnail->pixels = aligned_alloc (
+      16, sizeof (color) * thumbnail->width * thumbnail->height);
+  memset ((void *)thumbnail->pixels, 0,
+          sizeof (color) * thumbnail->width * thumbnail->height);
+  return thumbnail;
+}
+
+void
+thumbnail_del (Thumbnail *thumbnail)
+{
+  free (thumbnail->pixels);
+  free (thumbnail);
+}
+
+/* Split into columns, so that there is work for every thread even when a
+   whole band goes into one row of the thumbnail. */
+void
+thumbnail_add_band (Thumbnail *thumbnail, const FloatingDrawing *drawing,
+                    const color *scratch, int y, int height)
+{
+  const int factor = thumbnail->factor;
+  const int image_width = thumbnail->image_width;
+  const int is_uint16 = drawing->layer_format == LAYER_FORMAT_UINT16;
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  const int chunks
+      = (thumbnail->width + THUMBNAIL_CHUNK - 1) / THUMBNAIL_CHUNK;
+  int chunk;
+#pragma omp parallel for
+  for (chunk = 0; chunk < chunks; ++chunk)
+    {
+      const int x = chunk * THUMBNAIL_CHUNK * factor;
+      const int width = min (THUMBNAIL_CHUNK * factor, image_width - x);
+      color *converted
+          = is_uint16 ? aligned_alloc (16, sizeof (color) * width) : NULL;
+      int i;
+      for (i = 0; i < height; ++i)
+        {
+          const color *row = scratch + i * image_width + x;
+          if (is_uint16)
+            {
+              pixel16_span_to_color (
+                  converted,
+                  (const uint16_t *)scratch + 4 * (i * image_width + x),
+                  width);
+              row = converted;
+            }
+          color_span_box_add (thumbnail->pixels
+                                  + (y + i) / factor * thumbnail->width
+                                  + chunk * THUMBNAIL_CHUNK,
+                              row, factor, width, is_premultiplied);
+        }
+      free (converted);
+    }
+}
+
+void
+thumbnail_finish (Thumbnail *thumbnail, int is_premultiplied)
+{
+  const int factor = thumbnail->factor;
+  int y;
+#pragma omp parallel for
+  for (y = 0; y < thumbnail->height; ++y)
+    {
+      const int rows = min (factor, thumbnail->image_height - y * factor);
+      color *row = thumbnail->pixels + y * thumbnail->width;
+      int x;
+      for (x = 0; x < thumbnail->width; ++x)
+        {
+          const int columns
+              = min (factor, thumbnail->image_width - x * factor);
+          color_multiply_single_struct (1.0f / (rows * columns),
+                                        row[x].vector, row + x);
+        }
+      if (!is_premultiplied)
+        {
+          color_span_unpremultiply (row, thumbnail->width);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "drawing.h"
+
+/* Flattening the layer stack, a band of rows at a time, for the display
+   and for saving. */
+
+/* Composite the visible layers over a band of rows into a scratch buffer
+   of colors, or of 16 bit pixels (in half of it) for 16 bit layers. The
+   band may reach outside of the canvas, those pixels are left clear. */
+void composite_band (FloatingDrawing *drawing, color *scratch, int x, int y,
+                     int width, int height, int image_width,
+                     int image_height);
+
+#define THUMBNAIL_EXTENSION ".thumbnail.tif"
+
+typedef struct Thumbnail Thumbnail;
+
+/* A reduction of the composite by an integer factor, no larger than a size
+   either way, built from the composited bands as they go by. Each pixel is
+   the average of a box of the canvas, taken with premultiplied colors so
+   that transparent pixels do not darken the edges of the paint. */
+struct Thumbnail
+{
+  int factor;        /* Canvas pixels per thumbnail pixel, each way. */
+  int width, height; /* Of the thumbnail. */
+  int image_width, image_height;
+  color *pixels; /* Premultiplied sums, then the averages. */
+};
+
+Thumbnail *thumbnail_new (int image_width, int image_height, int size);
+void thumbnail_del (Thumbnail *thumbnail);
+
+/* Add the rows of a band composited by composite_band at full width. */
+void thumbnail_add_band (Thumbnail *thumbnail,
+                         const FloatingDrawing *drawing,
+                         const color *scratch, int y, int height);
+
+/* Turn the sums into averages, premultiplied or not. */
+void thumbnail_finish (Thumbnail *thumbnail, int is_premultiplied);
@@ -0,0 +1,523 @@
+#include "document.h"
+#include "io.h"
+#include "tile_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DOCUMENT_MAGIC "FLOATDOC"
+#define DOCUMENT_VERSION 1
+#define DOCUMENT_PAGE 4096
+#define DOCUMENT_TILE_BYTES (sizeof (color) * IMAGE_TILE_PIXELS)
+#define DOCUMENT_LAYER_PREMULTIPLIED 0x1
+#define DOCUMENT_LAYER_HIDDEN 0x2
+#define DOCUMENT_LAYER_LINEAR 0x4
+
+typedef struct DocumentHeader DocumentHeader;
+typedef struct DocumentLayerEntry DocumentLayerEntry;
+
+/* Stored at the start of the file, the rest of the first page is unused.
+   Tile blocks are page aligned so they can be mapped in place. The index is
+   written alternately to two areas and the header is updated last, so it
+   always points at a complete index. Changed tiles go to new blocks, never
+   over ones the index in the file points at. */
+struct DocumentHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_size;
+  uint32_t width, height;
+  uint32_t layers;
+  uint32_t reserved;
+  uint64_t index_offset;
+  uint64_t spare_index_offset;
+  uint64_t index_capacity;
+};
+
+/* The index is the layer table, bottom layer first, followed by the tile
+   offsets of each layer in turn. An offset of 0 means a transparent tile. */
+struct DocumentLayerEntry
+{
+  double alpha;
+  uint32_t flags;
+  uint32_t mode; /* BlendMode, 0 (normal) in files from before modes. */
+};
+
+struct Document
+{
+  char *file_name;
+  int fd;
+  void *mapping;
+  size_t mapping_size;
+  uint64_t end; /* Where the next tile is appended. */
+  uint64_t index_offset;
+  uint64_t spare_index_offset;
+  uint64_t index_capacity;
+  uint64_t *free_blocks; /* Unused tile blocks outside the mapping. */
+  size_t free_count, free_capacity;
+  uint64_t *indexed; /* Blocks the index in the file points at, sorted. */
+  size_t indexed_count;
+  Document *previous; /* Earlier files whose mappings are still in use. */
+};
+
+static uint64_t
+round_page (uint64_t size)
+{
+  return (size + DOCUMENT_PAGE - 1) & ~(uint64_t)(DOCUMENT_PAGE - 1);
+}
+
+static size_t
+index_size (uint32_t layers, size_t tiles)
+{
+  return layers * (sizeof (DocumentLayerEntry) + tiles * sizeof (uint64_t));
+}
+
+static int
+compare_offsets (const void *x, const void *y)
+{
+  const uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+  return (a > b) - (a < b);
+}
+
+/* The tile blocks of count offsets, sorted, without transparent tiles. */
+static uint64_t *
+sorted_blocks (const uint64_t *offsets, size_t count, size_t *block_count)
+{
+  uint64_t *blocks = malloc (sizeof (uint64_t) * count);
+  size_t i;
+  *block_count = 0;
+  for (i = 0; i < count; ++i)
+    {
+      if (offsets[i])
+        {
+          blocks[(*block_count)++] = offsets[i];
+        }
+    }
+  qsort (blocks, *block_count, sizeof (uint64_t), compare_offsets);
+  return blocks;
+}
+
+/* How tiles stored with a layer's flags become tiles of the drawing. */
+static unsigned int
+document_conversion (const FloatingDrawing *drawing, uint32_t flags)
+{
+  const int is_premultiplied = (flags & DOCUMENT_LAYER_PREMULTIPLIED) != 0;
+  const int is_linear = (flags & DOCUMENT_LAYER_LINEAR) != 0;
+  unsigned int conversion = 0;
+  if (is_premultiplied == layer_format_is_premultiplied (drawing)
+      && is_linear == drawing->is_linear)
+    {
+      return 0;
+    }
+  if (is_premultiplied)
+    {
+      conversion |= IMAGE_CONVERT_UNPREMULTIPLY;
+    }
+  if (is_linear && !drawing->is_linear)
+    {
+      conversion |= IMAGE_CONVERT_FROM_LINEAR;
+    }
+  else if (!is_linear && drawing->is_linear)
+    {
+      conversion |= IMAGE_CONVERT_TO_LINEAR;
+    }
+  if (layer_format_is_premultiplied (drawing))
+    {
+      conversion |= IMAGE_CONVERT_PREMULTIPLY;
+    }
+  return conversion;
+}
+
+int
+document_is_native (const char *file_name)
+{
+  size_t length = strlen (file_name);
+  size_t extension = strlen (DOCUMENT_EXTENSION);
+  return length > extension
+         && !strcmp (file_name + length - extension, DOCUMENT_EXTENSION);
+}
+
+Document *
+document_open (const char *file_name, FloatingDrawing *drawing)
+{
+  DocumentHeader header;
+  struct stat file_stat;
+  int fd = open (file_name, O_RDWR);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  if (fstat (fd, &file_stat) || file_stat.st_size < DOCUMENT_PAGE
+      || pread (fd, &header, sizeof (header), 0) != sizeof (header)
+      || memcmp (header.magic, DOCUMENT_MAGIC, sizeof (header.magic))
+      || header.version != DOCUMENT_VERSION
+      || header.tile_size != IMAGE_TILE_SIZE || !header.width
+      || !header.height || !header.layers)
+    {
+      fprintf (stderr, "%s: not a document\n", file_name);
+      close (fd);
+      return NULL;
+    }
+  const size_t size = file_stat.st_size;
+  const size_t tiles
+      = (size_t)((header.width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT)
+        * ((header.height + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT);
+  if (header.index_offset + index_size (header.layers, tiles) > size)
+    {
+      fprintf (stderr, "%s: truncated document\n", file_name);
+      close (fd);
+      return NULL;
+    }
+  /* Private and writable, so painting copies pages on write and the file
+     only changes when saving. Untouched tiles are never read. */
+  void *mapping
+      = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED)
+    {
+      perror (file_name);
+      close (fd);
+      return NULL;
+    }
+  const DocumentLayerEntry *entries
+      = (const void *)((char *)mapping + header.index_offset);
+  const uint64_t *offsets = (const void *)(entries + header.layers);
+  size_t i;
+  for (i = 0; i < header.layers * tiles; ++i)
+    {
+      if (offsets[i] % DOCUMENT_PAGE
+          || offsets[i] + DOCUMENT_TILE_BYTES > size)
+        {
+          fprintf (stderr, "%s: corrupt tile index\n", file_name);
+          munmap (mapping, size);
+          close (fd);
+          return NULL;
+        }
+    }
+  uint32_t layer;
+  for (layer = 0; layer < header.layers; ++layer)
+    {
+      const uint64_t *layer_offsets = offsets + layer * tiles;
+      const unsigned int conversion = document_conversion (
+          drawing, entries[layer].flags);
+      const color **sources = malloc (tiles * sizeof (color *));
+      for (i = 0; i < tiles; ++i)
+        {
+          sources[i] = layer_offsets[i]
+                           ? (color *)((char *)mapping + layer_offsets[i])
+                           : NULL;
+        }
+      /* Files always hold colors. Tiles stored as the layers are used in
+         place, others are converted as they are first used, and only
+         changed tiles are converted back when saving. */
+      image_t *image = image_new_converting (
+          header.width, header.height,
+          drawing->layer_format == LAYER_FORMAT_UINT16 ? IMAGE_FORMAT_UINT16
+                                                       : IMAGE_FORMAT_COLOR,
+          sources, conversion);
+      if (conversion)
+        { /* Stored in another format, the next save writes it all. */
+          image_mark (image, 0, 0, image->width, image->height,
+                      IMAGE_TILE_DIRTY);
+        }
+      add_top_layer_image (drawing, image);
+      FloatingLayer *current = current_layer (drawing);
+      current->alpha = entries[layer].alpha;
+      current->is_visible
+          = !(entries[layer].flags & DOCUMENT_LAYER_HIDDEN);
+      current->mode = entries[layer].mode < BLEND_MODES ? entries[layer].mode
+                                                        : BLEND_MODE_NORMAL;
+      current->tile_offsets = malloc (tiles * sizeof (uint64_t));
+      memcpy (current->tile_offsets, layer_offsets,
+              tiles * sizeof (uint64_t));
+    }
+  Document *document = calloc (1, sizeof (Document));
+  document->file_name = strdup (file_name);
+  document->fd = fd;
+  document->mapping = mapping;
+  document->mapping_size = size;
+  document->end = round_page (size);
+  document->index_offset = header.index_offset;
+  document->spare_index_offset = header.spare_index_offset;
+  document->index_capacity = header.index_capacity;
+  if (header.spare_index_offset + header.index_capacity > size
+      || header.index_capacity < index_size (header.layers, tiles))
+    {
+      document->index_capacity = 0;
+    }
+  document->indexed = sorted_blocks (offsets, header.layers * tiles,
+                                     &document->indexed_count);
+  return document;
+}
+
+static void
+push_block (uint64_t **blocks, size_t *count, size_t *capacity,
+            uint64_t offset)
+{
+  if (*count == *capacity)
+    {
+      *capacity = *capacity * 2 + 16;
+      *blocks = realloc (*blocks, sizeof (uint64_t) * *capacity);
+    }
+  (*blocks)[(*count)++] = offset;
+}
+
+/* A block for a tile about to be written, never one the file points at. */
+static uint64_t
+document_new_block (Document *document)
+{
+  if (document->free_count)
+    {
+      return document->free_blocks[--document->free_count];
+    }
+  document->end += DOCUMENT_TILE_BYTES;
+  return document->end - DOCUMENT_TILE_BYTES;
+}
+
+/* Once a new index made it to the header, the blocks only the one before
+   pointed at, of changed tiles and of layers deleted or merged since, can
+   be used again, unless the mapping still backs tiles with them: pages of
+   a private mapping that were not written to show what is in the file. */
+static void
+document_free_unindexed (Document *document, const uint64_t *offsets,
+                         size_t count)
+{
+  size_t indexed_count, i, j = 0;
+  uint64_t *indexed = sorted_blocks (offsets, count, &indexed_count);
+  for (i = 0; i < document->indexed_count; ++i)
+    {
+      const uint64_t block = document->indexed[i];
+      while (j < indexed_count && indexed[j] < block)
+        {
+          ++j;
+        }
+      if ((j == indexed_count || indexed[j] != block)
+          && block >= document->mapping_size)
+        {
+          push_block (&document->free_blocks, &document->free_count,
+                      &document->free_capacity, block);
+        }
+    }
+  free (document->indexed);
+  document->indexed = indexed;
+  document->indexed_count = indexed_count;
+}
+
+static void
+forget_tile_offsets (FloatingDrawing *drawing)
+{
+  int i;
+  for (i = 0; i < drawing->layer_count; ++i)
+    {
+      free (drawing->layers[i]->tile_offsets);
+      drawing->layers[i]->tile_offsets = NULL;
+    }
+}
+
+/* Write the tiles that are not in the file yet or changed since the last
+   save, then a new index, then the header pointing at it. Layers without
+   tile offsets have never been saved to this file and are written whole. */
+static int
+document_write (Document *document, FloatingDrawing *drawing)
+{
+  const image_t *bottom = drawing->layers[0]->image;
+  const size_t tiles = (size_t)bottom->tiles_across * bottom->tiles_down;
+  const uint32_t layers = drawing->layer_count;
+  color *converted = NULL;
+  uint32_t n;
+  size_t i;
+  for (n = 0; n < layers; ++n)
+    {
+      FloatingLayer *layer = drawing->layers[n];
+      image_t *image = layer->image;
+      const int is_new = layer->tile_offsets == NULL;
+      if (is_new)
+        {
+          layer->tile_offsets = calloc (tiles, sizeof (uint64_t));
+        }
+      for (i = 0; i < tiles; ++i)
+        {
+          uint64_t *offset = layer->tile_offsets + i;
+          if (!is_new && !(image->tile_flags[i] & IMAGE_TILE_DIRTY))
+            {
+              continue;
+            }
+          *offset = 0;
+          if (tile_cache_is_blank (image, i)
+              || tile_is_empty (image_tile (image, i),
+                                image_tile_bytes (image)))
+            {
+              continue;
+            }
+          *offset = document_new_block (document);
+          const color *tile = image_tile (image, i);
+          if (image->format == IMAGE_FORMAT_UINT16)
+            {
+              if (converted == NULL)
+                {
+                  converted = aligned_alloc (16, DOCUMENT_TILE_BYTES);
+                }
+              pixel16_span_to_color (converted, (const uint16_t *)tile,
+                                     IMAGE_TILE_PIXELS);
+              tile = converted;
+            }
+          if (!pwrite_all (document->fd, tile, DOCUMENT_TILE_BYTES, *offset))
+            {
+              free (converted);
+              return 0;
+            }
+          tile_cache_trim (image->cache);
+        }
+    }
+  free (converted);
+
+  const size_t size = index_size (layers, tiles);
+  uint64_t target = document->spare_index_offset;
+  uint64_t spare = document->index_offset;
+  if (size > document->index_capacity)
+    { /* Room for a few more layers before the areas move again. */
+      document->index_capacity = round_page (size + index_size (4, tiles));
+      target = document->end;
+      spare = document->end + document->index_capacity;
+      document->end += 2 * document->index_capacity;
+      if (ftruncate (document->fd, document->end))
+        {
+          return 0;
+        }
+    }
+  char *index = malloc (size);
+  DocumentLayerEntry *entries = (void *)index;
+  uint64_t *offsets = (void *)(entries + layers);
+  for (n = 0; n < layers; ++n)
+    {
+      const FloatingLayer *layer = drawing->layers[n];
+      entries[n].alpha = layer->alpha;
+      entries[n].flags = (layer_format_is_premultiplied (drawing)
+                              ? DOCUMENT_LAYER_PREMULTIPLIED
+                              : 0)
+                         | (drawing->is_linear ? DOCUMENT_LAYER_LINEAR : 0)
+                         | (layer->is_visible ? 0 : DOCUMENT_LAYER_HIDDEN);
+      entries[n].mode = layer->mode;
+      memcpy (offsets + n * tiles, layer->tile_offsets,
+              tiles * sizeof (uint64_t));
+    }
+  if (!pwrite_all (document->fd, index, size, target)
+      || fdatasync (document->fd))
+    {
+      free (index);
+      return 0;
+    }
+
+  DocumentHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, DOCUMENT_MAGIC, sizeof (header.magic));
+  header.version = DOCUMENT_VERSION;
+  header.tile_size = IMAGE_TILE_SIZE;
+  header.width = bottom->width;
+  header.height = bottom->height;
+  header.layers = layers;
+  header.index_offset = target;
+  header.spare_index_offset = spare;
+  header.index_capacity = document->index_capacity;
+  if (!pwrite_all (document->fd, &header, sizeof (header), 0)
+      || fdatasync (document->fd))
+    {
+      free (index);
+      return 0;
+    }
+  document->index_offset = target;
+  document->spare_index_offset = spare;
+  document_free_unindexed (document, offsets, layers * tiles);
+  free (index);
+
+  for (n = 0; n < layers; ++n)
+    {
+      image_t *image = drawing->layers[n]->image;
+      for (i = 0; i < tiles; ++i)
+        {
+          image->tile_flags[i] &= ~IMAGE_TILE_DIRTY;
+        }
+    }
+  return 1;
+}
+
+int
+document_save (FloatingDrawing *drawing, const char *file_name)
+{
+  Document *document = drawing->document;
+  if (!drawing->layer_count)
+    {
+      return 0;
+    }
+  if (document != NULL && !strcmp (document->file_name, file_name))
+    {
+      if (document_write (document, drawing))
+        {
+          return 1;
+        }
+      forget_tile_offsets (drawing);
+      return 0;
+    }
+
+  /* First save to this file: write a complete new file next to it and
+     rename it over the old one only once it is complete. */
+  char *temporary_name = malloc (strlen (file_name) + sizeof (".tmp"));
+  sprintf (temporary_name, "%s.tmp", file_name);
+  int fd = open (temporary_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      perror (temporary_name);
+      free (temporary_name);
+      return 0;
+    }
+  Document *fresh = calloc (1, sizeof (Document));
+  fresh->file_name = strdup (file_name);
+  fresh->fd = fd;
+  fresh->end = DOCUMENT_PAGE;
+  forget_tile_offsets (drawing);
+  if (!document_write (fresh, drawing) || fsync (fd)
+      || rename (temporary_name, file_name))
+    {
+      perror (file_name);
+      forget_tile_offsets (drawing);
+      unlink (temporary_name);
+      free (temporary_name);
+      document_close (fresh);
+      return 0;
+    }
+  free (temporary_name);
+  if (document != NULL)
+    { /* Its mapping still backs tiles that were not painted on. */
+      close (document->fd);
+      document->fd = -1;
+    }
+  fresh->previous = document;
+  drawing->document = fresh;
+  return 1;
+}
+
+void
+document_close (Document *document)
+{
+  while (document != NULL)
+    {
+      Document *previous = document->previous;
+      if (document->mapping)
+        {
+          munmap (document->mapping, document->mapping_size);
+        }
+      if (document->fd >= 0)
+        {
+          close (document->fd);
+        }
+      free (document->free_blocks);
+      free (document->indexed);
+      free (document->file_name);
+      free (document);
+      document = previous;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "drawing.h"
+
+/* Native document files: a header, a layer table and a tile index pointing
+   at raw tile blocks, which are mapped straight into the layer images. */
+
+#define DOCUMENT_EXTENSION ".floating"
+
+int document_is_native (const char *file_name);
+
+/* Map the document and add its layers on top of the drawing. Returns NULL
+   if the file is not a valid document. */
+Document *document_open (const char *file_name, FloatingDrawing *drawing);
+
+/* Save the drawing. When it was opened from or saved to the same file
+   before, only the tiles changed since then are written. */
+int document_save (FloatingDrawing *drawing, const char *file_name);
+
+void document_close (Document *document);
@@ -1,151 +1,234 @@
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <tiff.h>
+#include <unistd.h>
 #include <xcb/xcb.h>
 #include <xcb/xinput.h>
 
+#include "brush_tip.h"
+#include "composite.h"
+#include "document.h"
+#include "drawing.h"
+#include "fill.h"
+#include "filter.h"
 #include "image.h"
+#include "journal.h"
+#include "latency.h"
+#include "recorder.h"
+#include "selection.h"
+#include "share.h"
+#include "stroke.h"
+#include "tile_cache.h"
+#include "tiff_io.h"
+#include "trace.h"
+#include "viewport.h"
 
-#include <tiffio.h>
 #include <xcb/xproto.h>
 
-int
-min (int x, int y)
-{
-  return x <= y ? x : y;
-}
-
-int
-max (int x, int y)
-{
-  return x >= y ? x : y;
-}
-
-typedef struct FloatingDrawing FloatingDrawing;
-typedef struct FloatingLayer FloatingLayer;
-typedef struct Brush Brush;
-typedef struct rect rect;
-
-struct rect
-{
-  int x, y;
-  int width, height;
-};
-
-struct FloatingLayer
-{
-  image_t *image;
-  FloatingLayer *next;
-  double alpha;
-};
-
-typedef
-enum BlendMode
-{
-  BLEND_MODE_NORMAL = 0,
-  BLEND_MODE_ABSORB = 1,
-  BLEND_MODES,
-}
-BlendMode;
-
-struct Brush
-{
-  double radius;
-  double hardness;
-  double density;
-  double smudge;
-  int is_drawing;
-  int is_erasing;
-  int is_picking;
-  int is_smudging;
-  BlendMode mode;
-  color color;
-  color medium_color;
-  Brush *next;
-};
-
-struct FloatingDrawing
-{
-  uint32_t *image;
-  double x, y;
-  int is_drawing;
-  FloatingLayer *bottom;
-  FloatingLayer *current;
-  Brush *stored_brushes; /* List of all brushes. */
-  Brush *active_brushes; /* List of active ones. */
-  color color;
-  color medium_color;
-  char *filename;
-};
-
-static double
-blend (double t, double x, double y)
-{
-  return (1.0 - t) * x + t * y;
-}
-
-static FloatingLayer *
-floating_layer_new (int width, int height)
+/* The smallest rect containing both, either of which may be empty. */
+static rect
+rect_union (rect a, rect b)
 {
-  FloatingLayer *layer = malloc (sizeof (FloatingLayer));
-  layer->alpha = 1.0;
-  layer->image = image_new (width, height);
-  layer->next = NULL;
-  return layer;
+  if (!a.width || !a.height)
+    {
+      return b;
+    }
+  if (!b.width || !b.height)
+    {
+      return a;
+    }
+  const int x1 = max (a.x + a.width, b.x + b.width);
+  const int y1 = max (a.y + a.height, b.y + b.height);
+  a.x = min (a.x, b.x);
+  a.y = min (a.y, b.y);
+  a.width = x1 - a.x;
+  a.height = y1 - a.y;
+  return a;
 }
 
-static void
-floating_layer_del (FloatingLayer *layer)
+/* Rows of a given width that fit in one put image request. The maximum
+   request length is the extended one if the server has BIG-REQUESTS. */
+static int
+upload_band_rows (xcb_connection_t *connection, int width)
 {
-  image_del (layer->image);
-  free (layer);
+  const uint64_t request_bytes
+      = 4 * (uint64_t)xcb_get_maximum_request_length (connection);
+  /* The header, plus the length field BIG-REQUESTS adds to it. */
+  const uint64_t header = sizeof (xcb_put_image_request_t) + 4;
+  const uint64_t rows = (request_bytes - header) / (4 * (uint64_t)width);
+  return rows < 1 ? 1 : rows > INT_MAX ? INT_MAX : (int)rows;
 }
 
+/* Show an area of the window from the viewport's mip pyramid, in bands
+   that each fit in a request. The next band is rendered while the last
+   one is being sent, and only the last one is checked for errors, which
+   also keeps painting from running ahead of the server. */
 static void
-add_top_layer (FloatingDrawing *drawing, int width, int height)
+redraw_window (const Viewport *viewport, rect window_area,
+               xcb_connection_t *connection, xcb_window_t window,
+               xcb_gcontext_t draw, xcb_pixmap_t pixmap)
 {
-  FloatingLayer *current = drawing->current;
-  if (current != NULL)
+  const int width = window_area.width;
+  const int height = window_area.height;
+  if (!width || !height)
     {
-      current->next
-          = floating_layer_new (current->image->width, current->image->height);
-      drawing->current = current->next;
+      return;
     }
-  else
+  const int band_height
+      = min (height, upload_band_rows (connection, width));
+  uint32_t *pixels[2];
+  xcb_void_cookie_t cookie;
+  int y, k = 0;
+  pixels[0] = malloc (sizeof (uint32_t) * width * band_height);
+  pixels[1] = band_height < height
+                  ? malloc (sizeof (uint32_t) * width * band_height)
+                  : NULL;
+  rect band = { window_area.x, window_area.y, width, band_height };
+  viewport_render (viewport, band, pixels[0]);
+  trace_begin ("upload");
+  for (y = 0; y + band_height < height; y += band_height, k ^= 1)
+    {
+      rect next = { window_area.x, window_area.y + y + band_height, width,
+                    min (band_height, height - y - band_height) };
+#pragma omp parallel sections num_threads(2)
+      {
+#pragma omp section
+        xcb_put_image (connection, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, draw,
+                       width, band_height, window_area.x, window_area.y + y,
+                       0, 24, 4 * width * band_height, (void *)pixels[k]);
+#pragma omp section
+        viewport_render (viewport, next, pixels[k ^ 1]);
+      }
+    }
+  cookie = xcb_put_image_checked (
+      connection, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, draw, width, height - y,
+      window_area.x, window_area.y + y, 0, 24, 4 * width * (height - y),
+      (void *)pixels[k]);
+  xcb_copy_area (connection, pixmap, window, draw, window_area.x,
+                 window_area.y, window_area.x, window_area.y, width, height);
+  xcb_generic_error_t *error = xcb_request_check (connection, cookie);
+  if (error != NULL)
     {
-      drawing->current = floating_layer_new (width, height);
-      drawing->bottom = drawing->current;
+      fprintf (stderr, "Upload failed with X error %d\n",
+               error->error_code);
+      free (error);
     }
+  trace_end ("upload");
+  latency_mark (LATENCY_PRESENT);
+  free (pixels[0]);
+  free (pixels[1]);
 }
 
+/* Darken what is not selected in a row of display pixels, the gaps between
+   the selected runs. */
 static void
-del_top_layer (FloatingDrawing *drawing)
+display_unselected (const Selection *selection, uint32_t *bgra, int x, int y,
+                    int width)
 {
-  FloatingLayer *current = drawing->current;
-  if (current != NULL)
+  int i = x;
+  while (i < x + width)
     {
-      FloatingLayer *down = drawing->bottom;
-      while (down->next != NULL && down->next != current)
+      const int from = i;
+      const int stop = selection_clip (selection, y, &i, x + width);
+      int k;
+      for (k = from; k < i; ++k)
         {
-          down = down->next;
-        }
-      down->next = NULL;
-      drawing->current = down;
-      floating_layer_del (current);
-      if (current == drawing->bottom)
-        {
-          drawing->bottom = NULL;
-          drawing->current = NULL;
+          bgra[k - x] = (bgra[k - x] >> 1) & 0x7f7f7f7f;
         }
+      i = stop;
+    }
+}
+
+/* Convert a composited band to display pixels in the full size level of
+   the pyramid, which holds the rows of the canvas as BGRA blended on the
+   background. */
+static void
+display_band (const FloatingDrawing *drawing, const color *scratch, int x,
+              int y, int width, int height, int image_width,
+              int image_height, Viewport *viewport, uint8_t background)
+{
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  const int start = max (-x, 0);
+  const int end = min (width, image_width - x);
+  int i;
+  if (start >= end)
+    {
+      return;
     }
+  viewport_reserve (viewport, y, height);
+#pragma omp parallel
+  {
+    trace_begin ("convert worker");
+#pragma omp for nowait
+    for (i = 0; i < height; ++i)
+      {
+        if (y + i < 0 || y + i >= image_height)
+          {
+            continue;
+          }
+        uint8_t *bgra
+            = (uint8_t *)(viewport_canvas_row (viewport, y + i) + x + start);
+        const uint8_t *dither
+            = display_dither_row (drawing->is_dithered, x + start, y + i);
+        if (drawing->layer_format == LAYER_FORMAT_UINT16)
+          {
+            if (drawing->is_linear)
+              {
+                pixel16_span_linear_to_display (
+                    bgra, (const uint16_t *)scratch + 4 * (i * width + start),
+                    background, end - start);
+              }
+            else
+              {
+                pixel16_span_to_display (
+                    bgra, (const uint16_t *)scratch + 4 * (i * width + start),
+                    background, dither, end - start);
+              }
+            if (drawing->share != NULL)
+              {
+                share_write_row16 (
+                    drawing->share,
+                    (const uint16_t *)scratch + 4 * (i * width + start),
+                    x + start, y + i, end - start);
+              }
+          }
+        else
+          {
+            if (drawing->is_linear)
+              {
+                color_span_linear_to_display (
+                    bgra, scratch + i * width + start, background,
+                    is_premultiplied, end - start);
+              }
+            else
+              {
+                color_span_to_display (bgra, scratch + i * width + start,
+                                       background, is_premultiplied, dither,
+                                       end - start);
+              }
+            if (drawing->share != NULL)
+              {
+                share_write_row (drawing->share,
+                                 scratch + i * width + start, x + start,
+                                 y + i, end - start, is_premultiplied);
+              }
+          }
+        if (drawing->selection != NULL)
+          {
+            display_unselected (drawing->selection, (uint32_t *)bgra,
+                                x + start, y + i, end - start);
+          }
+      }
+    trace_end ("convert worker");
+  }
 }
 
 void
 update (FloatingDrawing *drawing, rect invalid_area, int image_width,
-        int image_height, uint32_t *image, xcb_connection_t *connection,
+        int image_height, Viewport *viewport, xcb_connection_t *connection,
         xcb_window_t window, xcb_gcontext_t draw, xcb_pixmap_t pixmap,
         uint8_t background)
 {
@@ -154,119 +237,54 @@ update (FloatingDrawing *drawing, rect invalid_area, int image_width,
       && invalid_area.width && invalid_area.height)
     {
       const int width = invalid_area.width;
-      const int height = invalid_area.height;
       const int x = invalid_area.x;
-      const int y = invalid_area.y;
-      image_t *scratch = image_new (width, height);
-      FloatingLayer *current = drawing->bottom;
-
-      while (current != NULL)
+      /* A band of rows at a time, so that the scratch buffer stays small
+         and an out of core canvas only needs a band of tiles in memory. */
+      const int band_height = min (invalid_area.height, IMAGE_TILE_SIZE);
+      color *scratch
+          = aligned_alloc (16, sizeof (color) * width * band_height);
+      int band;
+      if (drawing->share != NULL)
         {
-          int i;
-#pragma omp parallel for
-          for (i = 0; i < height; ++i)
-            {
-              int j;
-#pragma omp parallel for
-              for (j = 0; j < width; ++j)
-                {
-                  unsigned int scratch_index = i * width + j;
-                  unsigned int current_index
-                      = (y + i) * current->image->width + x + j;
-                  if (x + j >= 0 && x + j < image_width && y + i < image_height
-                      && y + i >= 0)
-                    {
-                      color final_color = scratch->data[scratch_index];
-                      color current_color
-                          = current->image->data[current_index];
-                      if (current != drawing->bottom)
-                        {
-                          if (current->alpha > 0 && current_color.alpha > 0)
-                            {
-                              const float alpha = final_color.alpha;
-                              const float current_alpha = current_color.alpha;
-                              const float inv_alpha
-                                  = 1
-                                    / (alpha * (1 - current_alpha)
-                                       + current->alpha * current_alpha);
-                              color_multiply_single_struct (final_color.alpha,
-                                                            final_color.vector,
-                                                            &final_color);
-                              color_multiply_single_struct (
-                                  current->alpha, current_color.vector,
-                                  &current_color);
-                              color_blend_absorb_single (
-                                  current_alpha, &final_color,
-                                  &current_color, &final_color);
-                              color_multiply_single_struct (
-                                  inv_alpha, final_color.vector, &final_color);
-                              final_color.alpha = fmin (
-                                  1.0, alpha + current->alpha * current_alpha);
-                            }
-                        }
-                      else
-                        {
-                          final_color = current_color;
-                          final_color.alpha
-                              = current->alpha * final_color.alpha;
-                        }
-                      scratch->data[scratch_index] = final_color;
-                    }
-                }
-            }
-          current = current->next;
+          share_begin (drawing->share);
         }
-
-      uint8_t *tmp_data = malloc (sizeof (uint32_t) * width * height);
-      unsigned char *surface_data = (void *)image;
-      int i;
-#pragma omp parallel for
-      for (i = 0; i < height; ++i)
+      for (band = 0; band < invalid_area.height; band += band_height)
         {
-          int j;
-#pragma omp parallel for
-          for (j = 0; j < width; ++j)
+          const int height = min (band_height, invalid_area.height - band);
+          const int y = invalid_area.y + band;
+          const int is_last = band + height == invalid_area.height;
+          trace_begin ("update band");
+          composite_band (drawing, scratch, x, y, width, height, image_width,
+                          image_height);
+          if (is_last)
             {
-              int scratch_index = i * width + j;
-              int surface_index = 4 * ((y + i) * image_width + x + j);
-              if (x + j >= 0 && x + j < image_width && y + i < image_height
-                  && y + i >= 0)
-                {
-                  const double f = scratch->data[scratch_index].alpha;
-                  surface_data[surface_index + 0]
-                      = scratch->data[scratch_index].red * 255;
-                  surface_data[surface_index + 1]
-                      = scratch->data[scratch_index].green * 255;
-                  surface_data[surface_index + 2]
-                      = scratch->data[scratch_index].blue * 255;
-                  surface_data[surface_index + 3]
-                      = scratch->data[scratch_index].alpha * 255;
-                  tmp_data[4 * scratch_index + 0]
-                      = blend (f, background, surface_data[surface_index + 2]);
-                  tmp_data[4 * scratch_index + 1]
-                      = blend (f, background, surface_data[surface_index + 1]);
-                  tmp_data[4 * scratch_index + 2]
-                      = blend (f, background, surface_data[surface_index + 0]);
-                  tmp_data[4 * scratch_index + 3]
-                      = blend (f, background, surface_data[surface_index + 3]);
-                }
+              latency_mark (LATENCY_COMPOSITE);
             }
+          display_band (drawing, scratch, x, y, width, height, image_width,
+                        image_height, viewport, background);
+          if (is_last)
+            {
+              latency_mark (LATENCY_CONVERT);
+            }
+          tile_cache_trim (drawing->tile_cache);
+          trace_end ("update band");
+        }
+      free (scratch);
+      if (drawing->share != NULL)
+        {
+          share_end (drawing->share, invalid_area);
         }
 
-      image_del (scratch);
-
-      xcb_put_image (connection, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, draw,
-                     width, height, x, y, 0, 24, (4 * width * height),
-                     (void *)tmp_data);
-      xcb_copy_area (connection, pixmap, window, draw, x, y, x, y, width,
-                     height);
-      xcb_flush (connection);
-      free (tmp_data);
+      viewport_update_levels (viewport, invalid_area);
+      redraw_window (viewport, viewport_window_area (viewport, invalid_area),
+                     connection, window, draw, pixmap);
     }
 }
 
 #define BRUSH_SIZE_MAX 64
-#define BRUSH_SIZE_DEFAULT 20
+#define FILTER_BLUR_SIGMA 4.0
+#define FILTER_SHARPEN_SIGMA 1.0
+#define FILL_TOLERANCE 0.05
 
 #define BACKGROUND 0x40
 
@@ -280,14 +298,564 @@ const color Cyan = { { 0.0, 1.0, 1.0, 1.0 } };
 const color Magenta = { { 1.0, 0.0, 1.0, 1.0 } };
 const color Yellow = { { 1.0, 1.0, 0.0, 1.0 } };
 
+static const color *const Colors[] =
+  {
+    &Red, &Green, &Blue, &White, &Black, &Gray, &Cyan, &Magenta, &Yellow
+  };
+
+/* Save to the output file, as a native document or as a TIFF of the
+   flattened layers. */
+static int
+save_drawing (FloatingDrawing *drawing, int image_width, int image_height)
+{
+  const char *image_file_name = drawing->filename;
+  if (image_file_name == NULL)
+    {
+      return 0;
+    }
+  if (document_is_native (image_file_name))
+    {
+      if (!document_save (drawing, image_file_name))
+        {
+          return 0;
+        }
+      printf ("Saved document to file %s\n", image_file_name);
+      if (drawing->thumbnail_size > 0)
+        {
+          tiff_io_save_thumbnail (drawing, image_file_name, image_width,
+                                  image_height);
+        }
+    }
+  else if (!tiff_io_save (drawing, image_file_name, image_width,
+                          image_height))
+    {
+      return 0;
+    }
+  else
+    {
+      printf ("Saved image to file %s\n", image_file_name);
+    }
+  if (drawing->export_scale > 0)
+    {
+      char *scaled_file_name
+          = malloc (strlen (image_file_name) + sizeof (SCALED_EXTENSION));
+      sprintf (scaled_file_name, "%s" SCALED_EXTENSION, image_file_name);
+      if (strokes_save_scaled (drawing, scaled_file_name,
+                               drawing->export_scale))
+        {
+          printf ("Saved image %g times larger to file %s\n",
+                  drawing->export_scale, scaled_file_name);
+        }
+      free (scaled_file_name);
+    }
+  return 1;
+}
+
+/* The next blend mode, or the previous one with shift, wrapping around. */
+static BlendMode
+next_blend_mode (unsigned int mode, uint16_t state)
+{
+  if (state & XCB_MOD_MASK_SHIFT)
+    {
+      return mode == 0 ? BLEND_MODES - 1 : mode - 1;
+    }
+  return mode + 1 >= BLEND_MODES ? 0 : mode + 1;
+}
+
+/* Apply a key press to the drawing. Used both for keys typed in the window
+   and when replaying the journal. Returns nonzero if the whole canvas has to
+   be redrawn. */
+static int
+handle_key (FloatingDrawing *drawing, uint8_t keycode, uint16_t state,
+            int image_width, int image_height)
+{
+  const int colors = sizeof (Colors) / sizeof (Colors[0]);
+  int redraw = 0;
+  switch (keycode)
+    {
+    case 31:
+      { /*key: i; increase brush size*/
+        if (state & XCB_MOD_MASK_SHIFT)
+          { /*key: shift-i; decrease brush size*/
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->radius -= 1;
+                if (brush->radius < 0)
+                  {
+                    brush->radius = 0;
+                  }
+                brush = brush->next;
+              }
+            /*printf("Maybe decreased brush size to %d\n",
+             * brush->size);*/
+          }
+        else
+          {
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->radius += 1;
+                if (brush->radius > BRUSH_SIZE_MAX)
+                  {
+                    brush->radius = BRUSH_SIZE_MAX;
+                  }
+                brush = brush->next;
+              }
+            /*printf("Maybe increased brush size to %d\n",
+             * brush->size);*/
+          }
+        break;
+      }
+    case 32:
+      { /*key: o; increase brush alpha*/
+        if (state & XCB_MOD_MASK_SHIFT)
+          { /*key: shift-o; decrease brush alpha*/
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->color.alpha -= 0.01;
+                if (brush->color.alpha < 0)
+                  {
+                    brush->color.alpha = 0;
+                  }
+                brush = brush->next;
+              }
+            /*printf("Maybe decreased brush alpha to %d\n",
+             * brush->color.alpha);*/
+          }
+        else
+          {
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->color.alpha += 0.01;
+                if (brush->color.alpha > 1)
+                  {
+                    brush->color.alpha = 1;
+                  }
+                brush = brush->next;
+              }
+            /*printf("Maybe increased brush alpha to %d\n",
+             * brush->color.alpha);*/
+          }
+        break;
+      }
+    case 39:
+      { /*key: s; toggle smudge on / off (shift-s saves, see main)*/
+        if (!(state & XCB_MOD_MASK_SHIFT))
+          {
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->is_smudging = brush->is_smudging ? 0 : 1;
+                if (!brush->is_smudging)
+                  {
+                    brush->color = drawing->color;
+                  }
+                brush = brush->next;
+              }
+          }
+        break;
+      }
+    case 56:
+      { /*key: b; toggle paint on / off*/
+        drawing->is_drawing = drawing->is_drawing ? 0 : 1;
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->is_drawing = brush->is_drawing ? 0 : 1;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 26:
+      { /*key: e; toggle erase on / off*/
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->is_erasing = brush->is_erasing ? 0 : 1;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 33:
+      { /*key: p; toggle pick on / off*/
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->is_picking = brush->is_picking ? 0 : 1;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 46:
+      { /*key: l; layer management*/
+        if (state & XCB_MOD_MASK_SHIFT)
+          { /*shift-l deletes the current layer*/
+            del_current_layer (drawing);
+            redraw = 1;
+          }
+        else
+          {
+            add_top_layer (drawing, image_width, image_height);
+          }
+        break;
+      }
+    case 10:
+      { /*key: 1; color number 1*/
+        drawing->colors_index = 0;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 11:
+      { /*key: 2; color number 2*/
+        drawing->colors_index = 1;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 12:
+      { /*key: 3; color number 3*/
+        drawing->colors_index = 2;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 13:
+      { /*key: 4; color number 4*/
+        drawing->colors_index = 3;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 14:
+      { /*key: 5; color number 5*/
+        drawing->colors_index = 4;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 15:
+    case 16:
+    case 17:
+    case 18:
+      { /*key: 6; color number 6*/
+        /*key: 7; color number 7*/
+        /*key: 8; color number 8*/
+        /*key: 9; color number 9*/
+        drawing->colors_index = keycode - 10;
+        drawing->color = drawing_working_color (
+            drawing, *Colors[drawing->colors_index]);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->color = drawing->color;
+            brush = brush->next;
+          }
+        break;
+      }
+    case 54:
+      { /*key: c; next color*/
+        if (drawing->colors_index >= 0)
+          {
+            if (state & XCB_MOD_MASK_SHIFT)
+              { /*shift-c previous color*/
+                drawing->colors_index -= 1;
+                if (drawing->colors_index < 0)
+                  {
+                    drawing->colors_index = colors - 1;
+                  }
+              }
+            else
+              {
+                drawing->colors_index += 1;
+                if (drawing->colors_index >= colors)
+                  {
+                    drawing->colors_index = 0;
+                  }
+              }
+            drawing->color = drawing_working_color (
+                drawing, *Colors[drawing->colors_index]);
+            Brush *brush = drawing->active_brushes;
+            while (brush != NULL)
+              {
+                brush->color = drawing->color;
+                brush = brush->next;
+              }
+          }
+        break;
+      }
+    case 58:
+      { /*key: m; next blend mode*/
+        drawing->blend_mode = next_blend_mode (drawing->blend_mode, state);
+        Brush *brush = drawing->active_brushes;
+        while (brush != NULL)
+          {
+            brush->mode = drawing->blend_mode;
+            brush = brush->next;
+          }
+        printf ("Brush blend mode %s\n",
+                color_blend_modes[drawing->blend_mode].name);
+        break;
+      }
+    case 45:
+      { /*key: k; next blend mode of the current layer*/
+        FloatingLayer *current = current_layer (drawing);
+        if (current != NULL)
+          {
+            current->mode = next_blend_mode (current->mode, state);
+            printf ("Layer blend mode %s\n",
+                    color_blend_modes[current->mode].name);
+            redraw = 1;
+          }
+        break;
+      }
+    case 112:
+    case 117:
+      { /*key: page up / page down; select the layer above / below*/
+        /*shift-page up / shift-page down moves the current layer*/
+        const int offset = keycode == 112 ? 1 : -1;
+        if (state & XCB_MOD_MASK_SHIFT)
+          {
+            move_current_layer (drawing, offset);
+            redraw = 1;
+          }
+        else
+          {
+            select_layer (drawing, drawing->current + offset);
+          }
+        printf ("Layer %d of %d\n", drawing->current + 1,
+                drawing->layer_count);
+        break;
+      }
+    case 43:
+      { /*key: h; hide / show the current layer*/
+        FloatingLayer *current = current_layer (drawing);
+        if (current != NULL)
+          {
+            current->is_visible = !current->is_visible;
+            redraw = 1;
+          }
+        break;
+      }
+    case 30:
+      { /*key: u; increase layer opacity, shift-u decrease*/
+        FloatingLayer *current = current_layer (drawing);
+        if (current != NULL)
+          {
+            current->alpha += state & XCB_MOD_MASK_SHIFT ? -0.1 : 0.1;
+            current->alpha = fmax (0.0, fmin (current->alpha, 1.0));
+            redraw = 1;
+          }
+        break;
+      }
+    case 44:
+      { /*key: j; merge the current layer down, shift-j flattens*/
+        if (state & XCB_MOD_MASK_SHIFT)
+          {
+            flatten (drawing);
+            redraw = 1;
+          }
+        else
+          {
+            redraw = merge_down (drawing);
+          }
+        break;
+      }
+    case 42:
+      { /*key: g; blur the current layer, shift-g sharpens it*/
+        FloatingLayer *current = current_layer (drawing);
+        if (current != NULL)
+          {
+            Filter *filter = state & XCB_MOD_MASK_SHIFT
+                                 ? filter_new_sharpen (FILTER_SHARPEN_SIGMA,
+                                                       1.0)
+                                 : filter_new_gaussian (FILTER_BLUR_SIGMA);
+            filter_apply (filter, current->image, drawing->selection,
+                          layer_format_is_premultiplied (drawing));
+            filter_del (filter);
+            floating_layer_drop_strokes (current);
+            redraw = 1;
+          }
+        break;
+      }
+    case 41:
+      { /*key: f; fill the area under the pointer on the current layer*/
+        /*key: shift-f; the same, going by what all layers show there*/
+        if (current_layer (drawing) != NULL)
+          {
+            flood_fill (drawing, floor (drawing->x), floor (drawing->y),
+                        FILL_TOLERANCE, state & XCB_MOD_MASK_SHIFT);
+            redraw = 1;
+          }
+        break;
+      }
+    case 27:
+      { /*key: r; set a corner of a rectangle, then select up to the other*/
+        /*key: shift-r; the same with an ellipse*/
+        if (!drawing->is_selecting)
+          {
+            drawing->selection_x = drawing->x;
+            drawing->selection_y = drawing->y;
+            drawing->is_selecting = 1;
+            break;
+          }
+        const double x = fmin (drawing->x, drawing->selection_x);
+        const double y = fmin (drawing->y, drawing->selection_y);
+        const double width = fabs (drawing->x - drawing->selection_x);
+        const double height = fabs (drawing->y - drawing->selection_y);
+        if (drawing->selection == NULL)
+          {
+            drawing->selection = selection_new (image_width, image_height);
+          }
+        if (state & XCB_MOD_MASK_SHIFT)
+          {
+            selection_add_ellipse (drawing->selection, x, y, width, height);
+          }
+        else
+          {
+            selection_add_rect (drawing->selection, floor (x), floor (y),
+                                ceil (width), ceil (height));
+          }
+        drawing->is_selecting = 0;
+        redraw = 1;
+        break;
+      }
+    case 53:
+      { /*key: x; invert the selection, shift-x drops it*/
+        if (state & XCB_MOD_MASK_SHIFT)
+          {
+            selection_del (drawing->selection);
+            drawing->selection = NULL;
+          }
+        else if (drawing->selection == NULL)
+          { /* Everything was, now nothing is. */
+            drawing->selection = selection_new (image_width, image_height);
+          }
+        else
+          {
+            selection_invert (drawing->selection);
+          }
+        drawing->is_selecting = 0;
+        redraw = 1;
+        break;
+      }
+    case 55:
+      { /*key: v; stretch the levels of the current layer*/
+        FloatingLayer *current = current_layer (drawing);
+        if (current != NULL)
+          {
+            Filter *filter = filter_new_levels (0.05, 0.95, 1.0);
+            filter_apply (filter, current->image, drawing->selection,
+                          layer_format_is_premultiplied (drawing));
+            filter_del (filter);
+            floating_layer_drop_strokes (current);
+            redraw = 1;
+          }
+        break;
+      }
+    default:
+      break;
+    }
+  return redraw;
+}
+
+/* Zoom and pan keys, which only change what the window shows. Returns
+   nonzero if the view changed. */
+static int
+handle_view_key (Viewport *viewport, uint8_t keycode, uint16_t state)
+{
+  switch (keycode)
+    {
+    case 52: /*key: z; zoom in, shift-z zoom out*/
+      viewport_zoom (viewport, viewport->zoom
+                                   + (state & XCB_MOD_MASK_SHIFT ? -1 : 1));
+      return 1;
+    case 113: /*key: left; pan left*/
+      viewport_pan (viewport, -viewport->width / 4, 0);
+      return 1;
+    case 114: /*key: right; pan right*/
+      viewport_pan (viewport, viewport->width / 4, 0);
+      return 1;
+    case 111: /*key: up; pan up*/
+      viewport_pan (viewport, 0, -viewport->height / 4);
+      return 1;
+    case 116: /*key: down; pan down*/
+      viewport_pan (viewport, 0, viewport->height / 4);
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+/* Replay recorded input without drawing to the screen, doing what the event
+   loop did for each record. */
+static void
+replay_journal (FloatingDrawing *drawing, const JournalRecord *records,
+                size_t count, int image_width, int image_height)
+{
+  size_t i;
+  for (i = 0; i < count; ++i)
+    {
+      const JournalRecord *record = records + i;
+      if (record->type == JOURNAL_KEY)
+        {
+          handle_key (drawing, record->keycode, record->state, image_width,
+                      image_height);
+        }
+      else if (record->type == JOURNAL_SAMPLE)
+        {
+          const double prev_x = drawing->x;
+          const double prev_y = drawing->y;
+          drawing->x = record->x;
+          drawing->y = record->y;
+          drawing->is_drawing = record->is_drawing;
+          if (drawing->is_drawing && drawing->current >= 0
+              && record->pressure > 0.0)
+            {
+              drawing_paint (drawing, prev_x, prev_y, record->pressure);
+            }
+          tile_cache_trim (drawing->tile_cache);
+        }
+    }
+}
+
+
 int
 main (int argc, char **args)
 {
-  const color *Colors[] =
-    {
-      &Red, &Green, &Blue, &White, &Black, &Gray, &Cyan, &Magenta, &Yellow
-    };
-  const int colors = 9; /*length of Colors*/
   int image_width = 400;
   int image_height = 400;
   char *image_file_name = 0;
@@ -297,32 +865,134 @@ main (int argc, char **args)
       image_height = atoi (args[2]);
       image_file_name = args[3];
     }
+  else if (argc == 2)
+    {
+      image_file_name = args[1];
+    }
+  const char *trace_file_name = getenv ("FLOATING_TRACE");
+  if (trace_file_name != NULL)
+    {
+      trace_open (trace_file_name);
+    }
   FloatingDrawing drawing_obj;
   Brush default_brush;
-  color default_color = { { 1, 0.1, 0.25, 0.8 } };
-  color default_medium_color = { { 0.9, 0.9, 0.75, 0.0 } };
-  default_brush.is_drawing = 0;
-  default_brush.is_picking = 0;
-  default_brush.is_erasing = 0;
-  default_brush.is_smudging = 0;
-  default_brush.mode = BLEND_MODE_NORMAL;
-  default_brush.color = default_color;
-  default_brush.medium_color = default_medium_color;
-  default_brush.radius = BRUSH_SIZE_DEFAULT;
-  default_brush.hardness = 0.4;
-  default_brush.density = 2.5;
-  default_brush.smudge = 0.5;
-  default_brush.next = NULL;
-  drawing_obj.image = NULL;
-  drawing_obj.is_drawing = 0;
-  drawing_obj.bottom = floating_layer_new (image_width, image_height);
-  drawing_obj.current = drawing_obj.bottom;
-  drawing_obj.stored_brushes = &default_brush;
-  drawing_obj.active_brushes = &default_brush;
+  drawing_init (&drawing_obj, &default_brush);
+  drawing_obj.is_dithered = getenv ("FLOATING_DITHER") != NULL;
+  const char *tip_file_name = getenv ("FLOATING_BRUSH_TIP");
+  if (tip_file_name != NULL)
+    {
+      default_brush.tip = brush_tip_load (tip_file_name);
+    }
+  int is_loaded = 0;
+  if (image_file_name && access (image_file_name, R_OK) == 0)
+    { /* Continue painting on an existing file. */
+      if (document_is_native (image_file_name))
+        {
+          drawing_obj.document = document_open (image_file_name, &drawing_obj);
+        }
+      else
+        {
+          tiff_io_load_layers (&drawing_obj, image_file_name);
+        }
+      if (drawing_obj.layer_count)
+        {
+          is_loaded = 1;
+          image_width = drawing_obj.layers[0]->image->width;
+          image_height = drawing_obj.layers[0]->image->height;
+          printf ("Loaded file %s\n", image_file_name);
+        }
+    }
+  /* Input recorded since the file was last saved. */
+  char *journal_file_name = NULL;
+  JournalRecord *journal_records = NULL;
+  size_t journal_record_count = 0;
+  if (image_file_name)
+    {
+      int journal_width, journal_height;
+      journal_file_name
+          = malloc (strlen (image_file_name) + sizeof (JOURNAL_EXTENSION));
+      sprintf (journal_file_name, "%s" JOURNAL_EXTENSION, image_file_name);
+      journal_records
+          = journal_read (journal_file_name, &journal_record_count,
+                          &journal_width, &journal_height);
+      if (journal_records && !drawing_obj.layer_count)
+        {
+          image_width = journal_width;
+          image_height = journal_height;
+        }
+    }
+  /* Layers are painted out of core if they would not fit in memory, the
+     loaded ones too. */
+  drawing_obj.tile_cache = tile_cache_new_for_canvas (image_width,
+                                                      image_height);
+  int layer;
+  for (layer = 0; layer < drawing_obj.layer_count; ++layer)
+    {
+      tile_cache_adopt (drawing_obj.tile_cache,
+                        drawing_obj.layers[layer]->image);
+    }
+  if (!drawing_obj.layer_count)
+    {
+      add_top_layer (&drawing_obj, image_width, image_height);
+    }
   drawing_obj.filename = image_file_name;
-  drawing_obj.color = default_color;
-  drawing_obj.medium_color = default_medium_color;
+  const char *share_name = getenv ("FLOATING_SHARE");
+  if (share_name != NULL)
+    {
+      drawing_obj.share = share_new (share_name, image_width, image_height,
+                                     share_format_from_env (),
+                                     drawing_obj.is_linear);
+    }
+  /* The recorder reads the published canvas, privately if it is not. */
+  const char *timelapse_interval = getenv ("FLOATING_TIMELAPSE");
+  Recorder *recorder = NULL;
+  if (timelapse_interval != NULL && image_file_name)
+    {
+      const double interval = atof (timelapse_interval);
+      char *timelapse_file_name = malloc (strlen (image_file_name)
+                                          + sizeof (TIMELAPSE_EXTENSION));
+      sprintf (timelapse_file_name, "%s" TIMELAPSE_EXTENSION,
+               image_file_name);
+      if (drawing_obj.share == NULL)
+        {
+          drawing_obj.share = share_new (NULL, image_width, image_height,
+                                         SHARE_FORMAT_BGRA8,
+                                         drawing_obj.is_linear);
+        }
+      if (drawing_obj.share != NULL)
+        {
+          recorder = recorder_new (timelapse_file_name,
+                                   share_header (drawing_obj.share),
+                                   interval > 0 ? interval : 1);
+        }
+      free (timelapse_file_name);
+    }
   FloatingDrawing *drawing = &drawing_obj;
+  if (journal_records)
+    {
+      size_t snapshot_size;
+      void *snapshot = journal_read_snapshot (journal_file_name,
+                                              &snapshot_size);
+      if (snapshot != NULL && !drawing_restore (drawing, snapshot,
+                                                snapshot_size))
+        {
+          fprintf (stderr, "Ignoring the snapshot in %s\n",
+                   journal_file_name);
+        }
+      free (snapshot);
+      replay_journal (drawing, journal_records, journal_record_count,
+                      image_width, image_height);
+      is_loaded = 1;
+      printf ("Recovered %zu input records from %s\n", journal_record_count,
+              journal_file_name);
+      free (journal_records);
+    }
+  Journal *journal = NULL;
+  if (journal_file_name)
+    {
+      journal = journal_open (journal_file_name, image_width, image_height);
+      free (journal_file_name);
+    }
 
   uint8_t graphics_tablet_stylus_device_id
       = 0; /* Will find what the correct id is later. */
@@ -340,6 +1010,7 @@ main (int argc, char **args)
   uint32_t graphics_tablet_stylus_y_axis_resolution = 1;
 
   xcb_connection_t *connection = xcb_connect (NULL, NULL);
+  xcb_prefetch_maximum_request_length (connection);
   xcb_screen_t *screen
       = xcb_setup_roots_iterator (xcb_get_setup (connection)).data;
   xcb_drawable_t window;
@@ -356,28 +1027,22 @@ main (int argc, char **args)
               | XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_BUTTON_PRESS
               | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_KEY_PRESS;
 
+  /* The window shows the canvas through the viewport, so it need not be
+     as big as the canvas. */
+  const int window_width = min (image_width, screen->width_in_pixels);
+  const int window_height = min (image_height, screen->height_in_pixels);
+  Viewport *viewport = viewport_new (image_width, image_height, window_width,
+                                     window_height, BACKGROUND);
   xcb_create_window (connection, XCB_COPY_FROM_PARENT, window, screen->root, 0,
-                     0, image_width, image_height, 0,
+                     0, window_width, window_height, 0,
                      XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, mask,
                      values);
 
   xcb_map_window (connection, window);
 
-  uint32_t *image = malloc (sizeof (uint32_t) * image_width * image_height);
-  memset ((void *)image, BACKGROUND,
-          sizeof (uint32_t) * image_width * image_height);
-
-  int i;
-  for (i = 0; i < image_width * image_height; ++i)
-    {
-      *((unsigned char *)(image + i) + 3) = 0x00;
-    }
-
-  drawing->image = image;
-
   xcb_pixmap_t pixmap = xcb_generate_id (connection);
-  xcb_create_pixmap (connection, 24, pixmap, window, image_width,
-                     image_height);
+  xcb_create_pixmap (connection, 24, pixmap, window, viewport->width,
+                     viewport->height);
 
   mask = XCB_GC_GRAPHICS_EXPOSURES;
   values[0] = 0;
@@ -385,10 +1050,17 @@ main (int argc, char **args)
   xcb_create_gc (connection, draw, window, mask, values);
 
   printf ("Screen depth: %d\n", screen->root_depth);
-  xcb_put_image (connection, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, draw,
-                 image_width, image_height, 0, 0, 0, 24,
-                 (4 * image_width * image_height), (void *)image);
-  xcb_flush (connection);
+  if (is_loaded)
+    {
+      rect invalid_area = { 0, 0, image_width, image_height };
+      update (drawing, invalid_area, image_width, image_height, viewport,
+              connection, window, draw, pixmap, BACKGROUND);
+    }
+  else
+    {
+      rect window_area = { 0, 0, viewport->width, viewport->height };
+      redraw_window (viewport, window_area, connection, window, draw, pixmap);
+    }
 
   const double divider = (double)(1ull << 32);
   xcb_input_xi_query_device_reply_t *devices_reply;
@@ -549,14 +1221,19 @@ main (int argc, char **args)
   root_height = screen->height_in_pixels;
 
   xcb_generic_event_t *event;
+  rect exposed = { 0, 0, 0, 0 }; /* Accumulated until the last expose. */
   uint16_t win_original_conf_x = 0, win_original_conf_y = 0;
   uint16_t win_pos_x = 0, win_pos_y = 0;
+  double pointer_x = 0, pointer_y = 0; /* In window coordinates. */
   float pressure = 0.0f;
-  int colors_index = -1;
-  BlendMode blend_mode = BLEND_MODE_NORMAL;
   while ((event = xcb_wait_for_event (connection)))
     {
-      switch (event->response_type & ~0x80)
+      const uint8_t event_type = event->response_type & ~0x80;
+      if (event_type == XCB_GE_GENERIC || event_type == XCB_KEY_PRESS)
+        {
+          latency_input ();
+        }
+      switch (event_type)
         {
         case XCB_CONFIGURE_NOTIFY:
           {
@@ -577,6 +1254,18 @@ main (int argc, char **args)
               {
                 win_pos_y = nt_event->y;
               }
+            if (nt_event->window == window
+                && (nt_event->width != viewport->width
+                    || nt_event->height != viewport->height))
+              {
+                viewport_resize (viewport, nt_event->width, nt_event->height);
+                xcb_free_pixmap (connection, pixmap);
+                xcb_create_pixmap (connection, 24, pixmap, window,
+                                   viewport->width, viewport->height);
+                rect window_area = { 0, 0, viewport->width, viewport->height };
+                redraw_window (viewport, window_area, connection, window,
+                               draw, pixmap);
+              }
             break;
           }
         case XCB_GE_GENERIC:
@@ -621,7 +1310,7 @@ main (int argc, char **args)
                                           = root_width * dbl_value
                                             / (graphics_tablet_stylus_x_axis_max
                                                - graphics_tablet_stylus_x_axis_min);
-                                      drawing->x = pos_x - win_pos_x;
+                                      pointer_x = pos_x - win_pos_x;
                                     }
                                   if (i
                                       == graphics_tablet_stylus_y_axis_number
@@ -631,7 +1320,7 @@ main (int argc, char **args)
                                           = root_height * dbl_value
                                             / (graphics_tablet_stylus_y_axis_max
                                                - graphics_tablet_stylus_y_axis_min);
-                                      drawing->y = pos_y - win_pos_y;
+                                      pointer_y = pos_y - win_pos_y;
                                     }
                                   if (i
                                       == graphics_tablet_stylus_pressure_axis_number
@@ -694,11 +1383,11 @@ main (int argc, char **args)
                                       = root_width * dbl_value
                                         / (graphics_tablet_stylus_x_axis_max
                                            - graphics_tablet_stylus_x_axis_min);
-                                  drawing->x = pos_x - win_pos_x;
+                                  pointer_x = pos_x - win_pos_x;
 #else
                                   long pos_x
                                       = dbl_value;
-                                  drawing->x = pos_x - win_pos_x;
+                                  pointer_x = pos_x - win_pos_x;
 #endif
                                 }
                               if (i
@@ -709,11 +1398,11 @@ main (int argc, char **args)
                                       = root_height * dbl_value
                                         / (graphics_tablet_stylus_y_axis_max
                                            - graphics_tablet_stylus_y_axis_min);
-                                  drawing->y = pos_y - win_pos_y;
+                                  pointer_y = pos_y - win_pos_y;
 #else
                                   long pos_y
                                       = dbl_value;
-                                  drawing->y = pos_y - win_pos_y;
+                                  pointer_y = pos_y - win_pos_y;
 #endif
                                 }
                               if (i
@@ -748,8 +1437,8 @@ main (int argc, char **args)
                                       - (bt_event->event_x >> 16);
                           win_pos_y = (bt_event->root_y >> 16)
                                       - (bt_event->event_y >> 16);
-                          drawing->x = (bt_event->event_x >> 16);
-                          drawing->y = (bt_event->event_y >> 16);
+                          pointer_x = (bt_event->event_x >> 16);
+                          pointer_y = (bt_event->event_y >> 16);
                         }
                     }
                   break;
@@ -784,16 +1473,19 @@ main (int argc, char **args)
                       && mt_event->deviceid
                              != graphics_tablet_stylus_device_id)
                     {
-                      drawing->x = (mt_event->root_x >> 16) - win_pos_x;
-                      drawing->y = (mt_event->root_y >> 16) - win_pos_y;
+                      pointer_x = (mt_event->root_x >> 16) - win_pos_x;
+                      pointer_y = (mt_event->root_y >> 16) - win_pos_y;
                     }
                   break;
                 }
               default:
                 break;
               }
-            if (!drawing->is_drawing || drawing->current == NULL
-                || drawing->current->image == NULL)
+            viewport_to_canvas (viewport, pointer_x, pointer_y, &drawing->x,
+                                &drawing->y);
+            journal_sample (journal, drawing->x, drawing->y, pressure,
+                            drawing->is_drawing);
+            if (!drawing->is_drawing || drawing->current < 0)
               {
                 break;
               }
@@ -802,547 +1494,110 @@ main (int argc, char **args)
                 break;
               }
             /* Draw to image buffer. */
-            const int width = drawing->current->image->width;
-            const int height = drawing->current->image->height;
-            color *pix = drawing->current->image->data;
-            Brush *brush = drawing->active_brushes;
-            rect invalid_area;
-            invalid_area.x = image_width;
-            invalid_area.y = image_height;
-            invalid_area.width = 0;
-            invalid_area.height = 0;
-            while (brush != NULL)
-              {
-                double brush_density = brush->density;
-                double brush_radius = brush->radius * pressure;
-                double brush_hardness = brush->hardness;
-                double brush_alpha = 1.0;
-                double brush_smudge = brush->smudge * pressure;
-                if (brush->is_drawing && brush_density > 0 && brush_radius > 0
-                    && brush_hardness > 0)
-                  {
-                    double t;
-                    for (t = 0.0; t < 1.0 + brush_density; t += brush_density)
-                      {
-                        const double x = t * drawing->x + (1 - t) * prev_x;
-                        const double y = t * drawing->y + (1 - t) * prev_y;
-                        const int xi = x, yi = y;
-                        const double brush_radius_sq
-                            = brush_radius * brush_radius;
-                        unsigned int total_pixels = 0;
-                        color total_color = { { 0, 0, 0, 0 } };
-                        /* Draw circular brush mark. */
-                        const int brush_bounding_size
-                            = 2 * ceil (brush_radius) + 1;
-                        int i;
-#pragma omp parallel for
-                        for (i = xi - ceil (brush_radius);
-                             i <= xi + brush_bounding_size; ++i)
-                          {
-                            int j;
-#pragma omp parallel for
-                            for (j = yi - ceil (brush_radius);
-                                 j <= yi + brush_bounding_size; ++j)
-                              {
-                                double blend_factor = 0.0;
-                                double alpha = 1.0;
-                                double distance_sq
-                                    = (i - x) * (i - x) + (j - y) * (j - y);
-                                if (i >= 0 && j >= 0 && i < width && j < height
-                                    && distance_sq <= brush_radius_sq)
-                                  {
-                                    unsigned int index = (j * width + i);
-                                    color final_color = pix[index];
-                                    color brush_color;
-                                    switch (brush->mode)
-                                      {
-                                        case BLEND_MODE_ABSORB:
-                                        color_blend_absorb_single (
-                                            brush->medium_color.alpha,
-                                            &brush->color,
-                                            &brush->medium_color,
-                                            &brush_color);
-                                        break;
-                                        case BLEND_MODE_NORMAL:
-                                        default:
-                                        color_blend_single_struct (
-                                            brush->medium_color.alpha,
-                                            brush->color.vector,
-                                            brush->medium_color.vector,
-                                            &brush_color);
-                                        break;
-                                      }
-                                    if (distance_sq / brush_radius_sq
-                                        >= brush_hardness)
-                                      {
-                                        alpha = brush_hardness * brush_hardness
-                                                * brush_radius_sq
-                                                / distance_sq;
-                                      }
-                                    alpha *= brush_alpha;
-                                    if (brush->is_erasing)
-                                      {
-                                        if (final_color.alpha > 0)
-                                          {
-                                            blend_factor
-                                                = alpha * brush_color.alpha;
-                                            if (final_color.alpha > 0)
-                                              {
-                                                final_color.alpha = blend (
-                                                    blend_factor,
-                                                    final_color.alpha, 0);
-                                              }
-                                          }
-                                      }
-                                    else
-                                      {
-                                        if (final_color.alpha > 0)
-                                          {
-                                            blend_factor
-                                                = alpha * brush_color.alpha;
-                                            switch (brush->mode)
-                                              {
-                                                case BLEND_MODE_ABSORB:
-                                                color_blend_absorb_single (
-                                                    blend_factor,
-                                                    &final_color,
-                                                    &brush_color,
-                                                    &final_color);
-                                                break;
-                                                case BLEND_MODE_NORMAL:
-                                                default:
-                                                color_blend_single_struct (
-                                                    blend_factor,
-                                                    final_color.vector,
-                                                    brush_color.vector,
-                                                    &final_color);
-                                                break;
-                                              }
-                                          }
-                                        else
-                                          {
-                                            final_color = brush_color;
-                                            final_color.alpha
-                                                = alpha * final_color.alpha;
-                                          }
-#pragma omp critical
-                                        {
-                                          color_add_struct (total_color.vector,
-                                                            final_color.vector,
-                                                            &total_color);
-                                          total_pixels += 1;
-                                        }
-                                      }
-                                    if (!brush->is_picking)
-                                      {
-                                        pix[index].red = final_color.red;
-                                        pix[index].green = final_color.green;
-                                        pix[index].blue = final_color.blue;
-                                        pix[index].alpha = final_color.alpha;
-                                      }
-                                  }
-                              }
-                          }
-                        if (total_pixels > 0)
-                          {
-                            total_color.red /= total_pixels;
-                            total_color.green /= total_pixels;
-                            total_color.blue /= total_pixels;
-                            total_color.alpha /= total_pixels;
-                            if (brush->is_smudging)
-                              {
-                                switch (brush->mode)
-                                  {
-                                    case BLEND_MODE_ABSORB:
-                                    color_blend_absorb_single (
-                                        brush_smudge, &brush->color,
-                                        &total_color, &brush->color);
-                                    break;
-                                    case BLEND_MODE_NORMAL:
-                                    default:
-                                    color_blend_absorb_single (
-                                        brush_smudge, &brush->color,
-                                        &total_color, &brush->color);
-                                    break;
-                                  }
-                              }
-                            if (brush->is_picking)
-                              {
-                                drawing->color = total_color;
-                                brush->color = drawing->color;
-                              }
-                          }
-                        int invalid_area_x = xi - brush_radius;
-                        int invalid_area_y = yi - brush_radius;
-                        while (width - invalid_area_x < brush_bounding_size)
-                          {
-                            --invalid_area_x;
-                          }
-                        while (height - invalid_area_y < brush_bounding_size)
-                          {
-                            --invalid_area_y;
-                          }
-                        int invalid_area_width = brush_bounding_size;
-                        int invalid_area_height = brush_bounding_size;
-                        invalid_area.x = min (invalid_area.x, invalid_area_x);
-                        invalid_area.y = min (invalid_area.y, invalid_area_y);
-                        invalid_area.width
-                            = max (invalid_area.width, invalid_area_width);
-                        invalid_area.height
-                            = max (invalid_area.height, invalid_area_height);
-                      }
-                  }
-                brush = brush->next;
-              }
-            /* Draw to screen and update image file buffer. */
-            update (drawing, invalid_area, image_width, image_height, image,
-                    connection, window, draw, pixmap, BACKGROUND);
+            latency_mark (LATENCY_DAB_START);
+            rect invalid_area
+                = drawing_paint (drawing, prev_x, prev_y, pressure);
+            latency_mark (LATENCY_DAB_END);
+            drawing_prefetch (drawing, prev_x, prev_y);
+            /* Draw to screen. */
+            update (drawing, invalid_area, image_width, image_height,
+                    viewport, connection, window, draw, pixmap, BACKGROUND);
             break;
           }
         case XCB_EXPOSE:
-          {
-            xcb_copy_area (connection, pixmap, window, draw, 0, 0, 0, 0,
-                           image_width, image_height);
-            xcb_flush (connection);
+          { /* The pixmap holds what the window shows, copy back the union
+               of a series of exposed rects once the last one arrives. */
+            xcb_expose_event_t *expose_event = (void *)event;
+            rect area = { expose_event->x, expose_event->y,
+                          expose_event->width, expose_event->height };
+            exposed = rect_union (exposed, area);
+            if (expose_event->count)
+              {
+                break;
+              }
+            exposed.width = max (min (exposed.width,
+                                      viewport->width - exposed.x), 0);
+            exposed.height = max (min (exposed.height,
+                                       viewport->height - exposed.y), 0);
+            if (exposed.width && exposed.height)
+              {
+                xcb_copy_area (connection, pixmap, window, draw, exposed.x,
+                               exposed.y, exposed.x, exposed.y,
+                               exposed.width, exposed.height);
+                xcb_flush (connection);
+              }
+            exposed.width = exposed.height = 0;
             break;
           }
         case XCB_KEY_PRESS:
           {
             xcb_key_press_event_t *key_event = (void *)event;
             printf ("Keycode: %d, %d\n", key_event->detail, key_event->state);
-            switch (key_event->detail)
-              {
-              case 31:
-                { /*key: i; increase brush size*/
-                  if (key_event->state & XCB_MOD_MASK_SHIFT)
-                    { /*key: shift-i; decrease brush size*/
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->radius -= 1;
-                          if (brush->radius < 0)
-                            {
-                              brush->radius = 0;
-                            }
-                          brush = brush->next;
-                        }
-                      /*printf("Maybe decreased brush size to %d\n",
-                       * brush->size);*/
-                    }
-                  else
-                    {
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->radius += 1;
-                          if (brush->radius > BRUSH_SIZE_MAX)
-                            {
-                              brush->radius = BRUSH_SIZE_MAX;
-                            }
-                          brush = brush->next;
-                        }
-                      /*printf("Maybe increased brush size to %d\n",
-                       * brush->size);*/
-                    }
-                  break;
-                }
-              case 32:
-                { /*key: o; increase brush alpha*/
-                  if (key_event->state & XCB_MOD_MASK_SHIFT)
-                    { /*key: shift-o; decrease brush alpha*/
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->color.alpha -= 0.01;
-                          if (brush->color.alpha < 0)
-                            {
-                              brush->color.alpha = 0;
-                            }
-                          brush = brush->next;
-                        }
-                      /*printf("Maybe decreased brush alpha to %d\n",
-                       * brush->color.alpha);*/
-                    }
-                  else
-                    {
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->color.alpha += 0.01;
-                          if (brush->color.alpha > 1)
-                            {
-                              brush->color.alpha = 1;
-                            }
-                          brush = brush->next;
-                        }
-                      /*printf("Maybe increased brush alpha to %d\n",
-                       * brush->color.alpha);*/
-                    }
-                  break;
-                }
-              case 39:
-                { /*key: s; maybe save image file*/
-                  if (key_event->state & XCB_MOD_MASK_SHIFT)
-                    { /*shift-s saves image data to file*/
-                      if (image_file_name)
-                        {
-                          TIFF *tif = TIFFOpen (image_file_name, "w");
-                          if (tif)
-                            {
-                              int32_t x, y;
-                              const uint16_t extra[]
-                                  = { EXTRASAMPLE_UNASSALPHA };
-                              TIFFSetField (tif, TIFFTAG_IMAGEWIDTH,
-                                            image_width);
-                              TIFFSetField (tif, TIFFTAG_IMAGELENGTH,
-                                            image_height);
-                              TIFFSetField (tif, TIFFTAG_SAMPLEFORMAT,
-                                            SAMPLEFORMAT_UINT);
-                              TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, 4);
-                              TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, 8);
-                              TIFFSetField (tif, TIFFTAG_EXTRASAMPLES, 1,
-                                            extra);
-                              TIFFSetField (tif, TIFFTAG_PLANARCONFIG,
-                                            PLANARCONFIG_CONTIG);
-                              TIFFSetField (tif, TIFFTAG_PHOTOMETRIC,
-                                            PHOTOMETRIC_RGB);
-                              for (y = 0; y < image_height; y++)
-                                {
-                                  TIFFWriteScanline (
-                                      tif, image + (y * image_width), y, 0);
-                                }
-                              TIFFFlush (tif);
-                              TIFFClose (tif);
-                              printf ("Saved image to file %s\n",
-                                      image_file_name);
-                            }
-                        }
-                    }
-                  else
-                    { /*key: s; toggle smudge on / off*/
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->is_smudging = brush->is_smudging ? 0 : 1;
-                          if (!brush->is_smudging)
-                            {
-                              brush->color = drawing->color;
-                            }
-                          brush = brush->next;
-                        }
-                    }
-                  break;
-                }
-              case 56:
-                { /*key: b; toggle paint on / off*/
-                  drawing->is_drawing = drawing->is_drawing ? 0 : 1;
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->is_drawing = brush->is_drawing ? 0 : 1;
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 26:
-                { /*key: e; toggle erase on / off*/
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->is_erasing = brush->is_erasing ? 0 : 1;
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 33:
-                { /*key: p; toggle pick on / off*/
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->is_picking = brush->is_picking ? 0 : 1;
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 46:
-                { /*key: l; layer management*/
-                  if (key_event->state & XCB_MOD_MASK_SHIFT)
-                    { /*shift-l deletes topmost layer*/
-                      del_top_layer (drawing);
-                      if (drawing->current == NULL)
-                        {
-                          memset ((void *)image, 0x0,
-                                  sizeof (uint32_t) * image_width
-                                      * image_height);
-                        }
-                      rect invalid_area = { 0, 0, image_width, image_height };
-                      update (drawing, invalid_area, image_width, image_height,
-                              image, connection, window, draw, pixmap,
-                              BACKGROUND);
-                    }
-                  else
-                    {
-                      add_top_layer (drawing, image_width, image_height);
-                    }
-                  break;
-                }
-              case 10:
-                { /*key: 1; color number 1*/
-                  colors_index = 0;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 11:
-                { /*key: 2; color number 2*/
-                  colors_index = 1;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 12:
-                { /*key: 3; color number 3*/
-                  colors_index = 2;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 13:
-                { /*key: 4; color number 4*/
-                  colors_index = 3;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 14:
-                { /*key: 5; color number 5*/
-                  colors_index = 4;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 15:
-              case 16:
-              case 17:
-              case 18:
-                { /*key: 6; color number 6*/
-                  /*key: 7; color number 7*/
-                  /*key: 8; color number 8*/
-                  /*key: 9; color number 9*/
-                  colors_index = key_event->detail - 10;
-                  drawing->color = *Colors[colors_index];
-                  Brush *brush = drawing->active_brushes;
-                  while (brush != NULL)
-                    {
-                      brush->color = *Colors[colors_index];
-                      brush = brush->next;
-                    }
-                  break;
-                }
-              case 54:
-                { /*key: c; next color*/
-                  if (colors_index >= 0)
-                    {
-                      if (key_event->state & XCB_MOD_MASK_SHIFT)
-                        { /*shift-c previous color*/
-                          colors_index -= 1;
-                          if (colors_index < 0)
-                            {
-                              colors_index = colors - 1;
-                            }
-                        }
-                      else
-                        {
-                          colors_index += 1;
-                          if (colors_index >= colors)
-                            {
-                              colors_index = 0;
-                            }
-                        }
-                      drawing->color = *Colors[colors_index];
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->color = *Colors[colors_index];
-                          brush = brush->next;
-                        }
-                    }
-                  break;
-                }
-              case 58:
-                { /*key: m; next blend mode*/
-                  if (blend_mode >= 0)
-                    {
-                      if (key_event->state & XCB_MOD_MASK_SHIFT)
-                        { /*shift-m previous blend mode*/
-                          blend_mode -= 1;
-                          if (blend_mode < 0)
-                            {
-                              blend_mode = BLEND_MODES - 1;
-                            }
-                        }
-                      else
-                        {
-                          blend_mode += 1;
-                          if (blend_mode >= colors)
-                            {
-                              blend_mode = 0;
-                            }
-                        }
-                      Brush *brush = drawing->active_brushes;
-                      while (brush != NULL)
-                        {
-                          brush->mode = blend_mode;
-                          brush = brush->next;
-                        }
-                    }
-                  break;
-                }
-              default:
+            if (key_event->detail == 28)
+              { /*key: t; print latency statistics*/
+                latency_report ();
                 break;
               }
+            if (handle_view_key (viewport, key_event->detail,
+                                 key_event->state))
+              { /* Keep the pointer where it is on the canvas, recorded
+                   without pressure so that replaying does not paint. */
+                viewport_to_canvas (viewport, pointer_x, pointer_y,
+                                    &drawing->x, &drawing->y);
+                journal_sample (journal, drawing->x, drawing->y, 0.0f,
+                                drawing->is_drawing);
+                rect window_area
+                    = { 0, 0, viewport->width, viewport->height };
+                redraw_window (viewport, window_area, connection, window,
+                               draw, pixmap);
+                break;
+              }
+            if (key_event->detail == 39
+                && key_event->state & XCB_MOD_MASK_SHIFT)
+              { /*shift-s saves image data to file*/
+                trace_begin ("save");
+                if (save_drawing (drawing, image_width, image_height))
+                  { /* Input from now on goes on from this state. */
+                    size_t snapshot_size;
+                    void *snapshot
+                        = drawing_snapshot (drawing, &snapshot_size);
+                    journal_reset (journal, snapshot, snapshot_size);
+                    free (snapshot);
+                  }
+                trace_end ("save");
+                break;
+              }
+            journal_key (journal, key_event->detail, key_event->state);
+            if (handle_key (drawing, key_event->detail, key_event->state,
+                            image_width, image_height))
+              {
+                rect invalid_area = { 0, 0, image_width, image_height };
+                update (drawing, invalid_area, image_width, image_height,
+                        viewport, connection, window, draw, pixmap,
+                        BACKGROUND);
+              }
+            break;
           }
         default:
           break;
         }
       free (event);
     }
+  journal_close (journal);
+  recorder_del (recorder);
+  latency_report ();
+  trace_close ();
   free (devices_reply);
   xcb_free_pixmap (connection, pixmap);
   xcb_disconnect (connection);
-  free (image);
+  viewport_del (viewport);
 
-  while (drawing->bottom != NULL)
-    {
-      FloatingLayer *current = drawing->bottom;
-      drawing->bottom = drawing->bottom->next;
-      floating_layer_del (current);
-    }
+  del_all_layers (drawing);
+  document_close (drawing->document);
+  tile_cache_del (drawing->tile_cache);
+  brush_tip_del (default_brush.tip);
+  selection_del (drawing->selection);
+  share_del (drawing->share);
 
   return 0;
 }
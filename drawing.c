@@ -0,0 +1,1011 @@
+#include "drawing.h"
+#include "brush_tip.h"
+#include "selection.h"
+#include "stroke.h"
+#include "tile_cache.h"
+#include "trace.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFETCH_STEPS 4 /* Movements ahead of the brush. */
+
+_Static_assert (BLEND_MODES == COLOR_BLEND_MODES,
+                "BlendMode and color_blend_modes differ");
+
+int
+min (int x, int y)
+{
+  return x <= y ? x : y;
+}
+
+int
+max (int x, int y)
+{
+  return x >= y ? x : y;
+}
+
+double
+blend (double t, double x, double y)
+{
+  return (1.0 - t) * x + t * y;
+}
+
+void
+drawing_init (FloatingDrawing *drawing, Brush *brush)
+{
+  const color default_color = { { 1, 0.1, 0.25, 0.8 } };
+  const color default_medium_color = { { 0.9, 0.9, 0.75, 0.0 } };
+  const char *layer_format = getenv ("FLOATING_LAYER_FORMAT");
+  const char *thumbnail_size = getenv ("FLOATING_THUMBNAIL");
+  const char *export_scale = getenv ("FLOATING_EXPORT_SCALE");
+  memset (drawing, 0, sizeof (FloatingDrawing));
+  drawing->is_linear = getenv ("FLOATING_LINEAR") != NULL;
+  brush->is_drawing = 0;
+  brush->is_picking = 0;
+  brush->is_erasing = 0;
+  brush->is_smudging = 0;
+  brush->mode = BLEND_MODE_NORMAL;
+  brush->color = drawing_working_color (drawing, default_color);
+  brush->medium_color = drawing_working_color (drawing, default_medium_color);
+  brush->radius = BRUSH_SIZE_DEFAULT;
+  brush->hardness = 0.4;
+  brush->density = 2.5;
+  brush->smudge = 0.5;
+  brush->tip = NULL;
+  brush->next = NULL;
+  drawing->colors_index = -1;
+  drawing->blend_mode = BLEND_MODE_NORMAL;
+  drawing->current = -1;
+  drawing->stored_brushes = brush;
+  drawing->active_brushes = brush;
+  drawing->color = brush->color;
+  drawing->medium_color = brush->medium_color;
+  drawing->thumbnail_size
+      = thumbnail_size != NULL ? atoi (thumbnail_size) : 0;
+  drawing->export_scale = export_scale != NULL ? atof (export_scale) : 0;
+  drawing->layer_format = LAYER_FORMAT_STRAIGHT;
+  if (layer_format != NULL && !strcmp (layer_format, "premultiplied"))
+    {
+      drawing->layer_format = LAYER_FORMAT_PREMULTIPLIED;
+    }
+  else if (layer_format != NULL && !strcmp (layer_format, "uint16"))
+    {
+      drawing->layer_format = LAYER_FORMAT_UINT16;
+    }
+}
+
+color
+drawing_working_color (const FloatingDrawing *drawing, color srgb)
+{
+  if (drawing->is_linear)
+    {
+      color_span_srgb_to_linear (&srgb, 1);
+    }
+  return srgb;
+}
+
+int
+layer_format_is_premultiplied (const FloatingDrawing *drawing)
+{
+  return drawing->layer_format != LAYER_FORMAT_STRAIGHT;
+}
+
+FloatingLayer *
+floating_layer_new (int width, int height, LayerFormat format,
+                    TileCache *cache)
+{
+  const unsigned int image_format = format == LAYER_FORMAT_UINT16
+                                        ? IMAGE_FORMAT_UINT16
+                                        : IMAGE_FORMAT_COLOR;
+  if (cache != NULL)
+    {
+      return floating_layer_new_from_image (
+          image_new_cached (width, height, image_format, cache));
+    }
+  return floating_layer_new_from_image (
+      image_format == IMAGE_FORMAT_UINT16 ? image_new_uint16 (width, height)
+                                          : image_new (width, height));
+}
+
+FloatingLayer *
+floating_layer_new_from_image (image_t *image)
+{
+  FloatingLayer *layer = malloc (sizeof (FloatingLayer));
+  layer->alpha = 1.0;
+  layer->image = image;
+  layer->is_visible = 1;
+  layer->tile_offsets = NULL;
+  layer->mode = BLEND_MODE_NORMAL;
+  layer->strokes = NULL;
+  return layer;
+}
+
+void
+floating_layer_del (FloatingLayer *layer)
+{
+  image_del (layer->image);
+  strokes_del (layer->strokes);
+  free (layer->tile_offsets);
+  free (layer);
+}
+
+void
+floating_layer_drop_strokes (FloatingLayer *layer)
+{
+  strokes_del (layer->strokes);
+  layer->strokes = NULL;
+}
+
+FloatingLayer *
+current_layer (const FloatingDrawing *drawing)
+{
+  return drawing->current >= 0 ? drawing->layers[drawing->current] : NULL;
+}
+
+/* Put a layer into the stack, as the current one. */
+static void
+insert_layer (FloatingDrawing *drawing, int index, FloatingLayer *layer)
+{
+  if (drawing->layer_count == drawing->layer_capacity)
+    {
+      drawing->layer_capacity = drawing->layer_capacity * 2 + 8;
+      drawing->layers
+          = realloc (drawing->layers,
+                     sizeof (FloatingLayer *) * drawing->layer_capacity);
+    }
+  memmove (drawing->layers + index + 1, drawing->layers + index,
+           sizeof (FloatingLayer *) * (drawing->layer_count - index));
+  drawing->layers[index] = layer;
+  drawing->layer_count += 1;
+  drawing->current = index;
+}
+
+/* Take a layer out of the stack without deleting it. */
+static void
+remove_layer (FloatingDrawing *drawing, int index)
+{
+  memmove (drawing->layers + index, drawing->layers + index + 1,
+           sizeof (FloatingLayer *) * (drawing->layer_count - index - 1));
+  drawing->layer_count -= 1;
+  if (drawing->current >= index)
+    {
+      drawing->current = max (drawing->current - 1,
+                              drawing->layer_count ? 0 : -1);
+    }
+}
+
+void
+add_top_layer (FloatingDrawing *drawing, int width, int height)
+{
+  if (drawing->layer_count)
+    {
+      width = drawing->layers[0]->image->width;
+      height = drawing->layers[0]->image->height;
+    }
+  insert_layer (drawing, drawing->layer_count,
+                floating_layer_new (width, height, drawing->layer_format,
+                                    drawing->tile_cache));
+  if (drawing->export_scale > 0)
+    { /* Empty, all of it is strokes from now on. */
+      current_layer (drawing)->strokes = strokes_new ();
+    }
+}
+
+void
+add_top_layer_image (FloatingDrawing *drawing, image_t *image)
+{
+  tile_cache_adopt (drawing->tile_cache, image);
+  insert_layer (drawing, drawing->layer_count,
+                floating_layer_new_from_image (image));
+}
+
+void
+del_current_layer (FloatingDrawing *drawing)
+{
+  FloatingLayer *current = current_layer (drawing);
+  if (current != NULL)
+    {
+      remove_layer (drawing, drawing->current);
+      floating_layer_del (current);
+    }
+}
+
+void
+del_all_layers (FloatingDrawing *drawing)
+{
+  int i;
+  for (i = 0; i < drawing->layer_count; ++i)
+    {
+      floating_layer_del (drawing->layers[i]);
+    }
+  free (drawing->layers);
+  drawing->layers = NULL;
+  drawing->layer_count = 0;
+  drawing->layer_capacity = 0;
+  drawing->current = -1;
+}
+
+void
+select_layer (FloatingDrawing *drawing, int index)
+{
+  if (drawing->layer_count)
+    {
+      drawing->current = max (0, min (index, drawing->layer_count - 1));
+    }
+}
+
+void
+move_current_layer (FloatingDrawing *drawing, int offset)
+{
+  FloatingLayer *current = current_layer (drawing);
+  if (current != NULL)
+    {
+      const int index = max (0, min (drawing->current + offset,
+                                     drawing->layer_count - 1));
+      remove_layer (drawing, drawing->current);
+      insert_layer (drawing, index, current);
+    }
+}
+
+/* Bake the opacity of the lower layer into its pixels, so that the result
+   looks the same, then composite the upper one onto it. */
+static void
+merge_layer (FloatingDrawing *drawing, FloatingLayer *below,
+             const FloatingLayer *above)
+{
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  floating_layer_drop_strokes (below);
+  if (below->alpha != 1.0)
+    {
+      image_fade (below->image, below->alpha, is_premultiplied);
+      below->alpha = 1.0;
+    }
+  image_blend (below->image, above->image, above->mode, above->alpha,
+               is_premultiplied);
+}
+
+int
+merge_down (FloatingDrawing *drawing)
+{
+  if (drawing->current < 1)
+    {
+      return 0;
+    }
+  FloatingLayer *above = drawing->layers[drawing->current];
+  merge_layer (drawing, drawing->layers[drawing->current - 1], above);
+  remove_layer (drawing, drawing->current);
+  floating_layer_del (above);
+  return 1;
+}
+
+void
+flatten (FloatingDrawing *drawing)
+{
+  FloatingLayer *bottom = NULL;
+  int i;
+  for (i = 0; i < drawing->layer_count; ++i)
+    {
+      FloatingLayer *layer = drawing->layers[i];
+      if (!layer->is_visible)
+        {
+          floating_layer_del (layer);
+        }
+      else if (bottom == NULL)
+        {
+          bottom = layer;
+        }
+      else
+        {
+          merge_layer (drawing, bottom, layer);
+          floating_layer_del (layer);
+        }
+    }
+  drawing->layer_count = bottom != NULL;
+  drawing->current = bottom != NULL ? 0 : -1;
+  if (bottom != NULL)
+    {
+      drawing->layers[0] = bottom;
+    }
+}
+
+/* Paint one dab of a brush on a canvas of straight colors, adding the
+   resulting colors of the pixels it covers to a total for smudging and
+   picking. */
+static void
+paint_dab (const Brush *brush, image_t *canvas, const Selection *selection,
+           double x, double y, double brush_radius, double brush_hardness,
+           double brush_alpha, color *total, unsigned int *total_pixels)
+{
+  const int width = canvas->width;
+  const int height = canvas->height;
+  const int xi = x, yi = y;
+  const double brush_radius_sq = brush_radius * brush_radius;
+  const int reach = ceil (brush_radius);
+  int i;
+#pragma omp parallel
+  {
+    trace_begin ("dab worker");
+#pragma omp for nowait
+    for (i = xi - reach; i <= xi + reach; ++i)
+      {
+        int j;
+#pragma omp parallel for
+        for (j = yi - reach; j <= yi + reach; ++j)
+          {
+            double blend_factor = 0.0;
+            double alpha = 1.0;
+            double distance_sq
+                = (i - x) * (i - x) + (j - y) * (j - y);
+            const int is_inside = i >= 0 && j >= 0 && i < width && j < height;
+            float tip_coverage = 0.0f;
+            if (is_inside && brush->tip != NULL)
+              {
+                brush_tip_row (brush->tip, x, y, brush_radius, i, j, 1,
+                               &tip_coverage);
+              }
+            /* Pixels the tip leaves out are neither painted nor picked. */
+            if (is_inside
+                && (brush->tip != NULL ? tip_coverage > 0.0f
+                                       : distance_sq <= brush_radius_sq)
+                && (selection == NULL
+                    || *selection_pixels (selection, i, j)))
+              {
+                color *pixel = image_pixel (canvas, i, j);
+                color final_color = *pixel;
+                color brush_color;
+                switch (brush->mode)
+                  {
+                    case BLEND_MODE_ABSORB:
+                    color_blend_absorb_single (
+                        brush->medium_color.alpha,
+                        &brush->color,
+                        &brush->medium_color,
+                        &brush_color);
+                    break;
+                    case BLEND_MODE_NORMAL:
+                    default:
+                    color_blend_single_struct (
+                        brush->medium_color.alpha,
+                        brush->color.vector,
+                        brush->medium_color.vector,
+                        &brush_color);
+                    break;
+                  }
+                if (brush->tip != NULL)
+                  {
+                    alpha = tip_coverage;
+                  }
+                else if (distance_sq / brush_radius_sq
+                         >= brush_hardness)
+                  {
+                    alpha = brush_hardness * brush_hardness
+                            * brush_radius_sq
+                            / distance_sq;
+                  }
+                alpha *= brush_alpha;
+                if (selection != NULL)
+                  {
+                    alpha *= *selection_pixels (selection, i, j) / 255.0;
+                  }
+                if (brush->is_erasing)
+                  {
+                    if (final_color.alpha > 0)
+                      {
+                        blend_factor
+                            = alpha * brush_color.alpha;
+                        if (final_color.alpha > 0)
+                          {
+                            final_color.alpha = blend (
+                                blend_factor,
+                                final_color.alpha, 0);
+                          }
+                      }
+                  }
+                else if (brush->mode != BLEND_MODE_NORMAL
+                         && brush->mode != BLEND_MODE_ABSORB)
+                  { /* The other modes only have premultiplied kernels. */
+                    const float coverage = alpha;
+                    color_span_premultiply (&final_color, 1);
+                    color_span_premultiply (&brush_color, 1);
+                    color_blend_modes[brush->mode].span (
+                        &final_color, &brush_color, 0, &coverage, 0, 1);
+                    color_span_unpremultiply (&final_color, 1);
+#pragma omp critical
+                    {
+                      color_add_struct (total->vector,
+                                        final_color.vector,
+                                        total);
+                      *total_pixels += 1;
+                    }
+                  }
+                else
+                  {
+                    if (final_color.alpha > 0)
+                      {
+                        blend_factor
+                            = alpha * brush_color.alpha;
+                        switch (brush->mode)
+                          {
+                            case BLEND_MODE_ABSORB:
+                            color_blend_absorb_single (
+                                blend_factor,
+                                &final_color,
+                                &brush_color,
+                                &final_color);
+                            break;
+                            case BLEND_MODE_NORMAL:
+                            default:
+                            color_blend_single_struct (
+                                blend_factor,
+                                final_color.vector,
+                                brush_color.vector,
+                                &final_color);
+                            break;
+                          }
+                      }
+                    else
+                      {
+                        final_color = brush_color;
+                        final_color.alpha
+                            = alpha * final_color.alpha;
+                      }
+#pragma omp critical
+                    {
+                      color_add_struct (total->vector,
+                                        final_color.vector,
+                                        total);
+                      *total_pixels += 1;
+                    }
+                  }
+                if (!brush->is_picking)
+                  {
+                    pixel->red = final_color.red;
+                    pixel->green = final_color.green;
+                    pixel->blue = final_color.blue;
+                    pixel->alpha = final_color.alpha;
+                  }
+              }
+          }
+      }
+    trace_end ("dab worker");
+  }
+}
+
+/* The same for a premultiplied canvas, a row span at a time through the
+   kernel of the blend mode, of either pixel format. */
+static void
+paint_dab_spans (const Brush *brush, image_t *canvas,
+                 const Selection *selection, double x, double y,
+                 double brush_radius, double brush_hardness,
+                 double brush_alpha, color *total, unsigned int *total_pixels)
+{
+  const int is_uint16 = canvas->format == IMAGE_FORMAT_UINT16;
+  const double brush_radius_sq = brush_radius * brush_radius;
+  const int y0 = max (ceil (y - brush_radius), 0);
+  const int y1 = min (floor (y + brush_radius), (int)canvas->height - 1);
+  const ColorBlendSpan blend_span = color_blend_modes[brush->mode].span;
+  color brush_color;
+  uint16_t brush_pixel[4];
+  uint64_t sums[4] = { 0, 0, 0, 0 };
+  unsigned int pixels = 0;
+  int j;
+  switch (brush->mode)
+    {
+      case BLEND_MODE_ABSORB:
+      color_blend_absorb_single (brush->medium_color.alpha, &brush->color,
+                                 &brush->medium_color, &brush_color);
+      break;
+      default:
+      color_blend_single_struct (brush->medium_color.alpha,
+                                 brush->color.vector,
+                                 brush->medium_color.vector, &brush_color);
+      break;
+    }
+  color_span_premultiply (&brush_color, 1);
+  pixel16_span_from_color (brush_pixel, &brush_color, 1);
+#pragma omp parallel
+  {
+    trace_begin ("dab worker");
+    float coverage[IMAGE_TILE_SIZE];
+    uint16_t coverage16[IMAGE_TILE_SIZE];
+    color picked[IMAGE_TILE_SIZE]; /* Big enough for either format. */
+    color row_total = { { 0, 0, 0, 0 } };
+    uint64_t row_sums[4] = { 0, 0, 0, 0 };
+    unsigned int row_pixels = 0;
+#pragma omp for nowait
+    for (j = y0; j <= y1; ++j)
+      {
+        /* A tip fills the square around the circle. */
+        const double half
+            = brush->tip != NULL
+                  ? brush_radius
+                  : sqrt (fmax (brush_radius_sq - (j - y) * (j - y), 0));
+        const int start = max (ceil (x - half), 0);
+        const int end = min (floor (x + half) + 1, (int)canvas->width);
+        int i = start;
+        while (i < end)
+          { /* Up to the end of the tile row and of the selected run. */
+            const int stop = selection_clip (selection, j, &i, end);
+            if (i >= end)
+              {
+                break;
+              }
+            const int n
+                = min (stop - i, IMAGE_TILE_SIZE - (i & IMAGE_TILE_MASK));
+            void *span = is_uint16 ? (void *)image_pixel16 (canvas, i, j)
+                                   : (void *)image_pixel (canvas, i, j);
+            int k;
+            if (brush->tip != NULL)
+              {
+                brush_tip_row (brush->tip, x, y, brush_radius, i, j, n,
+                               coverage);
+              }
+            for (k = 0; k < n; ++k)
+              {
+                const double distance_sq
+                    = (i + k - x) * (i + k - x) + (j - y) * (j - y);
+                double alpha = 1.0;
+                if (brush->tip != NULL)
+                  {
+                    alpha = coverage[k];
+                  }
+                else if (distance_sq / brush_radius_sq >= brush_hardness)
+                  {
+                    alpha = brush_hardness * brush_hardness * brush_radius_sq
+                            / distance_sq;
+                  }
+                coverage[k] = fmin (alpha * brush_alpha, 1.0);
+              }
+            if (selection != NULL)
+              {
+                selection_mask (selection, i, j, n, coverage);
+              }
+            for (k = 0; k < n; ++k)
+              {
+                coverage16[k] = lrint (coverage[k] * 65535);
+              }
+            if (brush->is_picking)
+              { /* Look at what it would do without doing it. */
+                memcpy (picked, span, n * (is_uint16 ? 4 * sizeof (uint16_t)
+                                                     : sizeof (color)));
+                span = picked;
+              }
+            if (is_uint16)
+              {
+                if (brush->is_erasing)
+                  {
+                    pixel16_span_erase (span, coverage16, brush_pixel, n);
+                  }
+                else
+                  {
+                    pixel16_span_paint_mode (brush->mode, span, coverage16,
+                                             brush_pixel, n);
+                    pixel16_span_sum (span, n, row_sums);
+                    row_pixels += n;
+                  }
+              }
+            else if (brush->is_erasing)
+              {
+                color *pixel = span;
+                for (k = 0; k < n; ++k)
+                  {
+                    color_multiply_single_struct (
+                        1 - coverage[k] * brush_color.alpha,
+                        pixel[k].vector, pixel + k);
+                  }
+              }
+            else
+              {
+                color *pixel = span;
+                blend_span (pixel, &brush_color, 0, coverage, 1, n);
+                for (k = 0; k < n; ++k)
+                  {
+                    color_add_struct (row_total.vector, pixel[k].vector,
+                                      &row_total);
+                  }
+                row_pixels += n;
+              }
+            i += n;
+          }
+      }
+#pragma omp critical
+    {
+      color_add_struct (total->vector, row_total.vector, total);
+      sums[0] += row_sums[0];
+      sums[1] += row_sums[1];
+      sums[2] += row_sums[2];
+      sums[3] += row_sums[3];
+      pixels += row_pixels;
+    }
+    trace_end ("dab worker");
+  }
+  total->red += sums[0] / 65535.0;
+  total->green += sums[1] / 65535.0;
+  total->blue += sums[2] / 65535.0;
+  total->alpha += sums[3] / 65535.0;
+  *total_pixels += pixels;
+}
+
+/* Add a segment about to be painted to the strokes of a layer, or forget
+   them if it cannot be painted again from its samples alone. */
+static void
+record_segment (const FloatingDrawing *drawing, FloatingLayer *layer,
+                double prev_x, double prev_y, float pressure)
+{
+  const Brush *brush;
+  if (layer->strokes == NULL)
+    {
+      return;
+    }
+  for (brush = drawing->active_brushes; brush != NULL; brush = brush->next)
+    {
+      if (brush->is_drawing && brush->is_smudging)
+        { /* Its color depends on what is under it. */
+          floating_layer_drop_strokes (layer);
+          return;
+        }
+    }
+  if (drawing->selection != NULL)
+    {
+      floating_layer_drop_strokes (layer);
+      return;
+    }
+  strokes_add (layer->strokes, drawing->active_brushes, prev_x, prev_y,
+               drawing->x, drawing->y, pressure);
+}
+
+void
+brush_paint_segment (const Brush *brush, image_t *canvas,
+                     int is_premultiplied, double prev_x, double prev_y,
+                     double x, double y, float pressure, double scale,
+                     int left, int top)
+{
+  const double brush_radius = brush->radius * pressure * scale;
+  color total_color = { { 0, 0, 0, 0 } };
+  unsigned int total_pixels = 0;
+  double t;
+  if (!brush->is_drawing || brush->density <= 0 || brush_radius <= 0
+      || brush->hardness <= 0)
+    {
+      return;
+    }
+  for (t = 0.0; t < 1.0 + brush->density; t += brush->density)
+    {
+      const double dab_x = (t * x + (1 - t) * prev_x) * scale - left;
+      const double dab_y = (t * y + (1 - t) * prev_y) * scale - top;
+      if (dab_x + brush_radius < 0 || dab_y + brush_radius < 0
+          || dab_x - brush_radius >= canvas->width
+          || dab_y - brush_radius >= canvas->height)
+        {
+          continue;
+        }
+      if (is_premultiplied)
+        {
+          paint_dab_spans (brush, canvas, NULL, dab_x, dab_y, brush_radius,
+                           brush->hardness, 1.0, &total_color,
+                           &total_pixels);
+        }
+      else
+        {
+          paint_dab (brush, canvas, NULL, dab_x, dab_y, brush_radius,
+                     brush->hardness, 1.0, &total_color, &total_pixels);
+        }
+    }
+}
+
+/* Paint with the active brushes along the line from the previous position
+   to the current one. Returns the area of the canvas that changed. */
+rect
+drawing_paint (FloatingDrawing *drawing, double prev_x, double prev_y,
+               float pressure)
+{
+  FloatingLayer *layer = current_layer (drawing);
+  image_t *canvas = layer->image;
+  const int width = canvas->width;
+  const int height = canvas->height;
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  Brush *brush = drawing->active_brushes;
+  rect invalid_area;
+  invalid_area.x = width;
+  invalid_area.y = height;
+  invalid_area.width = 0;
+  invalid_area.height = 0;
+  record_segment (drawing, layer, prev_x, prev_y, pressure);
+  while (brush != NULL)
+    {
+      double brush_density = brush->density;
+      double brush_radius = brush->radius * pressure;
+      double brush_hardness = brush->hardness;
+      double brush_alpha = 1.0;
+      double brush_smudge = brush->smudge * pressure;
+      if (brush->is_drawing && brush_density > 0 && brush_radius > 0
+          && brush_hardness > 0)
+        {
+          double t;
+          for (t = 0.0; t < 1.0 + brush_density; t += brush_density)
+            {
+              trace_begin ("dab");
+              const double x = t * drawing->x + (1 - t) * prev_x;
+              const double y = t * drawing->y + (1 - t) * prev_y;
+              const int xi = x, yi = y;
+              unsigned int total_pixels = 0;
+              color total_color = { { 0, 0, 0, 0 } };
+              /* Draw circular brush mark. */
+              const int brush_bounding_size
+                  = 2 * ceil (brush_radius) + 1;
+              if (is_premultiplied)
+                {
+                  paint_dab_spans (brush, canvas, drawing->selection, x, y,
+                                   brush_radius, brush_hardness, brush_alpha,
+                                   &total_color, &total_pixels);
+                }
+              else
+                {
+                  paint_dab (brush, canvas, drawing->selection, x, y,
+                             brush_radius, brush_hardness, brush_alpha,
+                             &total_color, &total_pixels);
+                }
+              if (total_pixels > 0)
+                {
+                  total_color.red /= total_pixels;
+                  total_color.green /= total_pixels;
+                  total_color.blue /= total_pixels;
+                  total_color.alpha /= total_pixels;
+                  if (is_premultiplied)
+                    {
+                      color_span_unpremultiply (&total_color, 1);
+                    }
+                  if (brush->is_smudging)
+                    { /* The brush takes up the colors under it the way
+                         its mode blends onto them, on premultiplied
+                         colors as the kernels take them. */
+                      const float smudge = brush_smudge;
+                      color picked = total_color, smudged = brush->color;
+                      color_span_premultiply (&picked, 1);
+                      color_span_premultiply (&smudged, 1);
+                      color_blend_modes[brush->mode].span (
+                          &smudged, &picked, 0, &smudge, 0, 1);
+                      if (smudged.alpha > 0)
+                        { /* Else the brush keeps its color. */
+                          color_span_unpremultiply (&smudged, 1);
+                          brush->color = smudged;
+                        }
+                    }
+                  if (brush->is_picking)
+                    {
+                      drawing->color = total_color;
+                      brush->color = drawing->color;
+                    }
+                }
+              if (!brush->is_picking)
+                {
+                  image_mark (canvas, xi - ceil (brush_radius),
+                              yi - ceil (brush_radius),
+                              brush_bounding_size + 1,
+                              brush_bounding_size + 1,
+                              IMAGE_TILE_DIRTY);
+                  tile_cache_touch (canvas, xi - ceil (brush_radius),
+                                    yi - ceil (brush_radius),
+                                    brush_bounding_size + 1,
+                                    brush_bounding_size + 1);
+                }
+              int invalid_area_x = xi - brush_radius;
+              int invalid_area_y = yi - brush_radius;
+              while (width - invalid_area_x < brush_bounding_size)
+                {
+                  --invalid_area_x;
+                }
+              while (height - invalid_area_y < brush_bounding_size)
+                {
+                  --invalid_area_y;
+                }
+              /* Grow to hold all the dabs, not only the largest. */
+              const int invalid_area_x1
+                  = invalid_area.width
+                        ? max (invalid_area.x + invalid_area.width,
+                               invalid_area_x + brush_bounding_size)
+                        : invalid_area_x + brush_bounding_size;
+              const int invalid_area_y1
+                  = invalid_area.height
+                        ? max (invalid_area.y + invalid_area.height,
+                               invalid_area_y + brush_bounding_size)
+                        : invalid_area_y + brush_bounding_size;
+              invalid_area.x = min (invalid_area.x, invalid_area_x);
+              invalid_area.y = min (invalid_area.y, invalid_area_y);
+              invalid_area.width = invalid_area_x1 - invalid_area.x;
+              invalid_area.height = invalid_area_y1 - invalid_area.y;
+              trace_end ("dab");
+            }
+        }
+      brush = brush->next;
+    }
+  return invalid_area;
+}
+
+void
+drawing_prefetch (FloatingDrawing *drawing, double prev_x, double prev_y)
+{
+  const double dx = drawing->x - prev_x;
+  const double dy = drawing->y - prev_y;
+  double radius = 0;
+  Brush *brush;
+  int step;
+  FloatingLayer *current = current_layer (drawing);
+  if (current == NULL || current->image->cache == NULL)
+    {
+      return;
+    }
+  for (brush = drawing->active_brushes; brush != NULL; brush = brush->next)
+    {
+      radius = fmax (radius, brush->radius);
+    }
+  const int r = ceil (radius) + 1;
+  for (step = 1; step <= PREFETCH_STEPS; ++step)
+    {
+      tile_cache_prefetch (current->image,
+                           drawing->x + step * dx - r,
+                           drawing->y + step * dy - r, 2 * r + 1, 2 * r + 1);
+    }
+}
+
+/* What drawing_snapshot keeps, in the byte order of the machine. */
+typedef struct DrawingSnapshot DrawingSnapshot;
+typedef struct BrushSnapshot BrushSnapshot;
+
+struct DrawingSnapshot
+{
+  double x, y;
+  double selection_x, selection_y;
+  color color;
+  color medium_color;
+  int32_t is_drawing, current, colors_index, blend_mode, is_selecting;
+  int32_t brush_count; /* Active brushes, first to last. */
+  int32_t selection_width, selection_height; /* 0 without a selection. */
+  uint64_t selection_size; /* Of the packed selection after the brushes. */
+};
+
+struct BrushSnapshot
+{
+  double radius, hardness, density, smudge;
+  color color;
+  color medium_color;
+  int32_t is_drawing, is_erasing, is_picking, is_smudging, mode, reserved;
+};
+
+void *
+drawing_snapshot (const FloatingDrawing *drawing, size_t *size)
+{
+  DrawingSnapshot snapshot;
+  const Brush *brush;
+  void *selection = NULL;
+  uint8_t *bytes, *p;
+  memset (&snapshot, 0, sizeof (snapshot));
+  snapshot.x = drawing->x;
+  snapshot.y = drawing->y;
+  snapshot.selection_x = drawing->selection_x;
+  snapshot.selection_y = drawing->selection_y;
+  snapshot.color = drawing->color;
+  snapshot.medium_color = drawing->medium_color;
+  snapshot.is_drawing = drawing->is_drawing;
+  snapshot.current = drawing->current;
+  snapshot.colors_index = drawing->colors_index;
+  snapshot.blend_mode = drawing->blend_mode;
+  snapshot.is_selecting = drawing->is_selecting;
+  for (brush = drawing->active_brushes; brush != NULL; brush = brush->next)
+    {
+      snapshot.brush_count += 1;
+    }
+  if (drawing->selection != NULL)
+    {
+      size_t selection_size;
+      selection = selection_pack (drawing->selection, &selection_size);
+      snapshot.selection_width = drawing->selection->width;
+      snapshot.selection_height = drawing->selection->height;
+      snapshot.selection_size = selection_size;
+    }
+  *size = sizeof (snapshot) + snapshot.brush_count * sizeof (BrushSnapshot)
+          + snapshot.selection_size;
+  bytes = p = malloc (*size);
+  memcpy (p, &snapshot, sizeof (snapshot));
+  p += sizeof (snapshot);
+  for (brush = drawing->active_brushes; brush != NULL; brush = brush->next)
+    {
+      BrushSnapshot brush_snapshot;
+      memset (&brush_snapshot, 0, sizeof (brush_snapshot));
+      brush_snapshot.radius = brush->radius;
+      brush_snapshot.hardness = brush->hardness;
+      brush_snapshot.density = brush->density;
+      brush_snapshot.smudge = brush->smudge;
+      brush_snapshot.color = brush->color;
+      brush_snapshot.medium_color = brush->medium_color;
+      brush_snapshot.is_drawing = brush->is_drawing;
+      brush_snapshot.is_erasing = brush->is_erasing;
+      brush_snapshot.is_picking = brush->is_picking;
+      brush_snapshot.is_smudging = brush->is_smudging;
+      brush_snapshot.mode = brush->mode;
+      memcpy (p, &brush_snapshot, sizeof (brush_snapshot));
+      p += sizeof (brush_snapshot);
+    }
+  memcpy (p, selection, snapshot.selection_size);
+  free (selection);
+  return bytes;
+}
+
+int
+drawing_restore (FloatingDrawing *drawing, const void *bytes, size_t size)
+{
+  DrawingSnapshot snapshot;
+  const uint8_t *p = bytes;
+  Selection *selection = NULL;
+  Brush *brush;
+  int i;
+  if (size < sizeof (snapshot))
+    {
+      return 0;
+    }
+  memcpy (&snapshot, p, sizeof (snapshot));
+  p += sizeof (snapshot);
+  if (snapshot.brush_count < 0
+      || (size - sizeof (snapshot)) / sizeof (BrushSnapshot)
+             < (size_t)snapshot.brush_count
+      || size - sizeof (snapshot)
+                 - snapshot.brush_count * sizeof (BrushSnapshot)
+             != snapshot.selection_size
+      || (unsigned int)snapshot.blend_mode >= BLEND_MODES)
+    {
+      return 0;
+    }
+  if (snapshot.selection_size)
+    {
+      if (snapshot.selection_width <= 0 || snapshot.selection_height <= 0)
+        {
+          return 0;
+        }
+      selection = selection_unpack (
+          p + snapshot.brush_count * sizeof (BrushSnapshot),
+          snapshot.selection_size, snapshot.selection_width,
+          snapshot.selection_height);
+      if (selection == NULL)
+        {
+          return 0;
+        }
+    }
+  drawing->x = snapshot.x;
+  drawing->y = snapshot.y;
+  drawing->selection_x = snapshot.selection_x;
+  drawing->selection_y = snapshot.selection_y;
+  drawing->color = snapshot.color;
+  drawing->medium_color = snapshot.medium_color;
+  drawing->is_drawing = snapshot.is_drawing;
+  drawing->colors_index = snapshot.colors_index;
+  drawing->blend_mode = snapshot.blend_mode;
+  drawing->is_selecting = snapshot.is_selecting;
+  select_layer (drawing, snapshot.current);
+  selection_del (drawing->selection);
+  drawing->selection = selection;
+  /* The brushes are the same ones in the same order as when the snapshot
+     was taken, only their settings changed since. */
+  for (brush = drawing->active_brushes, i = 0;
+       brush != NULL && i < snapshot.brush_count; brush = brush->next, ++i)
+    {
+      BrushSnapshot brush_snapshot;
+      memcpy (&brush_snapshot, p + i * sizeof (BrushSnapshot),
+              sizeof (brush_snapshot));
+      brush->radius = brush_snapshot.radius;
+      brush->hardness = brush_snapshot.hardness;
+      brush->density = brush_snapshot.density;
+      brush->smudge = brush_snapshot.smudge;
+      brush->color = brush_snapshot.color;
+      brush->medium_color = brush_snapshot.medium_color;
+      brush->is_drawing = brush_snapshot.is_drawing;
+      brush->is_erasing = brush_snapshot.is_erasing;
+      brush->is_picking = brush_snapshot.is_picking;
+      brush->is_smudging = brush_snapshot.is_smudging;
+      brush->mode = (unsigned int)brush_snapshot.mode < BLEND_MODES
+                        ? (BlendMode)brush_snapshot.mode
+                        : BLEND_MODE_NORMAL;
+    }
+  return 1;
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include <stdint.h>
+
+#include "image.h"
+
+typedef struct FloatingDrawing FloatingDrawing;
+typedef struct FloatingLayer FloatingLayer;
+typedef struct Brush Brush;
+typedef struct rect rect;
+typedef struct Document Document;
+typedef struct BrushTip BrushTip;
+typedef struct Selection Selection;
+typedef struct Strokes Strokes;
+typedef struct Share Share;
+
+struct rect
+{
+  int x, y;
+  int width, height;
+};
+
+struct FloatingLayer
+{
+  image_t *image;
+  int is_visible;
+  double alpha;
+  uint64_t *tile_offsets; /* Tile positions in the document, 0 if none. */
+  unsigned int mode;      /* How it is composited, a BlendMode. */
+  Strokes *strokes; /* Its strokes to paint it again, NULL if unknown. */
+};
+
+/* In the order of color_blend_modes in image.c. */
+typedef
+enum BlendMode
+{
+  BLEND_MODE_NORMAL = 0,
+  BLEND_MODE_ABSORB = 1,
+  BLEND_MODE_MULTIPLY = 2,
+  BLEND_MODE_SCREEN = 3,
+  BLEND_MODE_OVERLAY = 4,
+  BLEND_MODE_DARKEN = 5,
+  BLEND_MODE_LIGHTEN = 6,
+  BLEND_MODES,
+}
+BlendMode;
+
+#define BRUSH_SIZE_DEFAULT 20
+
+/* How the colors of all layers are stored. */
+typedef
+enum LayerFormat
+{
+  LAYER_FORMAT_STRAIGHT = 0,      /* Color and separate alpha. */
+  LAYER_FORMAT_PREMULTIPLIED = 1, /* Color multiplied by alpha. */
+  LAYER_FORMAT_UINT16 = 2,        /* Premultiplied, 16 bit integers. */
+  LAYER_FORMATS,
+}
+LayerFormat;
+
+struct Brush
+{
+  double radius;
+  double hardness;
+  double density;
+  double smudge;
+  int is_drawing;
+  int is_erasing;
+  int is_picking;
+  int is_smudging;
+  BlendMode mode;
+  color color;
+  color medium_color;
+  BrushTip *tip; /* Shape of the dabs, NULL for a round brush. */
+  Brush *next;
+};
+
+struct FloatingDrawing
+{
+  double x, y;
+  int is_drawing;
+  FloatingLayer **layers; /* The layer stack, bottom first. */
+  int layer_count;
+  int layer_capacity;
+  int current; /* Index of the layer painted on, -1 if there are none. */
+  Brush *stored_brushes; /* List of all brushes. */
+  Brush *active_brushes; /* List of active ones. */
+  color color;
+  color medium_color;
+  char *filename;
+  int colors_index; /* Selected color, -1 for the default one. */
+  BlendMode blend_mode;
+  LayerFormat layer_format;
+  int is_dithered; /* Dither the display instead of rounding. */
+  int is_linear;   /* Layers hold linear light instead of sRGB. */
+  int thumbnail_size; /* Of thumbnails saved with the drawing, 0 for none. */
+  double export_scale; /* Of copies painted again from the strokes. */
+  Selection *selection; /* Where painting applies, NULL for everywhere. */
+  double selection_x, selection_y; /* Corner of a selection being made. */
+  int is_selecting; /* Whether that corner has been set. */
+  Document *document; /* Native document file the drawing was saved to. */
+  TileCache *tile_cache; /* For new layers, NULL to keep them in memory. */
+  Share *share; /* Where the canvas is published, NULL if it is not. */
+};
+
+int min (int x, int y);
+int max (int x, int y);
+double blend (double t, double x, double y);
+
+/* An empty drawing painting with one brush, both with the defaults. The
+   layer format is taken from FLOATING_LAYER_FORMAT, the thumbnail size
+   from FLOATING_THUMBNAIL and the export scale, which turns recording
+   strokes on, from FLOATING_EXPORT_SCALE. Setting FLOATING_LINEAR paints
+   and blends in linear light. */
+void drawing_init (FloatingDrawing *drawing, Brush *brush);
+
+/* A color picked in sRGB as the layers of the drawing hold it. */
+color drawing_working_color (const FloatingDrawing *drawing, color srgb);
+
+/* Both other formats are premultiplied. */
+int layer_format_is_premultiplied (const FloatingDrawing *drawing);
+
+FloatingLayer *floating_layer_new (int width, int height, LayerFormat format,
+                                   TileCache *cache);
+FloatingLayer *floating_layer_new_from_image (image_t *image);
+void floating_layer_del (FloatingLayer *layer);
+
+/* The pixels of a layer changed other than by painting strokes, which no
+   longer describe it. */
+void floating_layer_drop_strokes (FloatingLayer *layer);
+
+/* The layer painted on, NULL if there are none. */
+FloatingLayer *current_layer (const FloatingDrawing *drawing);
+
+/* New layers go on top and become the current one. */
+void add_top_layer (FloatingDrawing *drawing, int width, int height);
+void add_top_layer_image (FloatingDrawing *drawing, image_t *image);
+
+/* Delete the current layer, the one below it becomes current. */
+void del_current_layer (FloatingDrawing *drawing);
+void del_all_layers (FloatingDrawing *drawing);
+
+/* Make another layer current, clamped to the stack. */
+void select_layer (FloatingDrawing *drawing, int index);
+
+/* Move the current layer up (positive) or down the stack. */
+void move_current_layer (FloatingDrawing *drawing, int offset);
+
+/* Composite the current layer onto the one below in place and delete it.
+   Returns 0 if there is no layer below. */
+int merge_down (FloatingDrawing *drawing);
+
+/* Merge all visible layers into the bottom one, dropping hidden ones. */
+void flatten (FloatingDrawing *drawing);
+
+rect drawing_paint (FloatingDrawing *drawing, double prev_x, double prev_y,
+                    float pressure);
+
+/* Paint the dabs of a brush along a segment as drawing_paint does, on a
+   canvas scale times the size of the drawing whose top left corner is at
+   left, top of the scaled drawing. */
+void brush_paint_segment (const Brush *brush, image_t *canvas,
+                          int is_premultiplied, double prev_x,
+                          double prev_y, double x, double y, float pressure,
+                          double scale, int left, int top);
+
+/* The state of the drawing input goes on from other than its layers: the
+   pointer, colors, selection and the settings of the active brushes, as
+   bytes to keep with the journal. drawing_restore returns 0 if they are not
+   of a snapshot, and leaves the drawing as it was. */
+void *drawing_snapshot (const FloatingDrawing *drawing, size_t *size);
+int drawing_restore (FloatingDrawing *drawing, const void *bytes,
+                     size_t size);
+
+/* Load the tiles ahead of the stroke, going by its last movement. */
+void drawing_prefetch (FloatingDrawing *drawing, double prev_x,
+                       double prev_y);
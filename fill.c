@@ -0,0 +1,400 @@
+#include "fill.h"
+#include "composite.h"
+#include "selection.h"
+#include "tile_cache.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A row of bits is one word per tile column, bit i of word w standing for
+   pixel 64 w + i. */
+_Static_assert (IMAGE_TILE_SIZE == 64, "a tile row is not a 64 bit word");
+
+typedef struct FillSeed FillSeed;
+typedef struct FillState FillState;
+
+struct FillSeed
+{
+  int x, y;
+};
+
+struct FillState
+{
+  FloatingDrawing *drawing;
+  const image_t *image; /* The layer filled. */
+  int width, height;
+  int words; /* Per row of the bitmaps. */
+  uint64_t *matches;
+  uint64_t *filled;
+  uint8_t *is_classified; /* Whether the matches of a tile are known. */
+  uint8_t *is_filled;     /* Whether a tile has filled pixels. */
+  color seed;
+  float tolerance;
+  int is_sampling_composite;
+  color *scratch; /* A tile of reference colors. */
+  FillSeed *stack;
+  size_t count, capacity;
+};
+
+/* The premultiplied colors of a tile of the reference. */
+static void
+read_reference (FillState *state, int tx, int ty)
+{
+  const image_t *image = state->image;
+  const unsigned int index = ty * image->tiles_across + tx;
+  const int is_premultiplied
+      = layer_format_is_premultiplied (state->drawing);
+  color *scratch = state->scratch;
+  if (state->is_sampling_composite)
+    {
+      composite_band (state->drawing, scratch, tx * IMAGE_TILE_SIZE,
+                      ty * IMAGE_TILE_SIZE, IMAGE_TILE_SIZE, IMAGE_TILE_SIZE,
+                      state->width, state->height);
+    }
+  else if (tile_cache_is_blank (image, index))
+    {
+      memset ((void *)scratch, 0, sizeof (color) * IMAGE_TILE_PIXELS);
+      return;
+    }
+  else
+    {
+      memcpy (scratch, image_tile (image, index), image_tile_bytes (image));
+    }
+  if (state->drawing->layer_format == LAYER_FORMAT_UINT16)
+    { /* Backwards, the 16 bit pixels are in the first half. */
+      int i;
+      for (i = IMAGE_TILE_PIXELS - IMAGE_TILE_SIZE; i >= 0;
+           i -= IMAGE_TILE_SIZE)
+        {
+          color row[IMAGE_TILE_SIZE];
+          pixel16_span_to_color (row, (const uint16_t *)scratch + 4 * i,
+                                 IMAGE_TILE_SIZE);
+          memcpy (scratch + i, row, sizeof (row));
+        }
+    }
+  else if (!is_premultiplied)
+    {
+      color_span_premultiply (scratch, IMAGE_TILE_PIXELS);
+    }
+}
+
+/* Work out which pixels of a tile match the seed, four channels at a
+   time. */
+static void
+classify_tile (FillState *state, int tx, int ty)
+{
+  const __m128 seed = state->seed.vector;
+  const __m128 tolerance = _mm_set1_ps (state->tolerance);
+  const __m128 sign = _mm_set1_ps (-0.0f);
+  const int rows = min (IMAGE_TILE_SIZE, state->height - ty * IMAGE_TILE_SIZE);
+  const int columns
+      = min (IMAGE_TILE_SIZE, state->width - tx * IMAGE_TILE_SIZE);
+  const uint64_t inside
+      = columns < IMAGE_TILE_SIZE ? (1ULL << columns) - 1 : ~0ULL;
+  const Selection *selection = state->drawing->selection;
+  int row, i;
+  if (selection != NULL
+      && selection_tile_is_empty (selection, ty * state->image->tiles_across
+                                                 + tx))
+    { /* Nothing to fill, without reading it. */
+      for (row = 0; row < rows; ++row)
+        {
+          state->matches[(ty * IMAGE_TILE_SIZE + row) * state->words + tx]
+              = 0;
+        }
+      state->is_classified[ty * state->image->tiles_across + tx] = 1;
+      return;
+    }
+  read_reference (state, tx, ty);
+  for (row = 0; row < rows; ++row)
+    {
+      const color *pixels = state->scratch + row * IMAGE_TILE_SIZE;
+      uint64_t bits = 0;
+      for (i = 0; i < IMAGE_TILE_SIZE; ++i)
+        {
+          const __m128 difference
+              = _mm_andnot_ps (sign, _mm_sub_ps (pixels[i].vector, seed));
+          const int is_close
+              = _mm_movemask_ps (_mm_cmple_ps (difference, tolerance)) == 0xf;
+          bits |= (uint64_t)is_close << i;
+        }
+      if (selection != NULL)
+        { /* Unselected pixels stop the fill. */
+          const uint8_t *mask = selection_pixels (
+              selection, tx * IMAGE_TILE_SIZE, ty * IMAGE_TILE_SIZE + row);
+          for (i = 0; i < IMAGE_TILE_SIZE; ++i)
+            {
+              bits &= ~((uint64_t)!mask[i] << i);
+            }
+        }
+      state->matches[(ty * IMAGE_TILE_SIZE + row) * state->words + tx]
+          = bits & inside;
+    }
+  state->is_classified[ty * state->image->tiles_across + tx] = 1;
+  tile_cache_trim (state->drawing->tile_cache);
+}
+
+/* Pixels of a word of a row that match and are not filled yet. */
+static uint64_t
+fill_candidates (FillState *state, int word, int y)
+{
+  const int ty = y >> IMAGE_TILE_SHIFT;
+  const size_t at = (size_t)y * state->words + word;
+  if (!state->is_classified[ty * state->image->tiles_across + word])
+    {
+      classify_tile (state, word, ty);
+    }
+  return state->matches[at] & ~state->filled[at];
+}
+
+static void
+fill_push (FillState *state, int x, int y)
+{
+  if (state->count == state->capacity)
+    {
+      state->capacity = state->capacity ? 2 * state->capacity : 256;
+      state->stack
+          = realloc (state->stack, sizeof (FillSeed) * state->capacity);
+    }
+  state->stack[state->count].x = x;
+  state->stack[state->count].y = y;
+  state->count += 1;
+}
+
+/* Mark pixels start to end of a row filled. */
+static void
+fill_span (FillState *state, int start, int end, int y)
+{
+  uint64_t *row = state->filled + (size_t)y * state->words;
+  int word;
+  for (word = start >> 6; word <= (end - 1) >> 6; ++word)
+    {
+      const int from = max (start - 64 * word, 0);
+      const int to = min (end - 64 * word, 64);
+      const uint64_t high = to < 64 ? (1ULL << to) - 1 : ~0ULL;
+      row[word] |= high & (~0ULL << from);
+      state->is_filled[(y >> IMAGE_TILE_SHIFT) * state->image->tiles_across
+                       + word]
+          = 1;
+    }
+}
+
+/* Push the first pixel of each run of candidates in a row below start to
+   end, a run going on from one word into the next counting once. */
+static void
+fill_scan (FillState *state, int start, int end, int y)
+{
+  int is_in_run = 0;
+  int word;
+  for (word = start >> 6; word <= (end - 1) >> 6; ++word)
+    {
+      const int from = max (start - 64 * word, 0);
+      const int to = min (end - 64 * word, 64);
+      const uint64_t range
+          = (to < 64 ? (1ULL << to) - 1 : ~0ULL) & (~0ULL << from);
+      const uint64_t bits = fill_candidates (state, word, y) & range;
+      uint64_t starts = bits & ~(bits << 1 | (uint64_t)is_in_run);
+      while (starts)
+        {
+          fill_push (state, 64 * word + __builtin_ctzll (starts), y);
+          starts &= starts - 1;
+        }
+      is_in_run = bits >> 63;
+    }
+}
+
+/* Fill from a seed along its row as far as candidates go, then look for
+   more in the rows above and below. */
+static void
+fill_from (FillState *state, int x, int y, rect *area)
+{
+  int start = x, end = x + 1;
+  uint64_t bits = fill_candidates (state, x >> 6, y);
+  if (!(bits >> (x & 63) & 1))
+    {
+      return;
+    }
+  for (;;)
+    { /* The first pixel of the run. */
+      const int bit = start & 63;
+      const uint64_t below = bit == 63 ? ~0ULL : (2ULL << bit) - 1;
+      const uint64_t gaps = ~fill_candidates (state, start >> 6, y) & below;
+      if (gaps)
+        {
+          start = (start & ~63) + 64 - __builtin_clzll (gaps);
+          break;
+        }
+      if (start < 64)
+        {
+          start = 0;
+          break;
+        }
+      start = (start & ~63) - 1;
+    }
+  while (end < state->width)
+    { /* One past the last. */
+      const uint64_t gaps = ~fill_candidates (state, end >> 6, y)
+                            & (~0ULL << (end & 63));
+      if (gaps)
+        {
+          end = (end & ~63) + __builtin_ctzll (gaps);
+          break;
+        }
+      end = (end & ~63) + 64;
+    }
+  end = min (end, state->width);
+  fill_span (state, start, end, y);
+  area->x = min (area->x, start);
+  area->y = min (area->y, y);
+  area->width = max (area->width, end);
+  area->height = max (area->height, y + 1);
+  if (y > 0)
+    {
+      fill_scan (state, start, end, y - 1);
+    }
+  if (y + 1 < state->height)
+    {
+      fill_scan (state, start, end, y + 1);
+    }
+}
+
+/* Paint the filled pixels of a tile, a run at a time. */
+static void
+paint_tile (FillState *state, image_t *image, int tx, int ty,
+            const color *fill, const uint16_t *fill16)
+{
+  const FloatingDrawing *drawing = state->drawing;
+  const int is_premultiplied = layer_format_is_premultiplied (drawing);
+  const unsigned int index = ty * image->tiles_across + tx;
+  const int rows = min (IMAGE_TILE_SIZE, state->height - ty * IMAGE_TILE_SIZE);
+  const Selection *selection = drawing->selection;
+  const int is_masked
+      = selection != NULL && !selection_tile_is_full (selection, index);
+  float coverage[IMAGE_TILE_SIZE];
+  uint16_t coverage16[IMAGE_TILE_SIZE];
+  int row, i;
+  for (i = 0; i < IMAGE_TILE_SIZE; ++i)
+    {
+      coverage[i] = 1.0f;
+      coverage16[i] = 65535;
+    }
+  for (row = 0; row < rows; ++row)
+    {
+      const int y = ty * IMAGE_TILE_SIZE + row;
+      uint64_t bits = state->filled[(size_t)y * state->words + tx];
+      if (is_masked)
+        { /* Partly selected, as much as the selection covers. */
+          const uint8_t *mask
+              = selection_pixels (selection, tx * IMAGE_TILE_SIZE, y);
+          for (i = 0; i < IMAGE_TILE_SIZE; ++i)
+            {
+              coverage[i] = mask[i] * (1.0f / 255);
+              coverage16[i] = mask[i] * 257;
+            }
+        }
+      while (bits)
+        {
+          const int start = __builtin_ctzll (bits);
+          const uint64_t run = bits & ~(bits + (bits & -bits));
+          const int n = __builtin_popcountll (run);
+          const int x = tx * IMAGE_TILE_SIZE + start;
+          bits &= ~run;
+          if (image->format == IMAGE_FORMAT_UINT16)
+            {
+              pixel16_span_paint_mode (drawing->blend_mode,
+                                       image_pixel16 (image, x, y),
+                                       coverage16 + start, fill16, n);
+              continue;
+            }
+          color *span = image_pixel (image, x, y);
+          if (!is_premultiplied)
+            {
+              color_span_premultiply (span, n);
+            }
+          color_blend_modes[drawing->blend_mode].span (
+              span, fill, 0, coverage + start, 1, n);
+          if (!is_premultiplied)
+            {
+              color_span_unpremultiply (span, n);
+            }
+        }
+    }
+  image->tile_flags[index] |= IMAGE_TILE_DIRTY | IMAGE_TILE_STALE;
+}
+
+rect
+flood_fill (FloatingDrawing *drawing, int x, int y, float tolerance,
+            int is_sampling_composite)
+{
+  FloatingLayer *current = current_layer (drawing);
+  rect area = { 0, 0, 0, 0 };
+  FillState state;
+  color fill = drawing->color;
+  uint16_t fill16[4];
+  int tx, ty;
+  if (current == NULL || x < 0 || y < 0 || x >= (int)current->image->width
+      || y >= (int)current->image->height)
+    {
+      return area;
+    }
+  trace_begin ("fill");
+  image_t *image = current->image;
+  const size_t tiles = (size_t)image->tiles_across * image->tiles_down;
+  const size_t words = (size_t)image->tiles_across * image->height;
+  memset (&state, 0, sizeof (state));
+  state.drawing = drawing;
+  state.image = image;
+  state.width = image->width;
+  state.height = image->height;
+  state.words = image->tiles_across;
+  state.matches = malloc (sizeof (uint64_t) * words);
+  state.filled = calloc (words, sizeof (uint64_t));
+  state.is_classified = calloc (tiles, 1);
+  state.is_filled = calloc (tiles, 1);
+  state.tolerance = tolerance;
+  state.is_sampling_composite = is_sampling_composite;
+  state.scratch = aligned_alloc (16, sizeof (color) * IMAGE_TILE_PIXELS);
+  /* The seed color is that of the reference at the seed. */
+  read_reference (&state, x >> IMAGE_TILE_SHIFT, y >> IMAGE_TILE_SHIFT);
+  state.seed = state.scratch[(y & IMAGE_TILE_MASK) * IMAGE_TILE_SIZE
+                             + (x & IMAGE_TILE_MASK)];
+  area.x = state.width;
+  area.y = state.height;
+  fill_push (&state, x, y);
+  while (state.count > 0)
+    {
+      const FillSeed seed = state.stack[--state.count];
+      fill_from (&state, seed.x, seed.y, &area);
+    }
+  color_span_premultiply (&fill, 1);
+  pixel16_span_from_color (fill16, &fill, 1);
+  /* A row of tiles at a time, so that out of core layers can be trimmed
+     in between. */
+  for (ty = 0; ty < (int)image->tiles_down; ++ty)
+    {
+#pragma omp parallel for
+      for (tx = 0; tx < (int)image->tiles_across; ++tx)
+        {
+          if (state.is_filled[ty * image->tiles_across + tx])
+            {
+              paint_tile (&state, image, tx, ty, &fill, fill16);
+            }
+        }
+      tile_cache_trim (drawing->tile_cache);
+    }
+  area.width = max (area.width - area.x, 0);
+  area.height = max (area.height - area.y, 0);
+  if (area.width > 0)
+    {
+      floating_layer_drop_strokes (current);
+    }
+  free (state.matches);
+  free (state.filled);
+  free (state.is_classified);
+  free (state.is_filled);
+  free (state.scratch);
+  free (state.stack);
+  trace_end ("fill");
+  return area;
+}
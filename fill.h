@@ -0,0 +1,17 @@
+#pragma once
+
+#include "drawing.h"
+
+/* Bucket fill: the area of pixels connected to a seed pixel that look like
+   it, within a tolerance, is painted with the drawing's color and blend
+   mode. Which pixels match is decided a tile at a time, only for the tiles
+   the fill reaches, and kept in a bitmap together with the pixels already
+   filled, so the fill walks rows a 64 bit word at a time. */
+
+/* Fill the current layer from a canvas position. Pixels match when no
+   channel of their premultiplied color differs from the seed's by more than
+   the tolerance, looking at the current layer or, with
+   is_sampling_composite, at all visible layers. The fill stops at the edge
+   of the selection. Returns the area of the canvas that changed. */
+rect flood_fill (FloatingDrawing *drawing, int x, int y, float tolerance,
+                 int is_sampling_composite);
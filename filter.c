@@ -0,0 +1,542 @@
+#include "filter.h"
+#include "selection.h"
+#include "tile_cache.h"
+#include "trace.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Average each run of 2 r + 1 pixels of rows into a pixel, with a running
+   sum. Rows of the result are as long as width, those of src 2 r longer. */
+static void
+box_rows (const color *src, color *dst, int stride, int width, int rows,
+          int r)
+{
+  const __m128 scale = _mm_set1_ps (1.0f / (2 * r + 1));
+  int y, x;
+  for (y = 0; y < rows; ++y)
+    {
+      const color *in = src + y * stride;
+      color *out = dst + y * stride;
+      __m128 sum = _mm_setzero_ps ();
+      for (x = 0; x < 2 * r; ++x)
+        {
+          sum = _mm_add_ps (sum, in[x].vector);
+        }
+      for (x = 0; x < width; ++x)
+        {
+          sum = _mm_add_ps (sum, in[x + 2 * r].vector);
+          out[x].vector = _mm_mul_ps (sum, scale);
+          sum = _mm_sub_ps (sum, in[x].vector);
+        }
+    }
+}
+
+/* The same down columns, all of a row at a time. Sums has room for a row
+   and src has 2 r more rows than the result. */
+static void
+box_columns (const color *src, int src_stride, color *dst, int dst_stride,
+             color *sums, int width, int rows, int r)
+{
+  const __m128 scale = _mm_set1_ps (1.0f / (2 * r + 1));
+  int y, x;
+  for (x = 0; x < width; ++x)
+    {
+      sums[x].vector = _mm_setzero_ps ();
+    }
+  for (y = 0; y < 2 * r; ++y)
+    {
+      const color *in = src + y * src_stride;
+      for (x = 0; x < width; ++x)
+        {
+          sums[x].vector = _mm_add_ps (sums[x].vector, in[x].vector);
+        }
+    }
+  for (y = 0; y < rows; ++y)
+    {
+      const color *in = src + (y + 2 * r) * src_stride;
+      const color *old = src + y * src_stride;
+      color *out = dst + y * dst_stride;
+      for (x = 0; x < width; ++x)
+        {
+          const __m128 sum = _mm_add_ps (sums[x].vector, in[x].vector);
+          out[x].vector = _mm_mul_ps (sum, scale);
+          sums[x].vector = _mm_sub_ps (sum, old[x].vector);
+        }
+    }
+}
+
+/* Convolve rows with symmetric weights, from the center out. */
+static void
+convolve_rows (const float *weights, int radius, const color *src,
+               color *dst, int stride, int width, int rows)
+{
+  int y, x, k;
+  for (y = 0; y < rows; ++y)
+    {
+      const color *in = src + y * stride + radius;
+      color *out = dst + y * stride;
+      for (x = 0; x < width; ++x)
+        {
+          __m128 sum = _mm_mul_ps (in[x].vector, _mm_set1_ps (weights[0]));
+          for (k = 1; k <= radius; ++k)
+            {
+              sum = _mm_add_ps (
+                  sum,
+                  _mm_mul_ps (_mm_add_ps (in[x - k].vector, in[x + k].vector),
+                              _mm_set1_ps (weights[k])));
+            }
+          out[x].vector = sum;
+        }
+    }
+}
+
+static void
+convolve_columns (const float *weights, int radius, const color *src,
+                  int src_stride, color *dst, int dst_stride, int width,
+                  int rows)
+{
+  int y, x, k;
+  for (y = 0; y < rows; ++y)
+    {
+      const color *in = src + (y + radius) * src_stride;
+      color *out = dst + y * dst_stride;
+      for (x = 0; x < width; ++x)
+        {
+          out[x].vector = _mm_mul_ps (in[x].vector, _mm_set1_ps (weights[0]));
+        }
+      for (k = 1; k <= radius; ++k)
+        {
+          const color *above = in - k * src_stride;
+          const color *below = in + k * src_stride;
+          const __m128 weight = _mm_set1_ps (weights[k]);
+          for (x = 0; x < width; ++x)
+            {
+              out[x].vector = _mm_add_ps (
+                  out[x].vector,
+                  _mm_mul_ps (_mm_add_ps (above[x].vector, below[x].vector),
+                              weight));
+            }
+        }
+    }
+}
+
+static void
+gaussian_kernel (const Filter *filter, const color *window, color *out,
+                 color *temp, int size)
+{
+  const int stride = size + 2 * filter->halo;
+  color *a = temp;
+  color *b = temp + stride * stride;
+  if (filter->weights != NULL)
+    {
+      convolve_rows (filter->weights, filter->radius, window, a, stride, size,
+                     stride);
+      convolve_columns (filter->weights, filter->radius, a, stride, out, size,
+                        size, size);
+      return;
+    }
+  /* Each box blur makes the rows shorter, then the columns. */
+  box_rows (window, a, stride, stride - 2 * filter->boxes[0], stride,
+            filter->boxes[0]);
+  box_rows (a, b, stride, size + 2 * filter->boxes[2], stride,
+            filter->boxes[1]);
+  box_rows (b, a, stride, size, stride, filter->boxes[2]);
+  box_columns (a, stride, b, stride, out, size,
+               stride - 2 * filter->boxes[0], filter->boxes[0]);
+  box_columns (b, stride, a, stride, out, size, size + 2 * filter->boxes[2],
+               filter->boxes[1]);
+  box_columns (a, stride, out, size, b, size, size, filter->boxes[2]);
+}
+
+static void
+sharpen_kernel (const Filter *filter, const color *window, color *out,
+                color *temp, int size)
+{
+  const int stride = size + 2 * filter->halo;
+  const __m128 amount = _mm_set1_ps (filter->amount);
+  const __m128 zero = _mm_setzero_ps ();
+  const __m128 one = _mm_set1_ps (1.0f);
+  int y, x;
+  gaussian_kernel (filter, window, out, temp, size);
+  for (y = 0; y < size; ++y)
+    {
+      const color *in = window + (y + filter->halo) * stride + filter->halo;
+      color *row = out + y * size;
+      for (x = 0; x < size; ++x)
+        {
+          const __m128 v = in[x].vector;
+          __m128 sharp = _mm_add_ps (
+              v, _mm_mul_ps (amount, _mm_sub_ps (v, row[x].vector)));
+          __m128 alpha = _mm_min_ps (_mm_max_ps (sharp, zero), one);
+          alpha = _mm_shuffle_ps (alpha, alpha, 0xff);
+          /* Colors between 0 and the alpha. */
+          sharp = _mm_min_ps (_mm_max_ps (sharp, zero), alpha);
+          row[x].vector = _mm_blend_ps (sharp, alpha, 0x8);
+        }
+    }
+}
+
+static void
+levels_kernel (const Filter *filter, const color *window, color *out,
+               color *temp, int size)
+{
+  const __m128 black = _mm_set1_ps (filter->black);
+  const __m128 scale = _mm_set1_ps (1.0f / (filter->white - filter->black));
+  const __m128 zero = _mm_setzero_ps ();
+  const __m128 one = _mm_set1_ps (1.0f);
+  const float exponent = 1.0f / filter->gamma;
+  int i, c;
+  (void)temp;
+  memcpy (out, window, sizeof (color) * size * size);
+  color_span_unpremultiply (out, size * size);
+  for (i = 0; i < size * size; ++i)
+    {
+      const __m128 v = out[i].vector;
+      __m128 stretched = _mm_mul_ps (_mm_sub_ps (v, black), scale);
+      out[i].vector = _mm_blend_ps (
+          _mm_min_ps (_mm_max_ps (stretched, zero), one), v, 0x8);
+      for (c = 0; exponent != 1.0f && c < 3; ++c)
+        {
+          out[i].values[c] = powf (out[i].values[c], exponent);
+        }
+    }
+  color_span_premultiply (out, size * size);
+}
+
+static Filter *
+filter_new (FilterKernel kernel)
+{
+  Filter *filter = calloc (1, sizeof (Filter));
+  filter->kernel = kernel;
+  filter->amount = 1;
+  filter->white = 1;
+  filter->gamma = 1;
+  return filter;
+}
+
+/* Small ones are convolved with their weights to three sigma. Large ones
+   are approximated by three box blurs of about the same variance, which
+   cost the same whatever their size. */
+Filter *
+filter_new_gaussian (double sigma)
+{
+  Filter *filter = filter_new (gaussian_kernel);
+  int i;
+  sigma = fmax (sigma, 0.1);
+  if (sigma <= FILTER_BOX_SIGMA)
+    {
+      float total = 0;
+      filter->radius = ceil (3 * sigma);
+      filter->weights = malloc (sizeof (float) * (filter->radius + 1));
+      for (i = 0; i <= filter->radius; ++i)
+        {
+          filter->weights[i] = exp (-i * i / (2 * sigma * sigma));
+          total += i ? 2 * filter->weights[i] : filter->weights[i];
+        }
+      for (i = 0; i <= filter->radius; ++i)
+        {
+          filter->weights[i] /= total;
+        }
+      filter->halo = filter->radius;
+    }
+  else
+    { /* Odd widths around the ideal one, the smaller for the first few. */
+      const double ideal = sqrt (4 * sigma * sigma + 1);
+      const int lower = (int)ideal % 2 ? (int)ideal : (int)ideal - 1;
+      const int smaller = lrint ((12 * sigma * sigma - 3 * lower * lower
+                                  - 12 * lower - 9)
+                                 / (-4.0 * lower - 4));
+      for (i = 0; i < 3; ++i)
+        {
+          filter->boxes[i] = ((i < smaller ? lower : lower + 2) - 1) / 2;
+          filter->halo += filter->boxes[i];
+        }
+    }
+  return filter;
+}
+
+Filter *
+filter_new_sharpen (double sigma, double amount)
+{
+  Filter *filter = filter_new_gaussian (sigma);
+  filter->kernel = sharpen_kernel;
+  filter->amount = amount;
+  return filter;
+}
+
+Filter *
+filter_new_levels (double black, double white, double gamma)
+{
+  Filter *filter = filter_new (levels_kernel);
+  filter->black = black;
+  filter->white = white > black ? white : black + 1.0 / 256;
+  filter->gamma = gamma > 0 ? gamma : 1;
+  return filter;
+}
+
+void
+filter_del (Filter *filter)
+{
+  if (filter != NULL)
+    {
+      free (filter->weights);
+    }
+  free (filter);
+}
+
+/* Read n pixels of a row as premultiplied colors, n no more than the rest
+   of the tile row. */
+static void
+read_span (const image_t *image, int x, int y, int n, color *out,
+           int is_premultiplied)
+{
+  if (tile_cache_is_blank (image, image_tile_index (image, x, y)))
+    {
+      memset ((void *)out, 0, sizeof (color) * n);
+    }
+  else if (image->format == IMAGE_FORMAT_UINT16)
+    {
+      pixel16_span_to_color (out, image_pixel16 (image, x, y), n);
+    }
+  else
+    {
+      memcpy (out, image_pixel (image, x, y), sizeof (color) * n);
+      if (!is_premultiplied)
+        {
+          color_span_premultiply (out, n);
+        }
+    }
+}
+
+/* Read the window of a block, the edges of the image repeating outside of
+   it. */
+static void
+read_window (const image_t *image, int x0, int y0, int stride, color *window,
+             int is_premultiplied)
+{
+  const int width = image->width;
+  const int height = image->height;
+  const int start = min (max (-x0, 0), stride);
+  const int end = max (min (width - x0, stride), start);
+  int row;
+  for (row = 0; row < stride; ++row)
+    {
+      const int y = min (max (y0 + row, 0), height - 1);
+      color *out = window + row * stride;
+      int i = start;
+      while (i < end)
+        {
+          const int n
+              = min (end - i, IMAGE_TILE_SIZE - ((x0 + i) & IMAGE_TILE_MASK));
+          read_span (image, x0 + i, y, n, out + i, is_premultiplied);
+          i += n;
+        }
+      for (i = 0; i < start; ++i)
+        {
+          read_span (image, 0, y, 1, out + i, is_premultiplied);
+        }
+      for (i = end; i < stride; ++i)
+        {
+          read_span (image, width - 1, y, 1, out + i, is_premultiplied);
+        }
+    }
+}
+
+/* Whether all tiles a block reads are blank, so that it stays blank. */
+static int
+window_is_blank (const image_t *image, int x0, int y0, int stride)
+{
+  const int tx0 = max (x0, 0) >> IMAGE_TILE_SHIFT;
+  const int ty0 = max (y0, 0) >> IMAGE_TILE_SHIFT;
+  const int tx1 = min ((x0 + stride - 1) >> IMAGE_TILE_SHIFT,
+                       (int)image->tiles_across - 1);
+  const int ty1 = min ((y0 + stride - 1) >> IMAGE_TILE_SHIFT,
+                       (int)image->tiles_down - 1);
+  int tx, ty;
+  if (image->cache == NULL)
+    {
+      return 0;
+    }
+  for (ty = ty0; ty <= ty1; ++ty)
+    {
+      for (tx = tx0; tx <= tx1; ++tx)
+        {
+          if (!tile_cache_is_blank (image, ty * image->tiles_across + tx))
+            {
+              return 0;
+            }
+        }
+    }
+  return 1;
+}
+
+/* Whether a block has nothing selected, so that it stays as it is. */
+static int
+block_is_unselected (const image_t *image, const Selection *selection,
+                     int bx, int by, int span)
+{
+  const int tx1 = min ((bx + 1) * span, (int)image->tiles_across);
+  const int ty1 = min ((by + 1) * span, (int)image->tiles_down);
+  int tx, ty;
+  if (selection == NULL)
+    {
+      return 0;
+    }
+  for (ty = by * span; ty < ty1; ++ty)
+    {
+      for (tx = bx * span; tx < tx1; ++tx)
+        {
+          if (!selection_tile_is_empty (selection,
+                                        ty * image->tiles_across + tx))
+            {
+              return 0;
+            }
+        }
+    }
+  return 1;
+}
+
+/* Store the result of a block into the tiles it covers, where they are
+   selected and inside the image. */
+static void
+write_block (image_t *image, const Selection *selection, color *out, int bx,
+             int by, int span, int is_premultiplied)
+{
+  const int size = span * IMAGE_TILE_SIZE;
+  const int tx1 = min ((bx + 1) * span, (int)image->tiles_across);
+  const int ty1 = min ((by + 1) * span, (int)image->tiles_down);
+  int tx, ty, row, k;
+  for (ty = by * span; ty < ty1; ++ty)
+    {
+      for (tx = bx * span; tx < tx1; ++tx)
+        {
+          const unsigned int index = ty * image->tiles_across + tx;
+          const int is_masked
+              = selection != NULL
+                && !selection_tile_is_full (selection, index);
+          if (selection != NULL && selection_tile_is_empty (selection, index))
+            {
+              continue;
+            }
+          /* Tiles on the right and bottom edges are partly outside. */
+          const int columns
+              = min (IMAGE_TILE_SIZE, image->width - tx * IMAGE_TILE_SIZE);
+          const int rows
+              = min (IMAGE_TILE_SIZE, image->height - ty * IMAGE_TILE_SIZE);
+          color *tile = image_tile (image, index);
+          color *in = out + (ty - by * span) * IMAGE_TILE_SIZE * size
+                      + (tx - bx * span) * IMAGE_TILE_SIZE;
+          for (row = 0; row < rows; ++row)
+            {
+              color *src = in + row * size;
+              if (is_masked)
+                { /* Part of the way from what was there. */
+                  const uint8_t *mask = selection_pixels (
+                      selection, tx * IMAGE_TILE_SIZE,
+                      ty * IMAGE_TILE_SIZE + row);
+                  color was[IMAGE_TILE_SIZE];
+                  read_span (image, tx * IMAGE_TILE_SIZE,
+                             ty * IMAGE_TILE_SIZE + row, columns, was,
+                             is_premultiplied);
+                  for (k = 0; k < columns; ++k)
+                    {
+                      color_blend_single_struct (mask[k] / 255.0f,
+                                                 was[k].vector,
+                                                 src[k].vector, src + k);
+                    }
+                }
+              if (image->format == IMAGE_FORMAT_UINT16)
+                {
+                  pixel16_span_from_color ((uint16_t *)tile
+                                               + 4 * row * IMAGE_TILE_SIZE,
+                                           src, columns);
+                  continue;
+                }
+              color *dst = tile + row * IMAGE_TILE_SIZE;
+              memcpy (dst, src, sizeof (color) * columns);
+              if (!is_premultiplied)
+                {
+                  color_span_unpremultiply (dst, columns);
+                }
+            }
+          image->tile_flags[index] |= IMAGE_TILE_DIRTY | IMAGE_TILE_STALE;
+        }
+    }
+}
+
+void
+filter_apply (const Filter *filter, image_t *image,
+              const Selection *selection, int is_premultiplied)
+{
+  const int halo = filter->halo;
+  /* Blocks at least as large as the halo, so that it only reaches into
+     the rows of blocks next to them. */
+  const int span = max (1, (halo + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT);
+  const int size = span * IMAGE_TILE_SIZE;
+  const int stride = size + 2 * halo;
+  const int across = (image->tiles_across + span - 1) / span;
+  const int down = (image->tiles_down + span - 1) / span;
+  const int delay = halo > 0;
+  color *pending[2];
+  uint8_t *is_blank[2];
+  int i, by, bx;
+  trace_begin ("filter");
+  for (i = 0; i < 2; ++i)
+    {
+      pending[i] = aligned_alloc (16, sizeof (color) * size * size * across);
+      is_blank[i] = malloc (across);
+    }
+  for (by = 0; by < down + delay; ++by)
+    {
+      if (by < down)
+        {
+          color *results = pending[by % 2];
+#pragma omp parallel
+          {
+            color *window = aligned_alloc (16, sizeof (color) * stride
+                                                   * stride * 3);
+#pragma omp for schedule(dynamic)
+            for (bx = 0; bx < across; ++bx)
+              {
+                const int x0 = bx * size - halo;
+                const int y0 = by * size - halo;
+                is_blank[by % 2][bx]
+                    = block_is_unselected (image, selection, bx, by, span)
+                      || window_is_blank (image, x0, y0, stride);
+                if (!is_blank[by % 2][bx])
+                  {
+                    read_window (image, x0, y0, stride, window,
+                                 is_premultiplied);
+                    filter->kernel (filter, window,
+                                    results + bx * size * size,
+                                    window + stride * stride, size);
+                  }
+              }
+            free (window);
+          }
+        }
+      if (by >= delay)
+        { /* The row of blocks the next one no longer reads. */
+          const int row = by - delay;
+#pragma omp parallel for
+          for (bx = 0; bx < across; ++bx)
+            {
+              if (!is_blank[row % 2][bx])
+                {
+                  write_block (image, selection,
+                               pending[row % 2] + bx * size * size, bx, row,
+                               span, is_premultiplied);
+                }
+            }
+        }
+      tile_cache_trim (image->cache);
+    }
+  for (i = 0; i < 2; ++i)
+    {
+      free (pending[i]);
+      free (is_blank[i]);
+    }
+  trace_end ("filter");
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "drawing.h"
+
+/* Filters of whole layers. A layer is processed in square blocks of tiles,
+   in parallel, each block read with a halo of the pixels around it that
+   its result depends on, so the memory used follows the size of a block
+   and not of the layer. Results are written back a row of blocks behind,
+   once no block still to come reads the pixels they replace. Kernels work
+   on premultiplied colors whatever the layer format. */
+
+typedef struct Filter Filter;
+
+/* Filter a block of size by size pixels, read from a window with the halo
+   on every side, into out. Temp has room for two windows. */
+typedef void (*FilterKernel) (const Filter *filter, const color *window,
+                              color *out, color *temp, int size);
+
+#define FILTER_BOX_SIGMA 3.0 /* Larger Gaussians are three box blurs. */
+
+struct Filter
+{
+  FilterKernel kernel;
+  int halo;       /* Pixels around a block that its result depends on. */
+  float *weights; /* Of a Gaussian from its center out, or NULL. */
+  int radius;     /* Of the weights. */
+  int boxes[3];   /* Radii of the box blurs when there are no weights. */
+  float amount;   /* Of sharpening. */
+  float black, white, gamma; /* Of levels. */
+};
+
+Filter *filter_new_gaussian (double sigma);
+
+/* Unsharp masking: add the difference from a Gaussian blur, times an
+   amount. */
+Filter *filter_new_sharpen (double sigma, double amount);
+
+/* Stretch each color channel from black to white to all of 0 to 1, then
+   apply a gamma. */
+Filter *filter_new_levels (double black, double white, double gamma);
+
+void filter_del (Filter *filter);
+
+/* Filter an image in place, of premultiplied colors unless
+   is_premultiplied is 0, or of 16 bit pixels, only where a selection is
+   (unless it is NULL). Changed tiles are marked dirty. */
+void filter_apply (const Filter *filter, image_t *image,
+                   const Selection *selection, int is_premultiplied);
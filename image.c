@@ -1,4 +1,5 @@
 #include "image.h"
+#include "tile_cache.h"
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,22 +59,1177 @@ void color_blend_absorb_single (const float t, const color *x, const color *y, c
 
 image_t *
 image_new (unsigned int width, unsigned int height)
+{
+    image_t *image = image_new_uninitialized (width, height);
+    unsigned char *image_data_chars = (unsigned char *) image->storage;
+    memset (image_data_chars, 0, sizeof (color) * IMAGE_TILE_PIXELS * image->tiles_across * image->tiles_down);
+    return image;
+}
+
+/* Zero the pixels of the edge tiles past the right and bottom of the
+   image, which are processed and saved with the rest of the tiles. */
+static void
+image_clear_padding (image_t *image)
+{
+    const unsigned int right = image->width & IMAGE_TILE_MASK;
+    const unsigned int bottom = image->height & IMAGE_TILE_MASK;
+    unsigned int i, row;
+    if (right)
+      {
+        for (i = 0; i < image->tiles_down; i++)
+          {
+            color *tile = image->tiles[(i + 1) * image->tiles_across - 1];
+            for (row = 0; row < IMAGE_TILE_SIZE; row++)
+              {
+                memset ((void *) (tile + row * IMAGE_TILE_SIZE + right), 0, sizeof (color) * (IMAGE_TILE_SIZE - right));
+              }
+          }
+      }
+    if (bottom)
+      {
+        for (i = 0; i < image->tiles_across; i++)
+          {
+            color *tile = image->tiles[(image->tiles_down - 1) * image->tiles_across + i];
+            memset ((void *) (tile + bottom * IMAGE_TILE_SIZE), 0, sizeof (color) * (IMAGE_TILE_SIZE - bottom) * IMAGE_TILE_SIZE);
+          }
+      }
+}
+
+/* For images that are about to be overwritten completely (e.g. decoded from
+   a file), skipping the memset saves a full pass over the memory. Only the
+   padding of the edge tiles, which nothing overwrites, is cleared. */
+image_t *
+image_new_uninitialized (unsigned int width, unsigned int height)
+{
+    image_t *image = image_new_unallocated (width, height);
+    size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t i;
+    image->storage = aligned_alloc (32, sizeof (color) * IMAGE_TILE_PIXELS * tiles);
+    for (i = 0; i < tiles; i++)
+      {
+        image->tiles[i] = image->storage + i * IMAGE_TILE_PIXELS;
+      }
+    image_clear_padding (image);
+    return image;
+}
+
+image_t *
+image_new_uint16 (unsigned int width, unsigned int height)
+{
+    image_t *image = image_new_unallocated (width, height);
+    size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t i;
+    image->format = IMAGE_FORMAT_UINT16;
+    image->storage = aligned_alloc (32, image_tile_bytes (image) * tiles);
+    memset ((void *) image->storage, 0, image_tile_bytes (image) * tiles);
+    for (i = 0; i < tiles; i++)
+      {
+        image->tiles[i] = image->storage + i * IMAGE_TILE_PIXELS / 2;
+      }
+    return image;
+}
+
+image_t *
+image_to_uint16 (image_t *image)
+{
+    image_t *converted = image_new_uint16 (image->width, image->height);
+    const size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t i;
+#pragma omp parallel for
+    for (i = 0; i < tiles; i++)
+      {
+        pixel16_span_from_color ((uint16_t *) converted->tiles[i], image_tile (image, i), IMAGE_TILE_PIXELS);
+      }
+    memcpy (converted->tile_flags, image->tile_flags, tiles);
+    return converted;
+}
+
+image_t *
+image_new_unallocated (unsigned int width, unsigned int height)
 {
     image_t *image = malloc (sizeof (image_t));
     image->width = width;
     image->height = height;
-    image->data = aligned_alloc (32, sizeof (color) * image->width * image->height);
-    unsigned char *image_data_chars = (unsigned char *) image->data;
-    memset (image_data_chars, 0, sizeof (color) * image->width * image->height);
+    image->tiles_across = (width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+    image->tiles_down = (height + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+    image->tiles = calloc ((size_t) image->tiles_across * image->tiles_down, sizeof (color *));
+    image->tile_flags = calloc ((size_t) image->tiles_across * image->tiles_down, sizeof (uint8_t));
+    image->storage = NULL;
+    image->cache = NULL;
+    image->tile_swap = NULL;
+    image->sources = NULL;
+    image->conversion = 0;
+    image->format = IMAGE_FORMAT_COLOR;
+    return image;
+}
+
+image_t *
+image_new_converting (unsigned int width, unsigned int height, unsigned int format, const color **sources, unsigned int conversion)
+{
+    image_t *image = image_new_unallocated (width, height);
+    const size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t tile_colors, empty = 0, i;
+    image->format = format;
+    tile_colors = image_tile_bytes (image) / sizeof (color);
+    image->sources = sources;
+    image->conversion = conversion;
+    for (i = 0; i < tiles; i++)
+      {
+        empty += sources[i] == NULL;
+      }
+    if (empty)
+      { /* Large callocs come from fresh pages, nothing is touched here. */
+        image->storage = calloc (empty * tile_colors, sizeof (color));
+      }
+    empty = 0;
+    for (i = 0; i < tiles; i++)
+      {
+        image->tiles[i] = sources[i] == NULL ? image->storage + tile_colors * empty++ : NULL;
+      }
+    if (!conversion && format == IMAGE_FORMAT_COLOR)
+      { /* Nothing to convert, the sources are the tiles. */
+        for (i = 0; i < tiles; i++)
+          {
+            if (sources[i] != NULL)
+              {
+                image->tiles[i] = (color *) sources[i];
+              }
+          }
+      }
+    return image;
+}
+
+void
+image_tile_convert (const image_t *image, unsigned int index, color *tile)
+{
+    color *colors = image->format == IMAGE_FORMAT_UINT16 ? aligned_alloc (32, sizeof (color) * IMAGE_TILE_PIXELS) : tile;
+    memcpy ((void *) colors, image->sources[index], sizeof (color) * IMAGE_TILE_PIXELS);
+    if (image->conversion & IMAGE_CONVERT_UNPREMULTIPLY)
+      {
+        color_span_unpremultiply (colors, IMAGE_TILE_PIXELS);
+      }
+    if (image->conversion & IMAGE_CONVERT_TO_LINEAR)
+      {
+        color_span_srgb_to_linear (colors, IMAGE_TILE_PIXELS);
+      }
+    if (image->conversion & IMAGE_CONVERT_FROM_LINEAR)
+      {
+        color_span_linear_to_srgb (colors, IMAGE_TILE_PIXELS);
+      }
+    if (image->conversion & IMAGE_CONVERT_PREMULTIPLY)
+      {
+        color_span_premultiply (colors, IMAGE_TILE_PIXELS);
+      }
+    if (colors != tile)
+      {
+        pixel16_span_from_color ((uint16_t *) tile, colors, IMAGE_TILE_PIXELS);
+        free (colors);
+      }
+}
+
+color *
+image_tile_fault (image_t *image, unsigned int index)
+{
+    if (image->sources == NULL || image->cache != NULL)
+      {
+        return tile_cache_fault (image, index);
+      }
+    color *tile = aligned_alloc (32, image_tile_bytes (image));
+    color *expected = NULL;
+    image_tile_convert (image, index, tile);
+    /* Threads compositing the same tile may both get here. */
+    if (!__atomic_compare_exchange_n (image->tiles + index, &expected, tile, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        free (tile);
+        return expected;
+      }
+    return tile;
+}
+
+image_t *
+image_new_cached (unsigned int width, unsigned int height, unsigned int format, TileCache *cache)
+{
+    image_t *image = image_new_unallocated (width, height);
+    image->format = format;
+    image->cache = cache;
+    image->tile_swap = calloc ((size_t) image->tiles_across * image->tiles_down, sizeof (TileSwap));
+    tile_cache_add (cache, image);
     return image;
 }
 
 void
 image_del (image_t *image) {
-    free (image->data);
+    if (image->sources != NULL)
+      { /* The tiles converted from them, those of a cache are its own. */
+        const size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+        size_t i;
+        for (i = 0; i < tiles && image->cache == NULL; i++)
+          {
+            if (image->sources[i] != NULL && image->tiles[i] != image->sources[i])
+              {
+                free (image->tiles[i]);
+              }
+          }
+        free ((void *) image->sources);
+      }
+    tile_cache_forget (image);
+    free (image->tile_swap);
+    free (image->storage);
+    free (image->tile_flags);
+    free (image->tiles);
     free (image);
 }
 
+int
+tile_is_empty (const void *tile, unsigned int bytes)
+{
+    const uint64_t *words = tile;
+    uint64_t any = 0;
+    unsigned int i;
+    for (i = 0; i < bytes / sizeof (uint64_t); i++)
+      {
+        any |= words[i];
+      }
+    return !any;
+}
+
+void
+image_mark (image_t *image, int x, int y, int width, int height, uint8_t flags)
+{
+    int x0 = x > 0 ? x : 0;
+    int y0 = y > 0 ? y : 0;
+    int x1 = x + width < (int) image->width ? x + width : (int) image->width;
+    int y1 = y + height < (int) image->height ? y + height : (int) image->height;
+    int i, j;
+    if (x0 >= x1 || y0 >= y1)
+      {
+        return;
+      }
+    if (flags & IMAGE_TILE_DIRTY)
+      {
+        flags |= IMAGE_TILE_STALE;
+      }
+    for (j = y0 >> IMAGE_TILE_SHIFT; j <= (y1 - 1) >> IMAGE_TILE_SHIFT; j++)
+      {
+        for (i = x0 >> IMAGE_TILE_SHIFT; i <= (x1 - 1) >> IMAGE_TILE_SHIFT; i++)
+          {
+            image->tile_flags[j * image->tiles_across + i] |= flags;
+          }
+      }
+}
+
+void
+image_premultiply (image_t *image)
+{
+    const size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t i;
+#pragma omp parallel for
+    for (i = 0; i < tiles; i++)
+      {
+        color_span_premultiply (image_tile (image, i), IMAGE_TILE_PIXELS);
+      }
+}
+
+void
+image_unpremultiply (image_t *image)
+{
+    const size_t tiles = (size_t) image->tiles_across * image->tiles_down;
+    size_t i;
+#pragma omp parallel for
+    for (i = 0; i < tiles; i++)
+      {
+        color_span_unpremultiply (image_tile (image, i), IMAGE_TILE_PIXELS);
+      }
+}
+
+static inline __m128 color_from_samples (__m128 v, unsigned int samples)
+{
+    switch (samples)
+      {
+        case 1:
+        return _mm_blend_ps (_mm_shuffle_ps (v, v, 0x00), _mm_set1_ps (1.0f), 0x8);
+        case 2:
+        return _mm_shuffle_ps (v, v, 0x40);
+        case 3:
+        return _mm_blend_ps (v, _mm_set1_ps (1.0f), 0x8);
+        default:
+        return v;
+      }
+}
+
+void color_span_from_uint8 (color *z, const uint8_t *x, unsigned int samples, unsigned int n)
+{
+    const __m128 scale = _mm_set1_ps (1.0f / 255.0f);
+    const unsigned int used = samples < 4 ? samples : 4;
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        int32_t word = 0;
+        memcpy (&word, x + i * samples, used);
+        __m128 v = _mm_cvtepi32_ps (_mm_cvtepu8_epi32 (_mm_cvtsi32_si128 (word)));
+        z[i].vector = color_from_samples (_mm_mul_ps (v, scale), samples);
+      }
+}
+
+void color_span_from_uint16 (color *z, const uint16_t *x, unsigned int samples, unsigned int n)
+{
+    const __m128 scale = _mm_set1_ps (1.0f / 65535.0f);
+    const unsigned int used = samples < 4 ? samples : 4;
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        int64_t words = 0;
+        memcpy (&words, x + i * samples, used * sizeof (uint16_t));
+        __m128 v = _mm_cvtepi32_ps (_mm_cvtepu16_epi32 (_mm_cvtsi64_si128 (words)));
+        z[i].vector = color_from_samples (_mm_mul_ps (v, scale), samples);
+      }
+}
+
+void color_span_from_float (color *z, const float *x, unsigned int samples, unsigned int n)
+{
+    const unsigned int used = samples < 4 ? samples : 4;
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        color value = { { 0, 0, 0, 0 } };
+        memcpy (value.values, x + i * samples, used * sizeof (float));
+        z[i].vector = color_from_samples (value.vector, samples);
+      }
+}
+
+/* Divide the color channels by alpha, for sources that store associated
+   (premultiplied) alpha. Fully transparent pixels are left as they are. */
+void color_span_unpremultiply (color *z, unsigned int n)
+{
+    const __m128 zero = _mm_setzero_ps ();
+    const __m128 one = _mm_set1_ps (1.0f);
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        __m128 v = z[i].vector;
+        __m128 alpha = _mm_shuffle_ps (v, v, 0xff);
+        __m128 scale = _mm_div_ps (one, alpha);
+        scale = _mm_and_ps (scale, _mm_cmpgt_ps (alpha, zero));
+        z[i].vector = _mm_blend_ps (_mm_mul_ps (v, scale), v, 0x8);
+      }
+}
+
+void color_span_premultiply (color *z, unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        __m128 v = z[i].vector;
+        __m128 alpha = _mm_shuffle_ps (v, v, 0xff);
+        z[i].vector = _mm_blend_ps (_mm_mul_ps (v, alpha), v, 0x8);
+      }
+}
+
+void color_span_box_add (color *z, const color *x, unsigned int factor, unsigned int width, int is_premultiplied)
+{
+    unsigned int i, j = 0;
+    for (i = 0; j < width; i++)
+      {
+        const unsigned int end = j + factor < width ? j + factor : width;
+        /* Two sums, so that the additions do not wait on each other. */
+        __m128 sums[2] = { z[i].vector, _mm_setzero_ps () };
+        for (; j < end; j++)
+          {
+            __m128 v = x[j].vector;
+            if (!is_premultiplied)
+              {
+                v = _mm_blend_ps (_mm_mul_ps (v, _mm_shuffle_ps (v, v, 0xff)), v, 0x8);
+              }
+            sums[j & 1] = _mm_add_ps (sums[j & 1], v);
+          }
+        z[i].vector = _mm_add_ps (sums[0], sums[1]);
+      }
+}
+
+/* With premultiplied colors, y with a coverage of t over x needs no
+   division: z = t * y + (1 - t * y.alpha) * x. */
+void color_over_premultiplied (float t, const color *x, const color *y, color *z)
+{
+    const __m128 source = _mm_mul_ps (y->vector, _mm_set1_ps (t));
+    const __m128 keep = _mm_sub_ps (_mm_set1_ps (1.0f), _mm_shuffle_ps (source, source, 0xff));
+    z->vector = _mm_add_ps (source, _mm_mul_ps (x->vector, keep));
+}
+
+/* color_blend_absorb for premultiplied inputs, with the maxima scaled by
+   alpha, comes down to interpolating towards y. Like painting, it does so
+   by the coverage times the alpha of y, the same as the span and 16 bit
+   kernels. */
+void color_blend_absorb_premultiplied (float t, const color *x, const color *y, color *z)
+{
+    const __m128 factor = _mm_mul_ps (_mm_set1_ps (t), _mm_shuffle_ps (y->vector, y->vector, 0xff));
+    z->vector = _mm_add_ps (x->vector, _mm_mul_ps (_mm_sub_ps (y->vector, x->vector), factor));
+}
+
+void color_span_over (color *z, const color *x, float opacity, unsigned int n)
+{
+    const __m128 scale = _mm_set1_ps (opacity);
+    const __m128 one = _mm_set1_ps (1.0f);
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        __m128 source = _mm_mul_ps (x[i].vector, scale);
+        __m128 keep = _mm_sub_ps (one, _mm_shuffle_ps (source, source, 0xff));
+        z[i].vector = _mm_add_ps (source, _mm_mul_ps (z[i].vector, keep));
+      }
+}
+
+/* The 16 bit kernels work on as many pixels as fit a vector register, 4
+   with AVX2 and 2 otherwise, and on a copy of the last few. */
+#ifdef __AVX2__
+typedef __m256i pixel16_vector;
+#define PIXEL16_LANES 4
+#define pixel16_load(x) _mm256_loadu_si256 ((const __m256i *) (x))
+#define pixel16_store(z, v) _mm256_storeu_si256 ((__m256i *) (z), v)
+#define pixel16_set1(x) _mm256_set1_epi16 (x)
+#define pixel16_set4(x) _mm256_set1_epi64x (*(const int64_t *) (x))
+#define pixel16_add(x, y) _mm256_adds_epu16 (x, y)
+#define pixel16_sub(x, y) _mm256_subs_epu16 (x, y)
+#define pixel16_wrap(x, y) _mm256_add_epi16 (x, y)
+#define pixel16_xor(x, y) _mm256_xor_si256 (x, y)
+#define pixel16_mullo(x, y) _mm256_mullo_epi16 (x, y)
+#define pixel16_mulhi(x, y) _mm256_mulhi_epu16 (x, y)
+#define pixel16_srli(x, n) _mm256_srli_epi16 (x, n)
+#define pixel16_max(x, y) _mm256_max_epu16 (x, y)
+#define pixel16_cmpeq(x, y) _mm256_cmpeq_epi16 (x, y)
+#define pixel16_alpha(x) _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (x, 0xff), 0xff)
+#else
+typedef __m128i pixel16_vector;
+#define PIXEL16_LANES 2
+#define pixel16_load(x) _mm_loadu_si128 ((const __m128i *) (x))
+#define pixel16_store(z, v) _mm_storeu_si128 ((__m128i *) (z), v)
+#define pixel16_set1(x) _mm_set1_epi16 (x)
+#define pixel16_set4(x) _mm_set1_epi64x (*(const int64_t *) (x))
+#define pixel16_add(x, y) _mm_adds_epu16 (x, y)
+#define pixel16_sub(x, y) _mm_subs_epu16 (x, y)
+#define pixel16_wrap(x, y) _mm_add_epi16 (x, y)
+#define pixel16_xor(x, y) _mm_xor_si128 (x, y)
+#define pixel16_mullo(x, y) _mm_mullo_epi16 (x, y)
+#define pixel16_mulhi(x, y) _mm_mulhi_epu16 (x, y)
+#define pixel16_srli(x, n) _mm_srli_epi16 (x, n)
+#define pixel16_max(x, y) _mm_max_epu16 (x, y)
+#define pixel16_cmpeq(x, y) _mm_cmpeq_epi16 (x, y)
+#define pixel16_alpha(x) _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (x, 0xff), 0xff)
+#endif
+
+/* x * y / 65535 rounded to nearest, exactly: with p = x * y + 32768 the
+   result is (p + (p >> 16)) >> 16, done on the high and low halves. */
+static inline pixel16_vector pixel16_mul (pixel16_vector x, pixel16_vector y)
+{
+    const pixel16_vector low = pixel16_mullo (x, y);
+    const pixel16_vector high = pixel16_add (pixel16_mulhi (x, y), pixel16_srli (low, 15));
+    const pixel16_vector sum = pixel16_wrap (pixel16_xor (low, pixel16_set1 ((short) 0x8000)), high);
+    /* All ones unless the low half carried. */
+    const pixel16_vector no_carry = pixel16_cmpeq (pixel16_max (sum, high), sum);
+    return pixel16_wrap (high, pixel16_wrap (pixel16_set1 (1), no_carry));
+}
+
+/* Each of the coverages of the pixels in all four channels. */
+static inline pixel16_vector pixel16_coverage (const uint16_t *coverage)
+{
+#ifdef __AVX2__
+    const __m128i pairs = _mm_unpacklo_epi16 (_mm_loadl_epi64 ((const __m128i *) coverage), _mm_loadl_epi64 ((const __m128i *) coverage));
+    return _mm256_set_m128i (_mm_unpackhi_epi32 (pairs, pairs), _mm_unpacklo_epi32 (pairs, pairs));
+#else
+    const __m128i pairs = _mm_unpacklo_epi16 (_mm_cvtsi32_si128 (*(const int32_t *) coverage), _mm_cvtsi32_si128 (*(const int32_t *) coverage));
+    return _mm_unpacklo_epi32 (pairs, pairs);
+#endif
+}
+
+/* Run a kernel over n pixels, the remainder through a copy. */
+#define PIXEL16_SPAN(z, coverage, n, kernel)                                \
+    do                                                                      \
+      {                                                                     \
+        unsigned int i;                                                     \
+        for (i = 0; i + PIXEL16_LANES <= n; i += PIXEL16_LANES)             \
+          {                                                                 \
+            const pixel16_vector c = pixel16_coverage (coverage + i);       \
+            pixel16_store (z + 4 * i, kernel (pixel16_load (z + 4 * i), c)); \
+          }                                                                 \
+        if (i < n)                                                          \
+          {                                                                 \
+            uint16_t pixels[4 * PIXEL16_LANES] = { 0 };                     \
+            uint16_t fractions[PIXEL16_LANES] = { 0 };                      \
+            memcpy (pixels, z + 4 * i, 4 * sizeof (uint16_t) * (n - i));    \
+            memcpy (fractions, coverage + i, sizeof (uint16_t) * (n - i));  \
+            pixel16_store (pixels, kernel (pixel16_load (pixels), pixel16_coverage (fractions))); \
+            memcpy (z + 4 * i, pixels, 4 * sizeof (uint16_t) * (n - i));    \
+          }                                                                 \
+      }                                                                     \
+    while (0)
+
+void pixel16_span_from_color (uint16_t *z, const color *x, unsigned int n)
+{
+    const __m128 scale = _mm_set1_ps (65535.0f);
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        const __m128i v = _mm_cvtps_epi32 (_mm_mul_ps (x[i].vector, scale));
+        _mm_storel_epi64 ((__m128i *) (z + 4 * i), _mm_packus_epi32 (v, v));
+      }
+}
+
+void pixel16_span_to_color (color *z, const uint16_t *x, unsigned int n)
+{
+    color_span_from_uint16 (z, x, 4, n);
+}
+
+/* Over, like color_over_premultiplied: z = c * b + (1 - c * b.alpha) * z. */
+void pixel16_span_paint (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n)
+{
+    const pixel16_vector b = pixel16_set4 (brush);
+    const pixel16_vector one = pixel16_set1 (-1);
+#define PIXEL16_PAINT(x, c) \
+    pixel16_add (pixel16_mul (b, c), pixel16_mul (x, pixel16_sub (one, pixel16_alpha (pixel16_mul (b, c)))))
+    PIXEL16_SPAN (z, coverage, n, PIXEL16_PAINT);
+#undef PIXEL16_PAINT
+}
+
+/* color_blend_absorb_premultiplied comes down to interpolating towards the
+   brush, by the coverage times the brush alpha. */
+void pixel16_span_absorb (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n)
+{
+    const pixel16_vector b = pixel16_set4 (brush);
+    const pixel16_vector b_alpha = pixel16_alpha (b);
+    const pixel16_vector one = pixel16_set1 (-1);
+#define PIXEL16_ABSORB(x, c) \
+    pixel16_add (pixel16_mul (b, pixel16_mul (b_alpha, c)), pixel16_mul (x, pixel16_sub (one, pixel16_mul (b_alpha, c))))
+    PIXEL16_SPAN (z, coverage, n, PIXEL16_ABSORB);
+#undef PIXEL16_ABSORB
+}
+
+/* Take away as much as the brush would have put down. */
+void pixel16_span_erase (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n)
+{
+    const pixel16_vector b = pixel16_alpha (pixel16_set4 (brush));
+    const pixel16_vector one = pixel16_set1 (-1);
+#define PIXEL16_ERASE(x, c) pixel16_mul (x, pixel16_sub (one, pixel16_mul (b, c)))
+    PIXEL16_SPAN (z, coverage, n, PIXEL16_ERASE);
+#undef PIXEL16_ERASE
+}
+
+void pixel16_span_over (uint16_t *z, const uint16_t *x, uint16_t opacity, unsigned int n)
+{
+    const pixel16_vector scale = pixel16_set1 ((short) opacity);
+    const pixel16_vector one = pixel16_set1 (-1);
+    unsigned int i;
+    for (i = 0; i + PIXEL16_LANES <= n; i += PIXEL16_LANES)
+      {
+        const pixel16_vector source = pixel16_mul (pixel16_load (x + 4 * i), scale);
+        const pixel16_vector keep = pixel16_sub (one, pixel16_alpha (source));
+        pixel16_store (z + 4 * i, pixel16_add (source, pixel16_mul (pixel16_load (z + 4 * i), keep)));
+      }
+    if (i < n)
+      {
+        uint16_t below[4 * PIXEL16_LANES] = { 0 };
+        uint16_t above[4 * PIXEL16_LANES] = { 0 };
+        memcpy (below, z + 4 * i, 4 * sizeof (uint16_t) * (n - i));
+        memcpy (above, x + 4 * i, 4 * sizeof (uint16_t) * (n - i));
+        pixel16_span_over (below, above, opacity, PIXEL16_LANES);
+        memcpy (z + 4 * i, below, 4 * sizeof (uint16_t) * (n - i));
+      }
+}
+
+void pixel16_span_scale (uint16_t *z, uint16_t t, unsigned int n)
+{
+    const pixel16_vector scale = pixel16_set1 ((short) t);
+    unsigned int i;
+    for (i = 0; i + PIXEL16_LANES <= n; i += PIXEL16_LANES)
+      {
+        pixel16_store (z + 4 * i, pixel16_mul (pixel16_load (z + 4 * i), scale));
+      }
+    if (i < n)
+      {
+        uint16_t pixels[4 * PIXEL16_LANES] = { 0 };
+        memcpy (pixels, z + 4 * i, 4 * sizeof (uint16_t) * (n - i));
+        pixel16_span_scale (pixels, t, PIXEL16_LANES);
+        memcpy (z + 4 * i, pixels, 4 * sizeof (uint16_t) * (n - i));
+      }
+}
+
+void pixel16_span_sum (const uint16_t *x, unsigned int n, uint64_t *sums)
+{
+    unsigned int i, c;
+    for (i = 0; i < n; i++)
+      {
+        for (c = 0; c < 4; c++)
+          {
+            sums[c] += x[4 * i + c];
+          }
+      }
+}
+
+/* Display conversion without going through float: the background shows
+   through as 1 - alpha of it, then x * 255 / 65535 rounds to 8 bits. */
+static inline __m128 color_alpha (__m128 v)
+{
+    return _mm_shuffle_ps (v, v, 0xff);
+}
+
+void pixel16_span_to_uint8 (uint8_t *z, const uint16_t *x, unsigned int n)
+{
+    const pixel16_vector to_8 = pixel16_set1 (255);
+    unsigned int i;
+    for (i = 0; i + PIXEL16_LANES <= n; i += PIXEL16_LANES)
+      {
+        const pixel16_vector v = pixel16_mul (pixel16_load (x + 4 * i), to_8);
+#ifdef __AVX2__
+        _mm_storeu_si128 ((__m128i *) (z + 4 * i), _mm256_castsi256_si128 (_mm256_permute4x64_epi64 (_mm256_packus_epi16 (v, v), 0x08)));
+#else
+        _mm_storel_epi64 ((__m128i *) (z + 4 * i), _mm_packus_epi16 (v, v));
+#endif
+      }
+    for (; i < n; i++)
+      {
+        unsigned int c;
+        for (c = 0; c < 4; c++)
+          {
+            z[4 * i + c] = (x[4 * i + c] * 255u + 32767) / 65535;
+          }
+      }
+}
+
+void pixel16_span_to_display (uint8_t *bgra, const uint16_t *x, uint8_t background, const uint8_t *dither, unsigned int n)
+{
+    const pixel16_vector one = pixel16_set1 (-1);
+    const pixel16_vector gray = pixel16_set1 ((short) (background * 257));
+    /* floor (x / 257) is (x * 65281) >> 24 for all 16 bit x. */
+    const pixel16_vector to_8 = pixel16_set1 ((short) 65281);
+    const __m128i swap = _mm_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint16_t thresholds[8];
+    unsigned int i;
+    for (i = 0; i < 8; i++)
+      {
+        thresholds[i] = dither[i] * 257 >> 8;
+      }
+    for (i = 0; i + PIXEL16_LANES <= n; i += PIXEL16_LANES)
+      {
+        const pixel16_vector v = pixel16_load (x + 4 * i);
+        pixel16_vector shown = pixel16_add (v, pixel16_mul (gray, pixel16_sub (one, pixel16_alpha (v))));
+        shown = pixel16_add (shown, pixel16_coverage (thresholds + (i & 7)));
+        shown = pixel16_srli (pixel16_mulhi (shown, to_8), 8);
+#ifdef __AVX2__
+        const __m128i bytes = _mm256_castsi256_si128 (_mm256_permute4x64_epi64 (_mm256_packus_epi16 (shown, shown), 0x08));
+        _mm_storeu_si128 ((__m128i *) (bgra + 4 * i), _mm_shuffle_epi8 (bytes, swap));
+#else
+        _mm_storel_epi64 ((__m128i *) (bgra + 4 * i), _mm_shuffle_epi8 (_mm_packus_epi16 (shown, shown), swap));
+#endif
+      }
+    if (i < n)
+      {
+        uint16_t pixels[4 * PIXEL16_LANES] = { 0 };
+        uint8_t shown[4 * PIXEL16_LANES];
+        uint8_t tail_dither[16];
+        unsigned int k;
+        /* The row is only good for 8 thresholds past the pointer, so start
+           a copy of it at the tail. */
+        for (k = 0; k < sizeof (tail_dither); k++)
+          {
+            tail_dither[k] = dither[(i + k) & 7];
+          }
+        memcpy (pixels, x + 4 * i, 4 * sizeof (uint16_t) * (n - i));
+        pixel16_span_to_display (shown, pixels, background, tail_dither, PIXEL16_LANES);
+        memcpy (bgra + 4 * i, shown, 4 * (n - i));
+      }
+}
+
+/* An 8x8 ordered (Bayer) dither matrix in 256ths, each row twice so that
+   any 8 pixels from a column on are contiguous. */
+static const uint8_t dither_matrix[8][16] =
+  {
+#define DITHER_ROW(a, b, c, d, e, f, g, h) \
+    { 4 * a + 2, 4 * b + 2, 4 * c + 2, 4 * d + 2, 4 * e + 2, 4 * f + 2, 4 * g + 2, 4 * h + 2, \
+      4 * a + 2, 4 * b + 2, 4 * c + 2, 4 * d + 2, 4 * e + 2, 4 * f + 2, 4 * g + 2, 4 * h + 2 }
+    DITHER_ROW (0, 32, 8, 40, 2, 34, 10, 42),
+    DITHER_ROW (48, 16, 56, 24, 50, 18, 58, 26),
+    DITHER_ROW (12, 44, 4, 36, 14, 46, 6, 38),
+    DITHER_ROW (60, 28, 52, 20, 62, 30, 54, 22),
+    DITHER_ROW (3, 35, 11, 43, 1, 33, 9, 41),
+    DITHER_ROW (51, 19, 59, 27, 49, 17, 57, 25),
+    DITHER_ROW (15, 47, 7, 39, 13, 45, 5, 37),
+    DITHER_ROW (63, 31, 55, 23, 61, 29, 53, 21),
+#undef DITHER_ROW
+  };
+
+static const uint8_t dither_none[16] =
+  {
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128
+  };
+
+const uint8_t *
+display_dither_row (int is_dithered, int x, int y)
+{
+    return is_dithered ? dither_matrix[y & 7] + (x & 7) : dither_none;
+}
+
+/* Clamp, scale and round four pixels to bytes, the rounding threshold of
+   each pixel in 256ths. */
+static inline __m128i color_pack_uint8 (const __m128 *v, const uint8_t *thresholds)
+{
+    const __m128 to_8 = _mm_set1_ps (255.0f);
+    __m128i words[4];
+    unsigned int k;
+    for (k = 0; k < 4; k++)
+      {
+        const __m128 threshold = _mm_set1_ps (thresholds[k] * (1.0f / 256));
+        const __m128 clamped = _mm_min_ps (_mm_max_ps (v[k], _mm_setzero_ps ()), _mm_set1_ps (1.0f));
+        words[k] = _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (clamped, to_8), threshold));
+      }
+    return _mm_packus_epi16 (_mm_packs_epi32 (words[0], words[1]), _mm_packs_epi32 (words[2], words[3]));
+}
+
+void color_span_to_uint8 (uint8_t *z, const color *x, unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < n; i += 4)
+      {
+        __m128 v[4];
+        unsigned int k;
+        for (k = 0; k < 4; k++)
+          {
+            v[k] = x[i + k < n ? i + k : n - 1].vector;
+          }
+        const __m128i bytes = color_pack_uint8 (v, dither_none);
+        if (i + 4 <= n)
+          {
+            _mm_storeu_si128 ((__m128i *) (z + 4 * i), bytes);
+          }
+        else
+          {
+            memcpy (z + 4 * i, &bytes, 4 * (n - i));
+          }
+      }
+}
+
+void color_span_to_display (uint8_t *bgra, const color *x, uint8_t background, int is_premultiplied, const uint8_t *dither, unsigned int n)
+{
+    const __m128 one = _mm_set1_ps (1.0f);
+    const __m128 gray = _mm_set1_ps (background / 255.0f);
+    const __m128i swap = _mm_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    unsigned int i;
+    for (i = 0; i < n; i += 4)
+      {
+        __m128 v[4];
+        unsigned int k;
+        for (k = 0; k < 4; k++)
+          {
+            __m128 pixel = _mm_min_ps (_mm_max_ps (x[i + k < n ? i + k : n - 1].vector, _mm_setzero_ps ()), one);
+            const __m128 alpha = color_alpha (pixel);
+            if (!is_premultiplied)
+              {
+                pixel = _mm_mul_ps (pixel, alpha);
+              }
+            v[k] = _mm_add_ps (pixel, _mm_mul_ps (gray, _mm_sub_ps (one, alpha)));
+          }
+        const __m128i bytes = _mm_shuffle_epi8 (color_pack_uint8 (v, dither + (i & 7)), swap);
+        if (i + 4 <= n)
+          {
+            _mm_storeu_si128 ((__m128i *) (bgra + 4 * i), bytes);
+          }
+        else
+          {
+            memcpy (bgra + 4 * i, &bytes, 4 * (n - i));
+          }
+      }
+}
+
+/* The sRGB transfer function by tables. 8 bit values go to linear light
+   through the 256 results, floats through SRGB_STEPS steps over 0 to 1
+   with linear interpolation, and linear floats back to 8 bits through a
+   table indexed by their exponent and the top bits of their mantissa, as
+   they are, so that its entries are fine near black where the curve is
+   steep and coarse near white. Below the smallest exponent everything
+   rounds to 0. Linear floats go back to sRGB floats through the same
+   segments, interpolating with the rest of the mantissa, and below them
+   along the straight part of the curve. pow is only used to fill the
+   tables. */
+#define SRGB_STEPS 4096
+#define SRGB_MANTISSA_BITS 10
+#define SRGB_EXPONENTS 13
+#define SRGB_SMALLEST ((127 - SRGB_EXPONENTS) << 23) /* 2^-13 as bits. */
+
+static float srgb_to_linear_8[256];
+static float srgb_to_linear_steps[SRGB_STEPS + 1];
+static uint8_t linear_to_srgb_8[SRGB_EXPONENTS << SRGB_MANTISSA_BITS];
+static float linear_to_srgb_segments[(SRGB_EXPONENTS << SRGB_MANTISSA_BITS) + 1];
+
+static double srgb_to_linear (double v)
+{
+    return v <= 0.04045 ? v / 12.92 : pow ((v + 0.055) / 1.055, 2.4);
+}
+
+static double linear_to_srgb (double v)
+{
+    return v <= 0.0031308 ? v * 12.92 : 1.055 * pow (v, 1 / 2.4) - 0.055;
+}
+
+/* Filled before main, the tables are small. */
+__attribute__ ((constructor)) static void srgb_tables_init (void)
+{
+    unsigned int i;
+    for (i = 0; i < 256; i++)
+      {
+        srgb_to_linear_8[i] = srgb_to_linear (i / 255.0);
+      }
+    for (i = 0; i <= SRGB_STEPS; i++)
+      {
+        srgb_to_linear_steps[i] = srgb_to_linear (i / (double) SRGB_STEPS);
+      }
+    for (i = 0; i < sizeof (linear_to_srgb_8); i++)
+      { /* The middle of the floats that share an entry. */
+        const uint32_t bits = SRGB_SMALLEST + (i << (23 - SRGB_MANTISSA_BITS)) + (1u << (22 - SRGB_MANTISSA_BITS));
+        float v;
+        memcpy (&v, &bits, sizeof (v));
+        linear_to_srgb_8[i] = lrint (255 * linear_to_srgb (v));
+      }
+    for (i = 0; i < sizeof (linear_to_srgb_segments) / sizeof (float); i++)
+      { /* The start of each, the last one ends at 1. */
+        const uint32_t bits = SRGB_SMALLEST + (i << (23 - SRGB_MANTISSA_BITS));
+        float v;
+        memcpy (&v, &bits, sizeof (v));
+        linear_to_srgb_segments[i] = linear_to_srgb (v);
+      }
+}
+
+void color_span_from_srgb8 (color *z, const uint8_t *x, unsigned int samples, unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        const uint8_t *sample = x + i * samples;
+        if (samples < 3)
+          {
+            z[i].red = z[i].green = z[i].blue = srgb_to_linear_8[sample[0]];
+            z[i].alpha = samples == 2 ? sample[1] / 255.0f : 1.0f;
+          }
+        else
+          {
+            z[i].red = srgb_to_linear_8[sample[0]];
+            z[i].green = srgb_to_linear_8[sample[1]];
+            z[i].blue = srgb_to_linear_8[sample[2]];
+            z[i].alpha = samples > 3 ? sample[3] / 255.0f : 1.0f;
+          }
+      }
+}
+
+void color_span_srgb_to_linear (color *z, unsigned int n)
+{
+    unsigned int i, c;
+    for (i = 0; i < n; i++)
+      {
+        for (c = 0; c < 3; c++)
+          {
+            const float v = fminf (fmaxf (z[i].values[c], 0.0f), 1.0f) * SRGB_STEPS;
+            const int step = v < SRGB_STEPS ? (int) v : SRGB_STEPS - 1;
+            const float t = v - step;
+            z[i].values[c] = srgb_to_linear_steps[step] + t * (srgb_to_linear_steps[step + 1] - srgb_to_linear_steps[step]);
+          }
+      }
+}
+
+void color_span_linear_to_srgb (color *z, unsigned int n)
+{
+    const float smallest = 1.0f / (1 << SRGB_EXPONENTS);
+    unsigned int i, c;
+    for (i = 0; i < n; i++)
+      {
+        for (c = 0; c < 3; c++)
+          {
+            /* Just below 1, in the last segment. */
+            const float v = fminf (fmaxf (z[i].values[c], 0.0f), 0x1.fffffep-1f);
+            uint32_t bits, segment;
+            if (v < smallest)
+              {
+                z[i].values[c] = v * 12.92f;
+                continue;
+              }
+            memcpy (&bits, &v, sizeof (bits));
+            segment = (bits - SRGB_SMALLEST) >> (23 - SRGB_MANTISSA_BITS);
+            const float t = (bits & ((1u << (23 - SRGB_MANTISSA_BITS)) - 1)) * (1.0f / (1 << (23 - SRGB_MANTISSA_BITS)));
+            z[i].values[c] = linear_to_srgb_segments[segment] + t * (linear_to_srgb_segments[segment + 1] - linear_to_srgb_segments[segment]);
+          }
+      }
+}
+
+/* The table entries of the color channels of a clamped pixel, its alpha
+   scaled and rounded. */
+static inline uint32_t color_pack_srgb8 (__m128 v)
+{
+    const __m128i bits = _mm_castps_si128 (_mm_min_ps (_mm_max_ps (v, _mm_castsi128_ps (_mm_set1_epi32 (SRGB_SMALLEST))),
+                                                       _mm_castsi128_ps (_mm_set1_epi32 (0x3f7fffff))));
+    const __m128i entries = _mm_srli_epi32 (_mm_sub_epi32 (bits, _mm_set1_epi32 (SRGB_SMALLEST)), 23 - SRGB_MANTISSA_BITS);
+    const int alpha = _mm_cvtss_si32 (_mm_mul_ss (_mm_min_ss (_mm_max_ss (color_alpha (v), _mm_setzero_ps ()), _mm_set_ss (1.0f)),
+                                                  _mm_set_ss (255.0f)));
+    return linear_to_srgb_8[_mm_cvtsi128_si32 (entries)] | linear_to_srgb_8[_mm_extract_epi32 (entries, 1)] << 8
+           | linear_to_srgb_8[_mm_extract_epi32 (entries, 2)] << 16 | (uint32_t) alpha << 24;
+}
+
+void color_span_to_srgb8 (uint8_t *z, const color *x, unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        const uint32_t pixel = color_pack_srgb8 (x[i].vector);
+        memcpy (z + 4 * i, &pixel, sizeof (pixel));
+      }
+}
+
+void color_span_linear_to_display (uint8_t *bgra, const color *x, uint8_t background, int is_premultiplied, unsigned int n)
+{
+    const __m128 one = _mm_set1_ps (1.0f);
+    const __m128 gray = _mm_set1_ps (srgb_to_linear_8[background]);
+    unsigned int i;
+    for (i = 0; i < n; i++)
+      {
+        __m128 pixel = _mm_min_ps (_mm_max_ps (x[i].vector, _mm_setzero_ps ()), one);
+        const __m128 alpha = color_alpha (pixel);
+        if (!is_premultiplied)
+          {
+            pixel = _mm_mul_ps (pixel, alpha);
+          }
+        const uint32_t rgba = color_pack_srgb8 (_mm_add_ps (pixel, _mm_mul_ps (gray, _mm_sub_ps (one, alpha))));
+        const uint32_t pixel_bgra = (rgba & 0xff00ff00) | (rgba >> 16 & 0xff) | (rgba & 0xff) << 16;
+        memcpy (bgra + 4 * i, &pixel_bgra, sizeof (pixel_bgra));
+      }
+}
+
+void pixel16_span_linear_to_display (uint8_t *bgra, const uint16_t *x, uint8_t background, unsigned int n)
+{
+    color chunk[IMAGE_TILE_SIZE] __attribute__ ((aligned (16)));
+    unsigned int i;
+    for (i = 0; i < n; i += IMAGE_TILE_SIZE)
+      {
+        const unsigned int count = n - i < IMAGE_TILE_SIZE ? n - i : IMAGE_TILE_SIZE;
+        pixel16_span_to_color (chunk, x + 4 * i, count);
+        color_span_linear_to_display (bgra + 4 * i, chunk, background, 1, count);
+      }
+}
+
+/* The blend modes on one premultiplied pixel: d below, s above with a
+   coverage t. The separable modes follow the W3C compositing formulas,
+   z = s (1 - d.a) + d (1 - s.a) + s.a d.a B (d / d.a, s / s.a), with the
+   divisions taken out. */
+static inline __m128 blend_pixel_normal (__m128 d, __m128 s, __m128 t)
+{
+    s = _mm_mul_ps (s, t);
+    return _mm_add_ps (s, _mm_mul_ps (d, _mm_sub_ps (_mm_set1_ps (1.0f), color_alpha (s))));
+}
+
+/* Like color_blend_absorb_premultiplied. */
+static inline __m128 blend_pixel_absorb (__m128 d, __m128 s, __m128 t)
+{
+    t = _mm_mul_ps (t, color_alpha (s));
+    return _mm_add_ps (d, _mm_mul_ps (_mm_sub_ps (s, d), t));
+}
+
+static inline __m128 blend_pixel_multiply (__m128 d, __m128 s, __m128 t)
+{
+    const __m128 one = _mm_set1_ps (1.0f);
+    s = _mm_mul_ps (s, t);
+    return _mm_add_ps (_mm_add_ps (_mm_mul_ps (s, _mm_sub_ps (one, color_alpha (d))),
+                                   _mm_mul_ps (d, _mm_sub_ps (one, color_alpha (s)))),
+                       _mm_mul_ps (s, d));
+}
+
+static inline __m128 blend_pixel_screen (__m128 d, __m128 s, __m128 t)
+{
+    s = _mm_mul_ps (s, t);
+    return _mm_sub_ps (_mm_add_ps (s, d), _mm_mul_ps (s, d));
+}
+
+static inline __m128 blend_pixel_overlay (__m128 d, __m128 s, __m128 t)
+{
+    const __m128 one = _mm_set1_ps (1.0f);
+    const __m128 two = _mm_set1_ps (2.0f);
+    s = _mm_mul_ps (s, t);
+    const __m128 d_alpha = color_alpha (d);
+    const __m128 s_alpha = color_alpha (s);
+    const __m128 dark = _mm_mul_ps (two, _mm_mul_ps (s, d));
+    const __m128 light = _mm_sub_ps (_mm_mul_ps (s_alpha, d_alpha),
+                                     _mm_mul_ps (two, _mm_mul_ps (_mm_sub_ps (d_alpha, d), _mm_sub_ps (s_alpha, s))));
+    const __m128 is_dark = _mm_cmple_ps (_mm_mul_ps (two, d), d_alpha);
+    return _mm_add_ps (_mm_add_ps (_mm_mul_ps (s, _mm_sub_ps (one, d_alpha)),
+                                   _mm_mul_ps (d, _mm_sub_ps (one, s_alpha))),
+                       _mm_blendv_ps (light, dark, is_dark));
+}
+
+static inline __m128 blend_pixel_darken (__m128 d, __m128 s, __m128 t)
+{
+    s = _mm_mul_ps (s, t);
+    return _mm_sub_ps (_mm_add_ps (s, d), _mm_max_ps (_mm_mul_ps (s, color_alpha (d)), _mm_mul_ps (d, color_alpha (s))));
+}
+
+static inline __m128 blend_pixel_lighten (__m128 d, __m128 s, __m128 t)
+{
+    s = _mm_mul_ps (s, t);
+    return _mm_sub_ps (_mm_add_ps (s, d), _mm_min_ps (_mm_mul_ps (s, color_alpha (d)), _mm_mul_ps (d, color_alpha (s))));
+}
+
+#define COLOR_BLEND_SPAN(mode)                                                  \
+    static void color_span_##mode (color *z, const color *x, unsigned int x_step, \
+                                   const float *coverage, unsigned int coverage_step, \
+                                   unsigned int n)                              \
+    {                                                                           \
+        unsigned int i;                                                         \
+        for (i = 0; i < n; i++)                                                 \
+          {                                                                     \
+            z[i].vector = blend_pixel_##mode (z[i].vector, x[i * x_step].vector, \
+                                              _mm_set1_ps (coverage[i * coverage_step])); \
+          }                                                                     \
+    }
+
+COLOR_BLEND_SPAN (normal)
+COLOR_BLEND_SPAN (absorb)
+COLOR_BLEND_SPAN (multiply)
+COLOR_BLEND_SPAN (screen)
+COLOR_BLEND_SPAN (overlay)
+COLOR_BLEND_SPAN (darken)
+COLOR_BLEND_SPAN (lighten)
+
+const ColorBlendMode color_blend_modes[COLOR_BLEND_MODES] =
+  {
+    { "normal", color_span_normal, pixel16_span_paint },
+    { "absorb", color_span_absorb, pixel16_span_absorb },
+    { "multiply", color_span_multiply, NULL },
+    { "screen", color_span_screen, NULL },
+    { "overlay", color_span_overlay, NULL },
+    { "darken", color_span_darken, NULL },
+    { "lighten", color_span_lighten, NULL },
+  };
+
+void pixel16_span_paint_mode (unsigned int mode, uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n)
+{
+    color pixels[IMAGE_TILE_SIZE], brush_color;
+    float fractions[IMAGE_TILE_SIZE];
+    unsigned int i, k;
+    if (color_blend_modes[mode].paint16 != NULL)
+      {
+        color_blend_modes[mode].paint16 (z, coverage, brush, n);
+        return;
+      }
+    pixel16_span_to_color (&brush_color, brush, 1);
+    for (i = 0; i < n; i += IMAGE_TILE_SIZE)
+      {
+        const unsigned int count = n - i < IMAGE_TILE_SIZE ? n - i : IMAGE_TILE_SIZE;
+        pixel16_span_to_color (pixels, z + 4 * i, count);
+        for (k = 0; k < count; k++)
+          {
+            fractions[k] = coverage[i + k] / 65535.0f;
+          }
+        color_blend_modes[mode].span (pixels, &brush_color, 0, fractions, 1, count);
+        pixel16_span_from_color (z + 4 * i, pixels, count);
+      }
+}
+
+void pixel16_span_over_mode (unsigned int mode, uint16_t *z, const uint16_t *x, uint16_t opacity, unsigned int n)
+{
+    color below[IMAGE_TILE_SIZE], above[IMAGE_TILE_SIZE];
+    const float fraction = opacity / 65535.0f;
+    unsigned int i;
+    if (mode == 0)
+      {
+        pixel16_span_over (z, x, opacity, n);
+        return;
+      }
+    for (i = 0; i < n; i += IMAGE_TILE_SIZE)
+      {
+        const unsigned int count = n - i < IMAGE_TILE_SIZE ? n - i : IMAGE_TILE_SIZE;
+        pixel16_span_to_color (below, z + 4 * i, count);
+        pixel16_span_to_color (above, x + 4 * i, count);
+        color_blend_modes[mode].span (below, above, 1, &fraction, 0, count);
+        pixel16_span_from_color (z + 4 * i, below, count);
+      }
+}
+
+static void
+image_blend_tile (image_t *z, const image_t *x, unsigned int index, unsigned int mode, float opacity, int is_premultiplied)
+{
+    color *below = image_tile (z, index);
+    const color *above = image_tile (x, index);
+    unsigned int row;
+    if (z->format == IMAGE_FORMAT_UINT16)
+      {
+        pixel16_span_over_mode (mode, (uint16_t *) below, (const uint16_t *) above, lrintf (opacity * 65535), IMAGE_TILE_PIXELS);
+        return;
+      }
+    if (is_premultiplied)
+      {
+        color_blend_modes[mode].span (below, above, 1, &opacity, 0, IMAGE_TILE_PIXELS);
+        return;
+      }
+    for (row = 0; row < IMAGE_TILE_PIXELS; row += IMAGE_TILE_SIZE)
+      {
+        color copy[IMAGE_TILE_SIZE];
+        memcpy (copy, above + row, sizeof (copy));
+        color_span_premultiply (copy, IMAGE_TILE_SIZE);
+        color_span_premultiply (below + row, IMAGE_TILE_SIZE);
+        color_blend_modes[mode].span (below + row, copy, 1, &opacity, 0, IMAGE_TILE_SIZE);
+        color_span_unpremultiply (below + row, IMAGE_TILE_SIZE);
+      }
+}
+
+void
+image_blend (image_t *z, const image_t *x, unsigned int mode, float opacity, int is_premultiplied)
+{
+    unsigned int row;
+    /* A row of tiles at a time, so that out of core images can be trimmed
+       in between. */
+    for (row = 0; row < z->tiles_down; row++)
+      {
+        const unsigned int first = row * z->tiles_across;
+        unsigned int i;
+#pragma omp parallel for
+        for (i = first; i < first + z->tiles_across; i++)
+          {
+            if (!tile_cache_is_blank (x, i))
+              {
+                image_blend_tile (z, x, i, mode, opacity, is_premultiplied);
+                z->tile_flags[i] |= IMAGE_TILE_DIRTY | IMAGE_TILE_STALE;
+              }
+          }
+        tile_cache_trim (z->cache);
+      }
+}
+
+void
+image_fade (image_t *image, float opacity, int is_premultiplied)
+{
+    const __m128 scale = is_premultiplied ? _mm_set1_ps (opacity) : _mm_setr_ps (1.0f, 1.0f, 1.0f, opacity);
+    unsigned int row;
+    for (row = 0; row < image->tiles_down; row++)
+      {
+        const unsigned int first = row * image->tiles_across;
+        unsigned int i;
+#pragma omp parallel for
+        for (i = first; i < first + image->tiles_across; i++)
+          {
+            if (tile_cache_is_blank (image, i))
+              {
+                continue;
+              }
+            if (image->format == IMAGE_FORMAT_UINT16)
+              {
+                pixel16_span_scale ((uint16_t *) image_tile (image, i), lrintf (opacity * 65535), IMAGE_TILE_PIXELS);
+              }
+            else
+              {
+                color *tile = image_tile (image, i);
+                unsigned int k;
+                for (k = 0; k < IMAGE_TILE_PIXELS; k++)
+                  {
+                    tile[k].vector = _mm_mul_ps (tile[k].vector, scale);
+                  }
+              }
+            image->tile_flags[i] |= IMAGE_TILE_DIRTY | IMAGE_TILE_STALE;
+          }
+        tile_cache_trim (image->cache);
+      }
+}
+
 inline void color_add (color *x, color *y, color *z)
 {
     asm volatile
@@ -92,19 +1248,22 @@ inline void color_add_struct (colorvector x, colorvector y, color *z)
          " : [xmm0] "+v" (x), [xmm1] "+v" (y) : [r] "r" (z) : "memory");
 }
 
+/* An operand of the blends, addressed however the code is linked. */
+static const colorvector color_ones = { 1.0f, 1.0f, 1.0f, 1.0f };
+
 inline void color_blend (float const *t, color const *x, color const *y, color *z)
 {
     asm volatile
         ("vmovaps (%[rdi]), %%xmm0;\
           vmovaps (%[rsi]), %%xmm1;\
-          vmovaps ones, %%xmm2;\
+          vmovaps %[ones], %%xmm2;\
           vsubps %%xmm0, %%xmm2, %%xmm2;\
           vmulps %%xmm2, %%xmm1, %%xmm3;\
           vmovaps (%[rdx]), %%xmm1;\
           vmulps %%xmm0, %%xmm1, %%xmm1;\
           vaddps %%xmm1, %%xmm3, %%xmm3;\
           vmovaps %%xmm3, (%[rcx]);\
-         " : : [rdi] "r" (t), [rsi] "r" (x), [rdx] "r" (y), [rcx] "r" (z) : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+         " : : [rdi] "r" (t), [rsi] "r" (x), [rdx] "r" (y), [rcx] "r" (z), [ones] "m" (color_ones) : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
 }
 
 inline void color_blend_single (float t, color const *x, color const *y, color *z)
@@ -112,39 +1271,39 @@ inline void color_blend_single (float t, color const *x, color const *y, color *
     asm volatile
         ("vbroadcastss %[xmm0], %[xmm0];\
           vmovaps (%[rdi]), %%xmm1;\
-          vmovaps ones, %%xmm2;\
+          vmovaps %[ones], %%xmm2;\
           vsubps %[xmm0], %%xmm2, %%xmm2;\
           vmulps %%xmm2, %%xmm1, %%xmm3;\
           vmovaps (%[rsi]), %%xmm1;\
           vmulps %[xmm0], %%xmm1, %%xmm1;\
           vaddps %%xmm1, %%xmm3, %%xmm3;\
           vmovaps %%xmm3, (%[rdx]);\
-         " : [xmm0] "+v" (t) : [rdi] "r" (x), [rsi] "r" (y), [rdx] "r" (z) : "xmm1", "xmm2", "xmm3", "memory");
+         " : [xmm0] "+v" (t) : [rdi] "r" (x), [rsi] "r" (y), [rdx] "r" (z), [ones] "m" (color_ones) : "xmm1", "xmm2", "xmm3", "memory");
 }
 
 inline void color_blend_single_struct (float t, colorvector x, colorvector y, color *z)
 {
     asm volatile
         ("vbroadcastss %[xmm0], %[xmm0];\
-          vmovaps ones, %%xmm3;\
+          vmovaps %[ones], %%xmm3;\
           vsubps %[xmm0], %%xmm3, %%xmm3;\
           vmulps %%xmm3, %[xmm1], %[xmm1];\
           vmulps %[xmm2], %[xmm0], %[xmm2];\
           vaddps %[xmm2], %[xmm1], %[xmm1];\
           vmovaps %[xmm1], (%[rdi]);\
-         " : [xmm0] "+v" (t), [xmm1] "+v" (x), [xmm2] "+v" (y) : [rdi] "r" (z) : "xmm3", "memory");
+         " : [xmm0] "+v" (t), [xmm1] "+v" (x), [xmm2] "+v" (y) : [rdi] "r" (z), [ones] "m" (color_ones) : "xmm3", "memory");
 }
 
 inline void color_blend_struct (colorvector t, colorvector x, colorvector y, color *z)
 {
     asm volatile
-        ("vmovaps ones, %%xmm3;\
+        ("vmovaps %[ones], %%xmm3;\
           vsubps %[xmm0], %%xmm3, %%xmm3;\
           vmulps %%xmm3, %[xmm1], %[xmm1];\
           vmulps %[xmm2], %[xmm0], %[xmm2];\
           vaddps %[xmm2], %[xmm1], %[xmm1];\
           vmovaps %[xmm1], (%[rdi]);\
-         " : [xmm0] "+v" (t), [xmm1] "+v" (x), [xmm2] "+v" (y) : [rdi] "r" (z) : "xmm3", "memory");
+         " : [xmm0] "+v" (t), [xmm1] "+v" (x), [xmm2] "+v" (y) : [rdi] "r" (z), [ones] "m" (color_ones) : "xmm3", "memory");
 }
 
 inline void color_multiply_single_struct (float t, colorvector x, color *z)
@@ -164,9 +1323,3 @@ inline void color_multiply_struct (colorvector t, colorvector x, color *z)
          " : [xmm0] "+v" (t), [xmm1] "+v" (x) : [rdi] "r" (z) : "memory");
 }
 
-asm (".section .rodata;\
-      .align 16;\
-       ones: .rept 4;\
-      .float 1.0;\
-      .endr;\
-      .text;");
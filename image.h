@@ -1,19 +1,97 @@
 #pragma once
 #include <immintrin.h>
+#include <stdint.h>
 
 typedef struct image_t image_t;
+typedef struct TileCache TileCache;
+typedef struct TileSwap TileSwap;
 typedef union color color;
 typedef __m128 colorvector;
 
+/* Images are stored as square tiles of pixels, each tile contiguous in
+   memory, so that tiles can be loaded, saved and tracked independently. */
+#define IMAGE_TILE_SHIFT 6
+#define IMAGE_TILE_SIZE (1 << IMAGE_TILE_SHIFT)
+#define IMAGE_TILE_MASK (IMAGE_TILE_SIZE - 1)
+#define IMAGE_TILE_PIXELS (IMAGE_TILE_SIZE * IMAGE_TILE_SIZE)
+
+#define IMAGE_TILE_DIRTY 0x1 /* Changed since the document was saved. */
+#define IMAGE_TILE_STALE 0x2 /* Changed since it was swapped out. */
+
+/* Pixel formats. Tiles of 16 bit images hold four premultiplied channels
+   of 0 to 65535 per pixel, in the same order as a color. */
+#define IMAGE_FORMAT_COLOR 0
+#define IMAGE_FORMAT_UINT16 1
+
+/* Steps converting source tiles of colors, in this order, before they go
+   into the format of the image. */
+#define IMAGE_CONVERT_UNPREMULTIPLY 0x1
+#define IMAGE_CONVERT_TO_LINEAR 0x2
+#define IMAGE_CONVERT_FROM_LINEAR 0x4
+#define IMAGE_CONVERT_PREMULTIPLY 0x8
+
 void color_blend_absorb (const float *t, const color *x, const color  *y, color *z);
 void color_blend_absorb_single (const float t, const color *x, const color *y, color *z);
 
 image_t *
 image_new (unsigned int width, unsigned int height);
 
+image_t *
+image_new_uninitialized (unsigned int width, unsigned int height);
+
+/* Only the tile table is allocated, all tile pointers are NULL. */
+image_t *
+image_new_unallocated (unsigned int width, unsigned int height);
+
+/* Tiles of colors from elsewhere (e.g. mapped from a file), converted into
+   tiles of the image's own as they are first used, so that the sources
+   are only read where the image is, or used as they are if there is
+   nothing to convert. NULL sources are transparent tiles. The image takes
+   the array of sources but not the tiles. */
+image_t *
+image_new_converting (unsigned int width, unsigned int height, unsigned int format, const color **sources, unsigned int conversion);
+
+/* Fill a tile with its source, converted as the image converts it. */
+void
+image_tile_convert (const image_t *image, unsigned int index, color *tile);
+
+/* Tiles are allocated on first use and may be swapped out, see
+   tile_cache.h. */
+image_t *
+image_new_cached (unsigned int width, unsigned int height, unsigned int format, TileCache *cache);
+
+image_t *
+image_new_uint16 (unsigned int width, unsigned int height);
+
+/* A 16 bit copy of an image of premultiplied colors. */
+image_t *
+image_to_uint16 (image_t *image);
+
 void
 image_del (image_t *image);
 
+/* Marking tiles dirty also marks them stale. */
+void
+image_mark (image_t *image, int x, int y, int width, int height, uint8_t flags);
+
+/* Convert all tiles between straight and premultiplied alpha. */
+void
+image_premultiply (image_t *image);
+
+void
+image_unpremultiply (image_t *image);
+
+/* Composite all of x onto z in place with a blend mode and opacity, a tile
+   at a time in parallel. Both have the same format, premultiplied unless
+   is_premultiplied is 0, in which case rows go through premultiplied
+   copies. Tiles of z that change are marked dirty. */
+void
+image_blend (image_t *z, const image_t *x, unsigned int mode, float opacity, int is_premultiplied);
+
+/* Multiply the alpha of all pixels by an opacity, in place. */
+void
+image_fade (image_t *image, float opacity, int is_premultiplied);
+
 void color_add (color *x, color *y, color *z);
 void color_add_struct (colorvector x, colorvector y, color *z);
 void color_blend (float const *t, color const *x, color const *y, color *z);
@@ -23,6 +101,89 @@ void color_blend_struct (colorvector t, colorvector x, colorvector y, color *z);
 void color_multiply_single_struct (float t, colorvector x, color *z);
 void color_multiply_struct (colorvector t, colorvector x, color *z);
 
+/* Convert n pixels of interleaved samples (1 gray, 2 gray + alpha, 3 RGB,
+   4 or more RGBA) to colors. */
+void color_span_from_uint8 (color *z, const uint8_t *x, unsigned int samples, unsigned int n);
+void color_span_from_uint16 (color *z, const uint16_t *x, unsigned int samples, unsigned int n);
+void color_span_from_float (color *z, const float *x, unsigned int samples, unsigned int n);
+void color_span_unpremultiply (color *z, unsigned int n);
+void color_span_premultiply (color *z, unsigned int n);
+/* Add the sums of boxes of factor pixels of x to z, premultiplied first
+   unless they are already, the last box cut short at width pixels. */
+void color_span_box_add (color *z, const color *x, unsigned int factor, unsigned int width, int is_premultiplied);
+/* To 8 bit RGBA, rounded. */
+void color_span_to_uint8 (uint8_t *z, const color *x, unsigned int n);
+
+/* Integer kernels for 16 bit pixels (four channels each). Fractions are
+   also 16 bit, 65535 standing for 1, and each product is rounded, so the
+   results are within two units of the exact ones. The coverage of each
+   pixel is a fraction, the brush a premultiplied pixel. */
+void pixel16_span_from_color (uint16_t *z, const color *x, unsigned int n);
+void pixel16_span_to_color (color *z, const uint16_t *x, unsigned int n);
+void pixel16_span_paint (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n);
+void pixel16_span_absorb (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n);
+void pixel16_span_erase (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n);
+/* Composite n pixels of x with an opacity over z. */
+void pixel16_span_over (uint16_t *z, const uint16_t *x, uint16_t opacity, unsigned int n);
+void pixel16_span_scale (uint16_t *z, uint16_t t, unsigned int n);
+void pixel16_span_sum (const uint16_t *x, unsigned int n, uint64_t *sums);
+/* To 8 bit premultiplied RGBA. */
+void pixel16_span_to_uint8 (uint8_t *z, const uint16_t *x, unsigned int n);
+
+/* Conversion for display: clamp, blend on a gray background, round to 8
+   bits and store as BGRA, in one pass. Each pixel is rounded up from its
+   threshold in a row of 256ths, which either dithers or is constant. The
+   row repeats every 8 pixels, and only 8 thresholds past its start are
+   read. */
+const uint8_t *display_dither_row (int is_dithered, int x, int y);
+void color_span_to_display (uint8_t *bgra, const color *x, uint8_t background, int is_premultiplied, const uint8_t *dither, unsigned int n);
+void pixel16_span_to_display (uint8_t *bgra, const uint16_t *x, uint8_t background, const uint8_t *dither, unsigned int n);
+
+/* The sRGB transfer function by tables, for drawings in linear light:
+   interleaved 8 bit sRGB samples (as color_span_from_uint8) to linear
+   colors, the color channels of sRGB colors to linear in place and back,
+   and linear colors to 8 bit sRGB RGBA. Alpha stays as it is. */
+void color_span_from_srgb8 (color *z, const uint8_t *x, unsigned int samples, unsigned int n);
+void color_span_srgb_to_linear (color *z, unsigned int n);
+void color_span_linear_to_srgb (color *z, unsigned int n);
+void color_span_to_srgb8 (uint8_t *z, const color *x, unsigned int n);
+/* Like color_span_to_display, blending in linear light, without dither. */
+void color_span_linear_to_display (uint8_t *bgra, const color *x, uint8_t background, int is_premultiplied, unsigned int n);
+void pixel16_span_linear_to_display (uint8_t *bgra, const uint16_t *x, uint8_t background, unsigned int n);
+
+/* Blend modes, kept in a table so that adding one takes one kernel. Each
+   blends x, with a coverage, onto a span of z, all premultiplied colors.
+   Either x and the coverage advance with z (step 1) or they are the same
+   for the whole span (step 0), so one kernel both paints with a brush
+   color and composites a layer. A mode can also have an integer kernel
+   for painting 16 bit pixels, the others go through colors. */
+typedef void (*ColorBlendSpan) (color *z, const color *x, unsigned int x_step, const float *coverage, unsigned int coverage_step, unsigned int n);
+typedef void (*Pixel16BlendSpan) (uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n);
+
+typedef struct ColorBlendMode ColorBlendMode;
+
+struct ColorBlendMode
+{
+    const char *name;
+    ColorBlendSpan span;
+    Pixel16BlendSpan paint16; /* NULL if there is none. */
+};
+
+#define COLOR_BLEND_MODES 7
+
+extern const ColorBlendMode color_blend_modes[COLOR_BLEND_MODES];
+
+/* Paint a constant brush or composite a layer onto 16 bit pixels with any
+   blend mode. */
+void pixel16_span_paint_mode (unsigned int mode, uint16_t *z, const uint16_t *coverage, const uint16_t *brush, unsigned int n);
+void pixel16_span_over_mode (unsigned int mode, uint16_t *z, const uint16_t *x, uint16_t opacity, unsigned int n);
+
+/* Kernels for colors with premultiplied (associated) alpha. */
+void color_over_premultiplied (float t, const color *x, const color *y, color *z);
+void color_blend_absorb_premultiplied (float t, const color *x, const color *y, color *z);
+/* Composite n pixels of x with an opacity over z. */
+void color_span_over (color *z, const color *x, float opacity, unsigned int n);
+
 union __attribute__ ((aligned (16))) color
 {
     colorvector vector;
@@ -35,10 +196,65 @@ union __attribute__ ((aligned (16))) color
 
 struct image_t
 {
-    color *data;
+    color **tiles; /* tiles_across * tiles_down tiles, row major. */
+    uint8_t *tile_flags;
+    color *storage; /* Owned memory, tiles may also point elsewhere. */
+    TileCache *cache; /* NULL if all tiles stay in memory. */
+    TileSwap *tile_swap; /* Where swapped out tiles are, with a cache. */
+    const color **sources; /* Converted on first use, NULL if none are. A
+                              cache drops those of tiles it stores. */
+    unsigned int conversion; /* IMAGE_CONVERT_ steps of the sources. */
     struct
     {
         unsigned int width;
         unsigned int height;
     };
+    unsigned int tiles_across;
+    unsigned int tiles_down;
+    unsigned int format;
 };
+
+static inline unsigned int
+image_tile_index (const image_t *image, unsigned int x, unsigned int y)
+{
+    return (y >> IMAGE_TILE_SHIFT) * image->tiles_across + (x >> IMAGE_TILE_SHIFT);
+}
+
+/* Brings a swapped out tile of a cached image back, or converts a tile
+   from its source. */
+color *
+image_tile_fault (image_t *image, unsigned int index);
+
+static inline color *
+image_tile (const image_t *image, unsigned int index)
+{
+    color *tile = __atomic_load_n (image->tiles + index, __ATOMIC_ACQUIRE);
+    return tile != NULL ? tile : image_tile_fault ((image_t *) image, index);
+}
+
+/* The pixels from x up to the end of its tile row are contiguous. */
+static inline color *
+image_pixel (const image_t *image, unsigned int x, unsigned int y)
+{
+    return image_tile (image, image_tile_index (image, x, y))
+           + ((y & IMAGE_TILE_MASK) << IMAGE_TILE_SHIFT) + (x & IMAGE_TILE_MASK);
+}
+
+/* The same for 16 bit images, four channels per pixel. */
+static inline uint16_t *
+image_pixel16 (const image_t *image, unsigned int x, unsigned int y)
+{
+    return (uint16_t *) image_tile (image, image_tile_index (image, x, y))
+           + 4 * (((y & IMAGE_TILE_MASK) << IMAGE_TILE_SHIFT) + (x & IMAGE_TILE_MASK));
+}
+
+static inline unsigned int
+image_tile_bytes (const image_t *image)
+{
+    return IMAGE_TILE_PIXELS * (image->format == IMAGE_FORMAT_UINT16 ? 4 * sizeof (uint16_t) : sizeof (color));
+}
+
+/* Whether all bytes of a tile are 0, i.e. it is transparent in any
+   format. */
+int
+tile_is_empty (const void *tile, unsigned int bytes);
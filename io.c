@@ -0,0 +1,86 @@
+#include "io.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+write_all (int fd, const void *data, size_t size)
+{
+  const char *bytes = data;
+  while (size)
+    {
+      ssize_t written = write (fd, bytes, size);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+          return 0;
+        }
+      bytes += written;
+      size -= written;
+    }
+  return 1;
+}
+
+int
+pwrite_all (int fd, const void *data, size_t size, uint64_t offset)
+{
+  const char *bytes = data;
+  while (size)
+    {
+      ssize_t written = pwrite (fd, bytes, size, offset);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+          return 0;
+        }
+      bytes += written;
+      size -= written;
+      offset += written;
+    }
+  return 1;
+}
+
+int
+pread_all (int fd, void *data, size_t size, uint64_t offset)
+{
+  char *bytes = data;
+  while (size)
+    {
+      ssize_t got = pread (fd, bytes, size, offset);
+      if (got <= 0)
+        {
+          if (got < 0 && errno == EINTR)
+            {
+              continue;
+            }
+          return 0;
+        }
+      bytes += got;
+      size -= got;
+      offset += got;
+    }
+  return 1;
+}
+
+uint64_t
+monotonic_nanoseconds (void)
+{
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+double
+monotonic_seconds (void)
+{
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* File and clock helpers shared by the modules that save, swap, record
+   and time things. */
+
+/* Write or read all of size bytes, retrying short transfers and
+   interrupted calls. Return 0 on errors, and reading also at the end of
+   the file. */
+int write_all (int fd, const void *data, size_t size);
+int pwrite_all (int fd, const void *data, size_t size, uint64_t offset);
+int pread_all (int fd, void *data, size_t size, uint64_t offset);
+
+/* Time on the monotonic clock. */
+uint64_t monotonic_nanoseconds (void);
+double monotonic_seconds (void);
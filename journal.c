@@ -0,0 +1,347 @@
+#include "journal.h"
+#include "io.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "FLOATJNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_CAPACITY 65536 /* Records in the ring, a power of two. */
+#define JOURNAL_FLUSH_INTERVAL_NS 50000000
+#define JOURNAL_FLUSHES_PER_SYNC 20
+
+typedef struct JournalHeader JournalHeader;
+
+/* Followed by the snapshot of the last reset, then the records. */
+struct JournalHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  int32_t width, height;
+  uint64_t snapshot_size;
+};
+
+/* A single producer (the event loop) single consumer (the writer thread)
+   ring, so recording never takes a lock. The lock is only held by the
+   writer while writing and by journal_reset. */
+struct Journal
+{
+  JournalRecord *ring;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  int fd;
+  JournalHeader header;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int is_closing;
+};
+
+/* Write out everything recorded so far, at most two write calls. */
+static size_t
+journal_flush_locked (Journal *journal)
+{
+  const size_t tail
+      = atomic_load_explicit (&journal->tail, memory_order_relaxed);
+  const size_t head
+      = atomic_load_explicit (&journal->head, memory_order_acquire);
+  const size_t count = head - tail;
+  const size_t first = tail & (JOURNAL_CAPACITY - 1);
+  const size_t wrapped
+      = first + count > JOURNAL_CAPACITY ? first + count - JOURNAL_CAPACITY : 0;
+  if (!count)
+    {
+      return 0;
+    }
+  if (!write_all (journal->fd, journal->ring + first,
+                  (count - wrapped) * sizeof (JournalRecord))
+      || !write_all (journal->fd, journal->ring,
+                     wrapped * sizeof (JournalRecord)))
+    {
+      perror ("journal");
+    }
+  atomic_store_explicit (&journal->tail, head, memory_order_release);
+  return count;
+}
+
+static void *
+journal_writer (void *data)
+{
+  Journal *journal = data;
+  unsigned int flushes = 0;
+  pthread_mutex_lock (&journal->lock);
+  for (;;)
+    {
+      const int is_closing = journal->is_closing;
+      if (journal_flush_locked (journal)
+          && ++flushes % JOURNAL_FLUSHES_PER_SYNC == 0)
+        {
+          fdatasync (journal->fd);
+        }
+      if (is_closing)
+        {
+          break;
+        }
+      struct timespec deadline;
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += JOURNAL_FLUSH_INTERVAL_NS;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec += 1;
+          deadline.tv_nsec -= 1000000000;
+        }
+      pthread_cond_timedwait (&journal->wake, &journal->lock, &deadline);
+    }
+  fdatasync (journal->fd);
+  pthread_mutex_unlock (&journal->lock);
+  return NULL;
+}
+
+/* Whether a header is of a journal this version can read. */
+static int
+journal_header_is_valid (const JournalHeader *header, size_t file_size)
+{
+  return !memcmp (header->magic, JOURNAL_MAGIC, sizeof (header->magic))
+         && header->version == JOURNAL_VERSION
+         && header->record_size == sizeof (JournalRecord)
+         && header->width > 0 && header->height > 0
+         && header->snapshot_size <= file_size - sizeof (JournalHeader);
+}
+
+Journal *
+journal_open (const char *file_name, int width, int height)
+{
+  struct stat file_stat;
+  JournalHeader header;
+  int fd = open (file_name, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0 || fstat (fd, &file_stat))
+    {
+      perror (file_name);
+      if (fd >= 0)
+        {
+          close (fd);
+        }
+      return NULL;
+    }
+  Journal *journal = calloc (1, sizeof (Journal));
+  memcpy (journal->header.magic, JOURNAL_MAGIC, sizeof (journal->header.magic));
+  journal->header.version = JOURNAL_VERSION;
+  journal->header.record_size = sizeof (JournalRecord);
+  journal->header.width = width;
+  journal->header.height = height;
+  journal->fd = fd;
+  if ((size_t)file_stat.st_size < sizeof (JournalHeader)
+      || pread (fd, &header, sizeof (header), 0) != sizeof (header)
+      || !journal_header_is_valid (&header, file_stat.st_size))
+    { /* New, or not something this version can add to. */
+      if (ftruncate (fd, 0)
+          || !write_all (fd, &journal->header, sizeof (JournalHeader)))
+        {
+          perror (file_name);
+        }
+    }
+  else
+    { /* Drop a record torn by a crash, so new ones stay aligned. */
+      const size_t torn = (file_stat.st_size - sizeof (JournalHeader)
+                           - header.snapshot_size)
+                          % sizeof (JournalRecord);
+      journal->header.snapshot_size = header.snapshot_size;
+      if (torn && ftruncate (fd, file_stat.st_size - torn))
+        {
+          perror (file_name);
+        }
+    }
+  journal->ring = malloc (sizeof (JournalRecord) * JOURNAL_CAPACITY);
+  atomic_init (&journal->head, 0);
+  atomic_init (&journal->tail, 0);
+  pthread_mutex_init (&journal->lock, NULL);
+  pthread_cond_init (&journal->wake, NULL);
+  pthread_create (&journal->thread, NULL, journal_writer, journal);
+  return journal;
+}
+
+void
+journal_close (Journal *journal)
+{
+  if (journal == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&journal->lock);
+  journal->is_closing = 1;
+  pthread_cond_signal (&journal->wake);
+  pthread_mutex_unlock (&journal->lock);
+  pthread_join (journal->thread, NULL);
+  pthread_cond_destroy (&journal->wake);
+  pthread_mutex_destroy (&journal->lock);
+  close (journal->fd);
+  free (journal->ring);
+  free (journal);
+}
+
+static void
+journal_append (Journal *journal, const JournalRecord *record)
+{
+  const size_t head
+      = atomic_load_explicit (&journal->head, memory_order_relaxed);
+  while (head - atomic_load_explicit (&journal->tail, memory_order_acquire)
+         >= JOURNAL_CAPACITY)
+    { /* Only if the disk stalls: wait rather than lose input. */
+      pthread_cond_signal (&journal->wake);
+      sched_yield ();
+    }
+  journal->ring[head & (JOURNAL_CAPACITY - 1)] = *record;
+  atomic_store_explicit (&journal->head, head + 1, memory_order_release);
+}
+
+void
+journal_sample (Journal *journal, double x, double y, float pressure,
+                int is_drawing)
+{
+  JournalRecord record = { 0 };
+  if (journal == NULL)
+    {
+      return;
+    }
+  record.type = JOURNAL_SAMPLE;
+  record.is_drawing = is_drawing;
+  record.pressure = pressure;
+  record.x = x;
+  record.y = y;
+  journal_append (journal, &record);
+}
+
+void
+journal_key (Journal *journal, uint8_t keycode, uint16_t state)
+{
+  JournalRecord record = { 0 };
+  if (journal == NULL)
+    {
+      return;
+    }
+  record.type = JOURNAL_KEY;
+  record.keycode = keycode;
+  record.state = state;
+  journal_append (journal, &record);
+}
+
+void
+journal_reset (Journal *journal, const void *snapshot, size_t size)
+{
+  if (journal == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&journal->lock);
+  atomic_store_explicit (&journal->tail,
+                         atomic_load_explicit (&journal->head,
+                                               memory_order_acquire),
+                         memory_order_release);
+  journal->header.snapshot_size = size;
+  if (ftruncate (journal->fd, 0)
+      || !write_all (journal->fd, &journal->header, sizeof (JournalHeader))
+      || !write_all (journal->fd, snapshot, size)
+      || fdatasync (journal->fd))
+    {
+      perror ("journal");
+    }
+  pthread_mutex_unlock (&journal->lock);
+}
+
+/* Open a journal for reading and check its header, -1 if it is not one. */
+static int
+journal_open_for_reading (const char *file_name, JournalHeader *header,
+                          size_t *file_size)
+{
+  struct stat file_stat;
+  int fd = open (file_name, O_RDONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  if (fstat (fd, &file_stat)
+      || (size_t)file_stat.st_size < sizeof (JournalHeader)
+      || pread (fd, header, sizeof (JournalHeader), 0)
+             != sizeof (JournalHeader)
+      || !journal_header_is_valid (header, file_stat.st_size))
+    {
+      close (fd);
+      return -1;
+    }
+  *file_size = file_stat.st_size;
+  return fd;
+}
+
+JournalRecord *
+journal_read (const char *file_name, size_t *records, int *width,
+              int *height)
+{
+  JournalHeader header;
+  size_t file_size;
+  JournalRecord *recorded = NULL;
+  int fd = journal_open_for_reading (file_name, &header, &file_size);
+  *records = 0;
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  const size_t start = sizeof (header) + header.snapshot_size;
+  const size_t count = (file_size - start) / sizeof (JournalRecord);
+  const size_t size = count * sizeof (JournalRecord);
+  if (count)
+    {
+      recorded = malloc (size);
+      if (pread (fd, recorded, size, start) == (ssize_t)size)
+        {
+          *records = count;
+          *width = header.width;
+          *height = header.height;
+        }
+      else
+        {
+          free (recorded);
+          recorded = NULL;
+        }
+    }
+  close (fd);
+  return recorded;
+}
+
+void *
+journal_read_snapshot (const char *file_name, size_t *size)
+{
+  JournalHeader header;
+  size_t file_size;
+  void *snapshot = NULL;
+  int fd = journal_open_for_reading (file_name, &header, &file_size);
+  *size = 0;
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  if (header.snapshot_size)
+    {
+      snapshot = malloc (header.snapshot_size);
+      if (pread (fd, snapshot, header.snapshot_size, sizeof (header))
+          == (ssize_t)header.snapshot_size)
+        {
+          *size = header.snapshot_size;
+        }
+      else
+        {
+          free (snapshot);
+          snapshot = NULL;
+        }
+    }
+  close (fd);
+  return snapshot;
+}
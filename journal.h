@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only record of the input that changed the drawing since it was
+   last saved, so that a session can be recovered after a crash by replaying
+   it. Recording only copies the record into a ring buffer, a background
+   thread writes the buffer out in batches. The state the input after a
+   save applies to, of brushes, colors and so on, is kept with the records
+   as an opaque snapshot. */
+
+typedef struct Journal Journal;
+typedef struct JournalRecord JournalRecord;
+
+#define JOURNAL_EXTENSION ".journal"
+
+typedef enum JournalRecordType
+{
+  JOURNAL_SAMPLE = 1, /* Pointer position, pressure and drawing state. */
+  JOURNAL_KEY = 2,
+} JournalRecordType;
+
+struct JournalRecord
+{
+  uint8_t type;
+  uint8_t is_drawing;
+  uint8_t keycode;
+  uint8_t reserved;
+  uint16_t state;
+  uint16_t reserved_state;
+  float pressure;
+  float reserved_pressure;
+  double x, y;
+};
+
+/* Open for appending, creating the file for a canvas of the given size if
+   it does not exist. */
+Journal *journal_open (const char *file_name, int width, int height);
+void journal_close (Journal *journal);
+
+void journal_sample (Journal *journal, double x, double y, float pressure,
+                     int is_drawing);
+void journal_key (Journal *journal, uint8_t keycode, uint16_t state);
+
+/* The drawing was saved, forget everything recorded so far and keep size
+   bytes of snapshot to replay the records from now on from. */
+void journal_reset (Journal *journal, const void *snapshot, size_t size);
+
+/* Read all complete records, NULL if there are none. */
+JournalRecord *journal_read (const char *file_name, size_t *records,
+                             int *width, int *height);
+
+/* Read the snapshot of the last reset, NULL if there is none. */
+void *journal_read_snapshot (const char *file_name, size_t *size);
@@ -0,0 +1,153 @@
+#include "latency.h"
+#include "io.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Buckets are spaced logarithmically, eight to each doubling of the time
+   in nanoseconds, which keeps the error of a percentile within 12.5%. */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+typedef struct LatencyHistogram LatencyHistogram;
+
+/* Only the owning thread writes its counts, the report reads them. */
+struct LatencyHistogram
+{
+  _Atomic uint64_t counts[LATENCY_STAGES][LATENCY_BUCKETS];
+  LatencyHistogram *next;
+};
+
+static const char *const stage_names[LATENCY_STAGES]
+    = { "dab start", "dab end", "composite", "convert", "present" };
+
+static _Atomic uint64_t input_time; /* 0 if no input is being followed. */
+static _Atomic (LatencyHistogram *) histograms;
+static _Thread_local LatencyHistogram *local_histogram;
+
+static unsigned int
+bucket_of (uint64_t nanoseconds)
+{
+  if (nanoseconds < LATENCY_SUB_BUCKETS)
+    {
+      return nanoseconds;
+    }
+  const unsigned int exponent = 63 - __builtin_clzll (nanoseconds);
+  const unsigned int sub = (nanoseconds >> (exponent - LATENCY_SUB_BITS))
+                           & (LATENCY_SUB_BUCKETS - 1);
+  return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/* The middle of the times falling into a bucket. */
+static double
+bucket_time (unsigned int bucket)
+{
+  if (bucket < LATENCY_SUB_BUCKETS)
+    {
+      return bucket;
+    }
+  const unsigned int exponent
+      = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+  const unsigned int sub = bucket % LATENCY_SUB_BUCKETS;
+  return ldexp (LATENCY_SUB_BUCKETS + sub + 0.5,
+                exponent - LATENCY_SUB_BITS);
+}
+
+static LatencyHistogram *
+latency_histogram (void)
+{
+  if (local_histogram == NULL)
+    {
+      LatencyHistogram *histogram = calloc (1, sizeof (LatencyHistogram));
+      histogram->next = atomic_load (&histograms);
+      while (!atomic_compare_exchange_weak (&histograms, &histogram->next,
+                                            histogram))
+        {
+        }
+      local_histogram = histogram;
+    }
+  return local_histogram;
+}
+
+void
+latency_input (void)
+{
+  atomic_store_explicit (&input_time, monotonic_nanoseconds (),
+                         memory_order_relaxed);
+}
+
+void
+latency_mark (LatencyStage stage)
+{
+  const uint64_t start
+      = atomic_load_explicit (&input_time, memory_order_relaxed);
+  if (!start)
+    {
+      return;
+    }
+  const uint64_t end = monotonic_nanoseconds ();
+  _Atomic uint64_t *count
+      = latency_histogram ()->counts[stage] + bucket_of (end - start);
+  atomic_store_explicit (
+      count, atomic_load_explicit (count, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+  if (stage == LATENCY_PRESENT)
+    {
+      atomic_store_explicit (&input_time, 0, memory_order_relaxed);
+    }
+}
+
+void
+latency_report (void)
+{
+  static const double percentiles[] = { 0.5, 0.95, 0.99 };
+  int stage;
+  printf ("Latency from input (ms)     p50      p95      p99  samples\n");
+  for (stage = 0; stage < LATENCY_STAGES; ++stage)
+    {
+      uint64_t *counts = calloc (LATENCY_BUCKETS, sizeof (uint64_t));
+      uint64_t total = 0;
+      LatencyHistogram *histogram;
+      unsigned int bucket;
+      for (histogram = atomic_load (&histograms); histogram != NULL;
+           histogram = histogram->next)
+        {
+          for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+            {
+              const uint64_t count = atomic_load_explicit (
+                  histogram->counts[stage] + bucket, memory_order_relaxed);
+              counts[bucket] += count;
+              total += count;
+            }
+        }
+      printf ("  %-24s", stage_names[stage]);
+      size_t i;
+      for (i = 0; i < sizeof (percentiles) / sizeof (percentiles[0]); ++i)
+        {
+          const uint64_t rank = total ? ceil (percentiles[i] * total) : 0;
+          uint64_t seen = 0;
+          for (bucket = 0; bucket < LATENCY_BUCKETS && total; ++bucket)
+            {
+              seen += counts[bucket];
+              if (seen >= rank)
+                {
+                  break;
+                }
+            }
+          if (total)
+            {
+              printf ("%9.3f", bucket_time (bucket) / 1000000);
+            }
+          else
+            {
+              printf ("%9s", "-");
+            }
+        }
+      printf ("%9llu\n", (unsigned long long)total);
+      free (counts);
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+/* Input to photon latency: each stage is timed from the arrival of the
+   input event that caused it to the end of the stage, and collected in
+   histograms per thread that are only merged for the report. */
+
+typedef
+enum LatencyStage
+{
+  LATENCY_DAB_START = 0,
+  LATENCY_DAB_END,
+  LATENCY_COMPOSITE,
+  LATENCY_CONVERT,
+  LATENCY_PRESENT,
+  LATENCY_STAGES,
+}
+LatencyStage;
+
+/* An input event arrived, later stages are timed from now. */
+void latency_input (void);
+
+/* A stage ended. Nothing is recorded unless an input is being followed,
+   and following it ends with LATENCY_PRESENT. */
+void latency_mark (LatencyStage stage);
+
+/* Print the median, 95th and 99th percentile of each stage. */
+void latency_report (void);
@@ -0,0 +1,467 @@
+#include "recorder.h"
+#include "io.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tile_cache.h"
+
+#define RECORDER_POLL_NS 20000000 /* Between collecting changes. */
+#define RECORDER_TRIES 4 /* To read changes not written over meanwhile. */
+
+/* The canvas is kept in tiles of 8 bit RGBA, each one contiguous, as it
+   was at the last frame and as it is now. Only the thread touches them. */
+struct Recorder
+{
+  const ShareHeader *share;
+  int fd;
+  RecorderHeader header;
+  int tiles_across, tiles_down;
+  uint8_t *current;
+  uint8_t *previous;
+  uint8_t *is_changed; /* Per tile, since the last frame. */
+  uint64_t since;      /* The last generation of the share read. */
+  uint8_t *frame;      /* A frame being put together. */
+  size_t frame_capacity;
+  uint32_t flags;      /* Of the next frame written. */
+  double interval, start, next;
+  size_t frames, bytes;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int is_closing;
+};
+
+struct Playback
+{
+  FILE *file;
+  RecorderHeader header;
+  int tiles_across, tiles_down;
+  uint8_t *tiles;
+  uint8_t *data;
+  size_t data_capacity;
+};
+
+/* Copy a row of the published canvas into the current tiles, as straight
+   RGBA, a tile at a time. */
+static void
+recorder_copy_row (Recorder *recorder, const uint8_t *pixels, int x, int y,
+                   int width)
+{
+  const ShareHeader *share = recorder->share;
+  const int tile_y = y >> IMAGE_TILE_SHIFT;
+  const int row = y & IMAGE_TILE_MASK;
+  color chunk[IMAGE_TILE_SIZE] __attribute__ ((aligned (16)));
+  int i = x;
+  while (i < x + width)
+    {
+      const int tile_x = i >> IMAGE_TILE_SHIFT;
+      const int end = min ((tile_x + 1) << IMAGE_TILE_SHIFT, x + width);
+      const int n = end - i;
+      const uint8_t *from
+          = pixels + ((size_t)y * share->width + i) * share->pixel_bytes;
+      uint8_t *to = recorder->current
+                    + (size_t)(tile_y * recorder->tiles_across + tile_x)
+                          * RECORDER_TILE_BYTES
+                    + 4 * (row * IMAGE_TILE_SIZE + (i & IMAGE_TILE_MASK));
+      int k;
+      if (share->format == SHARE_FORMAT_FLOAT)
+        {
+          memcpy (chunk, from, sizeof (color) * n);
+          color_span_unpremultiply (chunk, n);
+          if (share->is_linear)
+            {
+              color_span_to_srgb8 (to, chunk, n);
+            }
+          else
+            {
+              color_span_to_uint8 (to, chunk, n);
+            }
+        }
+      else
+        {
+          for (k = 0; k < n; ++k)
+            {
+              to[4 * k] = from[4 * k + 2];
+              to[4 * k + 1] = from[4 * k + 1];
+              to[4 * k + 2] = from[4 * k];
+              to[4 * k + 3] = from[4 * k + 3];
+            }
+        }
+      i = end;
+    }
+}
+
+/* Copy what changed in the canvas since the last time. Returns 0 if it
+   was written over while being read, and has to be read again. */
+static int
+recorder_capture (Recorder *recorder)
+{
+  const void *pixels;
+  uint32_t sequence;
+  const uint64_t generation
+      = share_read_begin (recorder->share, &pixels, &sequence);
+  const ShareRect area
+      = share_changes (recorder->share, recorder->since, generation);
+  int y, tile_x, tile_y;
+  for (y = area.y; y < area.y + area.height; ++y)
+    {
+      recorder_copy_row (recorder, pixels, area.x, y, area.width);
+    }
+  if (!share_read_end (recorder->share, generation, sequence))
+    {
+      return 0;
+    }
+  for (tile_y = area.y >> IMAGE_TILE_SHIFT;
+       tile_y << IMAGE_TILE_SHIFT < area.y + area.height; ++tile_y)
+    {
+      for (tile_x = area.x >> IMAGE_TILE_SHIFT;
+           tile_x << IMAGE_TILE_SHIFT < area.x + area.width; ++tile_x)
+        {
+          recorder->is_changed[tile_y * recorder->tiles_across + tile_x] = 1;
+        }
+    }
+  recorder->since = generation;
+  return 1;
+}
+
+/* Append the tiles that differ from the last frame, if any. */
+static void
+recorder_write_frame (Recorder *recorder)
+{
+  const int tiles = recorder->tiles_across * recorder->tiles_down;
+  RecorderFrame frame
+      = { recorder->flags, 0, 0, monotonic_seconds () - recorder->start };
+  uint8_t delta[RECORDER_TILE_BYTES];
+  size_t size = sizeof (RecorderFrame);
+  int index, k;
+  for (index = 0; index < tiles; ++index)
+    {
+      uint8_t *current
+          = recorder->current + (size_t)index * RECORDER_TILE_BYTES;
+      uint8_t *previous
+          = recorder->previous + (size_t)index * RECORDER_TILE_BYTES;
+      if (!recorder->is_changed[index])
+        {
+          continue;
+        }
+      recorder->is_changed[index] = 0;
+      if (!memcmp (current, previous, RECORDER_TILE_BYTES))
+        {
+          continue;
+        }
+      if (recorder->frame_capacity
+          < size + sizeof (RecorderTile) + RECORDER_TILE_BYTES)
+        {
+          recorder->frame_capacity = recorder->frame_capacity * 2
+                                     + sizeof (RecorderTile)
+                                     + RECORDER_TILE_BYTES;
+          recorder->frame
+              = realloc (recorder->frame, recorder->frame_capacity);
+        }
+      for (k = 0; k < RECORDER_TILE_BYTES; ++k)
+        {
+          delta[k] = current[k] ^ previous[k];
+        }
+      memcpy (previous, current, RECORDER_TILE_BYTES);
+      RecorderTile tile = { index, 0 };
+      uint8_t *data = recorder->frame + size + sizeof (RecorderTile);
+      tile.size = tile_encode (delta, 4, data);
+      if (!tile.size)
+        {
+          tile.size = RECORDER_TILE_BYTES;
+          memcpy (data, delta, RECORDER_TILE_BYTES);
+        }
+      memcpy (recorder->frame + size, &tile, sizeof (RecorderTile));
+      size += sizeof (RecorderTile) + tile.size;
+      ++frame.tile_count;
+    }
+  if (!frame.tile_count)
+    {
+      return;
+    }
+  frame.bytes = size - sizeof (RecorderFrame);
+  memcpy (recorder->frame, &frame, sizeof (RecorderFrame));
+  if (!write_all (recorder->fd, recorder->frame, size))
+    {
+      perror ("timelapse");
+    }
+  recorder->flags = 0;
+  recorder->frames += 1;
+  recorder->bytes += size;
+}
+
+static void *
+recorder_thread (void *data)
+{
+  Recorder *recorder = data;
+  pthread_mutex_lock (&recorder->lock);
+  for (;;)
+    {
+      const int is_closing = recorder->is_closing;
+      int is_captured = 0, tries;
+      for (tries = 0; !is_captured && tries < RECORDER_TRIES; ++tries)
+        {
+          is_captured = recorder_capture (recorder);
+        }
+      if (is_captured
+          && (is_closing || monotonic_seconds () >= recorder->next))
+        {
+          recorder_write_frame (recorder);
+          recorder->next += recorder->interval;
+          if (recorder->next < monotonic_seconds ())
+            { /* Do not catch up after a stall. */
+              recorder->next = monotonic_seconds () + recorder->interval;
+            }
+        }
+      if (is_closing)
+        {
+          break;
+        }
+      struct timespec deadline;
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += RECORDER_POLL_NS;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec += 1;
+          deadline.tv_nsec -= 1000000000;
+        }
+      pthread_cond_timedwait (&recorder->wake, &recorder->lock, &deadline);
+    }
+  pthread_mutex_unlock (&recorder->lock);
+  return NULL;
+}
+
+/* The size of the complete frames of a recording, after its header. */
+static off_t
+recorder_complete_size (int fd, off_t size)
+{
+  off_t offset = sizeof (RecorderHeader);
+  RecorderFrame frame;
+  while (offset + (off_t)sizeof (RecorderFrame) <= size
+         && pread (fd, &frame, sizeof (frame), offset) == sizeof (frame)
+         && offset + (off_t)sizeof (RecorderFrame) + (off_t)frame.bytes
+                <= size)
+    {
+      offset += sizeof (RecorderFrame) + frame.bytes;
+    }
+  return offset;
+}
+
+Recorder *
+recorder_new (const char *file_name, const ShareHeader *share,
+              double interval)
+{
+  struct stat file_stat;
+  RecorderHeader header;
+  int fd = open (file_name, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0 || fstat (fd, &file_stat))
+    {
+      perror (file_name);
+      if (fd >= 0)
+        {
+          close (fd);
+        }
+      return NULL;
+    }
+  Recorder *recorder = calloc (1, sizeof (Recorder));
+  memcpy (recorder->header.magic, RECORDER_MAGIC,
+          sizeof (recorder->header.magic));
+  recorder->header.version = RECORDER_VERSION;
+  recorder->header.tile_size = IMAGE_TILE_SIZE;
+  recorder->header.width = share->width;
+  recorder->header.height = share->height;
+  if ((size_t)file_stat.st_size < sizeof (RecorderHeader)
+      || pread (fd, &header, sizeof (header), 0) != sizeof (header)
+      || memcmp (&header, &recorder->header, sizeof (header)))
+    {
+      if (ftruncate (fd, 0)
+          || !write_all (fd, &recorder->header, sizeof (RecorderHeader)))
+        {
+          perror (file_name);
+        }
+    }
+  else
+    { /* Drop a frame torn by a crash. */
+      const off_t size = recorder_complete_size (fd, file_stat.st_size);
+      if (size < file_stat.st_size && ftruncate (fd, size))
+        {
+          perror (file_name);
+        }
+    }
+  recorder->share = share;
+  recorder->fd = fd;
+  recorder->tiles_across = (share->width + IMAGE_TILE_SIZE - 1)
+                           >> IMAGE_TILE_SHIFT;
+  recorder->tiles_down = (share->height + IMAGE_TILE_SIZE - 1)
+                         >> IMAGE_TILE_SHIFT;
+  const size_t tiles = (size_t)recorder->tiles_across * recorder->tiles_down;
+  recorder->current = calloc (tiles, RECORDER_TILE_BYTES);
+  recorder->previous = calloc (tiles, RECORDER_TILE_BYTES);
+  recorder->is_changed = calloc (tiles, 1);
+  recorder->flags = RECORDER_FRAME_START;
+  recorder->interval = interval;
+  recorder->start = monotonic_seconds ();
+  recorder->next = recorder->start;
+  pthread_mutex_init (&recorder->lock, NULL);
+  pthread_cond_init (&recorder->wake, NULL);
+  pthread_create (&recorder->thread, NULL, recorder_thread, recorder);
+  printf ("Recording a frame every %g seconds to %s\n", interval, file_name);
+  return recorder;
+}
+
+void
+recorder_del (Recorder *recorder)
+{
+  if (recorder == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&recorder->lock);
+  recorder->is_closing = 1;
+  pthread_cond_signal (&recorder->wake);
+  pthread_mutex_unlock (&recorder->lock);
+  pthread_join (recorder->thread, NULL);
+  pthread_cond_destroy (&recorder->wake);
+  pthread_mutex_destroy (&recorder->lock);
+  printf ("Recorded %zu frames in %zu bytes\n", recorder->frames,
+          recorder->bytes);
+  close (recorder->fd);
+  free (recorder->current);
+  free (recorder->previous);
+  free (recorder->is_changed);
+  free (recorder->frame);
+  free (recorder);
+}
+
+Playback *
+playback_open (const char *file_name, int *width, int *height)
+{
+  RecorderHeader header;
+  FILE *file = fopen (file_name, "rb");
+  if (file == NULL)
+    {
+      perror (file_name);
+      return NULL;
+    }
+  if (fread (&header, sizeof (header), 1, file) != 1
+      || memcmp (header.magic, RECORDER_MAGIC, sizeof (header.magic))
+      || header.version != RECORDER_VERSION
+      || header.tile_size != IMAGE_TILE_SIZE || header.width <= 0
+      || header.height <= 0)
+    {
+      fprintf (stderr, "%s: not a recording\n", file_name);
+      fclose (file);
+      return NULL;
+    }
+  Playback *playback = calloc (1, sizeof (Playback));
+  playback->file = file;
+  playback->header = header;
+  playback->tiles_across = (header.width + IMAGE_TILE_SIZE - 1)
+                           >> IMAGE_TILE_SHIFT;
+  playback->tiles_down = (header.height + IMAGE_TILE_SIZE - 1)
+                         >> IMAGE_TILE_SHIFT;
+  playback->tiles
+      = calloc ((size_t)playback->tiles_across * playback->tiles_down,
+                RECORDER_TILE_BYTES);
+  *width = header.width;
+  *height = header.height;
+  return playback;
+}
+
+void
+playback_close (Playback *playback)
+{
+  if (playback == NULL)
+    {
+      return;
+    }
+  fclose (playback->file);
+  free (playback->tiles);
+  free (playback->data);
+  free (playback);
+}
+
+int
+playback_next (Playback *playback, uint8_t *pixels, double *seconds)
+{
+  const int tiles = playback->tiles_across * playback->tiles_down;
+  const int width = playback->header.width;
+  const int height = playback->header.height;
+  uint8_t delta[RECORDER_TILE_BYTES];
+  RecorderFrame frame;
+  size_t offset = 0;
+  uint32_t i;
+  int y;
+  if (fread (&frame, sizeof (frame), 1, playback->file) != 1)
+    {
+      return 0;
+    }
+  if (playback->data_capacity < frame.bytes)
+    {
+      playback->data_capacity = frame.bytes;
+      playback->data = realloc (playback->data, frame.bytes);
+    }
+  if (fread (playback->data, 1, frame.bytes, playback->file) != frame.bytes)
+    {
+      return 0;
+    }
+  if (frame.flags & RECORDER_FRAME_START)
+    {
+      memset (playback->tiles, 0, (size_t)tiles * RECORDER_TILE_BYTES);
+    }
+  for (i = 0; i < frame.tile_count; ++i)
+    {
+      RecorderTile tile;
+      int k;
+      if (offset + sizeof (tile) > frame.bytes)
+        {
+          return 0;
+        }
+      memcpy (&tile, playback->data + offset, sizeof (tile));
+      offset += sizeof (tile);
+      if (tile.index >= (uint32_t)tiles || tile.size > RECORDER_TILE_BYTES
+          || offset + tile.size > frame.bytes)
+        {
+          return 0;
+        }
+      if (tile.size == RECORDER_TILE_BYTES)
+        {
+          memcpy (delta, playback->data + offset, RECORDER_TILE_BYTES);
+        }
+      else
+        {
+          tile_decode (playback->data + offset, tile.size, 4, delta);
+        }
+      offset += tile.size;
+      uint8_t *to = playback->tiles + (size_t)tile.index * RECORDER_TILE_BYTES;
+      for (k = 0; k < RECORDER_TILE_BYTES; ++k)
+        {
+          to[k] ^= delta[k];
+        }
+    }
+  for (y = 0; y < height; ++y)
+    {
+      const int tile_y = y >> IMAGE_TILE_SHIFT;
+      const int row = y & IMAGE_TILE_MASK;
+      int tile_x;
+      for (tile_x = 0; tile_x < playback->tiles_across; ++tile_x)
+        {
+          const int x = tile_x << IMAGE_TILE_SHIFT;
+          memcpy (pixels + 4 * ((size_t)y * width + x),
+                  playback->tiles
+                      + (size_t)(tile_y * playback->tiles_across + tile_x)
+                            * RECORDER_TILE_BYTES
+                      + 4 * row * IMAGE_TILE_SIZE,
+                  4 * min (IMAGE_TILE_SIZE, width - x));
+        }
+    }
+  *seconds = frame.seconds;
+  return 1;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+
+#include "share.h"
+
+/* Time-lapse recording of a session. A background thread reads the
+   canvas published through a share as a reader like any other, so
+   painting never waits for it: it collects the areas that changed every
+   few milliseconds, and at every interval appends the tiles that differ
+   from the last frame to a file, as the XOR with their last contents, run
+   length coded. Frames of a painting session change a small part of the
+   canvas each and most of their tiles not at all, so the file takes a tiny
+   fraction of the frames it holds.
+
+   The file is a RecorderHeader followed by frames, each a RecorderFrame
+   followed by its tiles, each a RecorderTile followed by its bytes. */
+
+#define TIMELAPSE_EXTENSION ".timelapse"
+
+#define RECORDER_MAGIC "FLOATLAP"
+#define RECORDER_VERSION 1
+#define RECORDER_TILE_BYTES (4 * IMAGE_TILE_PIXELS) /* Of 8 bit RGBA. */
+#define RECORDER_FRAME_START 1 /* The tiles start out transparent. */
+
+typedef struct Recorder Recorder;
+typedef struct RecorderHeader RecorderHeader;
+typedef struct RecorderFrame RecorderFrame;
+typedef struct RecorderTile RecorderTile;
+typedef struct Playback Playback;
+
+struct RecorderHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_size;
+  int32_t width, height;
+};
+
+struct RecorderFrame
+{
+  uint32_t flags;
+  uint32_t tile_count;
+  uint64_t bytes;  /* Of the tiles that follow. */
+  double seconds; /* Since the start of the session. */
+};
+
+struct RecorderTile
+{
+  uint32_t index; /* Row by row, of tiles of tile_size pixels square. */
+  uint32_t size;  /* Not coded if RECORDER_TILE_BYTES. */
+};
+
+/* Append a frame of the canvas published by a share every interval of
+   seconds to a file, which is created unless it holds a recording of a
+   canvas of the same size, and then starts a new session. */
+Recorder *recorder_new (const char *file_name, const ShareHeader *share,
+                        double interval);
+
+/* Record the last changes and stop. */
+void recorder_del (Recorder *recorder);
+
+/* Read a recording from the start, NULL if it is none. */
+Playback *playback_open (const char *file_name, int *width, int *height);
+void playback_close (Playback *playback);
+
+/* Apply the next frame and write the canvas as straight 8 bit RGBA to
+   pixels, width by height of them. Returns 0 after the last one. */
+int playback_next (Playback *playback, uint8_t *pixels, double *seconds);
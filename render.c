@@ -0,0 +1,482 @@
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "brush_tip.h"
+#include "drawing.h"
+#include "fill.h"
+#include "filter.h"
+#include "selection.h"
+#include "stroke.h"
+#include "image.h"
+#include "tiff_io.h"
+#include "tile_cache.h"
+#include "trace.h"
+
+/* Render paintings without a display: each document is a file of painting
+   commands, applied to a new canvas or to the layers of a TIFF file, and
+   the result is saved as a TIFF file. Documents are rendered in parallel
+   by a pool of threads, one document per thread at a time. */
+
+#define RENDER_WIDTH_DEFAULT 400
+#define RENDER_HEIGHT_DEFAULT 400
+#define RENDER_STEP 1.0 /* Largest distance between brush samples. */
+
+typedef struct RenderJob RenderJob;
+
+struct RenderJob
+{
+  const char *commands;
+  const char *input; /* TIFF file to paint on, NULL for a new canvas. */
+  const char *output;
+  double scale; /* Of the output, painted again from the strokes. */
+};
+
+static int
+blend_mode_from_name (const char *name)
+{
+  int mode;
+  for (mode = 0; mode < BLEND_MODES; ++mode)
+    {
+      if (!strcmp (name, color_blend_modes[mode].name))
+        {
+          return mode;
+        }
+    }
+  return -1;
+}
+
+/* Only whitespace left. */
+static int
+is_blank (const char *text)
+{
+  return text[strspn (text, " \t\r\n")] == '\0';
+}
+
+/* Paint along points given as x y pressure, the first one putting the
+   brush down. Lines between them are split into steps like the samples of
+   a pen, which the brush spacing is made for. */
+static int
+render_stroke (FloatingDrawing *drawing, const char *arguments)
+{
+  double x, y;
+  float pressure, prev_pressure = 0.0f;
+  int offset;
+  int points = 0;
+  while (sscanf (arguments, "%lf %lf %f%n", &x, &y, &pressure, &offset) == 3)
+    {
+      const double start_x = points ? drawing->x : x;
+      const double start_y = points ? drawing->y : y;
+      const int steps
+          = max (1, ceil (hypot (x - start_x, y - start_y) / RENDER_STEP));
+      int step;
+      for (step = 1; step <= steps; ++step)
+        {
+          const double t = (double)step / steps;
+          const double prev_x = drawing->x;
+          const double prev_y = drawing->y;
+          const float step_pressure
+              = points ? prev_pressure + (pressure - prev_pressure) * t
+                       : pressure;
+          drawing->x = start_x + (x - start_x) * t;
+          drawing->y = start_y + (y - start_y) * t;
+          if (step_pressure > 0.0f)
+            {
+              drawing_paint (drawing, points ? prev_x : x,
+                             points ? prev_y : y, step_pressure);
+            }
+          tile_cache_trim (drawing->tile_cache);
+        }
+      prev_pressure = pressure;
+      arguments += offset;
+      ++points;
+    }
+  return points && is_blank (arguments);
+}
+
+/* Apply one line of a command file. Returns 0 if it is not valid. */
+static int
+render_command (FloatingDrawing *drawing, const char *line, int *width,
+                int *height)
+{
+  Brush *brush = drawing->active_brushes;
+  FloatingLayer *current;
+  char name[32], value[32];
+  int offset;
+  if (sscanf (line, " %31s%n", name, &offset) != 1 || name[0] == '#')
+    { /* Blank or a comment. */
+      return 1;
+    }
+  const char *arguments = line + offset;
+  if (!strcmp (name, "size"))
+    { /* Of a new canvas, before anything is painted. */
+      return !drawing->layer_count
+             && sscanf (arguments, "%d %d", width, height) == 2
+             && *width > 0 && *height > 0;
+    }
+  if (!drawing->layer_count)
+    {
+      drawing->tile_cache = tile_cache_new_for_canvas (*width, *height);
+      add_top_layer (drawing, *width, *height);
+    }
+  current = current_layer (drawing);
+  if (!strcmp (name, "stroke"))
+    {
+      return current != NULL && render_stroke (drawing, arguments);
+    }
+  if (!strcmp (name, "color"))
+    {
+      color c;
+      if (sscanf (arguments, "%f %f %f %f", &c.red, &c.green, &c.blue,
+                  &c.alpha)
+          != 4)
+        {
+          return 0;
+        }
+      drawing->color = drawing_working_color (drawing, c);
+      brush->color = drawing->color;
+      return 1;
+    }
+  if (!strcmp (name, "radius"))
+    {
+      return sscanf (arguments, "%lf", &brush->radius) == 1;
+    }
+  if (!strcmp (name, "hardness"))
+    {
+      return sscanf (arguments, "%lf", &brush->hardness) == 1;
+    }
+  if (!strcmp (name, "density"))
+    {
+      return sscanf (arguments, "%lf", &brush->density) == 1
+             && brush->density > 0;
+    }
+  if (!strcmp (name, "smudge"))
+    { /* An amount, 0 to stop smudging. */
+      if (sscanf (arguments, "%lf", &brush->smudge) != 1)
+        {
+          return 0;
+        }
+      brush->is_smudging = brush->smudge > 0;
+      if (!brush->is_smudging)
+        {
+          brush->color = drawing->color;
+        }
+      return 1;
+    }
+  if (!strcmp (name, "tip"))
+    { /* A TIFF file of the brush shape, or none for a round brush. */
+      char file_name[256];
+      BrushTip *tip = NULL;
+      if (sscanf (arguments, "%255s", file_name) != 1)
+        {
+          return 0;
+        }
+      if (strcmp (file_name, "none"))
+        {
+          tip = brush_tip_load (file_name);
+          if (tip == NULL)
+            {
+              return 0;
+            }
+        }
+      /* Recorded strokes keep the old tip until they are gone. */
+      brush_tip_del (brush->tip);
+      brush->tip = tip;
+      return 1;
+    }
+  if (!strcmp (name, "erase"))
+    {
+      return sscanf (arguments, "%d", &brush->is_erasing) == 1;
+    }
+  if (!strcmp (name, "mode") || !strcmp (name, "layer_mode"))
+    {
+      const int mode = sscanf (arguments, "%31s", value) == 1
+                           ? blend_mode_from_name (value)
+                           : -1;
+      if (mode < 0)
+        {
+          return 0;
+        }
+      if (name[0] == 'm')
+        {
+          drawing->blend_mode = mode;
+          brush->mode = mode;
+        }
+      else if (current != NULL)
+        {
+          current->mode = mode;
+        }
+      return 1;
+    }
+  if (!strcmp (name, "opacity"))
+    {
+      double alpha;
+      if (current == NULL || sscanf (arguments, "%lf", &alpha) != 1)
+        {
+          return 0;
+        }
+      current->alpha = alpha < 0 ? 0 : alpha > 1 ? 1 : alpha;
+      return 1;
+    }
+  if (!strcmp (name, "hide") || !strcmp (name, "show"))
+    {
+      if (current != NULL)
+        {
+          current->is_visible = name[0] == 's';
+        }
+      return is_blank (arguments);
+    }
+  if (!strcmp (name, "layer"))
+    {
+      add_top_layer (drawing, *width, *height);
+      return is_blank (arguments);
+    }
+  if (!strcmp (name, "select"))
+    {
+      int index;
+      if (sscanf (arguments, "%d", &index) != 1)
+        {
+          return 0;
+        }
+      select_layer (drawing, index);
+      return 1;
+    }
+  if (!strcmp (name, "merge"))
+    {
+      return merge_down (drawing) && is_blank (arguments);
+    }
+  if (!strcmp (name, "mask"))
+    { /* Change the selection: rect or ellipse x y width height, invert or
+         none. */
+      double x, y, w, h;
+      if (sscanf (arguments, "%31s%n", value, &offset) != 1)
+        {
+          return 0;
+        }
+      arguments += offset;
+      if (!strcmp (value, "none"))
+        {
+          selection_del (drawing->selection);
+          drawing->selection = NULL;
+          return is_blank (arguments);
+        }
+      if (drawing->selection == NULL)
+        {
+          drawing->selection = selection_new (*width, *height);
+          if (!strcmp (value, "invert"))
+            { /* Everything was selected, now nothing is. */
+              return is_blank (arguments);
+            }
+        }
+      if (!strcmp (value, "invert"))
+        {
+          selection_invert (drawing->selection);
+          return is_blank (arguments);
+        }
+      if (sscanf (arguments, "%lf %lf %lf %lf", &x, &y, &w, &h) != 4)
+        {
+          return 0;
+        }
+      if (!strcmp (value, "rect"))
+        {
+          selection_add_rect (drawing->selection, x, y, w, h);
+          return 1;
+        }
+      if (!strcmp (value, "ellipse"))
+        {
+          selection_add_ellipse (drawing->selection, x, y, w, h);
+          return 1;
+        }
+      return 0;
+    }
+  if (!strcmp (name, "fill"))
+    { /* From a position, optionally going by the composite. */
+      int x, y;
+      float tolerance;
+      if (current == NULL
+          || sscanf (arguments, "%d %d %f%n", &x, &y, &tolerance, &offset)
+                 != 3)
+        {
+          return 0;
+        }
+      arguments += offset;
+      const int is_sampling_composite
+          = sscanf (arguments, "%31s", value) == 1
+            && !strcmp (value, "composite");
+      flood_fill (drawing, x, y, tolerance, is_sampling_composite);
+      return is_sampling_composite || is_blank (arguments);
+    }
+  if (!strcmp (name, "blur") || !strcmp (name, "sharpen")
+      || !strcmp (name, "levels"))
+    {
+      double a, b = 1.0, c = 1.0;
+      const int count = sscanf (arguments, "%lf %lf %lf", &a, &b, &c);
+      Filter *filter;
+      if (current == NULL || count < 1)
+        {
+          return 0;
+        }
+      filter = name[0] == 'b'   ? filter_new_gaussian (a)
+               : name[0] == 's' ? filter_new_sharpen (a, b)
+                                : filter_new_levels (a, b, c);
+      filter_apply (filter, current->image, drawing->selection,
+                    layer_format_is_premultiplied (drawing));
+      filter_del (filter);
+      floating_layer_drop_strokes (current);
+      return 1;
+    }
+  if (!strcmp (name, "flatten"))
+    {
+      flatten (drawing);
+      return is_blank (arguments);
+    }
+  return 0;
+}
+
+static int
+render_document (const RenderJob *job)
+{
+  FloatingDrawing drawing;
+  Brush brush;
+  int width = RENDER_WIDTH_DEFAULT;
+  int height = RENDER_HEIGHT_DEFAULT;
+  unsigned int line_number = 0;
+  char *line = NULL;
+  size_t capacity = 0;
+  int is_valid = 1;
+  int i;
+  FILE *file = fopen (job->commands, "r");
+  if (file == NULL)
+    {
+      perror (job->commands);
+      return 0;
+    }
+  drawing_init (&drawing, &brush);
+  drawing.export_scale = job->scale != 1.0 ? job->scale : 0;
+  drawing.is_drawing = 1;
+  brush.is_drawing = 1;
+  if (job->input != NULL)
+    {
+      if (!tiff_io_load_layers (&drawing, job->input))
+        {
+          fprintf (stderr, "%s: no layers could be loaded\n", job->input);
+          fclose (file);
+          return 0;
+        }
+      width = drawing.layers[0]->image->width;
+      height = drawing.layers[0]->image->height;
+      drawing.tile_cache = tile_cache_new_for_canvas (width, height);
+      for (i = 0; i < drawing.layer_count; ++i)
+        {
+          tile_cache_adopt (drawing.tile_cache, drawing.layers[i]->image);
+        }
+    }
+  while (is_valid && getline (&line, &capacity, file) >= 0)
+    {
+      ++line_number;
+      is_valid = render_command (&drawing, line, &width, &height);
+      if (!is_valid)
+        {
+          fprintf (stderr, "%s:%u: invalid command: %s", job->commands,
+                   line_number, line);
+        }
+    }
+  free (line);
+  fclose (file);
+  if (is_valid)
+    {
+      is_valid = drawing.export_scale > 0
+                     ? strokes_save_scaled (&drawing, job->output,
+                                            drawing.export_scale)
+                     : tiff_io_save (&drawing, job->output, width, height);
+      if (is_valid)
+        {
+          printf ("Rendered %s to %s\n", job->commands, job->output);
+        }
+      else
+        {
+          fprintf (stderr, "%s: could not be saved\n", job->output);
+        }
+    }
+  del_all_layers (&drawing);
+  tile_cache_del (drawing.tile_cache);
+  brush_tip_del (brush.tip);
+  selection_del (drawing.selection);
+  return is_valid;
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr,
+           "Usage: %s [-j jobs] [-s scale] [-i input.tif] commands "
+           "output.tif [[-s scale] [-i input.tif] commands output.tif]...\n",
+           program);
+}
+
+int
+main (int argc, char **args)
+{
+  RenderJob *jobs = malloc (sizeof (RenderJob) * argc);
+  const char *input = NULL;
+  double scale = 1.0;
+  int job_count = 0;
+  int threads = 1;
+  int failures = 0;
+  int i;
+  for (i = 1; i < argc; ++i)
+    {
+      if (!strcmp (args[i], "-j") && i + 1 < argc)
+        {
+          threads = atoi (args[++i]);
+        }
+      else if (!strcmp (args[i], "-i") && i + 1 < argc)
+        {
+          input = args[++i];
+        }
+      else if (!strcmp (args[i], "-s") && i + 1 < argc)
+        {
+          scale = atof (args[++i]);
+        }
+      else if (args[i][0] != '-' && i + 1 < argc)
+        {
+          jobs[job_count].commands = args[i];
+          jobs[job_count].output = args[++i];
+          jobs[job_count].input = input;
+          jobs[job_count].scale = scale;
+          input = NULL;
+          ++job_count;
+        }
+      else
+        {
+          break;
+        }
+    }
+  if (i < argc || !job_count || threads < 1 || input != NULL || scale <= 0)
+    {
+      usage (args[0]);
+      free (jobs);
+      return 2;
+    }
+  const char *trace_file_name = getenv ("FLOATING_TRACE");
+  if (trace_file_name != NULL)
+    {
+      trace_open (trace_file_name);
+    }
+  /* With several documents at once each one is painted by a single
+     thread, the pool is the parallelism, and has a tile cache of its own
+     with its share of the memory. */
+  omp_set_max_active_levels (1);
+  tile_cache_share_budget (threads < job_count ? threads : job_count);
+#pragma omp parallel for schedule(dynamic) num_threads(threads)             \
+    reduction(+ : failures)
+  for (i = 0; i < job_count; ++i)
+    {
+      failures += !render_document (jobs + i);
+    }
+  trace_close ();
+  free (jobs);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,442 @@
+#include "selection.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t selection_none[IMAGE_TILE_SIZE];
+
+/* Update the runs of selected pixels from the tiles, skipping whole tiles
+   that are empty or full. */
+static void
+selection_update_spans (Selection *selection)
+{
+  int count = 0, capacity = selection->height;
+  int y;
+  free (selection->spans);
+  selection->spans = malloc (sizeof (SelectionSpan) * capacity);
+  for (y = 0; y < selection->height; ++y)
+    {
+      int is_in_span = 0;
+      unsigned int tx;
+      selection->rows[y] = count;
+      for (tx = 0; tx < selection->tiles_across; ++tx)
+        {
+          const int x0 = tx * IMAGE_TILE_SIZE;
+          const int n = selection->width - x0 < IMAGE_TILE_SIZE
+                            ? selection->width - x0
+                            : IMAGE_TILE_SIZE;
+          const uint8_t *tile
+              = selection->tiles[(y >> IMAGE_TILE_SHIFT)
+                                     * selection->tiles_across
+                                 + tx];
+          int i;
+          if (tile == NULL || tile == selection->full)
+            {
+              if ((tile != NULL) == is_in_span)
+                {
+                  continue;
+                }
+            }
+          for (i = 0; i < n; ++i)
+            {
+              const int is_selected
+                  = tile != NULL
+                    && tile[((y & IMAGE_TILE_MASK) << IMAGE_TILE_SHIFT) + i];
+              if (is_selected == is_in_span)
+                {
+                  continue;
+                }
+              if (is_selected)
+                {
+                  if (count == capacity)
+                    {
+                      capacity *= 2;
+                      selection->spans = realloc (
+                          selection->spans,
+                          sizeof (SelectionSpan) * capacity);
+                    }
+                  selection->spans[count].start = x0 + i;
+                }
+              else
+                {
+                  selection->spans[count++].end = x0 + i;
+                }
+              is_in_span = is_selected;
+              if (tile == NULL || tile == selection->full)
+                { /* The rest of the tile is the same. */
+                  break;
+                }
+            }
+        }
+      if (is_in_span)
+        {
+          selection->spans[count++].end = selection->width;
+        }
+    }
+  selection->rows[selection->height] = count;
+}
+
+Selection *
+selection_new (int width, int height)
+{
+  Selection *selection = malloc (sizeof (Selection));
+  selection->width = width;
+  selection->height = height;
+  selection->tiles_across = (width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+  selection->tiles_down = (height + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+  selection->tiles = calloc (
+      (size_t)selection->tiles_across * selection->tiles_down,
+      sizeof (uint8_t *));
+  selection->full = malloc (IMAGE_TILE_PIXELS);
+  memset (selection->full, 255, IMAGE_TILE_PIXELS);
+  selection->spans = NULL;
+  selection->rows = malloc (sizeof (int) * (height + 1));
+  selection_update_spans (selection);
+  return selection;
+}
+
+void
+selection_del (Selection *selection)
+{
+  size_t i;
+  if (selection == NULL)
+    {
+      return;
+    }
+  for (i = 0; i < (size_t)selection->tiles_across * selection->tiles_down;
+       ++i)
+    {
+      if (selection->tiles[i] != selection->full)
+        {
+          free (selection->tiles[i]);
+        }
+    }
+  free (selection->tiles);
+  free (selection->full);
+  free (selection->spans);
+  free (selection->rows);
+  free (selection);
+}
+
+/* A tile of its own to change. */
+static uint8_t *
+selection_tile_for_writing (Selection *selection, unsigned int index)
+{
+  uint8_t *tile = selection->tiles[index];
+  if (tile == NULL)
+    {
+      tile = calloc (IMAGE_TILE_PIXELS, 1);
+    }
+  else if (tile == selection->full)
+    {
+      tile = malloc (IMAGE_TILE_PIXELS);
+      memset (tile, 255, IMAGE_TILE_PIXELS);
+    }
+  selection->tiles[index] = tile;
+  return tile;
+}
+
+/* Let go of the memory of a changed tile if it is all or nothing. */
+static void
+selection_tile_settle (Selection *selection, unsigned int index)
+{
+  uint8_t *tile = selection->tiles[index];
+  int i;
+  if (tile == NULL || tile == selection->full)
+    {
+      return;
+    }
+  for (i = 1; i < IMAGE_TILE_PIXELS && tile[i] == tile[0]; ++i)
+    {
+    }
+  if (i == IMAGE_TILE_PIXELS && (tile[0] == 0 || tile[0] == 255))
+    {
+      selection->tiles[index] = tile[0] ? selection->full : NULL;
+      free (tile);
+    }
+}
+
+/* Raise the coverage of an area to what a function gives for each pixel,
+   tile by tile. Tiles the area covers entirely with full coverage become
+   full without looking at their pixels. */
+static void
+selection_add (Selection *selection, int x0, int y0, int x1, int y1,
+               uint8_t (*coverage) (const void *shape, int x, int y),
+               const void *shape, int is_solid)
+{
+  unsigned int tx, ty;
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 > selection->width ? selection->width : x1;
+  y1 = y1 > selection->height ? selection->height : y1;
+  if (x0 >= x1 || y0 >= y1)
+    {
+      return;
+    }
+  for (ty = y0 >> IMAGE_TILE_SHIFT;
+       ty <= (unsigned int)(y1 - 1) >> IMAGE_TILE_SHIFT; ++ty)
+    {
+      for (tx = x0 >> IMAGE_TILE_SHIFT;
+           tx <= (unsigned int)(x1 - 1) >> IMAGE_TILE_SHIFT; ++tx)
+        {
+          const unsigned int index = ty * selection->tiles_across + tx;
+          const int left = tx * IMAGE_TILE_SIZE, top = ty * IMAGE_TILE_SIZE;
+          const int right = left + IMAGE_TILE_SIZE;
+          const int bottom = top + IMAGE_TILE_SIZE;
+          const int from_x = x0 > left ? x0 : left;
+          const int from_y = y0 > top ? y0 : top;
+          const int to_x = x1 < right ? x1 : right;
+          const int to_y = y1 < bottom ? y1 : bottom;
+          uint8_t *tile;
+          int x, y;
+          if (selection->tiles[index] == selection->full)
+            {
+              continue;
+            }
+          if (is_solid && from_x == left && from_y == top && to_x == right
+              && to_y == bottom)
+            {
+              free (selection->tiles[index]);
+              selection->tiles[index] = selection->full;
+              continue;
+            }
+          tile = selection_tile_for_writing (selection, index);
+          for (y = from_y; y < to_y; ++y)
+            {
+              uint8_t *row = tile + ((y - top) << IMAGE_TILE_SHIFT);
+              for (x = from_x; x < to_x; ++x)
+                {
+                  const uint8_t value = coverage (shape, x, y);
+                  if (value > row[x - left])
+                    {
+                      row[x - left] = value;
+                    }
+                }
+            }
+          selection_tile_settle (selection, index);
+        }
+    }
+  selection_update_spans (selection);
+}
+
+static uint8_t
+rect_coverage (const void *shape, int x, int y)
+{
+  (void)shape;
+  (void)x;
+  (void)y;
+  return 255;
+}
+
+void
+selection_add_rect (Selection *selection, int x, int y, int width,
+                    int height)
+{
+  selection_add (selection, x, y, x + width, y + height, rect_coverage, NULL,
+                 1);
+}
+
+typedef struct Ellipse Ellipse;
+
+struct Ellipse
+{
+  double x, y; /* The center. */
+  double rx, ry;
+};
+
+/* About the distance from the edge, a pixel wide ramp across it. */
+static uint8_t
+ellipse_coverage (const void *shape, int x, int y)
+{
+  const Ellipse *ellipse = shape;
+  const double dx = (x + 0.5 - ellipse->x) / ellipse->rx;
+  const double dy = (y + 0.5 - ellipse->y) / ellipse->ry;
+  const double outside
+      = (sqrt (dx * dx + dy * dy) - 1) * fmin (ellipse->rx, ellipse->ry);
+  return lrint (fmin (fmax (0.5 - outside, 0), 1) * 255);
+}
+
+void
+selection_add_ellipse (Selection *selection, double x, double y,
+                       double width, double height)
+{
+  const Ellipse ellipse = { x + width / 2, y + height / 2, width / 2,
+                            height / 2 };
+  if (width <= 0 || height <= 0)
+    {
+      return;
+    }
+  selection_add (selection, floor (x), floor (y), ceil (x + width) + 1,
+                 ceil (y + height) + 1, ellipse_coverage, &ellipse, 0);
+}
+
+void
+selection_invert (Selection *selection)
+{
+  size_t i;
+  int k;
+  for (i = 0; i < (size_t)selection->tiles_across * selection->tiles_down;
+       ++i)
+    {
+      uint8_t *tile = selection->tiles[i];
+      if (tile == NULL || tile == selection->full)
+        {
+          selection->tiles[i] = tile == NULL ? selection->full : NULL;
+          continue;
+        }
+      for (k = 0; k < IMAGE_TILE_PIXELS; ++k)
+        {
+          tile[k] = 255 - tile[k];
+        }
+    }
+  selection_update_spans (selection);
+}
+
+/* Each tile packs to a byte saying whether nothing (0) or all (255) of it
+   is selected, or else (1) is followed by its coverage. */
+void *
+selection_pack (const Selection *selection, size_t *size)
+{
+  const size_t count
+      = (size_t)selection->tiles_across * selection->tiles_down;
+  uint8_t *packed, *p;
+  size_t i;
+  *size = count;
+  for (i = 0; i < count; ++i)
+    {
+      if (selection->tiles[i] != NULL
+          && selection->tiles[i] != selection->full)
+        {
+          *size += IMAGE_TILE_PIXELS;
+        }
+    }
+  packed = p = malloc (*size);
+  for (i = 0; i < count; ++i)
+    {
+      const uint8_t *tile = selection->tiles[i];
+      if (tile == NULL || tile == selection->full)
+        {
+          *p++ = tile == NULL ? 0 : 255;
+          continue;
+        }
+      *p++ = 1;
+      memcpy (p, tile, IMAGE_TILE_PIXELS);
+      p += IMAGE_TILE_PIXELS;
+    }
+  return packed;
+}
+
+Selection *
+selection_unpack (const void *packed, size_t size, int width, int height)
+{
+  Selection *selection = selection_new (width, height);
+  const uint8_t *p = packed, *end = p + size;
+  size_t i;
+  for (i = 0; i < (size_t)selection->tiles_across * selection->tiles_down;
+       ++i)
+    {
+      if (p == end || (*p == 1 && end - p <= IMAGE_TILE_PIXELS))
+        {
+          selection_del (selection);
+          return NULL;
+        }
+      if (*p == 1)
+        {
+          selection->tiles[i] = malloc (IMAGE_TILE_PIXELS);
+          memcpy (selection->tiles[i], p + 1, IMAGE_TILE_PIXELS);
+          p += 1 + IMAGE_TILE_PIXELS;
+          continue;
+        }
+      selection->tiles[i] = *p++ ? selection->full : NULL;
+    }
+  selection_update_spans (selection);
+  return selection;
+}
+
+const SelectionSpan *
+selection_row (const Selection *selection, int y, int *count)
+{
+  *count = selection->rows[y + 1] - selection->rows[y];
+  return selection->spans + selection->rows[y];
+}
+
+int
+selection_clip (const Selection *selection, int y, int *x, int end)
+{
+  const SelectionSpan *spans;
+  int low = 0, high;
+  if (selection == NULL)
+    {
+      return end;
+    }
+  spans = selection_row (selection, y, &high);
+  while (low < high)
+    { /* The first run ending after x. */
+      const int middle = (low + high) / 2;
+      if (spans[middle].end <= *x)
+        {
+          low = middle + 1;
+        }
+      else
+        {
+          high = middle;
+        }
+    }
+  if (low == selection->rows[y + 1] - selection->rows[y]
+      || spans[low].start >= end)
+    {
+      *x = end;
+      return end;
+    }
+  if (spans[low].start > *x)
+    {
+      *x = spans[low].start;
+    }
+  return spans[low].end < end ? spans[low].end : end;
+}
+
+const uint8_t *
+selection_pixels (const Selection *selection, int x, int y)
+{
+  const uint8_t *tile
+      = selection->tiles[(y >> IMAGE_TILE_SHIFT) * selection->tiles_across
+                         + (x >> IMAGE_TILE_SHIFT)];
+  if (tile == NULL)
+    {
+      return selection_none;
+    }
+  return tile + ((y & IMAGE_TILE_MASK) << IMAGE_TILE_SHIFT)
+         + (x & IMAGE_TILE_MASK);
+}
+
+void
+selection_mask (const Selection *selection, int x, int y, int n,
+                float *coverage)
+{
+  const unsigned int index = (y >> IMAGE_TILE_SHIFT)
+                                 * selection->tiles_across
+                             + (x >> IMAGE_TILE_SHIFT);
+  const uint8_t *pixels = selection_pixels (selection, x, y);
+  int i;
+  if (selection->tiles[index] == selection->full)
+    {
+      return;
+    }
+  for (i = 0; i < n; ++i)
+    {
+      coverage[i] *= pixels[i] * (1.0f / 255);
+    }
+}
+
+int
+selection_tile_is_empty (const Selection *selection, unsigned int index)
+{
+  return selection->tiles[index] == NULL;
+}
+
+int
+selection_tile_is_full (const Selection *selection, unsigned int index)
+{
+  return selection->tiles[index] == selection->full;
+}
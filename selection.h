@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+
+#include "image.h"
+
+/* A selection limits painting, filling and filters to part of the canvas.
+   Its coverage is kept in 8 bit tiles like those of a layer, where a tile
+   nothing of is selected has no memory and one all of is selected shares a
+   single full tile. The selected pixels of each row are also kept as runs,
+   so painting clips a row to them and skips what is outside without
+   looking at the coverage at all. */
+
+typedef struct Selection Selection;
+typedef struct SelectionSpan SelectionSpan;
+
+struct SelectionSpan
+{
+  int start, end; /* Pixels with some coverage, end excluded. */
+};
+
+struct Selection
+{
+  int width, height;
+  unsigned int tiles_across, tiles_down;
+  uint8_t **tiles; /* NULL where nothing is selected. */
+  uint8_t *full;   /* The tile where all is selected. */
+  SelectionSpan *spans;
+  int *rows; /* Index of the first span of each row, then the end. */
+};
+
+/* A selection of nothing on a canvas of this size. */
+Selection *selection_new (int width, int height);
+void selection_del (Selection *selection);
+
+/* Add an area to what is selected, an ellipse with smooth edges. */
+void selection_add_rect (Selection *selection, int x, int y, int width,
+                         int height);
+void selection_add_ellipse (Selection *selection, double x, double y,
+                            double width, double height);
+
+/* Select what was not, and the other way around. */
+void selection_invert (Selection *selection);
+
+/* The selection as bytes, to keep and make again later. NULL if the bytes
+   are not of a selection of this size. */
+void *selection_pack (const Selection *selection, size_t *size);
+Selection *selection_unpack (const void *packed, size_t size, int width,
+                             int height);
+
+/* The runs of selected pixels of a row, left to right. */
+const SelectionSpan *selection_row (const Selection *selection, int y,
+                                    int *count);
+
+/* Move x on to the next selected pixel of a row before end and return
+   where its run stops, no later than end. If there is none x becomes end.
+   Without a selection (NULL) everything is selected. */
+int selection_clip (const Selection *selection, int y, int *x, int end);
+
+/* The coverage of the pixels from x to the end of its tile row, 255
+   standing for selected. */
+const uint8_t *selection_pixels (const Selection *selection, int x, int y);
+
+/* Multiply n coverages by the selection, within a tile row. */
+void selection_mask (const Selection *selection, int x, int y, int n,
+                     float *coverage);
+
+/* Whether a tile of the canvas has nothing selected, or all of it. */
+int selection_tile_is_empty (const Selection *selection, unsigned int index);
+int selection_tile_is_full (const Selection *selection, unsigned int index);
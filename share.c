@@ -0,0 +1,389 @@
+#include "share.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARE_CHUNK 256 /* Pixels of a row converted at a time. */
+
+struct Share
+{
+  char *name;
+  ShareHeader *header;
+  size_t size;
+  uint8_t *buffers[2];
+  int back;        /* Buffer of the frame being written. */
+  uint32_t sequence; /* Its sequence number, odd. */
+};
+
+static size_t
+page_round (size_t size)
+{
+  const size_t page = sysconf (_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+Share *
+share_new (const char *name, int width, int height, ShareFormat format,
+           int is_linear)
+{
+  const size_t pixel_bytes
+      = format == SHARE_FORMAT_FLOAT ? sizeof (color) : 4;
+  const size_t buffer_bytes = page_round (pixel_bytes * width * height);
+  const size_t header_bytes = page_round (sizeof (ShareHeader));
+  const size_t size = header_bytes + 2 * buffer_bytes;
+  void *memory;
+  Share *share;
+  if (name == NULL)
+    {
+      memory = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+  else
+    {
+      int fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0)
+        {
+          perror ("Could not create shared memory");
+          return NULL;
+        }
+      if (ftruncate (fd, size))
+        {
+          perror ("Could not size shared memory");
+          close (fd);
+          shm_unlink (name);
+          return NULL;
+        }
+      memory = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close (fd);
+    }
+  if (memory == MAP_FAILED)
+    {
+      perror ("Could not map shared memory");
+      if (name != NULL)
+        {
+          shm_unlink (name);
+        }
+      return NULL;
+    }
+  share = malloc (sizeof (Share));
+  share->name = name != NULL ? strdup (name) : NULL;
+  share->header = memory;
+  share->size = size;
+  share->buffers[0] = (uint8_t *)memory + header_bytes;
+  share->buffers[1] = share->buffers[0] + buffer_bytes;
+  share->back = 1;
+  share->header->format = format;
+  share->header->pixel_bytes = pixel_bytes;
+  share->header->width = width;
+  share->header->height = height;
+  share->header->is_linear = is_linear;
+  share->header->buffer_offsets[0] = header_bytes;
+  share->header->buffer_offsets[1] = header_bytes + buffer_bytes;
+  atomic_init (&share->header->sequences[0], 0);
+  atomic_init (&share->header->sequences[1], 0);
+  atomic_init (&share->header->generation, 0);
+  /* Last, readers check it before anything else. */
+  atomic_store_explicit (&share->header->magic, SHARE_MAGIC,
+                         memory_order_release);
+  if (name != NULL)
+    {
+      printf ("Publishing the canvas in shared memory %s\n", name);
+    }
+  return share;
+}
+
+void
+share_del (Share *share)
+{
+  if (share == NULL)
+    {
+      return;
+    }
+  if (share->name != NULL)
+    {
+      shm_unlink (share->name);
+    }
+  munmap (share->header, share->size);
+  free (share->name);
+  free (share);
+}
+
+ShareFormat
+share_format_from_env (void)
+{
+  const char *format = getenv ("FLOATING_SHARE_FORMAT");
+  return format != NULL && !strcmp (format, "float") ? SHARE_FORMAT_FLOAT
+                                                      : SHARE_FORMAT_BGRA8;
+}
+
+/* Copy an area from the buffer readers are sent to, to the other one. */
+static void
+share_copy_area (Share *share, ShareRect area)
+{
+  const size_t pixel_bytes = share->header->pixel_bytes;
+  const size_t stride = pixel_bytes * share->header->width;
+  const uint8_t *from = share->buffers[share->back ^ 1];
+  uint8_t *to = share->buffers[share->back];
+  int y;
+#pragma omp parallel for
+  for (y = area.y; y < area.y + area.height; ++y)
+    {
+      memcpy (to + y * stride + area.x * pixel_bytes,
+              from + y * stride + area.x * pixel_bytes,
+              area.width * pixel_bytes);
+    }
+}
+
+void
+share_begin (Share *share)
+{
+  ShareHeader *header = share->header;
+  const uint64_t generation
+      = atomic_load_explicit (&header->generation, memory_order_relaxed);
+  share->back = (generation + 1) & 1;
+  share->sequence = atomic_load_explicit (&header->sequences[share->back],
+                                          memory_order_relaxed)
+                    + 1;
+  atomic_store_explicit (&header->sequences[share->back], share->sequence,
+                         memory_order_relaxed);
+  /* Readers that see anything written from here on see the odd sequence
+     number, or a generation past the changes about to be replaced. */
+  atomic_thread_fence (memory_order_release);
+  if (generation)
+    { /* The back buffer is missing the last frame. */
+      share_copy_area (share, header->changes[generation % SHARE_HISTORY]);
+    }
+}
+
+/* The straight 8 bit sRGB BGRA of premultiplied colors. */
+static void
+colors_to_bgra (uint8_t *bgra, color *colors, int n, int is_linear)
+{
+  int i;
+  color_span_unpremultiply (colors, n);
+  if (is_linear)
+    {
+      color_span_to_srgb8 (bgra, colors, n);
+    }
+  else
+    {
+      color_span_to_uint8 (bgra, colors, n);
+    }
+  for (i = 0; i < n; ++i)
+    {
+      const uint8_t red = bgra[4 * i];
+      bgra[4 * i] = bgra[4 * i + 2];
+      bgra[4 * i + 2] = red;
+    }
+}
+
+static uint8_t *
+share_pixel (const Share *share, int x, int y)
+{
+  const ShareHeader *header = share->header;
+  return share->buffers[share->back]
+         + ((size_t)y * header->width + x) * header->pixel_bytes;
+}
+
+void
+share_write_row (Share *share, const color *row, int x, int y, int width,
+                 int is_premultiplied)
+{
+  color chunk[SHARE_CHUNK] __attribute__ ((aligned (16)));
+  int i;
+  for (i = 0; i < width; i += SHARE_CHUNK)
+    {
+      const int n = width - i < SHARE_CHUNK ? width - i : SHARE_CHUNK;
+      memcpy (chunk, row + i, sizeof (color) * n);
+      if (!is_premultiplied)
+        {
+          color_span_premultiply (chunk, n);
+        }
+      if (share->header->format == SHARE_FORMAT_FLOAT)
+        {
+          memcpy (share_pixel (share, x + i, y), chunk, sizeof (color) * n);
+        }
+      else
+        {
+          colors_to_bgra (share_pixel (share, x + i, y), chunk, n,
+                          share->header->is_linear);
+        }
+    }
+}
+
+void
+share_write_row16 (Share *share, const uint16_t *row, int x, int y,
+                   int width)
+{
+  color chunk[SHARE_CHUNK] __attribute__ ((aligned (16)));
+  int i;
+  for (i = 0; i < width; i += SHARE_CHUNK)
+    {
+      const int n = width - i < SHARE_CHUNK ? width - i : SHARE_CHUNK;
+      pixel16_span_to_color (chunk, row + 4 * i, n);
+      if (share->header->format == SHARE_FORMAT_FLOAT)
+        {
+          memcpy (share_pixel (share, x + i, y), chunk, sizeof (color) * n);
+        }
+      else
+        {
+          colors_to_bgra (share_pixel (share, x + i, y), chunk, n,
+                          share->header->is_linear);
+        }
+    }
+}
+
+void
+share_end (Share *share, rect area)
+{
+  ShareHeader *header = share->header;
+  const uint64_t generation
+      = atomic_load_explicit (&header->generation, memory_order_relaxed)
+        + 1;
+  ShareRect *change = header->changes + generation % SHARE_HISTORY;
+  change->x = max (area.x, 0);
+  change->y = max (area.y, 0);
+  change->width = max (min (area.x + area.width, header->width) - change->x,
+                       0);
+  change->height
+      = max (min (area.y + area.height, header->height) - change->y, 0);
+  atomic_store_explicit (&header->sequences[share->back],
+                         share->sequence + 1, memory_order_release);
+  atomic_store_explicit (&header->generation, generation,
+                         memory_order_release);
+}
+
+const ShareHeader *
+share_attach (const char *name)
+{
+  struct stat status;
+  const ShareHeader *header;
+  int fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+    {
+      perror ("Could not open shared memory");
+      return NULL;
+    }
+  if (fstat (fd, &status) || (size_t)status.st_size < sizeof (ShareHeader))
+    {
+      fprintf (stderr, "Shared memory %s holds no canvas\n", name);
+      close (fd);
+      return NULL;
+    }
+  header = mmap (NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (header == MAP_FAILED)
+    {
+      perror ("Could not map shared memory");
+      return NULL;
+    }
+  if (atomic_load_explicit (&((ShareHeader *)header)->magic,
+                            memory_order_acquire)
+          != SHARE_MAGIC
+      || (size_t)status.st_size < header->buffer_offsets[1]
+                                      + (size_t)header->pixel_bytes
+                                            * header->width * header->height)
+    {
+      fprintf (stderr, "Shared memory %s holds no canvas\n", name);
+      munmap ((void *)header, status.st_size);
+      return NULL;
+    }
+  return header;
+}
+
+const ShareHeader *
+share_header (const Share *share)
+{
+  return share->header;
+}
+
+void
+share_detach (const ShareHeader *header)
+{
+  munmap ((void *)header, header->buffer_offsets[1]
+                              + (size_t)header->pixel_bytes * header->width
+                                    * header->height);
+}
+
+uint64_t
+share_read_begin (const ShareHeader *header, const void **pixels,
+                  uint32_t *sequence)
+{
+  ShareHeader *shared = (ShareHeader *)header;
+  for (;;)
+    {
+      const uint64_t generation
+          = atomic_load_explicit (&shared->generation, memory_order_acquire);
+      const int buffer = generation & 1;
+      *sequence = atomic_load_explicit (&shared->sequences[buffer],
+                                        memory_order_acquire);
+      if (!(*sequence & 1))
+        {
+          *pixels = (const uint8_t *)header + header->buffer_offsets[buffer];
+          return generation;
+        }
+      /* The painter got two frames further meanwhile. */
+    }
+}
+
+int
+share_read_end (const ShareHeader *header, uint64_t generation,
+                uint32_t sequence)
+{
+  ShareHeader *shared = (ShareHeader *)header;
+  atomic_thread_fence (memory_order_acquire);
+  return atomic_load_explicit (&shared->sequences[generation & 1],
+                               memory_order_relaxed)
+         == sequence;
+}
+
+ShareRect
+share_changes (const ShareHeader *header, uint64_t since,
+               uint64_t generation)
+{
+  ShareHeader *shared = (ShareHeader *)header;
+  const ShareRect all = { 0, 0, header->width, header->height };
+  ShareRect area = { 0, 0, 0, 0 };
+  uint64_t frame;
+  if (generation <= since)
+    {
+      return area;
+    }
+  if (generation - since >= SHARE_HISTORY)
+    {
+      return all;
+    }
+  for (frame = since + 1; frame <= generation; ++frame)
+    {
+      const ShareRect change = header->changes[frame % SHARE_HISTORY];
+      if (!change.width || !change.height)
+        {
+          continue;
+        }
+      if (!area.width || !area.height)
+        {
+          area = change;
+          continue;
+        }
+      const int x1 = max (area.x + area.width, change.x + change.width);
+      const int y1 = max (area.y + area.height, change.y + change.height);
+      area.x = min (area.x, change.x);
+      area.y = min (area.y, change.y);
+      area.width = x1 - area.x;
+      area.height = y1 - area.y;
+    }
+  /* The change of frame since + 1 is replaced once the painter is past
+     frame since + SHARE_HISTORY. */
+  atomic_thread_fence (memory_order_acquire);
+  if (atomic_load_explicit (&shared->generation, memory_order_relaxed)
+      >= since + SHARE_HISTORY)
+    {
+      return all;
+    }
+  return area;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "drawing.h"
+
+/* The composited canvas published in POSIX shared memory, for capture and
+   streaming tools on the same machine to map instead of reading the
+   window. The canvas is without the background and anything else shown
+   on top of it, in one of two formats. There are two buffers of it: each
+   frame is written to the one readers are not sent to, brought up to date
+   with the frame before it, and then published. Readers never wait for
+   the painter nor it for them, a sequence number per buffer tells them
+   when what they read was written over meanwhile.
+
+   Reading a frame:
+     generation = share_read_begin (header, &pixels, &sequence);
+     ...copy or use the pixels, those of share_changes (header, since,
+     generation) being all that changed after frame since...
+     if (!share_read_end (header, generation, sequence)) read again. */
+
+#define SHARE_MAGIC 0x74616f6c66 /* "float" */
+#define SHARE_HISTORY 64 /* Frames whose changed areas are kept. */
+
+typedef enum ShareFormat
+{
+  SHARE_FORMAT_BGRA8 = 0, /* Straight sRGB, 8 bits per channel. */
+  SHARE_FORMAT_FLOAT,     /* Premultiplied RGBA, a float per channel, in
+                             linear light if is_linear is set. */
+} ShareFormat;
+
+typedef struct Share Share;
+typedef struct ShareHeader ShareHeader;
+typedef struct ShareRect ShareRect;
+
+struct ShareRect
+{
+  int32_t x, y, width, height;
+};
+
+/* At the start of the shared memory, followed by the buffers, rows of
+   width pixels without padding. */
+struct ShareHeader
+{
+  _Atomic uint64_t magic; /* Set last, once the rest is. */
+  uint32_t format; /* A ShareFormat. */
+  uint32_t pixel_bytes;
+  uint32_t width, height;
+  uint32_t is_linear; /* Of the canvas, BGRA8 is always sRGB. */
+  uint32_t reserved;
+  uint64_t buffer_offsets[2]; /* From the start of the shared memory. */
+  _Atomic uint64_t generation; /* Frames published, the last one is in
+                                  buffer generation & 1. */
+  _Atomic uint32_t sequences[2]; /* Of each buffer, odd while written. */
+  ShareRect changes[SHARE_HISTORY]; /* By frame g in changes[g % HISTORY]. */
+};
+
+/* Create a shared memory object of a name like "/floating" for a canvas,
+   or NULL if that fails. Both buffers start out transparent. Without a
+   name the memory is only shared with threads of this process. Rows of a
+   canvas in linear light are converted to sRGB for BGRA8. */
+Share *share_new (const char *name, int width, int height,
+                  ShareFormat format, int is_linear);
+
+/* Unlink the object, readers that mapped it keep their mapping. */
+void share_del (Share *share);
+
+/* The format asked for by FLOATING_SHARE_FORMAT, "float" or BGRA8. */
+ShareFormat share_format_from_env (void);
+
+/* Start a frame, after which rows of it can be written, from several
+   threads, then end it with the area of the canvas that changed. */
+void share_begin (Share *share);
+void share_write_row (Share *share, const color *row, int x, int y,
+                      int width, int is_premultiplied);
+void share_write_row16 (Share *share, const uint16_t *row, int x, int y,
+                        int width);
+void share_end (Share *share, rect area);
+
+/* For readers in this process. */
+const ShareHeader *share_header (const Share *share);
+
+/* Map the object of another process read only, NULL if that fails. */
+const ShareHeader *share_attach (const char *name);
+void share_detach (const ShareHeader *header);
+
+/* The last frame published, its pixels and the sequence number of their
+   buffer. */
+uint64_t share_read_begin (const ShareHeader *header, const void **pixels,
+                           uint32_t *sequence);
+
+/* Whether the pixels read since share_read_begin were not written over. */
+int share_read_end (const ShareHeader *header, uint64_t generation,
+                    uint32_t sequence);
+
+/* The smallest area holding what changed after frame since up to frame
+   generation, the whole canvas if those frames are no longer kept. */
+ShareRect share_changes (const ShareHeader *header, uint64_t since,
+                         uint64_t generation);
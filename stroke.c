@@ -0,0 +1,345 @@
+#include "stroke.h"
+#include "brush_tip.h"
+#include "tiff_io.h"
+#include "tile_cache.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STROKE_BLOCK 4 /* Tiles across a block painted by one thread. */
+
+Strokes *
+strokes_new (void)
+{
+  return calloc (1, sizeof (Strokes));
+}
+
+void
+strokes_del (Strokes *strokes)
+{
+  size_t i;
+  if (strokes == NULL)
+    {
+      return;
+    }
+  for (i = 0; i < strokes->count; ++i)
+    {
+      int k;
+      for (k = 0; k < strokes->strokes[i].brush_count; ++k)
+        {
+          brush_tip_del (strokes->strokes[i].brushes[k].tip);
+        }
+      free (strokes->strokes[i].brushes);
+      free (strokes->strokes[i].samples);
+    }
+  free (strokes->strokes);
+  free (strokes);
+}
+
+/* Whether a brush paints pixels, picking only looks at them. */
+static int
+brush_paints (const Brush *brush)
+{
+  return brush->is_drawing && !brush->is_picking;
+}
+
+/* Whether a stroke was painted with the brushes as they are now. Strokes
+   hold their tips, so no other tip can be at the address of one. */
+static int
+stroke_has_brushes (const Stroke *stroke, const Brush *brush)
+{
+  int i = 0;
+  for (; brush != NULL; brush = brush->next)
+    {
+      if (!brush_paints (brush))
+        {
+          continue;
+        }
+      if (i == stroke->brush_count)
+        {
+          return 0;
+        }
+      const Brush *other = stroke->brushes + i++;
+      if (other->radius != brush->radius
+          || other->hardness != brush->hardness
+          || other->density != brush->density || other->mode != brush->mode
+          || other->is_erasing != brush->is_erasing
+          || other->tip != brush->tip
+          || memcmp (&other->color, &brush->color, sizeof (color))
+          || memcmp (&other->medium_color, &brush->medium_color,
+                     sizeof (color)))
+        {
+          return 0;
+        }
+    }
+  return i == stroke->brush_count;
+}
+
+static void
+stroke_add_sample (Stroke *stroke, double x, double y, float pressure)
+{
+  const float reach = fabsf (pressure);
+  int i;
+  if (stroke->sample_count == stroke->sample_capacity)
+    {
+      stroke->sample_capacity = stroke->sample_capacity * 2 + 16;
+      stroke->samples
+          = realloc (stroke->samples,
+                     sizeof (StrokeSample) * stroke->sample_capacity);
+    }
+  stroke->samples[stroke->sample_count].x = x;
+  stroke->samples[stroke->sample_count].y = y;
+  stroke->samples[stroke->sample_count].pressure = pressure;
+  if (!stroke->sample_count++)
+    {
+      stroke->left = stroke->right = x;
+      stroke->top = stroke->bottom = y;
+    }
+  stroke->left = fminf (stroke->left, x);
+  stroke->right = fmaxf (stroke->right, x);
+  stroke->top = fminf (stroke->top, y);
+  stroke->bottom = fmaxf (stroke->bottom, y);
+  for (i = 0; i < stroke->brush_count; ++i)
+    {
+      stroke->reach
+          = fmaxf (stroke->reach, stroke->brushes[i].radius * reach);
+    }
+}
+
+void
+strokes_add (Strokes *strokes, const Brush *brushes, double prev_x,
+             double prev_y, double x, double y, float pressure)
+{
+  Stroke *stroke
+      = strokes->count ? strokes->strokes + strokes->count - 1 : NULL;
+  const Brush *brush;
+  if (stroke != NULL
+      && stroke->samples[stroke->sample_count - 1].x == (float)prev_x
+      && stroke->samples[stroke->sample_count - 1].y == (float)prev_y
+      && stroke_has_brushes (stroke, brushes))
+    {
+      stroke_add_sample (stroke, x, y, pressure);
+      return;
+    }
+  if (strokes->count == strokes->capacity)
+    {
+      strokes->capacity = strokes->capacity * 2 + 16;
+      strokes->strokes
+          = realloc (strokes->strokes, sizeof (Stroke) * strokes->capacity);
+    }
+  stroke = strokes->strokes + strokes->count++;
+  memset (stroke, 0, sizeof (Stroke));
+  for (brush = brushes; brush != NULL; brush = brush->next)
+    {
+      if (brush_paints (brush))
+        {
+          const size_t bytes = sizeof (Brush) * (stroke->brush_count + 1);
+          stroke->brushes = realloc (stroke->brushes, bytes);
+          stroke->brushes[stroke->brush_count] = *brush;
+          brush_tip_ref (brush->tip);
+          stroke->brushes[stroke->brush_count++].next = NULL;
+        }
+    }
+  stroke_add_sample (stroke, prev_x, prev_y, pressure);
+  stroke_add_sample (stroke, x, y, pressure);
+}
+
+size_t
+strokes_bytes (const Strokes *strokes)
+{
+  size_t bytes = sizeof (Strokes) + strokes->capacity * sizeof (Stroke);
+  size_t i;
+  for (i = 0; i < strokes->count; ++i)
+    {
+      bytes += strokes->strokes[i].brush_count * sizeof (Brush)
+               + strokes->strokes[i].sample_capacity * sizeof (StrokeSample);
+    }
+  return bytes;
+}
+
+/* Paint the strokes that reach a block of the image on a canvas of its
+   own, then copy the tiles that got paint into the image. */
+static void
+strokes_paint_block (const Strokes *strokes, image_t *image,
+                     int is_premultiplied, double scale, int left, int top,
+                     int size)
+{
+  image_t *block = NULL;
+  size_t i, k;
+  unsigned int tx, ty;
+  for (i = 0; i < strokes->count; ++i)
+    {
+      const Stroke *stroke = strokes->strokes + i;
+      const double reach = stroke->reach * scale + 1;
+      if (stroke->right * scale + reach < left
+          || stroke->left * scale - reach >= left + size
+          || stroke->bottom * scale + reach < top
+          || stroke->top * scale - reach >= top + size)
+        {
+          continue;
+        }
+      for (k = 1; k < stroke->sample_count; ++k)
+        {
+          const StrokeSample *from = stroke->samples + k - 1;
+          const StrokeSample *to = stroke->samples + k;
+          int b;
+          if (fmax (from->x, to->x) * scale + reach < left
+              || fmin (from->x, to->x) * scale - reach >= left + size
+              || fmax (from->y, to->y) * scale + reach < top
+              || fmin (from->y, to->y) * scale - reach >= top + size)
+            {
+              continue;
+            }
+          if (block == NULL)
+            {
+              block = image->format == IMAGE_FORMAT_UINT16
+                          ? image_new_uint16 (size, size)
+                          : image_new (size, size);
+            }
+          for (b = 0; b < stroke->brush_count; ++b)
+            {
+              brush_paint_segment (stroke->brushes + b, block,
+                                   is_premultiplied, from->x, from->y,
+                                   to->x, to->y, to->pressure, scale, left,
+                                   top);
+            }
+        }
+    }
+  if (block == NULL)
+    {
+      return;
+    }
+  for (ty = 0; ty < block->tiles_down; ++ty)
+    {
+      for (tx = 0; tx < block->tiles_across; ++tx)
+        {
+          const unsigned int x = (left >> IMAGE_TILE_SHIFT) + tx;
+          const unsigned int y = (top >> IMAGE_TILE_SHIFT) + ty;
+          const unsigned int index = y * image->tiles_across + x;
+          const color *tile
+              = image_tile (block, ty * block->tiles_across + tx);
+          if (x >= image->tiles_across || y >= image->tiles_down
+              || tile_is_empty (tile, image_tile_bytes (image)))
+            {
+              continue;
+            }
+          memcpy ((void *)image_tile (image, index), tile,
+                  image_tile_bytes (image));
+          image->tile_flags[index] |= IMAGE_TILE_DIRTY | IMAGE_TILE_STALE;
+        }
+    }
+  image_del (block);
+}
+
+void
+strokes_rasterize (const Strokes *strokes, image_t *image,
+                   int is_premultiplied, double scale)
+{
+  const int size = STROKE_BLOCK * IMAGE_TILE_SIZE;
+  const int across = (image->width + size - 1) / size;
+  const int down = (image->height + size - 1) / size;
+  int row;
+  for (row = 0; row < down; ++row)
+    {
+      int column;
+#pragma omp parallel for schedule(dynamic)
+      for (column = 0; column < across; ++column)
+        {
+          strokes_paint_block (strokes, image, is_premultiplied, scale,
+                               column * size, row * size, size);
+        }
+      tile_cache_trim (image->cache);
+    }
+}
+
+/* Scale the pixels of a layer without strokes, each taken from the nearest
+   one. */
+static void
+scale_pixels (const image_t *from, image_t *to, double scale)
+{
+  const int is_uint16 = from->format == IMAGE_FORMAT_UINT16;
+  unsigned int y;
+  for (y = 0; y < to->height; y += IMAGE_TILE_SIZE)
+    {
+      const unsigned int rows = to->height - y < IMAGE_TILE_SIZE
+                                    ? to->height - y
+                                    : IMAGE_TILE_SIZE;
+      unsigned int i;
+#pragma omp parallel for
+      for (i = 0; i < rows; ++i)
+        {
+          const unsigned int from_y
+              = fmin ((y + i) / scale, from->height - 1);
+          unsigned int x;
+          for (x = 0; x < to->width; ++x)
+            {
+              const unsigned int from_x = fmin (x / scale, from->width - 1);
+              if (is_uint16)
+                {
+                  memcpy (image_pixel16 (to, x, y + i),
+                          image_pixel16 (from, from_x, from_y),
+                          4 * sizeof (uint16_t));
+                }
+              else
+                {
+                  *image_pixel (to, x, y + i)
+                      = *image_pixel (from, from_x, from_y);
+                }
+            }
+        }
+      image_mark (to, 0, y, to->width, rows, IMAGE_TILE_DIRTY);
+      tile_cache_trim (to->cache);
+      tile_cache_trim (from->cache);
+    }
+}
+
+int
+strokes_save_scaled (const FloatingDrawing *drawing,
+                     const char *file_name, double scale)
+{
+  FloatingDrawing scaled;
+  Brush brush;
+  int i, is_saved;
+  if (!drawing->layer_count)
+    {
+      return 0;
+    }
+  const int width = lrint (drawing->layers[0]->image->width * scale);
+  const int height = lrint (drawing->layers[0]->image->height * scale);
+  drawing_init (&scaled, &brush);
+  scaled.layer_format = drawing->layer_format;
+  scaled.thumbnail_size = drawing->thumbnail_size;
+  scaled.export_scale = 0;
+  scaled.tile_cache = tile_cache_new_for_canvas (width, height);
+  for (i = 0; i < drawing->layer_count; ++i)
+    {
+      const FloatingLayer *layer = drawing->layers[i];
+      add_top_layer (&scaled, width, height);
+      FloatingLayer *copy = current_layer (&scaled);
+      copy->alpha = layer->alpha;
+      copy->is_visible = layer->is_visible;
+      copy->mode = layer->mode;
+      if (!layer->is_visible)
+        {
+          continue;
+        }
+      if (layer->strokes != NULL)
+        {
+          strokes_rasterize (layer->strokes, copy->image,
+                             layer_format_is_premultiplied (drawing), scale);
+        }
+      else
+        {
+          printf ("Layer %d was not only painted with strokes, scaling its "
+                  "pixels\n",
+                  i);
+          scale_pixels (layer->image, copy->image, scale);
+        }
+    }
+  is_saved = tiff_io_save (&scaled, file_name, width, height);
+  del_all_layers (&scaled);
+  tile_cache_del (scaled.tile_cache);
+  return is_saved;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stddef.h>
+
+#include "drawing.h"
+
+/* Strokes kept as the samples of the pointer and the brushes that painted
+   them, instead of only as their pixels, so that a layer can be painted
+   again at any scale. A layer has them as long as nothing but strokes
+   changed it: fills, filters, merges, smudging and painting through a
+   selection forget them. */
+
+#define SCALED_EXTENSION ".scaled.tif"
+
+typedef struct Stroke Stroke;
+typedef struct StrokeSample StrokeSample;
+
+struct StrokeSample
+{
+  float x, y;
+  float pressure; /* Of the segment ending here. */
+};
+
+struct Stroke
+{
+  Brush *brushes; /* Copies of the brushes that painted it, in order,
+                     each holding a reference to its tip. */
+  int brush_count;
+  StrokeSample *samples;
+  size_t sample_count, sample_capacity;
+  float left, top, right, bottom; /* Around the samples. */
+  float reach; /* The largest radius of a dab, for the pressure. */
+};
+
+struct Strokes
+{
+  Stroke *strokes;
+  size_t count, capacity;
+};
+
+Strokes *strokes_new (void);
+void strokes_del (Strokes *strokes);
+
+/* Record a segment painted by drawing_paint with the active brushes. It
+   goes on the last stroke if it starts where that one ended with the same
+   brushes, otherwise it starts a new one. */
+void strokes_add (Strokes *strokes, const Brush *brushes, double prev_x,
+                  double prev_y, double x, double y, float pressure);
+
+/* Memory held by the records. */
+size_t strokes_bytes (const Strokes *strokes);
+
+/* Paint the strokes onto an empty image scale times the size of the layer
+   they were recorded on, in blocks of tiles painted in parallel. */
+void strokes_rasterize (const Strokes *strokes, image_t *image,
+                        int is_premultiplied, double scale);
+
+/* Save the drawing scale times larger like tiff_io_save, painting layers
+   that have strokes again from them and scaling the pixels of the
+   others. */
+int strokes_save_scaled (const FloatingDrawing *drawing,
+                         const char *file_name, double scale);
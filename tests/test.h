@@ -0,0 +1,47 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* The test programs check as they go, report each check that fails with
+   where it is and fail at the end if any did, so make check stops at the
+   first program that has a failure. */
+
+static int test_failures;
+static char test_file_names[8][256];
+static int test_file_count;
+
+#define CHECK(condition)                                                      \
+  do                                                                          \
+    {                                                                         \
+      if (!(condition))                                                       \
+        {                                                                     \
+          fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,  \
+                   #condition);                                               \
+          test_failures++;                                                    \
+        }                                                                     \
+    }                                                                         \
+  while (0)
+
+/* A file name for the test to write to, in TMPDIR, that is removed when
+   the test finishes. */
+static inline const char *
+test_file_name (const char *name)
+{
+  const char *directory = getenv ("TMPDIR");
+  char *file_name = test_file_names[test_file_count++];
+  snprintf (file_name, sizeof test_file_names[0], "%s/floating-test-%d-%s",
+            directory ? directory : "/tmp", (int)getpid (), name);
+  unlink (file_name);
+  return file_name;
+}
+
+static inline int
+test_finish (void)
+{
+  for (int i = 0; i < test_file_count; i++)
+    {
+      unlink (test_file_names[i]);
+    }
+  return test_failures != 0;
+}
@@ -0,0 +1,193 @@
+#include "image.h"
+#include "test.h"
+
+#include <math.h>
+
+/* The display conversions of float and 16 bit pixels against the same
+   conversion worked out a pixel at a time: rounded to within a unit, dithered
+   to the right average, and with the thresholds of each pixel in the right
+   place along spans that end in a partial vector. */
+
+enum
+{
+  PIXELS = 1005 /* The tail starts half way through a dither row. */
+};
+
+static float
+random_unit (void)
+{
+  return rand () / (float)RAND_MAX;
+}
+
+/* What a straight or premultiplied color shows on the background, in 8 bit
+   units, as BGR. The display does not use the fourth byte. */
+static void
+shown (const color *x, int is_premultiplied, uint8_t background, float *bgr)
+{
+  const float alpha = fminf (fmaxf (x->alpha, 0.0f), 1.0f);
+  for (int k = 0; k < 3; k++)
+    {
+      float value = fminf (fmaxf (x->values[k], 0.0f), 1.0f);
+      if (!is_premultiplied)
+        {
+          value *= alpha;
+        }
+      bgr[2 - k] = (value + background / 255.0f * (1.0f - alpha)) * 255.0f;
+    }
+}
+
+static float
+largest_error (const uint8_t *bgra, const float *expected)
+{
+  float largest = 0.0f;
+  for (int k = 0; k < 3; k++)
+    {
+      largest = fmaxf (largest, fabsf (bgra[k] - expected[k]));
+    }
+  return largest;
+}
+
+static void
+test_colors (int is_premultiplied)
+{
+  static color x[PIXELS];
+  static uint8_t bgra[4 * PIXELS];
+  const uint8_t background = rand () % 256;
+  float error = 0.0f;
+  for (int i = 0; i < PIXELS; i++)
+    {
+      for (int k = 0; k < 4; k++)
+        { /* A little out of range too, which is clamped. */
+          x[i].values[k] = 1.2f * random_unit () - 0.1f;
+        }
+      if (is_premultiplied)
+        {
+          x[i].alpha = fminf (fmaxf (x[i].alpha, 0.0f), 1.0f);
+          for (int k = 0; k < 3; k++)
+            {
+              x[i].values[k] = fminf (x[i].values[k], x[i].alpha);
+            }
+        }
+    }
+  color_span_to_display (bgra, x, background, is_premultiplied,
+                         display_dither_row (0, 0, 0), PIXELS);
+  for (int i = 0; i < PIXELS; i++)
+    {
+      float expected[3];
+      shown (x + i, is_premultiplied, background, expected);
+      error = fmaxf (error, largest_error (bgra + 4 * i, expected));
+    }
+  CHECK (error <= 0.5f + 1e-3f);
+
+  /* Each pixel dithered on its own from its own place in the row is the
+     same as in the span, which starts at a different column each time. */
+  int mismatches = 0;
+  for (int y = 0; y < 8; y++)
+    {
+      color_span_to_display (bgra, x, background, is_premultiplied,
+                             display_dither_row (1, y, y), PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          uint8_t alone[4];
+          color_span_to_display (alone, x + i, background, is_premultiplied,
+                                 display_dither_row (1, y + i, y), 1);
+          for (int k = 0; k < 4; k++)
+            {
+              mismatches += alone[k] != bgra[4 * i + k];
+            }
+        }
+    }
+  CHECK (mismatches == 0);
+}
+
+static void
+test_pixel16 (void)
+{
+  static uint16_t x[4 * PIXELS];
+  static uint8_t bgra[4 * PIXELS];
+  const uint8_t background = rand () % 256;
+  float error = 0.0f;
+  for (int i = 0; i < PIXELS; i++)
+    {
+      x[4 * i + 3] = rand () % 65536;
+      for (int k = 0; k < 3; k++)
+        {
+          x[4 * i + k] = rand () % (x[4 * i + 3] + 1);
+        }
+    }
+  pixel16_span_to_display (bgra, x, background, display_dither_row (0, 0, 0),
+                           PIXELS);
+  for (int i = 0; i < PIXELS; i++)
+    {
+      color c;
+      float expected[3];
+      pixel16_span_to_color (&c, x + 4 * i, 1);
+      shown (&c, 1, background, expected);
+      error = fmaxf (error, largest_error (bgra + 4 * i, expected));
+    }
+  CHECK (error <= 1.0f);
+
+  int mismatches = 0;
+  for (int y = 0; y < 8; y++)
+    {
+      pixel16_span_to_display (bgra, x, background,
+                               display_dither_row (1, y, y), PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          uint8_t alone[4];
+          pixel16_span_to_display (alone, x + 4 * i, background,
+                                   display_dither_row (1, y + i, y), 1);
+          for (int k = 0; k < 4; k++)
+            {
+              mismatches += alone[k] != bgra[4 * i + k];
+            }
+        }
+    }
+  CHECK (mismatches == 0);
+}
+
+/* A flat color dithered over the 8x8 matrix averages to its exact value,
+   to within a step of the matrix. */
+static void
+test_dither_average (void)
+{
+  for (int round = 0; round < 100; round++)
+    {
+      const float gray = random_unit ();
+      color x[8];
+      uint8_t bgra[4 * 8];
+      float expected[3], sums[3] = { 0 };
+      for (int i = 0; i < 8; i++)
+        {
+          x[i].red = x[i].green = x[i].blue = gray;
+          x[i].alpha = 1.0f;
+        }
+      for (int y = 0; y < 8; y++)
+        {
+          color_span_to_display (bgra, x, 0, 0, display_dither_row (1, 0, y),
+                                 8);
+          for (int i = 0; i < 8; i++)
+            {
+              for (int k = 0; k < 3; k++)
+                {
+                  sums[k] += bgra[4 * i + k];
+                }
+            }
+        }
+      shown (x, 0, 0, expected);
+      for (int k = 0; k < 3; k++)
+        {
+          CHECK (fabsf (sums[k] / 64.0f - expected[k]) <= 1.0f / 64 + 1e-3f);
+        }
+    }
+}
+
+int
+main (void)
+{
+  test_colors (0);
+  test_colors (1);
+  test_pixel16 ();
+  test_dither_average ();
+  return test_finish ();
+}
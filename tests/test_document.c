@@ -0,0 +1,255 @@
+#include "document.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Documents saved and opened again, whole, after changing a few tiles,
+   after deleting and merging layers, and in the other layer formats. */
+
+enum
+{
+  WIDTH = 300,
+  HEIGHT = 200
+};
+
+static off_t
+file_size (const char *file_name)
+{
+  struct stat status;
+  return stat (file_name, &status) == 0 ? status.st_size : -1;
+}
+
+static color
+pattern (int x, int y)
+{
+  const color c = { { x / (float)WIDTH, 0.25f, 1.0f - y / (float)HEIGHT,
+                      y / (float)HEIGHT } };
+  return c;
+}
+
+static int
+layers_are_equal (const FloatingDrawing *a, const FloatingDrawing *b)
+{
+  if (a->layer_count != b->layer_count)
+    {
+      return 0;
+    }
+  for (int i = 0; i < a->layer_count; i++)
+    {
+      image_t *x = a->layers[i]->image;
+      image_t *y = b->layers[i]->image;
+      for (int row = 0; row < HEIGHT; row++)
+        {
+          for (int column = 0; column < WIDTH; column++)
+            {
+              if (memcmp (image_pixel (x, column, row),
+                          image_pixel (y, column, row), sizeof (color)))
+                {
+                  return 0;
+                }
+            }
+        }
+    }
+  return 1;
+}
+
+static void
+new_drawing (FloatingDrawing *drawing, LayerFormat format)
+{
+  memset (drawing, 0, sizeof (FloatingDrawing));
+  drawing->current = -1;
+  drawing->layer_format = format;
+}
+
+static void
+open_document (FloatingDrawing *drawing, LayerFormat format,
+               const char *file_name)
+{
+  new_drawing (drawing, format);
+  drawing->document = document_open (file_name, drawing);
+  CHECK (drawing->document != NULL);
+}
+
+static void
+close_document (FloatingDrawing *drawing)
+{
+  del_all_layers (drawing);
+  document_close (drawing->document);
+}
+
+static void
+test_round_trip (const char *file_name)
+{
+  FloatingDrawing drawing, saved;
+  new_drawing (&drawing, LAYER_FORMAT_STRAIGHT);
+  add_top_layer (&drawing, WIDTH, HEIGHT);
+  add_top_layer (&drawing, WIDTH, HEIGHT);
+  for (int y = 10; y < 150; y++)
+    {
+      for (int x = 20; x < 250; x++)
+        {
+          *image_pixel (drawing.layers[1]->image, x, y) = pattern (x, y);
+        }
+    }
+  image_mark (drawing.layers[1]->image, 0, 0, WIDTH, HEIGHT,
+              IMAGE_TILE_DIRTY);
+  CHECK (document_save (&drawing, file_name));
+
+  open_document (&saved, LAYER_FORMAT_STRAIGHT, file_name);
+  CHECK (layers_are_equal (&drawing, &saved));
+
+  /* Change a tile of each layer a few times, saving each time. Only those
+     tiles are written, so the file grows by no more than them, and the
+     document still being read is not written over. */
+  const off_t size = file_size (file_name);
+  const off_t tile = IMAGE_TILE_SIZE * IMAGE_TILE_SIZE * sizeof (color);
+  for (int i = 0; i < 5; i++)
+    {
+      color *c = image_pixel (saved.layers[1]->image, 30, 30);
+      c->green = i / 10.0f;
+      image_mark (saved.layers[1]->image, 30, 30, 1, 1, IMAGE_TILE_DIRTY);
+      c = image_pixel (saved.layers[0]->image, WIDTH - 1, HEIGHT - 1);
+      *c = pattern (i, i);
+      image_mark (saved.layers[0]->image, WIDTH - 1, HEIGHT - 1, 1, 1,
+                  IMAGE_TILE_DIRTY);
+      CHECK (document_save (&saved, file_name));
+      CHECK (file_size (file_name) <= size + 2 * (i + 1) * tile);
+
+      FloatingDrawing reopened;
+      open_document (&reopened, LAYER_FORMAT_STRAIGHT, file_name);
+      CHECK (layers_are_equal (&saved, &reopened));
+      close_document (&reopened);
+    }
+  CHECK (memcmp (image_pixel (saved.layers[1]->image, 100, 100),
+                 image_pixel (drawing.layers[1]->image, 100, 100),
+                 sizeof (color))
+         == 0);
+  close_document (&saved);
+  close_document (&drawing);
+}
+
+/* Opened in another format, tiles are converted as they are first used,
+   and saved back they are converted again. */
+static void
+test_formats (const char *file_name)
+{
+  FloatingDrawing drawing;
+  new_drawing (&drawing, LAYER_FORMAT_STRAIGHT);
+  add_top_layer (&drawing, WIDTH, HEIGHT);
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          *image_pixel (drawing.layers[0]->image, x, y) = pattern (x, y);
+        }
+    }
+  image_mark (drawing.layers[0]->image, 0, 0, WIDTH, HEIGHT, IMAGE_TILE_DIRTY);
+  CHECK (document_save (&drawing, file_name));
+
+  const LayerFormat formats[] = { LAYER_FORMAT_PREMULTIPLIED,
+                                  LAYER_FORMAT_UINT16 };
+  for (int f = 0; f < 2; f++)
+    {
+      FloatingDrawing converted, saved;
+      open_document (&converted, formats[f], file_name);
+      image_t *image = converted.layers[0]->image;
+      int loaded = 0;
+      for (unsigned int i = 0; i < image->tiles_across * image->tiles_down;
+           i++)
+        {
+          loaded += image->tiles[i] != NULL;
+        }
+      CHECK (loaded == 0);
+      for (int y = 0; y < HEIGHT; y += 7)
+        {
+          for (int x = 0; x < WIDTH; x += 5)
+            {
+              color c, expected = pattern (x, y);
+              if (image->format == IMAGE_FORMAT_UINT16)
+                {
+                  pixel16_span_to_color (&c, image_pixel16 (image, x, y), 1);
+                }
+              else
+                {
+                  c = *image_pixel (image, x, y);
+                }
+              color_span_premultiply (&expected, 1);
+              for (int k = 0; k < 4; k++)
+                {
+                  CHECK (fabsf (c.values[k] - expected.values[k]) < 1e-4f);
+                }
+            }
+        }
+
+      CHECK (document_save (&converted, file_name));
+      open_document (&saved, LAYER_FORMAT_STRAIGHT, file_name);
+      for (int y = 10; y < HEIGHT; y += 7)
+        {
+          for (int x = 0; x < WIDTH; x += 5)
+            {
+              const color *c = image_pixel (saved.layers[0]->image, x, y);
+              const color expected = pattern (x, y);
+              CHECK (fabsf (c->red - expected.red) < 2e-3f);
+              CHECK (fabsf (c->alpha - expected.alpha) < 1e-4f);
+            }
+        }
+      close_document (&saved);
+      close_document (&converted);
+    }
+  del_all_layers (&drawing);
+}
+
+static void
+paint_top_layer (FloatingDrawing *drawing)
+{
+  add_top_layer (drawing, WIDTH, HEIGHT);
+  image_t *image = current_layer (drawing)->image;
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          *image_pixel (image, x, y) = pattern (x + drawing->layer_count, y);
+        }
+    }
+  image_mark (image, 0, 0, WIDTH, HEIGHT, IMAGE_TILE_DIRTY);
+}
+
+/* The blocks of layers deleted or merged away are used again once the
+   index no longer points at them, so two new layers fit in the file. */
+static void
+test_deleted_layers (const char *file_name)
+{
+  FloatingDrawing drawing, saved;
+  new_drawing (&drawing, LAYER_FORMAT_STRAIGHT);
+  for (int i = 0; i < 3; i++)
+    {
+      paint_top_layer (&drawing);
+    }
+  CHECK (document_save (&drawing, file_name));
+  CHECK (merge_down (&drawing));
+  select_layer (&drawing, 0);
+  del_current_layer (&drawing);
+  CHECK (drawing.layer_count == 1);
+  CHECK (document_save (&drawing, file_name));
+  const off_t size = file_size (file_name);
+
+  paint_top_layer (&drawing);
+  paint_top_layer (&drawing);
+  CHECK (document_save (&drawing, file_name));
+  CHECK (file_size (file_name) <= size);
+  open_document (&saved, LAYER_FORMAT_STRAIGHT, file_name);
+  CHECK (layers_are_equal (&drawing, &saved));
+  close_document (&saved);
+  close_document (&drawing);
+}
+
+int
+main (void)
+{
+  test_round_trip (test_file_name ("round-trip" DOCUMENT_EXTENSION));
+  test_deleted_layers (test_file_name ("deleted" DOCUMENT_EXTENSION));
+  test_formats (test_file_name ("formats" DOCUMENT_EXTENSION));
+  return test_finish ();
+}
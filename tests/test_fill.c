@@ -0,0 +1,189 @@
+#include "fill.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+
+/* Flood fills in each layer format, of the current layer and of the
+   composite, against a fill a pixel at a time. */
+
+enum
+{
+  WIDTH = 300,
+  HEIGHT = 200
+};
+
+static const float tolerance = 0.05f;
+
+/* Walls across tile edges, and specks on the floor some of which differ
+   from it by less than the tolerance. */
+static color
+pattern (int x, int y)
+{
+  color c = { { 0.2f, 0.5f, 0.1f, 0.0f } };
+  if ((x * x / 97 + y * 3) % 53 < 3 || (x % 131 == 0 && y % 200 < 180)
+      || (y % 71 == 0 && x % 150 > 20))
+    {
+      c.alpha = 1.0f;
+    }
+  else if ((x + y) % 29 == 0)
+    {
+      c.alpha = 0.04f;
+    }
+  else if ((x + 2 * y) % 37 == 0)
+    {
+      c.alpha = 0.06f;
+    }
+  return c;
+}
+
+static color
+layer_pixel (const FloatingDrawing *drawing, image_t *image, int x, int y)
+{
+  color c;
+  if (image->format == IMAGE_FORMAT_UINT16)
+    {
+      pixel16_span_to_color (&c, image_pixel16 (image, x, y), 1);
+      return c;
+    }
+  c = *image_pixel (image, x, y);
+  if (!layer_format_is_premultiplied (drawing))
+    {
+      color_span_premultiply (&c, 1);
+    }
+  return c;
+}
+
+static int
+is_similar (color a, color b)
+{
+  for (int k = 0; k < 4; k++)
+    {
+      if (fabsf (a.values[k] - b.values[k]) > tolerance)
+        {
+          return 0;
+        }
+    }
+  return 1;
+}
+
+/* Which pixels a fill from x, y reaches, 4 connected. */
+static uint8_t *
+reference_fill (const color *reference, int x, int y)
+{
+  uint8_t *is_reached = calloc (WIDTH * HEIGHT, 1);
+  int *stack = malloc (sizeof (int) * WIDTH * HEIGHT);
+  const color seed = reference[y * WIDTH + x];
+  int count = 0;
+  stack[count++] = y * WIDTH + x;
+  is_reached[y * WIDTH + x] = 1;
+  while (count > 0)
+    {
+      const int i = stack[--count];
+      const int neighbors[4]
+          = { i % WIDTH > 0 ? i - 1 : -1, i % WIDTH < WIDTH - 1 ? i + 1 : -1,
+              i >= WIDTH ? i - WIDTH : -1,
+              i < WIDTH * (HEIGHT - 1) ? i + WIDTH : -1 };
+      for (int k = 0; k < 4; k++)
+        {
+          const int j = neighbors[k];
+          if (j >= 0 && !is_reached[j] && is_similar (reference[j], seed))
+            {
+              is_reached[j] = 1;
+              stack[count++] = j;
+            }
+        }
+    }
+  free (stack);
+  return is_reached;
+}
+
+static void
+test_fill (const char *format, int is_sampling_composite)
+{
+  FloatingDrawing drawing;
+  Brush brush;
+  const color fill = { { 0.0f, 0.0f, 1.0f, 1.0f } };
+  color *reference = malloc (sizeof (color) * WIDTH * HEIGHT);
+  setenv ("FLOATING_LAYER_FORMAT", format, 1);
+  drawing_init (&drawing, &brush);
+  add_top_layer (&drawing, WIDTH, HEIGHT);
+  image_t *image = drawing.layers[0]->image;
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          color c = pattern (x, y);
+          color premultiplied = c;
+          color_span_premultiply (&premultiplied, 1);
+          reference[y * WIDTH + x] = premultiplied;
+          if (image->format == IMAGE_FORMAT_UINT16)
+            {
+              pixel16_span_from_color (image_pixel16 (image, x, y),
+                                       &premultiplied, 1);
+            }
+          else
+            {
+              *image_pixel (image, x, y)
+                  = layer_format_is_premultiplied (&drawing) ? premultiplied
+                                                             : c;
+            }
+        }
+    }
+  if (is_sampling_composite)
+    { /* Fill an empty layer up to what the one below shows. */
+      add_top_layer (&drawing, WIDTH, HEIGHT);
+      image = drawing.layers[1]->image;
+    }
+  drawing.color = fill;
+
+  int x = WIDTH / 2 + 1, y = HEIGHT / 2 + 1;
+  while (reference[y * WIDTH + x].alpha > 0.5f)
+    {
+      x++;
+    }
+  uint8_t *is_reached = reference_fill (reference, x, y);
+  const rect area = flood_fill (&drawing, x, y, tolerance,
+                                is_sampling_composite);
+  int mismatches = 0, reached = 0;
+  for (int j = 0; j < HEIGHT; j++)
+    {
+      for (int i = 0; i < WIDTH; i++)
+        {
+          const color c = layer_pixel (&drawing, image, i, j);
+          const int is_filled = fabsf (c.blue - 1.0f) < 1e-3f
+                                && fabsf (c.alpha - 1.0f) < 1e-3f
+                                && c.red < 1e-3f;
+          mismatches += is_filled != is_reached[j * WIDTH + i];
+          if (is_reached[j * WIDTH + i])
+            {
+              reached++;
+              mismatches += i < area.x || j < area.y
+                            || i >= area.x + area.width
+                            || j >= area.y + area.height;
+            }
+        }
+    }
+  CHECK (reached > WIDTH * HEIGHT / 8);
+  CHECK (mismatches == 0);
+  if (mismatches != 0)
+    {
+      fprintf (stderr, "%s%s: %d pixels differ\n", format,
+               is_sampling_composite ? ", composite" : "", mismatches);
+    }
+  free (is_reached);
+  free (reference);
+  del_all_layers (&drawing);
+}
+
+int
+main (void)
+{
+  const char *formats[] = { "straight", "premultiplied", "uint16" };
+  for (int f = 0; f < 3; f++)
+    {
+      test_fill (formats[f], 0);
+      test_fill (formats[f], 1);
+    }
+  return test_finish ();
+}
@@ -0,0 +1,233 @@
+#include "drawing.h"
+#include "journal.h"
+#include "selection.h"
+#include "test.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+/* Journals read back as they were recorded, across the ring wrapping
+   around, opening again to append, a reset with its snapshot and a record
+   torn by a crash. Then a drawing saved half way through a session, brought
+   back from the save and the journal to the same pixels. */
+
+enum
+{
+  WIDTH = 640,
+  HEIGHT = 480,
+  SAMPLES = 200000, /* More than the ring holds. */
+};
+
+static void
+record (Journal *journal, int first, int count)
+{
+  for (int i = first; i < first + count; i++)
+    {
+      if (i % 100 == 99)
+        {
+          journal_key (journal, i & 0xff, i & 0xffff);
+        }
+      else
+        {
+          journal_sample (journal, i * 0.5, HEIGHT - i * 0.25,
+                          (i % 1000) / 1000.0f, i & 1);
+        }
+    }
+}
+
+static int
+is_recorded (const JournalRecord *recorded, int i)
+{
+  if (i % 100 == 99)
+    {
+      return recorded->type == JOURNAL_KEY && recorded->keycode == (i & 0xff)
+             && recorded->state == (i & 0xffff);
+    }
+  return recorded->type == JOURNAL_SAMPLE && recorded->x == i * 0.5
+         && recorded->y == HEIGHT - i * 0.25
+         && recorded->pressure == (i % 1000) / 1000.0f
+         && recorded->is_drawing == (i & 1);
+}
+
+static int
+read_back (const char *file_name, int first, int count)
+{
+  size_t records;
+  int width, height, mismatches = 0;
+  JournalRecord *recorded
+      = journal_read (file_name, &records, &width, &height);
+  if (recorded == NULL || records != (size_t)count || width != WIDTH
+      || height != HEIGHT)
+    {
+      free (recorded);
+      return 0;
+    }
+  for (int i = 0; i < count; i++)
+    {
+      mismatches += !is_recorded (recorded + i, first + i);
+    }
+  free (recorded);
+  return mismatches == 0;
+}
+
+/* What the event loop of draw does with a sample. */
+static void
+apply_sample (FloatingDrawing *drawing, double x, double y, float pressure,
+              int is_drawing)
+{
+  const double prev_x = drawing->x;
+  const double prev_y = drawing->y;
+  drawing->x = x;
+  drawing->y = y;
+  drawing->is_drawing = is_drawing;
+  if (drawing->is_drawing && drawing->current >= 0 && pressure > 0.0f)
+    {
+      drawing_paint (drawing, prev_x, prev_y, pressure);
+    }
+}
+
+/* A stroke across the canvas, the same for the same seed. */
+static void
+paint_stroke (FloatingDrawing *drawing, Journal *journal, int seed)
+{
+  for (int i = 0; i < 60; i++)
+    {
+      const double x = 40 + i * 9 + seed * 13 % 50;
+      const double y = 60 + (i * 37 + seed * 71) % 300;
+      const float pressure = (i % 10 + 1) / 10.0f;
+      const int is_drawing = i % 20 != 0;
+      journal_sample (journal, x, y, pressure, is_drawing);
+      apply_sample (drawing, x, y, pressure, is_drawing);
+    }
+}
+
+static void
+new_drawing (FloatingDrawing *drawing, Brush *brush)
+{
+  drawing_init (drawing, brush);
+  add_top_layer (drawing, WIDTH, HEIGHT);
+}
+
+static void
+test_replay (void)
+{
+  const char *file_name = test_file_name ("replay" JOURNAL_EXTENSION);
+  FloatingDrawing painted, recovered;
+  Brush painted_brush, recovered_brush;
+  new_drawing (&painted, &painted_brush);
+  new_drawing (&recovered, &recovered_brush);
+  Journal *journal = journal_open (file_name, WIDTH, HEIGHT);
+
+  /* Before saving the brush and selection change from their defaults. */
+  painted_brush.is_drawing = 1;
+  painted_brush.radius = 7;
+  painted_brush.density = 0.25;
+  painted_brush.color.green = 0.75;
+  painted_brush.mode = BLEND_MODE_MULTIPLY;
+  painted.color = painted_brush.color;
+  painted.selection = selection_new (WIDTH, HEIGHT);
+  selection_add_ellipse (painted.selection, 100, 80, 400, 300);
+  paint_stroke (&painted, journal, 1);
+
+  /* Saving, the layer is what a drawing opened again would load. */
+  size_t size;
+  void *snapshot = drawing_snapshot (&painted, &size);
+  journal_reset (journal, snapshot, size);
+  free (snapshot);
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          *image_pixel (recovered.layers[0]->image, x, y)
+              = *image_pixel (painted.layers[0]->image, x, y);
+        }
+    }
+  paint_stroke (&painted, journal, 2);
+  paint_stroke (&painted, journal, 3);
+  journal_close (journal);
+
+  /* Replaying goes on from the state at the save. */
+  size_t records;
+  int width, height, mismatches = 0;
+  JournalRecord *recorded
+      = journal_read (file_name, &records, &width, &height);
+  snapshot = journal_read_snapshot (file_name, &size);
+  CHECK (recorded != NULL && records == 120);
+  CHECK (snapshot != NULL && drawing_restore (&recovered, snapshot, size));
+  CHECK (!drawing_restore (&recovered, snapshot, size - 1));
+  for (size_t i = 0; i < records; i++)
+    {
+      apply_sample (&recovered, recorded[i].x, recorded[i].y,
+                    recorded[i].pressure, recorded[i].is_drawing);
+    }
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          mismatches += !!memcmp (
+              image_pixel (recovered.layers[0]->image, x, y),
+              image_pixel (painted.layers[0]->image, x, y), sizeof (color));
+        }
+    }
+  CHECK (mismatches == 0);
+  CHECK (recovered_brush.radius == painted_brush.radius);
+  free (snapshot);
+  free (recorded);
+  del_all_layers (&painted);
+  del_all_layers (&recovered);
+  selection_del (painted.selection);
+  selection_del (recovered.selection);
+}
+
+int
+main (void)
+{
+  const char *file_name = test_file_name ("session" JOURNAL_EXTENSION);
+  size_t records;
+  int width, height;
+
+  Journal *journal = journal_open (file_name, WIDTH, HEIGHT);
+  CHECK (journal != NULL);
+  record (journal, 0, SAMPLES);
+  journal_close (journal);
+  CHECK (read_back (file_name, 0, SAMPLES));
+
+  /* Opening again appends. */
+  journal = journal_open (file_name, WIDTH, HEIGHT);
+  record (journal, SAMPLES, 1000);
+  journal_close (journal);
+  CHECK (read_back (file_name, 0, SAMPLES + 1000));
+
+  /* Saving forgets what was recorded before and keeps the snapshot, of a
+     size that leaves the records after it unaligned. */
+  const char saved[] = "state at save";
+  journal = journal_open (file_name, WIDTH, HEIGHT);
+  journal_reset (journal, saved, sizeof (saved));
+  CHECK (journal_read (file_name, &records, &width, &height) == NULL);
+  CHECK (records == 0);
+  record (journal, 7, 500);
+  journal_close (journal);
+  CHECK (read_back (file_name, 7, 500));
+  journal = journal_open (file_name, WIDTH, HEIGHT);
+  record (journal, 507, 100);
+  journal_close (journal);
+  CHECK (read_back (file_name, 7, 600));
+  size_t size;
+  char *snapshot = journal_read_snapshot (file_name, &size);
+  CHECK (snapshot != NULL && size == sizeof (saved)
+         && !memcmp (snapshot, saved, size));
+  free (snapshot);
+
+  /* A record only partly written is left out, also when appending. */
+  struct stat status;
+  CHECK (stat (file_name, &status) == 0);
+  CHECK (truncate (file_name, status.st_size - 3) == 0);
+  CHECK (read_back (file_name, 7, 599));
+  journal = journal_open (file_name, WIDTH, HEIGHT);
+  record (journal, 606, 10);
+  journal_close (journal);
+  CHECK (read_back (file_name, 7, 609));
+
+  test_replay ();
+  return test_finish ();
+}
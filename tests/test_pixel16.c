@@ -0,0 +1,156 @@
+#include "image.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+
+/* The 16 bit kernels on random premultiplied pixels against the float
+   kernels they stand for, within the two units image.h promises. Spans are
+   not a multiple of the vector width, so the tails are checked too. The
+   display conversion is checked in test_display. */
+
+enum
+{
+  PIXELS = 1003,
+  BRUSHES = 20
+};
+
+static uint16_t
+random_fraction (void)
+{
+  return rand () % 65536;
+}
+
+/* Channels no more than alpha, as in a premultiplied pixel. */
+static void
+random_pixel (uint16_t *pixel)
+{
+  pixel[3] = random_fraction ();
+  for (int k = 0; k < 3; k++)
+    {
+      pixel[k] = pixel[3] ? rand () % (pixel[3] + 1) : 0;
+    }
+}
+
+static color
+to_color (const uint16_t *pixel)
+{
+  color c;
+  for (int k = 0; k < 4; k++)
+    {
+      c.values[k] = pixel[k] / 65535.0f;
+    }
+  return c;
+}
+
+/* The largest distance of a 16 bit pixel from a color, in 16 bit units. */
+static float
+distance (const uint16_t *pixel, const color *c)
+{
+  float largest = 0.0f;
+  for (int k = 0; k < 4; k++)
+    {
+      largest = fmaxf (largest, fabsf (pixel[k] - c->values[k] * 65535.0f));
+    }
+  return largest;
+}
+
+static float
+largest_8 (const uint8_t *x, const float *expected)
+{
+  float largest = 0.0f;
+  for (int k = 0; k < 4; k++)
+    {
+      largest = fmaxf (largest, fabsf (x[k] - expected[k]));
+    }
+  return largest;
+}
+
+int
+main (void)
+{
+  static uint16_t below[4 * PIXELS], above[4 * PIXELS], z[4 * PIXELS];
+  static uint16_t coverage[PIXELS];
+  static uint8_t rgba[4 * PIXELS];
+  float paint = 0.0f, absorb = 0.0f, erase = 0.0f, over = 0.0f;
+  float to_8 = 0.0f;
+  for (int round = 0; round < BRUSHES; round++)
+    {
+      uint16_t brush[4];
+      const uint16_t opacity = random_fraction ();
+      random_pixel (brush);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          random_pixel (below + 4 * i);
+          random_pixel (above + 4 * i);
+          coverage[i] = random_fraction ();
+        }
+      const color b = to_color (brush);
+
+      memcpy (z, below, sizeof (z));
+      pixel16_span_paint (z, coverage, brush, PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          const color x = to_color (below + 4 * i);
+          color expected;
+          color_over_premultiplied (coverage[i] / 65535.0f, &x, &b,
+                                    &expected);
+          paint = fmaxf (paint, distance (z + 4 * i, &expected));
+        }
+
+      memcpy (z, below, sizeof (z));
+      pixel16_span_absorb (z, coverage, brush, PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          const color x = to_color (below + 4 * i);
+          color expected;
+          color_blend_absorb_premultiplied (coverage[i] / 65535.0f, &x, &b,
+                                            &expected);
+          absorb = fmaxf (absorb, distance (z + 4 * i, &expected));
+        }
+
+      memcpy (z, below, sizeof (z));
+      pixel16_span_erase (z, coverage, brush, PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          const color x = to_color (below + 4 * i);
+          const float keep = 1.0f - coverage[i] / 65535.0f * b.alpha;
+          color expected;
+          for (int k = 0; k < 4; k++)
+            {
+              expected.values[k] = x.values[k] * keep;
+            }
+          erase = fmaxf (erase, distance (z + 4 * i, &expected));
+        }
+
+      color colors[PIXELS], sources[PIXELS];
+      memcpy (z, below, sizeof (z));
+      pixel16_span_over (z, above, opacity, PIXELS);
+      pixel16_span_to_color (colors, below, PIXELS);
+      pixel16_span_to_color (sources, above, PIXELS);
+      color_span_over (colors, sources, opacity / 65535.0f, PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          over = fmaxf (over, distance (z + 4 * i, colors + i));
+        }
+
+      /* To 8 bits within a unit. */
+      pixel16_span_to_uint8 (rgba, below, PIXELS);
+      for (int i = 0; i < PIXELS; i++)
+        {
+          const color x = to_color (below + 4 * i);
+          float expected[4];
+          for (int k = 0; k < 4; k++)
+            {
+              expected[k] = x.values[k] * 255.0f;
+            }
+          to_8 = fmaxf (to_8, largest_8 (rgba + 4 * i, expected));
+        }
+    }
+  CHECK (paint <= 2.0f);
+  CHECK (absorb <= 2.0f);
+  CHECK (erase <= 2.0f);
+  CHECK (over <= 2.0f);
+  CHECK (to_8 <= 1.0f);
+  return test_finish ();
+}
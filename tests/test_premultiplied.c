@@ -0,0 +1,133 @@
+#include "drawing.h"
+#include "test.h"
+
+#include <math.h>
+
+/* The premultiplied kernels on random pixels against the same composites
+   worked out on straight colors. */
+
+enum
+{
+  PIXELS = 1000
+};
+
+static float
+random_unit (void)
+{
+  return rand () / (float)RAND_MAX;
+}
+
+static color
+random_color (void)
+{
+  const color c = { { random_unit (), random_unit (), random_unit (),
+                      random_unit () } };
+  return c;
+}
+
+static color
+premultiplied (color c)
+{
+  color_span_premultiply (&c, 1);
+  return c;
+}
+
+static int
+is_near (const color *x, const color *y, float tolerance)
+{
+  for (int k = 0; k < 4; k++)
+    {
+      if (!(fabsf (x->values[k] - y->values[k]) <= tolerance))
+        {
+          return 0;
+        }
+    }
+  return 1;
+}
+
+/* y with a coverage of t over x, on straight colors, premultiplied. */
+static color
+over (float t, const color *x, const color *y)
+{
+  const float a = t * y->alpha;
+  color z;
+  for (int k = 0; k < 3; k++)
+    {
+      z.values[k] = a * y->values[k] + (1.0f - a) * x->alpha * x->values[k];
+    }
+  z.alpha = a + (1.0f - a) * x->alpha;
+  return z;
+}
+
+int
+main (void)
+{
+  color below[PIXELS], above[PIXELS], span[PIXELS], straight[PIXELS];
+  float opacity = 0.7f;
+  for (int i = 0; i < PIXELS; i++)
+    {
+      straight[i] = random_color ();
+      below[i] = premultiplied (straight[i]);
+      above[i] = premultiplied (random_color ());
+      span[i] = below[i];
+    }
+
+  /* Colors come back from premultiplying, where there is alpha to divide
+     by. */
+  color_span_unpremultiply (below, PIXELS);
+  for (int i = 0; i < PIXELS; i++)
+    {
+      CHECK (straight[i].alpha < 1e-3f
+             || is_near (below + i, straight + i, 1e-3f));
+      below[i] = span[i];
+    }
+
+  color_span_over (span, above, opacity, PIXELS);
+  for (int i = 0; i < PIXELS; i++)
+    {
+      const float t = random_unit ();
+      color y = above[i], z;
+      color_span_unpremultiply (&y, 1);
+      const color expected = over (opacity, straight + i, &y);
+      CHECK (is_near (span + i, &expected, 1e-5f));
+
+      const color single = over (t, straight + i, &y);
+      color_over_premultiplied (t, below + i, above + i, &z);
+      CHECK (is_near (&z, &single, 1e-5f));
+
+      /* Absorbing goes from the color below towards the color above by
+         the coverage times its alpha, and stays a premultiplied color on
+         the way. */
+      color_blend_absorb_premultiplied (0.0f, below + i, above + i, &z);
+      CHECK (is_near (&z, below + i, 1e-5f));
+      color_blend_absorb_premultiplied (t, below + i, above + i, &z);
+      for (int k = 0; k < 4; k++)
+        {
+          const float expected
+              = below[i].values[k]
+                + (above[i].values[k] - below[i].values[k]) * t
+                      * above[i].alpha;
+          CHECK (fabsf (z.values[k] - expected) < 1e-5f);
+        }
+      CHECK (z.red <= z.alpha + 1e-5f && z.green <= z.alpha + 1e-5f
+             && z.blue <= z.alpha + 1e-5f);
+    }
+
+  /* The absorb span kernel blends the same way. */
+  float coverage[PIXELS];
+  for (int i = 0; i < PIXELS; i++)
+    {
+      coverage[i] = random_unit ();
+      span[i] = below[i];
+    }
+  color_blend_modes[BLEND_MODE_ABSORB].span (span, above, 1, coverage, 1,
+                                             PIXELS);
+  for (int i = 0; i < PIXELS; i++)
+    {
+      color z;
+      color_blend_absorb_premultiplied (coverage[i], below + i, above + i,
+                                        &z);
+      CHECK (is_near (span + i, &z, 1e-5f));
+    }
+  return test_finish ();
+}
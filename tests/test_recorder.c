@@ -0,0 +1,112 @@
+#include "recorder.h"
+#include "test.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Time-lapse recordings of a canvas published through a share play back
+   to the canvas, over two sessions. */
+
+enum
+{
+  WIDTH = 200, /* Not whole tiles. */
+  HEIGHT = 150,
+  FRAMES = 12
+};
+
+static void
+sleep_milliseconds (int milliseconds)
+{
+  const struct timespec duration = { 0, milliseconds * 1000000L };
+  nanosleep (&duration, NULL);
+}
+
+/* Paint a rectangle of the canvas in a color of the frame and publish
+   it. */
+static void
+publish (Share *share, color *canvas, int frame)
+{
+  const rect area = { (frame * 37) % (WIDTH - 80),
+                      (frame * 23) % (HEIGHT - 40), 50 + frame, 40 };
+  const color c = { { (frame % 5) / 4.0f, 0.5f, 1.0f - frame / 30.0f,
+                      0.25f + (frame % 4) / 4.0f } };
+  share_begin (share);
+  for (int y = area.y; y < area.y + area.height; y++)
+    {
+      for (int x = area.x; x < area.x + area.width; x++)
+        {
+          canvas[y * WIDTH + x] = c;
+        }
+      share_write_row (share, canvas + y * WIDTH + area.x, area.x, y,
+                       area.width, 0);
+    }
+  share_end (share, area);
+}
+
+static void
+record_session (const char *file_name, Share *share, color *canvas,
+                int first)
+{
+  Recorder *recorder = recorder_new (file_name, share_header (share), 0.01);
+  CHECK (recorder != NULL);
+  for (int frame = first; frame < first + FRAMES; frame++)
+    {
+      publish (share, canvas, frame);
+      sleep_milliseconds (20);
+    }
+  recorder_del (recorder);
+}
+
+/* Play the whole recording back, checking the last frame against the
+   canvas. */
+static void
+check_playback (const char *file_name, const color *canvas, int sessions)
+{
+  uint8_t *pixels = malloc (4 * WIDTH * HEIGHT);
+  uint8_t expected[4 * WIDTH];
+  double seconds, last = 0;
+  int width, height, frames = 0, mismatches = 0;
+  Playback *playback = playback_open (file_name, &width, &height);
+  CHECK (playback != NULL);
+  CHECK (width == WIDTH && height == HEIGHT);
+  while (playback_next (playback, pixels, &seconds))
+    {
+      frames++;
+      last = seconds;
+    }
+  playback_close (playback);
+  CHECK (frames >= 2 * sessions);
+  CHECK (last > 0);
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      color_span_to_uint8 (expected, canvas + y * WIDTH, WIDTH);
+      for (int i = 0; i < 4 * WIDTH; i++)
+        {
+          mismatches += abs (expected[i] - pixels[4 * WIDTH * y + i]) > 1;
+        }
+    }
+  CHECK (mismatches == 0);
+  free (pixels);
+}
+
+int
+main (void)
+{
+  const char *file_name = test_file_name ("session" TIMELAPSE_EXTENSION);
+  color *canvas = calloc (WIDTH * HEIGHT, sizeof (color));
+  Share *share = share_new (NULL, WIDTH, HEIGHT, SHARE_FORMAT_BGRA8, 0);
+  CHECK (share != NULL);
+  record_session (file_name, share, canvas, 0);
+  check_playback (file_name, canvas, 1);
+
+  /* A second session appends to the recording and starts from what the
+     canvas is then. */
+  memset ((void *)canvas, 0, sizeof (color) * WIDTH * HEIGHT);
+  share_del (share);
+  share = share_new (NULL, WIDTH, HEIGHT, SHARE_FORMAT_BGRA8, 0);
+  record_session (file_name, share, canvas, FRAMES);
+  check_playback (file_name, canvas, 2);
+  share_del (share);
+  free (canvas);
+  return test_finish ();
+}
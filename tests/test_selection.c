@@ -0,0 +1,207 @@
+#include "selection.h"
+#include "drawing.h"
+#include "test.h"
+
+#include <string.h>
+
+/* The runs of selected pixels of each row against the coverage they are
+   made from, and painting through a selection. */
+
+enum
+{
+  WIDTH = 300,
+  HEIGHT = 200
+};
+
+static int
+coverage (const Selection *selection, int x, int y)
+{
+  return *selection_pixels (selection, x, y);
+}
+
+/* Clip a part of a row from first to last a run at a time. */
+static int
+clip_mismatches (const Selection *selection, int y, int first, int last)
+{
+  int mismatches = 0, x = first, previous = first;
+  while (x < last)
+    {
+      const int end = selection_clip (selection, y, &x, last);
+      for (int i = previous; i < x; i++)
+        {
+          mismatches += coverage (selection, i, y) != 0;
+        }
+      for (int i = x; i < end; i++)
+        {
+          mismatches += coverage (selection, i, y) == 0;
+        }
+      if (end < last)
+        {
+          mismatches += coverage (selection, end, y) != 0;
+        }
+      x = previous = end;
+    }
+  return mismatches;
+}
+
+static void
+check_spans (const Selection *selection)
+{
+  int mismatches = 0;
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      int count, x = 0, span = 0;
+      const SelectionSpan *spans = selection_row (selection, y, &count);
+      while (x < WIDTH)
+        { /* Each run of pixels with some coverage is a span. */
+          int start = x, end;
+          while (start < WIDTH && coverage (selection, start, y) == 0)
+            {
+              start++;
+            }
+          end = start;
+          while (end < WIDTH && coverage (selection, end, y) != 0)
+            {
+              end++;
+            }
+          if (start < WIDTH)
+            {
+              mismatches += span >= count || spans[span].start != start
+                            || spans[span].end != end;
+              span++;
+            }
+          x = end;
+        }
+      mismatches += span != count;
+      for (int first = 0; first < WIDTH; first += 37)
+        {
+          mismatches += clip_mismatches (selection, y, first,
+                                         WIDTH - first / 2);
+        }
+    }
+  CHECK (mismatches == 0);
+
+  for (unsigned int index = 0;
+       index < selection->tiles_across * selection->tiles_down; index++)
+    {
+      const int tx = (index % selection->tiles_across) << IMAGE_TILE_SHIFT;
+      const int ty = (index / selection->tiles_across) << IMAGE_TILE_SHIFT;
+      int selected = 0, unselected = 0;
+      for (int y = ty; y < ty + IMAGE_TILE_SIZE && y < HEIGHT; y++)
+        {
+          for (int x = tx; x < tx + IMAGE_TILE_SIZE && x < WIDTH; x++)
+            {
+              selected += coverage (selection, x, y) != 0;
+              unselected += coverage (selection, x, y) != 255;
+            }
+        }
+      CHECK (!selection_tile_is_full (selection, index) || unselected == 0);
+      CHECK (!selection_tile_is_empty (selection, index) || selected == 0);
+    }
+}
+
+static const void *
+pixel (const image_t *image, int x, int y)
+{
+  if (image->format == IMAGE_FORMAT_UINT16)
+    {
+      return image_pixel16 (image, x, y);
+    }
+  return image_pixel (image, x, y);
+}
+
+static void
+draw_line (FloatingDrawing *drawing, double x0, double y0, double x1,
+           double y1)
+{
+  drawing->x = x0;
+  drawing->y = y0;
+  for (int step = 1; step <= 200; step++)
+    {
+      const double x = drawing->x, y = drawing->y;
+      drawing->x = x0 + (x1 - x0) * step / 200.0;
+      drawing->y = y0 + (y1 - y0) * step / 200.0;
+      drawing_paint (drawing, x, y, 1.0f);
+    }
+}
+
+/* Painting changes selected pixels and leaves the others alone. */
+static void
+check_painting (const char *format, int is_inverted)
+{
+  FloatingDrawing drawing;
+  Brush brush;
+  setenv ("FLOATING_LAYER_FORMAT", format, 1);
+  drawing_init (&drawing, &brush);
+  add_top_layer (&drawing, WIDTH, HEIGHT);
+  image_t *image = drawing.layers[0]->image;
+  const size_t bytes = image_tile_bytes (image) / IMAGE_TILE_PIXELS;
+  uint8_t *before = malloc (bytes * WIDTH * HEIGHT);
+  brush.radius = 10;
+  brush.density = 0.5;
+  brush.smudge = 0;
+  brush.is_drawing = 1;
+  drawing.is_drawing = 1;
+  brush.color = (color){ { 0.9f, 0.2f, 0.1f, 1.0f } };
+  draw_line (&drawing, 20, 20, 280, 180);
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          memcpy (before + bytes * (WIDTH * y + x), pixel (image, x, y),
+                  bytes);
+        }
+    }
+
+  drawing.selection = selection_new (WIDTH, HEIGHT);
+  selection_add_rect (drawing.selection, 50, 40, 130, 70);
+  selection_add_ellipse (drawing.selection, 180, 120, 90, 60);
+  if (is_inverted)
+    {
+      selection_invert (drawing.selection);
+    }
+  brush.color = (color){ { 0.0f, 1.0f, 0.0f, 1.0f } };
+  draw_line (&drawing, 0, 100, 300, 100);
+  draw_line (&drawing, 100, 0, 100, 200);
+  int outside = 0, inside = 0;
+  for (int y = 0; y < HEIGHT; y++)
+    {
+      for (int x = 0; x < WIDTH; x++)
+        {
+          const int is_changed
+              = memcmp (before + bytes * (WIDTH * y + x), pixel (image, x, y),
+                        bytes);
+          outside += is_changed && coverage (drawing.selection, x, y) == 0;
+          inside += is_changed && coverage (drawing.selection, x, y) == 255;
+        }
+    }
+  CHECK (outside == 0);
+  CHECK (inside > 1000);
+  selection_del (drawing.selection);
+  drawing.selection = NULL;
+  del_all_layers (&drawing);
+  free (before);
+}
+
+int
+main (void)
+{
+  Selection *selection = selection_new (WIDTH, HEIGHT);
+  check_spans (selection);
+  selection_add_rect (selection, 50, 40, 130, 70);
+  check_spans (selection);
+  selection_add_ellipse (selection, 180, 120, 90, 60.5);
+  selection_add_ellipse (selection, -20, 150, 100, 100);
+  check_spans (selection);
+  selection_invert (selection);
+  check_spans (selection);
+  selection_del (selection);
+
+  const char *formats[] = { "straight", "premultiplied", "uint16" };
+  for (int f = 0; f < 3; f++)
+    {
+      check_painting (formats[f], 0);
+      check_painting (formats[f], 1);
+    }
+  return test_finish ();
+}
@@ -0,0 +1,191 @@
+#include "share.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A painter thread publishing frames that each change a different area,
+   while the test reads them the way a capture tool would: every frame read
+   that share_read_end accepts is whole, the same as a copy brought up to
+   date with share_changes. Then which reads are turned down, step by step
+   through the frames after one being read. */
+
+enum
+{
+  WIDTH = 96,
+  HEIGHT = 64,
+  FRAMES = 3000
+};
+
+static atomic_int is_painting;
+
+/* The area frame g paints, with g in each channel. */
+static rect
+frame_area (uint64_t g)
+{
+  rect area;
+  area.x = g * 37 % WIDTH;
+  area.y = g * 23 % HEIGHT;
+  area.width = 1 + g * 13 % (WIDTH - area.x);
+  area.height = 1 + g * 7 % (HEIGHT - area.y);
+  return area;
+}
+
+/* Write the area of frame g, between share_begin and share_end. */
+static void
+paint_area (Share *share, uint64_t g)
+{
+  const rect area = frame_area (g);
+  color row[WIDTH];
+  for (int i = 0; i < WIDTH; i++)
+    {
+      row[i].red = row[i].green = row[i].blue = row[i].alpha = g;
+    }
+  for (int y = area.y; y < area.y + area.height; y++)
+    {
+      share_write_row (share, row, area.x, y, area.width, 1);
+    }
+}
+
+static void *
+paint (void *data)
+{
+  Share *share = data;
+  for (uint64_t g = 1; g <= FRAMES; g++)
+    {
+      share_begin (share);
+      paint_area (share, g);
+      share_end (share, frame_area (g));
+    }
+  atomic_store (&is_painting, 0);
+  return NULL;
+}
+
+/* Bring a copy up to frame generation from frame since. */
+static void
+catch_up (color *canvas, uint64_t since, uint64_t generation)
+{
+  for (uint64_t g = since + 1; g <= generation; g++)
+    {
+      const rect area = frame_area (g);
+      for (int y = area.y; y < area.y + area.height; y++)
+        {
+          for (int x = area.x; x < area.x + area.width; x++)
+            {
+              color *c = canvas + y * WIDTH + x;
+              c->red = c->green = c->blue = c->alpha = g;
+            }
+        }
+    }
+}
+
+/* Whether the changes from since to generation hold every area painted in
+   between. */
+static int
+is_covered (ShareRect changes, uint64_t since, uint64_t generation)
+{
+  for (uint64_t g = since + 1; g <= generation; g++)
+    {
+      const rect area = frame_area (g);
+      if (area.x < changes.x || area.y < changes.y
+          || area.x + area.width > changes.x + changes.width
+          || area.y + area.height > changes.y + changes.height)
+        {
+          return 0;
+        }
+    }
+  return 1;
+}
+
+static void
+test_frames (Share *share, const ShareHeader *header)
+{
+  static color expected[WIDTH * HEIGHT], frame[WIDTH * HEIGHT];
+  pthread_t painter;
+  atomic_store (&is_painting, 1);
+  pthread_create (&painter, NULL, paint, share);
+  uint64_t known = 0;
+  int reads = 0, is_whole = 1, is_changed = 1;
+  for (int painting = 1; painting;)
+    {
+      painting = atomic_load (&is_painting);
+      const void *pixels;
+      uint32_t sequence;
+      const uint64_t generation
+          = share_read_begin (header, &pixels, &sequence);
+      memcpy (frame, pixels, sizeof (frame));
+      const ShareRect changes = share_changes (header, known, generation);
+      if (!share_read_end (header, generation, sequence))
+        {
+          continue;
+        }
+      is_changed &= is_covered (changes, known, generation);
+      catch_up (expected, known, generation);
+      known = generation;
+      is_whole &= !memcmp (frame, expected, sizeof (frame));
+      reads += 1;
+    }
+  pthread_join (painter, NULL);
+  CHECK (is_whole);
+  CHECK (is_changed);
+  CHECK (reads > 0);
+  CHECK (known == FRAMES); /* The last read starts after the last frame. */
+}
+
+static void
+test_sequences (Share *share, const ShareHeader *header)
+{
+  const void *pixels, *next_pixels;
+  uint32_t sequence, next_sequence;
+  const uint64_t generation = share_read_begin (header, &pixels, &sequence);
+
+  /* The next frame is painted in the other buffer, readers of the last one
+     go on undisturbed and new readers are still sent to it. */
+  share_begin (share);
+  paint_area (share, generation + 1);
+  CHECK (share_read_end (header, generation, sequence));
+  CHECK (share_read_begin (header, &next_pixels, &next_sequence)
+         == generation);
+  CHECK (next_pixels == pixels && next_sequence == sequence);
+  share_end (share, frame_area (generation + 1));
+  CHECK (share_read_end (header, generation, sequence));
+
+  /* The one after that writes over the buffer being read, from its start
+     on. */
+  share_begin (share);
+  CHECK (!share_read_end (header, generation, sequence));
+  CHECK (share_read_begin (header, &next_pixels, &next_sequence)
+         == generation + 1);
+  CHECK (next_pixels != pixels);
+  paint_area (share, generation + 2);
+  share_end (share, frame_area (generation + 2));
+  CHECK (!share_read_end (header, generation, sequence));
+  CHECK (share_read_begin (header, &next_pixels, &next_sequence)
+         == generation + 2);
+  CHECK (next_pixels == pixels && next_sequence != sequence);
+  CHECK (share_read_end (header, generation + 2, next_sequence));
+}
+
+int
+main (void)
+{
+  char name[64];
+  snprintf (name, sizeof (name), "/floating-test-%d", (int)getpid ());
+  Share *share = share_new (name, WIDTH, HEIGHT, SHARE_FORMAT_FLOAT, 0);
+  CHECK (share != NULL);
+  if (share == NULL)
+    {
+      return test_finish ();
+    }
+  const ShareHeader *header = share_attach (name);
+  CHECK (header != NULL);
+  CHECK (header->width == WIDTH && header->height == HEIGHT);
+  CHECK (header->pixel_bytes == sizeof (color));
+  test_frames (share, header);
+  test_sequences (share, header);
+  share_detach (header);
+  share_del (share);
+  return test_finish ();
+}
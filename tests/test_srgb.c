@@ -0,0 +1,77 @@
+#include "image.h"
+#include "test.h"
+
+#include <math.h>
+
+/* The sRGB transfer function by tables against the formulas. */
+
+static double
+srgb_to_linear (double v)
+{
+  return v <= 0.04045 ? v / 12.92 : pow ((v + 0.055) / 1.055, 2.4);
+}
+
+static double
+linear_to_srgb (double v)
+{
+  return v <= 0.0031308 ? v * 12.92 : 1.055 * pow (v, 1 / 2.4) - 0.055;
+}
+
+int
+main (void)
+{
+  double to_linear = 0, to_srgb = 0, round_trip = 0;
+  int to_srgb8 = 0, mismatches = 0;
+  for (int i = 0; i <= 100000; i++)
+    {
+      const float v = i / 100000.0f;
+      color c = { { v, v / 2, v / 3, 0.5f } };
+      color_span_srgb_to_linear (&c, 1);
+      to_linear = fmax (to_linear, fabs (c.red - srgb_to_linear (v)));
+      to_linear = fmax (to_linear, fabs (c.blue - srgb_to_linear (v / 3)));
+      mismatches += c.alpha != 0.5f;
+      color_span_linear_to_srgb (&c, 1);
+      round_trip = fmax (round_trip, fabs (c.red - v));
+      round_trip = fmax (round_trip, fabs (c.green - v / 2));
+
+      c = (color){ { v, v / 2, v / 3, 0.5f } };
+      color_span_linear_to_srgb (&c, 1);
+      to_srgb = fmax (to_srgb, fabs (c.red - linear_to_srgb (v)));
+      to_srgb = fmax (to_srgb, fabs (c.blue - linear_to_srgb (v / 3)));
+      mismatches += c.alpha != 0.5f;
+
+      uint8_t srgb8[4];
+      c = (color){ { v, v / 2, v / 3, 1.0f } };
+      color_span_to_srgb8 (srgb8, &c, 1);
+      const int error = abs (srgb8[0] - (int)lrint (255 * linear_to_srgb (v)));
+      to_srgb8 = error > to_srgb8 ? error : to_srgb8;
+      mismatches += srgb8[3] != 255;
+    }
+  CHECK (to_linear < 1e-6);
+  CHECK (to_srgb < 1e-6);
+  CHECK (round_trip < 1e-5);
+  CHECK (to_srgb8 <= 1);
+  CHECK (mismatches == 0);
+
+  /* Out of range colors are clamped. */
+  color c = { { -0.5f, 1.5f, 1.0f, 1.0f } };
+  color_span_linear_to_srgb (&c, 1);
+  CHECK (c.red == 0.0f && c.green <= 1.0f && c.blue > 0.9999f);
+
+  /* Every 8 bit value comes back, from RGBA and from RGB samples. */
+  for (int i = 0; i < 256; i++)
+    {
+      const uint8_t rgba[4] = { i, 255 - i, i / 2, 255 }, rgb[3] = { i, i, i };
+      uint8_t back[4];
+      color_span_from_srgb8 (&c, rgba, 4, 1);
+      color_span_to_srgb8 (back, &c, 1);
+      mismatches += back[0] != i || back[1] != 255 - i || back[2] != i / 2
+                    || back[3] != 255;
+      color_span_from_srgb8 (&c, rgb, 3, 1);
+      CHECK (c.alpha == 1.0f);
+      color_span_to_srgb8 (back, &c, 1);
+      mismatches += back[0] != i || back[1] != i || back[2] != i;
+    }
+  CHECK (mismatches == 0);
+  return test_finish ();
+}
@@ -0,0 +1,336 @@
+#include "tile_cache.h"
+#include "test.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/* A cached image several times the budget, filled with flat, noisy and
+   transparent tiles, read back after they were swapped out, and again after
+   changing some of them after they were first stored. Images made in
+   memory and converted from sources handed over to a cache, which swaps
+   them out the same way without touching the sources. The same image in a
+   cache that only compresses idle tiles, read back after they were
+   compressed, and handed over to one, as loaded layers are. */
+
+enum
+{
+  TILES_ACROSS = 16,
+  TILES_DOWN = 16,
+  BUDGET = 64 /* Tiles, the smallest the cache takes. */
+};
+
+/* Every third tile is transparent, every third flat, the rest noise. */
+static color
+pattern (int x, int y, int generation)
+{
+  const int tile = (y >> IMAGE_TILE_SHIFT) * TILES_ACROSS
+                   + (x >> IMAGE_TILE_SHIFT) + generation;
+  const unsigned int noise = (x * 7919u + y * 104729u + generation * 31u)
+                             * 2654435761u;
+  color c = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+  switch (tile % 3)
+    {
+    case 0:
+      break;
+    case 1:
+      c.red = tile / 256.0f;
+      c.alpha = 1.0f;
+      break;
+    default:
+      c.red = (noise & 0xff) / 255.0f;
+      c.green = (noise >> 8 & 0xff) / 255.0f;
+      c.blue = (noise >> 16 & 0xff) / 255.0f;
+      c.alpha = (noise >> 24) / 255.0f;
+      break;
+    }
+  return c;
+}
+
+static void
+fill_tile (image_t *image, int column, int row, int generation)
+{
+  const int x0 = column << IMAGE_TILE_SHIFT, y0 = row << IMAGE_TILE_SHIFT;
+  for (int y = y0; y < y0 + IMAGE_TILE_SIZE; y++)
+    {
+      for (int x = x0; x < x0 + IMAGE_TILE_SIZE; x++)
+        {
+          *image_pixel (image, x, y) = pattern (x, y, generation);
+        }
+    }
+  image_mark (image, x0, y0, IMAGE_TILE_SIZE, IMAGE_TILE_SIZE,
+              IMAGE_TILE_DIRTY);
+}
+
+static int
+resident_tiles (const image_t *image)
+{
+  int resident = 0;
+  for (int i = 0; i < TILES_ACROSS * TILES_DOWN; i++)
+    {
+      resident += image->tiles[i] != NULL;
+    }
+  return resident;
+}
+
+/* Tiles that do not hold the pattern of their generation. */
+static int
+tile_mismatches (image_t *image, const int *generations)
+{
+  int mismatches = 0;
+  for (int row = 0; row < TILES_DOWN; row++)
+    {
+      for (int column = 0; column < TILES_ACROSS; column++)
+        {
+          const int generation = generations[row * TILES_ACROSS + column];
+          int is_equal = 1;
+          for (int y = row << IMAGE_TILE_SHIFT;
+               y < (row + 1) << IMAGE_TILE_SHIFT; y++)
+            {
+              for (int x = column << IMAGE_TILE_SHIFT;
+                   x < (column + 1) << IMAGE_TILE_SHIFT; x++)
+                {
+                  const color c = pattern (x, y, generation);
+                  is_equal &= !memcmp (image_pixel (image, x, y), &c,
+                                       sizeof (color));
+                }
+            }
+          mismatches += !is_equal;
+          tile_cache_trim (image->cache);
+        }
+    }
+  return mismatches;
+}
+
+/* A cache of the smallest budget for one image of the test's size. */
+static TileCache *
+new_swapping_cache (void)
+{
+  const char *directory = getenv ("TMPDIR");
+  return tile_cache_new (BUDGET * IMAGE_TILE_PIXELS * sizeof (color),
+                         directory ? directory : "/tmp", 0);
+}
+
+/* Change every fifth tile, trimming after each. */
+static void
+change_tiles (image_t *image, int *generations)
+{
+  for (int i = 0; i < TILES_ACROSS * TILES_DOWN; i += 5)
+    {
+      generations[i] = 1 + i % 2;
+      fill_tile (image, i % TILES_ACROSS, i / TILES_ACROSS, generations[i]);
+      tile_cache_trim (image->cache);
+    }
+}
+
+static void
+test_swapping (void)
+{
+  TileCache *cache = new_swapping_cache ();
+  image_t *image
+      = image_new_cached (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                          TILES_DOWN << IMAGE_TILE_SHIFT, IMAGE_FORMAT_COLOR,
+                          cache);
+  int generations[TILES_ACROSS * TILES_DOWN] = { 0 };
+  CHECK (cache != NULL);
+
+  for (int row = 0; row < TILES_DOWN; row++)
+    {
+      for (int column = 0; column < TILES_ACROSS; column++)
+        {
+          fill_tile (image, column, row, 0);
+          tile_cache_trim (cache);
+          CHECK (resident_tiles (image) <= BUDGET);
+        }
+    }
+  CHECK (tile_mismatches (image, generations) == 0);
+  CHECK (resident_tiles (image) <= BUDGET);
+
+  /* Tiles changed after they were stored are written again, also when they
+     become transparent or stop being so, instead of coming back as they
+     were. */
+  change_tiles (image, generations);
+  CHECK (tile_mismatches (image, generations) == 0);
+
+  /* Tiles only read are swapped out without writing them, and still come
+     back whole. */
+  CHECK (tile_mismatches (image, generations) == 0);
+  image_del (image);
+  tile_cache_del (cache);
+}
+
+enum
+{
+  TILES = TILES_ACROSS * TILES_DOWN
+};
+
+/* An image converting from sources filled with the pattern, as mapped from
+   a document, into mapped. Every third source is left out as
+   transparent. */
+static image_t *
+new_mapped_image (color *mapped)
+{
+  const color **sources = malloc (sizeof (color *) * TILES);
+  image_t *image = image_new (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                              TILES_DOWN << IMAGE_TILE_SHIFT);
+  for (int i = 0; i < TILES; i++)
+    {
+      fill_tile (image, i % TILES_ACROSS, i / TILES_ACROSS, 0);
+      memcpy ((void *)(mapped + i * IMAGE_TILE_PIXELS), image->tiles[i],
+              sizeof (color) * IMAGE_TILE_PIXELS);
+      sources[i] = i % 3 ? mapped + i * IMAGE_TILE_PIXELS : NULL;
+    }
+  image_del (image);
+  return image_new_converting (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                               TILES_DOWN << IMAGE_TILE_SHIFT,
+                               IMAGE_FORMAT_COLOR, sources, 0);
+}
+
+static void
+test_adopting (void)
+{
+  TileCache *cache = new_swapping_cache ();
+  image_t *image = image_new (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                              TILES_DOWN << IMAGE_TILE_SHIFT);
+  int generations[TILES] = { 0 };
+  for (int i = 0; i < TILES; i++)
+    {
+      fill_tile (image, i % TILES_ACROSS, i / TILES_ACROSS, 0);
+    }
+  tile_cache_adopt (cache, image);
+  CHECK (image->cache == cache && image->storage == NULL);
+  CHECK (resident_tiles (image) <= BUDGET);
+  CHECK (tile_mismatches (image, generations) == 0);
+  change_tiles (image, generations);
+  CHECK (tile_mismatches (image, generations) == 0);
+  image_del (image);
+
+  /* Sources, as mapped from a document, are used in place by an image
+     without a cache. */
+  color *mapped = aligned_alloc (32, sizeof (color) * IMAGE_TILE_PIXELS
+                                         * TILES);
+  image = new_mapped_image (mapped);
+  memset (generations, 0, sizeof (generations));
+  CHECK (image->tiles[1] == mapped + IMAGE_TILE_PIXELS);
+  tile_cache_adopt (cache, image);
+  CHECK (resident_tiles (image) == 0);
+  CHECK (!tile_cache_is_blank (image, 1) && tile_cache_is_blank (image, 3));
+  CHECK (tile_mismatches (image, generations) == 0);
+  CHECK (resident_tiles (image) <= BUDGET);
+  change_tiles (image, generations);
+  CHECK (tile_mismatches (image, generations) == 0);
+  int changed_sources = 0;
+  for (int i = 0; i < TILES; i++)
+    {
+      const color c = pattern (i % TILES_ACROSS << IMAGE_TILE_SHIFT,
+                               i / TILES_ACROSS << IMAGE_TILE_SHIFT, 0);
+      changed_sources += !!memcmp (mapped + i * IMAGE_TILE_PIXELS, &c,
+                                   sizeof (color));
+    }
+  CHECK (changed_sources == 0);
+  image_del (image);
+  free (mapped);
+  tile_cache_del (cache);
+}
+
+/* Trim until no more than the noise tiles, which do not compress, are left
+   in memory, or give up after a while. Unchanged tiles of a source are let
+   go whatever they hold. Returns how many more are left. */
+static int
+wait_for_compression (image_t *image, const int *generations)
+{
+  int noise = 0;
+  for (int i = 0; i < TILES_ACROSS * TILES_DOWN; i++)
+    {
+      const int is_source = image->sources != NULL
+                            && image->sources[i] != NULL && !generations[i];
+      noise += !is_source && (i + generations[i]) % 3 == 2;
+    }
+  for (int i = 0; i < 100 && resident_tiles (image) > noise; i++)
+    {
+      usleep (100000);
+      tile_cache_trim (image->cache);
+    }
+  return resident_tiles (image) - noise;
+}
+
+static void
+test_compressing (void)
+{
+  TileCache *cache = tile_cache_new (0, NULL, 1);
+  image_t *image
+      = image_new_cached (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                          TILES_DOWN << IMAGE_TILE_SHIFT, IMAGE_FORMAT_COLOR,
+                          cache);
+  int generations[TILES_ACROSS * TILES_DOWN] = { 0 };
+  for (int row = 0; row < TILES_DOWN; row++)
+    {
+      for (int column = 0; column < TILES_ACROSS; column++)
+        {
+          fill_tile (image, column, row, 0);
+        }
+    }
+  tile_cache_trim (cache);
+  CHECK (resident_tiles (image) == TILES_ACROSS * TILES_DOWN);
+
+  /* Flat and transparent tiles leave memory, and come back as they were. */
+  CHECK (wait_for_compression (image, generations) <= 0);
+  CHECK (tile_mismatches (image, generations) == 0);
+
+  /* Tiles changed after they were compressed are compressed again. */
+  for (int i = 0; i < TILES_ACROSS * TILES_DOWN; i += 5)
+    {
+      generations[i] = 1 + i % 2;
+      fill_tile (image, i % TILES_ACROSS, i / TILES_ACROSS, generations[i]);
+    }
+  CHECK (wait_for_compression (image, generations) <= 0);
+  CHECK (tile_mismatches (image, generations) == 0);
+  image_del (image);
+
+  /* Loaded layers, handed over to the cache, are compressed the same way.
+     Tiles converted from a source are let go while unchanged, changed ones
+     are compressed, and the sources stay as they were. */
+  image = image_new (TILES_ACROSS << IMAGE_TILE_SHIFT,
+                     TILES_DOWN << IMAGE_TILE_SHIFT);
+  memset (generations, 0, sizeof (generations));
+  for (int i = 0; i < TILES; i++)
+    {
+      fill_tile (image, i % TILES_ACROSS, i / TILES_ACROSS, 0);
+    }
+  tile_cache_adopt (cache, image);
+  CHECK (wait_for_compression (image, generations) <= 0);
+  CHECK (tile_mismatches (image, generations) == 0);
+  image_del (image);
+
+  color *mapped = aligned_alloc (32, sizeof (color) * IMAGE_TILE_PIXELS
+                                         * TILES);
+  image = new_mapped_image (mapped);
+  tile_cache_adopt (cache, image);
+  CHECK (tile_mismatches (image, generations) == 0);
+  CHECK (resident_tiles (image) > 0);
+  CHECK (wait_for_compression (image, generations) <= 0);
+  CHECK (resident_tiles (image) == 0);
+  change_tiles (image, generations);
+  CHECK (wait_for_compression (image, generations) <= 0);
+  CHECK (tile_mismatches (image, generations) == 0);
+  int changed_sources = 0;
+  for (int i = 0; i < TILES; i++)
+    {
+      const color c = pattern (i % TILES_ACROSS << IMAGE_TILE_SHIFT,
+                               i / TILES_ACROSS << IMAGE_TILE_SHIFT, 0);
+      changed_sources += !!memcmp (mapped + i * IMAGE_TILE_PIXELS, &c,
+                                   sizeof (color));
+    }
+  CHECK (changed_sources == 0);
+  image_del (image);
+  free (mapped);
+  tile_cache_del (cache);
+}
+
+int
+main (void)
+{
+  test_swapping ();
+  test_adopting ();
+  test_compressing ();
+  return test_finish ();
+}
@@ -0,0 +1,163 @@
+#include "viewport.h"
+#include "test.h"
+
+#include <math.h>
+
+/* The mip levels against averages of the level above, after filling the
+   canvas and after changing part of it, and the window at a few zooms.
+   Bands of the levels are only allocated where something was drawn. */
+
+enum
+{
+  WIDTH = 301, /* Odd sizes, so that edge pixels are their own neighbours. */
+  HEIGHT = 157
+};
+
+static uint32_t
+random_pixel (void)
+{
+  return (uint32_t)rand () << 16 ^ (uint32_t)rand ();
+}
+
+/* The pixel of a level from the 2x2 block of the level above it. */
+static uint32_t
+average (const Viewport *viewport, int level, int x, int y)
+{
+  const MipLevel *source = viewport->levels + level;
+  const int right = 2 * x + 1 < source->width ? 2 * x + 1 : 2 * x;
+  const int below = 2 * y + 1 < source->height ? 2 * y + 1 : 2 * y;
+  const uint32_t *a = viewport_row (viewport, level, 2 * y);
+  const uint32_t *b = viewport_row (viewport, level, below);
+  uint32_t pixel = 0;
+  for (int shift = 0; shift < 32; shift += 8)
+    {
+      const unsigned int sum
+          = (a[2 * x] >> shift & 0xff) + (a[right] >> shift & 0xff)
+            + (b[2 * x] >> shift & 0xff) + (b[right] >> shift & 0xff);
+      pixel |= (uint32_t)((sum + 2) >> 2) << shift;
+    }
+  return pixel;
+}
+
+static int
+level_mismatches (const Viewport *viewport)
+{
+  int mismatches = 0;
+  for (int level = 1; level < viewport->level_count; level++)
+    {
+      const MipLevel *source = viewport->levels + level - 1;
+      const MipLevel *target = viewport->levels + level;
+      mismatches += target->width != (source->width + 1) / 2
+                    || target->height != (source->height + 1) / 2;
+      for (int y = 0; y < target->height; y++)
+        {
+          const uint32_t *row = viewport_row (viewport, level, y);
+          for (int x = 0; x < target->width; x++)
+            {
+              mismatches += row[x] != average (viewport, level - 1, x, y);
+            }
+        }
+    }
+  return mismatches;
+}
+
+/* What the window shows against the level it shows, pixel by pixel. */
+static int
+window_mismatches (Viewport *viewport, int zoom)
+{
+  uint32_t *pixels
+      = malloc (sizeof (uint32_t) * viewport->width * viewport->height);
+  const rect window = { 0, 0, viewport->width, viewport->height };
+  int mismatches = 0;
+  viewport_zoom (viewport, zoom);
+  viewport_render (viewport, window, pixels);
+  const int level = viewport->zoom < 0 ? -viewport->zoom : 0;
+  const MipLevel *source = viewport->levels + level;
+  for (int y = 0; y < viewport->height; y++)
+    {
+      for (int x = 0; x < viewport->width; x++)
+        {
+          double canvas_x, canvas_y;
+          viewport_to_canvas (viewport, x, y, &canvas_x, &canvas_y);
+          const int sx = (int)floor (canvas_x) >> level;
+          const int sy = (int)floor (canvas_y) >> level;
+          const uint32_t expected
+              = sx >= 0 && sy >= 0 && sx < source->width
+                        && sy < source->height
+                    ? viewport_row (viewport, level, sy)[sx]
+                    : VIEWPORT_OUTSIDE;
+          mismatches += pixels[y * viewport->width + x] != expected;
+        }
+    }
+  free (pixels);
+  return mismatches;
+}
+
+static void
+draw_random (Viewport *viewport, rect area)
+{
+  viewport_reserve (viewport, area.y, area.height);
+  for (int y = area.y; y < area.y + area.height; y++)
+    {
+      uint32_t *row = viewport_canvas_row (viewport, y);
+      for (int x = area.x; x < area.x + area.width; x++)
+        {
+          row[x] = random_pixel ();
+        }
+    }
+  viewport_update_levels (viewport, area);
+}
+
+static int
+allocated_bands (const MipLevel *level)
+{
+  const int bands = (level->height + (1 << VIEWPORT_BAND_SHIFT) - 1)
+                    >> VIEWPORT_BAND_SHIFT;
+  int allocated = 0;
+  for (int band = 0; band < bands; band++)
+    {
+      allocated += level->bands[band] != NULL;
+    }
+  return allocated;
+}
+
+int
+main (void)
+{
+  Viewport *viewport = viewport_new (WIDTH, HEIGHT, 120, 90, 0xff);
+  const rect canvas = { 0, 0, WIDTH, HEIGHT };
+  const rect changed = { 37, 101, 70, 9 };
+  CHECK (viewport->level_count > 4);
+  CHECK (level_mismatches (viewport) == 0);
+  CHECK (window_mismatches (viewport, -1) == 0);
+  for (int level = 0; level < viewport->level_count; level++)
+    {
+      CHECK (allocated_bands (viewport->levels + level) == 0);
+    }
+
+  /* A change within a band of level 0 only allocates that band, and the
+     one of each level below it. */
+  draw_random (viewport, changed);
+  CHECK (level_mismatches (viewport) == 0);
+  for (int level = 0; level < viewport->level_count; level++)
+    {
+      CHECK (allocated_bands (viewport->levels + level) == 1);
+    }
+
+  draw_random (viewport, canvas);
+  CHECK (level_mismatches (viewport) == 0);
+  CHECK (allocated_bands (viewport->levels) == 3);
+
+  /* Only the area that changed is downsampled again. */
+  draw_random (viewport, changed);
+  CHECK (level_mismatches (viewport) == 0);
+
+  for (int zoom = 2; zoom > -4; zoom--)
+    {
+      CHECK (window_mismatches (viewport, zoom) == 0);
+    }
+  viewport_pan (viewport, -200, 50);
+  CHECK (window_mismatches (viewport, 0) == 0);
+  viewport_del (viewport);
+  return test_finish ();
+}
@@ -0,0 +1,476 @@
+#include "tiff_io.h"
+#include "composite.h"
+#include "tile_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiffio.h>
+
+typedef struct TiffPage TiffPage;
+
+struct TiffPage
+{
+  uint32_t width, height;
+  uint16_t samples;
+  uint16_t bits;
+  int is_float;
+  int is_associated;
+  int is_tiled;
+  int is_linear; /* Convert the sRGB samples to linear light. */
+  uint32_t chunk_width, chunk_height; /* Tile size, or width x rows per strip. */
+  uint32_t chunks_across, chunks;
+};
+
+static int
+tiff_page_read (TIFF *tif, TiffPage *page)
+{
+  uint16_t format = SAMPLEFORMAT_UINT;
+  uint16_t planar = PLANARCONFIG_CONTIG;
+  uint16_t photometric = PHOTOMETRIC_RGB;
+  uint16_t extra_count = 0;
+  uint16_t *extra_types = NULL;
+  uint32_t subfile_type = 0;
+  if (!TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &page->width)
+      || !TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &page->height)
+      || !TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric))
+    {
+      return 0;
+    }
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SUBFILETYPE, &subfile_type);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &page->samples);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE, &page->bits);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLEFORMAT, &format);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG, &planar);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_EXTRASAMPLES, &extra_count,
+                         &extra_types);
+  /* Reduced resolution pages are previews, not layers. */
+  if (subfile_type & ~FILETYPE_PAGE)
+    {
+      return 0;
+    }
+  if (planar != PLANARCONFIG_CONTIG || !page->width || !page->height
+      || !page->samples
+      || (photometric != PHOTOMETRIC_RGB
+          && photometric != PHOTOMETRIC_MINISBLACK))
+    {
+      return 0;
+    }
+  page->is_float = format == SAMPLEFORMAT_IEEEFP;
+  if (!(page->bits == 8 && format == SAMPLEFORMAT_UINT)
+      && !(page->bits == 16 && format == SAMPLEFORMAT_UINT)
+      && !(page->bits == 32 && page->is_float))
+    {
+      return 0;
+    }
+  page->is_associated
+      = extra_count && extra_types[0] == EXTRASAMPLE_ASSOCALPHA;
+  page->is_tiled = TIFFIsTiled (tif);
+  if (page->is_tiled)
+    {
+      TIFFGetField (tif, TIFFTAG_TILEWIDTH, &page->chunk_width);
+      TIFFGetField (tif, TIFFTAG_TILELENGTH, &page->chunk_height);
+    }
+  else
+    {
+      page->chunk_width = page->width;
+      TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &page->chunk_height);
+    }
+  if (!page->chunk_width || !page->chunk_height)
+    {
+      return 0;
+    }
+  page->chunk_height = page->chunk_height < page->height ? page->chunk_height
+                                                         : page->height;
+  page->chunks_across
+      = (page->width + page->chunk_width - 1) / page->chunk_width;
+  page->chunks = page->chunks_across
+                 * ((page->height + page->chunk_height - 1)
+                    / page->chunk_height);
+  return 1;
+}
+
+static void
+tiff_page_convert_row (const TiffPage *page, const void *row, color *z,
+                       unsigned int n)
+{
+  if (page->is_linear && page->bits == 8 && !page->is_associated)
+    {
+      color_span_from_srgb8 (z, row, page->samples, n);
+      return;
+    }
+  switch (page->bits)
+    {
+    case 8:
+      color_span_from_uint8 (z, row, page->samples, n);
+      break;
+    case 16:
+      color_span_from_uint16 (z, row, page->samples, n);
+      break;
+    default:
+      color_span_from_float (z, row, page->samples, n);
+      break;
+    }
+  if (page->is_associated)
+    {
+      color_span_unpremultiply (z, n);
+    }
+  if (page->is_linear)
+    {
+      color_span_srgb_to_linear (z, n);
+    }
+}
+
+/* Every thread opens its own handle on the file (libtiff handles are not
+   thread safe) and decodes whole strips or tiles into a private buffer,
+   converting them straight into the rows of the image. */
+static int
+tiff_page_decode (const char *file_name, unsigned int directory,
+                  const TiffPage *page, image_t *image)
+{
+  const size_t sample_size = page->bits / 8;
+  const size_t chunk_row_size
+      = sample_size * page->samples * page->chunk_width;
+  int failed = 0;
+#pragma omp parallel reduction(| : failed)
+  {
+    uint8_t *buffer = NULL;
+    tmsize_t buffer_size = 0;
+    TIFF *tif = TIFFOpen (file_name, "r");
+    if (tif && TIFFSetDirectory (tif, directory))
+      {
+        buffer_size = page->is_tiled ? TIFFTileSize (tif) : TIFFStripSize (tif);
+        buffer = malloc (buffer_size);
+      }
+    uint32_t chunk;
+#pragma omp for schedule(dynamic)
+    for (chunk = 0; chunk < page->chunks; ++chunk)
+      {
+        const uint32_t x = (chunk % page->chunks_across) * page->chunk_width;
+        const uint32_t y = (chunk / page->chunks_across) * page->chunk_height;
+        const uint32_t width = page->width - x < page->chunk_width
+                                   ? page->width - x
+                                   : page->chunk_width;
+        const uint32_t height = page->height - y < page->chunk_height
+                                    ? page->height - y
+                                    : page->chunk_height;
+        tmsize_t read = -1;
+        if (buffer)
+          {
+            read = page->is_tiled
+                       ? TIFFReadEncodedTile (tif, chunk, buffer, buffer_size)
+                       : TIFFReadEncodedStrip (tif, chunk, buffer,
+                                               buffer_size);
+          }
+        if (read < (tmsize_t)(chunk_row_size * (height - 1)
+                              + sample_size * page->samples * width))
+          {
+            failed = 1;
+            continue;
+          }
+        uint32_t row;
+        for (row = 0; row < height; ++row)
+          {
+            const uint8_t *samples = buffer + row * chunk_row_size;
+            uint32_t column = 0;
+            while (column < width)
+              { /* Split the row where it crosses into the next tile. */
+                uint32_t n = IMAGE_TILE_SIZE - ((x + column) & IMAGE_TILE_MASK);
+                n = n < width - column ? n : width - column;
+                tiff_page_convert_row (
+                    page, samples + column * sample_size * page->samples,
+                    image_pixel (image, x + column, y + row), n);
+                column += n;
+              }
+          }
+      }
+    free (buffer);
+    if (tif)
+      {
+        TIFFClose (tif);
+      }
+  }
+  return !failed;
+}
+
+static image_t **
+tiff_io_load_pages (const char *file_name, unsigned int *pages,
+                    int is_linear)
+{
+  TIFF *tif = TIFFOpen (file_name, "r");
+  image_t **images = NULL;
+  unsigned int count = 0;
+  unsigned int directory = 0;
+  if (!tif)
+    {
+      return NULL;
+    }
+  do
+    {
+      TiffPage page;
+      page.is_linear = is_linear;
+      if (!tiff_page_read (tif, &page))
+        {
+          fprintf (stderr, "%s: skipping unsupported page %u\n", file_name,
+                   directory);
+        }
+      else if (count
+               && (page.width != images[0]->width
+                   || page.height != images[0]->height))
+        {
+          fprintf (stderr, "%s: skipping page %u, size differs from page 0\n",
+                   file_name, directory);
+        }
+      else
+        {
+          image_t *image = image_new_uninitialized (page.width, page.height);
+          if (tiff_page_decode (file_name, directory, &page, image))
+            {
+              images = realloc (images, sizeof (image_t *) * (count + 1));
+              images[count++] = image;
+            }
+          else
+            {
+              fprintf (stderr, "%s: failed to decode page %u\n", file_name,
+                       directory);
+              image_del (image);
+            }
+        }
+      ++directory;
+    }
+  while (TIFFReadDirectory (tif));
+  TIFFClose (tif);
+  *pages = count;
+  return images;
+}
+
+image_t **
+tiff_io_load (const char *file_name, unsigned int *pages)
+{
+  return tiff_io_load_pages (file_name, pages, 0);
+}
+
+unsigned int
+tiff_io_load_layers (FloatingDrawing *drawing, const char *file_name)
+{
+  unsigned int pages = 0;
+  image_t **images
+      = tiff_io_load_pages (file_name, &pages, drawing->is_linear);
+  unsigned int page;
+  for (page = 0; page < pages; ++page)
+    {
+      if (layer_format_is_premultiplied (drawing))
+        {
+          image_premultiply (images[page]);
+        }
+      if (drawing->layer_format == LAYER_FORMAT_UINT16)
+        {
+          image_t *converted = image_to_uint16 (images[page]);
+          image_del (images[page]);
+          images[page] = converted;
+        }
+      add_top_layer_image (drawing, images[page]);
+    }
+  free (images);
+  return pages;
+}
+
+/* Create a file for an 8 bit RGBA image. */
+static TIFF *
+tiff_io_create (const char *file_name, int width, int height,
+                int is_premultiplied)
+{
+  TIFF *tif = TIFFOpen (file_name, "w");
+  const uint16_t extra[] = { is_premultiplied ? EXTRASAMPLE_ASSOCALPHA
+                                              : EXTRASAMPLE_UNASSALPHA };
+  if (!tif)
+    {
+      return NULL;
+    }
+  TIFFSetField (tif, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField (tif, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField (tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+  TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, 4);
+  TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField (tif, TIFFTAG_EXTRASAMPLES, 1, extra);
+  TIFFSetField (tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField (tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  return tif;
+}
+
+/* Files of drawings in linear light hold sRGB with unassociated alpha,
+   like the files they are loaded from. */
+static int
+tiff_io_is_premultiplied (const FloatingDrawing *drawing)
+{
+  return layer_format_is_premultiplied (drawing) && !drawing->is_linear;
+}
+
+/* Row i of a composited band of a drawing in linear light as 8 bit
+   sRGB. */
+static void
+tiff_io_row_to_srgb8 (const FloatingDrawing *drawing, uint8_t *z,
+                      const color *scratch, int i, color *converted,
+                      int width)
+{
+  if (drawing->layer_format == LAYER_FORMAT_UINT16)
+    {
+      pixel16_span_to_color (
+          converted, (const uint16_t *)scratch + 4 * i * width, width);
+    }
+  else
+    {
+      memcpy (converted, scratch + i * width, sizeof (color) * width);
+    }
+  if (layer_format_is_premultiplied (drawing))
+    {
+      color_span_unpremultiply (converted, width);
+    }
+  color_span_to_srgb8 (z, converted, width);
+}
+
+/* Composite the whole canvas a band at a time, writing the rows to a file
+   and adding them to a thumbnail, either of which may be NULL. */
+static void
+tiff_io_composite (FloatingDrawing *drawing, TIFF *tif, Thumbnail *thumbnail,
+                   int width, int height)
+{
+  const int band_height = min (height, IMAGE_TILE_SIZE);
+  color *scratch = aligned_alloc (16, sizeof (color) * width * band_height);
+  uint8_t *row = malloc (4 * width);
+  color *converted = drawing->is_linear
+                         ? aligned_alloc (16, sizeof (color) * width)
+                         : NULL;
+  int32_t y;
+  for (y = 0; y < height; y += band_height)
+    {
+      const int rows = min (band_height, height - y);
+      int i;
+      composite_band (drawing, scratch, 0, y, width, rows, width, height);
+      if (thumbnail != NULL)
+        {
+          thumbnail_add_band (thumbnail, drawing, scratch, y, rows);
+        }
+      for (i = 0; tif != NULL && i < rows; ++i)
+        {
+          if (drawing->is_linear)
+            {
+              tiff_io_row_to_srgb8 (drawing, row, scratch, i, converted,
+                                    width);
+            }
+          else if (drawing->layer_format == LAYER_FORMAT_UINT16)
+            {
+              pixel16_span_to_uint8 (
+                  row, (const uint16_t *)scratch + 4 * i * width, width);
+            }
+          else
+            {
+              color_span_to_uint8 (row, scratch + i * width, width);
+            }
+          TIFFWriteScanline (tif, row, y + i, 0);
+        }
+      tile_cache_trim (drawing->tile_cache);
+    }
+  free (converted);
+  free (row);
+  free (scratch);
+}
+
+/* Write a finished thumbnail next to the file it belongs to. */
+static int
+tiff_io_write_thumbnail (Thumbnail *thumbnail, const char *file_name,
+                         const FloatingDrawing *drawing)
+{
+  const int is_premultiplied = tiff_io_is_premultiplied (drawing);
+  char *thumbnail_file_name
+      = malloc (strlen (file_name) + sizeof (THUMBNAIL_EXTENSION));
+  uint8_t *row = malloc (4 * thumbnail->width);
+  int y;
+  sprintf (thumbnail_file_name, "%s" THUMBNAIL_EXTENSION, file_name);
+  TIFF *tif = tiff_io_create (thumbnail_file_name, thumbnail->width,
+                              thumbnail->height, is_premultiplied);
+  if (tif != NULL)
+    {
+      thumbnail_finish (thumbnail, is_premultiplied);
+      for (y = 0; y < thumbnail->height; ++y)
+        {
+          const color *pixels = thumbnail->pixels + y * thumbnail->width;
+          if (drawing->is_linear)
+            {
+              color_span_to_srgb8 (row, pixels, thumbnail->width);
+            }
+          else
+            {
+              color_span_to_uint8 (row, pixels, thumbnail->width);
+            }
+          TIFFWriteScanline (tif, row, y, 0);
+        }
+      TIFFClose (tif);
+    }
+  else
+    {
+      fprintf (stderr, "%s: could not be created\n", thumbnail_file_name);
+    }
+  free (row);
+  free (thumbnail_file_name);
+  return tif != NULL;
+}
+
+int
+tiff_io_save (FloatingDrawing *drawing, const char *file_name, int width,
+              int height)
+{
+  TIFF *tif = tiff_io_create (file_name, width, height,
+                              tiff_io_is_premultiplied (drawing));
+  Thumbnail *thumbnail = NULL;
+  if (!tif)
+    {
+      return 0;
+    }
+  if (drawing->thumbnail_size > 0)
+    {
+      thumbnail = thumbnail_new (width, height, drawing->thumbnail_size);
+    }
+  tiff_io_composite (drawing, tif, thumbnail, width, height);
+  TIFFFlush (tif);
+  TIFFClose (tif);
+  if (thumbnail != NULL)
+    {
+      tiff_io_write_thumbnail (thumbnail, file_name, drawing);
+      thumbnail_del (thumbnail);
+    }
+  return 1;
+}
+
+int
+tiff_io_save_thumbnail (FloatingDrawing *drawing, const char *file_name,
+                        int width, int height)
+{
+  Thumbnail *thumbnail
+      = thumbnail_new (width, height, drawing->thumbnail_size);
+  int is_saved;
+  tiff_io_composite (drawing, NULL, thumbnail, width, height);
+  is_saved = tiff_io_write_thumbnail (thumbnail, file_name, drawing);
+  thumbnail_del (thumbnail);
+  return is_saved;
+}
+
+int
+tiff_io_save_rgba8 (const char *file_name, const uint8_t *pixels, int width,
+                    int height)
+{
+  TIFF *tif = tiff_io_create (file_name, width, height, 0);
+  int32_t y;
+  if (!tif)
+    {
+      return 0;
+    }
+  for (y = 0; y < height; ++y)
+    {
+      TIFFWriteScanline (tif, (void *)(pixels + 4 * (size_t)width * y), y,
+                         0);
+    }
+  TIFFFlush (tif);
+  TIFFClose (tif);
+  return 1;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "drawing.h"
+#include "image.h"
+
+/* Load every full resolution page of a TIFF file, bottom layer first.
+   Returns a malloc'd array of *pages images, or NULL if nothing could be
+   loaded. */
+image_t **
+tiff_io_load (const char *file_name, unsigned int *pages);
+
+/* Load every page as a layer on top of the drawing, converted to its layer
+   format. Returns the number of layers added. */
+unsigned int tiff_io_load_layers (FloatingDrawing *drawing,
+                                  const char *file_name);
+
+/* Save the visible layers composited into one 8 bit RGBA image, with
+   associated alpha if the layers are premultiplied. If the drawing has a
+   thumbnail size, a thumbnail is saved from the same pass to the file name
+   with THUMBNAIL_EXTENSION added. */
+int tiff_io_save (FloatingDrawing *drawing, const char *file_name, int width,
+                  int height);
+
+/* Save rows of 8 bit RGBA pixels with unassociated alpha. */
+int tiff_io_save_rgba8 (const char *file_name, const uint8_t *pixels,
+                        int width, int height);
+
+/* Save only the thumbnail, for drawings saved in other formats. */
+int tiff_io_save_thumbnail (FloatingDrawing *drawing, const char *file_name,
+                            int width, int height);
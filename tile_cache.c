@@ -0,0 +1,929 @@
+#include "tile_cache.h"
+#include "io.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TILE_CACHE_BYTES (sizeof (color) * IMAGE_TILE_PIXELS) /* A slot. */
+#define TILE_CACHE_QUEUE 256 /* Prefetch requests, a power of two. */
+#define TILE_CACHE_REPEAT 0x8000
+#define TILE_CACHE_IDLE_SECONDS 30
+
+/* Steps of compressing a batch of idle tiles in memory, which go back and
+   forth between the background thread, which does the work, and
+   tile_cache_trim, where tiles can be freed. */
+#define TILE_PACK_NONE 0
+#define TILE_PACK_FOUND 1   /* Idle tiles were found. */
+#define TILE_PACK_ENCODE 2  /* Their contents are to be compressed. */
+#define TILE_PACK_ENCODED 3 /* And were, to be freed if unchanged. */
+
+typedef struct TileRequest TileRequest;
+typedef struct ResidentTile ResidentTile;
+typedef struct TilePacking TilePacking;
+
+struct TileRequest
+{
+  image_t *image; /* NULL if the image was deleted meanwhile. */
+  unsigned int index;
+};
+
+struct ResidentTile
+{
+  image_t *image;
+  unsigned int index;
+  uint32_t use;
+};
+
+struct TilePacking
+{
+  image_t *image; /* NULL if the image was deleted meanwhile. */
+  unsigned int index;
+  uint8_t *packed; /* The result, NULL if blank or not any smaller. */
+  uint32_t size;
+  int is_blank;
+};
+
+/* Everything is guarded by the lock, except that tile pointers are
+   published atomically so that image_tile only takes it on a miss. */
+struct TileCache
+{
+  size_t budget;   /* In bytes. */
+  size_t resident; /* Bytes of tiles in memory. */
+  uint32_t clock;  /* Advanced by each trim. */
+  int fd;
+  uint32_t end_slot;
+  uint32_t *free_slots;
+  size_t free_count, free_capacity;
+  size_t packed_count; /* Tiles compressed in memory. */
+  image_t **images;
+  size_t image_count, image_capacity;
+  TileRequest queue[TILE_CACHE_QUEUE];
+  size_t queue_head, queue_tail;
+  uint8_t *buffer; /* An encoded tile. */
+  int idle_seconds; /* 0 if tiles are not compressed in memory. */
+  uint32_t idle_clock; /* The clock when idle tiles were last looked for. */
+  uint32_t batch;      /* Numbers the batches of idle tiles. */
+  int pack_step;
+  TilePacking *packings; /* The batch. */
+  size_t packing_count, packing_capacity, packing_next;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int is_closing;
+};
+
+/* Runs of equal pixels are stored once. Each run starts with 16 bits
+   holding its length less one, with the top bit set for a repeated pixel,
+   followed by that pixel or by the differing pixels. Painted tiles are
+   mostly flat or transparent outside the strokes, so this pays for itself
+   in less I/O. Returns 0 if the result would not be smaller. Pixels are
+   of either format, opaque blocks of a given size. */
+size_t
+tile_encode (const uint8_t *tile, size_t pixel, uint8_t *out)
+{
+  const size_t bytes = pixel * IMAGE_TILE_PIXELS;
+  size_t size = 0;
+  unsigned int i = 0;
+  while (i < IMAGE_TILE_PIXELS)
+    {
+      unsigned int run = 1;
+      uint16_t header;
+      while (i + run < IMAGE_TILE_PIXELS
+             && !memcmp (tile + i * pixel, tile + (i + run) * pixel, pixel))
+        {
+          ++run;
+        }
+      if (run > 1)
+        {
+          header = TILE_CACHE_REPEAT | (run - 1);
+          if (size + sizeof (header) + pixel >= bytes)
+            {
+              return 0;
+            }
+          memcpy (out + size, &header, sizeof (header));
+          memcpy (out + size + sizeof (header), tile + i * pixel, pixel);
+          size += sizeof (header) + pixel;
+        }
+      else
+        { /* Up to the start of the next repeat. */
+          while (i + run < IMAGE_TILE_PIXELS
+                 && (i + run + 1 == IMAGE_TILE_PIXELS
+                     || memcmp (tile + (i + run) * pixel,
+                                tile + (i + run + 1) * pixel, pixel)))
+            {
+              ++run;
+            }
+          header = run - 1;
+          if (size + sizeof (header) + run * pixel >= bytes)
+            {
+              return 0;
+            }
+          memcpy (out + size, &header, sizeof (header));
+          memcpy (out + size + sizeof (header), tile + i * pixel,
+                  run * pixel);
+          size += sizeof (header) + run * pixel;
+        }
+      i += run;
+    }
+  return size;
+}
+
+void
+tile_decode (const uint8_t *in, size_t size, size_t pixel, uint8_t *tile)
+{
+  const uint8_t *end = in + size;
+  unsigned int i = 0;
+  while (in + sizeof (uint16_t) <= end && i < IMAGE_TILE_PIXELS)
+    {
+      uint16_t header;
+      memcpy (&header, in, sizeof (header));
+      in += sizeof (header);
+      unsigned int run = (header & ~TILE_CACHE_REPEAT) + 1;
+      run = run < IMAGE_TILE_PIXELS - i ? run : IMAGE_TILE_PIXELS - i;
+      if (header & TILE_CACHE_REPEAT)
+        {
+          unsigned int k;
+          for (k = 0; k < run; ++k)
+            {
+              memcpy (tile + (i + k) * pixel, in, pixel);
+            }
+          in += pixel;
+        }
+      else
+        {
+          memcpy (tile + i * pixel, in, run * pixel);
+          in += run * pixel;
+        }
+      i += run;
+    }
+}
+
+static void
+tile_cache_release_slot (TileCache *cache, TileSwap *swap)
+{
+  if (swap->slot)
+    {
+      if (cache->free_count == cache->free_capacity)
+        {
+          cache->free_capacity = cache->free_capacity * 2 + 64;
+          cache->free_slots = realloc (
+              cache->free_slots, sizeof (uint32_t) * cache->free_capacity);
+        }
+      cache->free_slots[cache->free_count++] = swap->slot;
+    }
+  swap->slot = 0;
+  swap->size = 0;
+}
+
+/* Forget the copy of a tile compressed in memory. */
+static void
+tile_cache_drop_packed (TileCache *cache, TileSwap *swap)
+{
+  if (swap->packed != NULL)
+    {
+      free (swap->packed);
+      cache->resident -= swap->packed_size;
+      cache->packed_count -= 1;
+    }
+  swap->packed = NULL;
+  swap->packed_size = 0;
+}
+
+/* A tile that changed is stored from now on instead of converted from its
+   source again. */
+static void
+tile_cache_drop_source (image_t *image, unsigned int index)
+{
+  if (image->sources != NULL)
+    {
+      image->sources[index] = NULL;
+    }
+}
+
+/* Free a tile in memory, whose contents are stored elsewhere. */
+static void
+tile_cache_free_tile (TileCache *cache, image_t *image, unsigned int index)
+{
+  free (image->tiles[index]);
+  image->tiles[index] = NULL;
+  cache->resident -= image_tile_bytes (image);
+}
+
+/* Bring a tile into memory, with the lock held. */
+static color *
+tile_cache_load (TileCache *cache, image_t *image, unsigned int index)
+{
+  TileSwap *swap = image->tile_swap + index;
+  const size_t bytes = image_tile_bytes (image);
+  color *tile = image->tiles[index];
+  if (tile != NULL)
+    {
+      return tile;
+    }
+  tile = aligned_alloc (32, bytes);
+  if (swap->packed != NULL)
+    { /* Kept, it stays good until the tile changes. */
+      tile_decode (swap->packed, swap->packed_size, bytes / IMAGE_TILE_PIXELS,
+                   (uint8_t *)tile);
+    }
+  else if (image->sources != NULL && image->sources[index] != NULL)
+    {
+      image_tile_convert (image, index, tile);
+    }
+  else if (!swap->slot)
+    {
+      memset ((void *)tile, 0, bytes);
+    }
+  else if (swap->size == bytes
+               ? !pread_all (cache->fd, tile, bytes,
+                            (off_t)swap->slot * TILE_CACHE_BYTES)
+               : !pread_all (cache->fd, cache->buffer, swap->size,
+                            (off_t)swap->slot * TILE_CACHE_BYTES))
+    {
+      perror ("tile cache");
+      memset ((void *)tile, 0, bytes);
+    }
+  else if (swap->size != bytes)
+    {
+      tile_decode (cache->buffer, swap->size, bytes / IMAGE_TILE_PIXELS,
+                   (uint8_t *)tile);
+    }
+  swap->use = cache->clock;
+  cache->resident += bytes;
+  __atomic_store_n (image->tiles + index, tile, __ATOMIC_RELEASE);
+  return tile;
+}
+
+/* Write a tile out if it changed since it was stored and free it. A tile
+   only compressed in memory is moved to the file as it is. */
+static void
+tile_cache_swap_out (TileCache *cache, image_t *image, unsigned int index)
+{
+  TileSwap *swap = image->tile_swap + index;
+  const size_t bytes = image_tile_bytes (image);
+  color *tile = image->tiles[index];
+  if (tile == NULL)
+    {
+      if (!swap->slot)
+        {
+          swap->slot = cache->free_count
+                           ? cache->free_slots[--cache->free_count]
+                           : ++cache->end_slot;
+        }
+      if (!pwrite_all (cache->fd, swap->packed, swap->packed_size,
+                       (off_t)swap->slot * TILE_CACHE_BYTES))
+        {
+          perror ("tile cache");
+          return;
+        }
+      swap->size = swap->packed_size;
+      tile_cache_drop_packed (cache, swap);
+      return;
+    }
+  /* Being compressed, nothing else holds its contents. */
+  if ((image->tile_flags[index] & IMAGE_TILE_STALE) || swap->packing)
+    {
+      tile_cache_drop_source (image, index);
+      tile_cache_drop_packed (cache, swap);
+      if (tile_is_empty (tile, bytes))
+        {
+          tile_cache_release_slot (cache, swap);
+        }
+      else
+        {
+          size_t size = tile_encode ((const uint8_t *)tile,
+                                     bytes / IMAGE_TILE_PIXELS,
+                                     cache->buffer);
+          const void *data = size ? (const void *)cache->buffer : tile;
+          if (!swap->slot)
+            {
+              swap->slot = cache->free_count
+                               ? cache->free_slots[--cache->free_count]
+                               : ++cache->end_slot;
+            }
+          if (!size)
+            {
+              size = bytes;
+            }
+          if (!pwrite_all (cache->fd, data, size,
+                           (off_t)swap->slot * TILE_CACHE_BYTES))
+            { /* Keep it in memory rather than lose it. */
+              perror ("tile cache");
+              return;
+            }
+          swap->size = size;
+        }
+      image->tile_flags[index] &= ~IMAGE_TILE_STALE;
+    }
+  swap->packing = 0;
+  tile_cache_free_tile (cache, image, index);
+}
+
+static int
+compare_use (const void *x, const void *y)
+{
+  const ResidentTile *a = x, *b = y;
+  return a->use < b->use ? -1 : a->use > b->use;
+}
+
+/* Swap out the least recently used tiles, down to 7/8 of the budget so that
+   this does not have to happen again on the next trim. */
+static void
+tile_cache_evict (TileCache *cache)
+{
+  /* The smallest tiles, of 16 bit images, are half a slot, compressed
+     ones can be anything. */
+  const size_t capacity
+      = cache->resident / (TILE_CACHE_BYTES / 2) + cache->packed_count;
+  ResidentTile *tiles = malloc (sizeof (ResidentTile) * capacity);
+  const size_t target = cache->budget - cache->budget / 8;
+  size_t count = 0;
+  size_t i;
+  for (i = 0; i < cache->image_count; ++i)
+    {
+      image_t *image = cache->images[i];
+      const unsigned int n = image->tiles_across * image->tiles_down;
+      unsigned int index;
+      for (index = 0; index < n && count < capacity; ++index)
+        {
+          if (image->tiles[index] != NULL
+              || image->tile_swap[index].packed != NULL)
+            {
+              tiles[count].image = image;
+              tiles[count].index = index;
+              tiles[count].use = image->tile_swap[index].use;
+              ++count;
+            }
+        }
+    }
+  qsort (tiles, count, sizeof (ResidentTile), compare_use);
+  for (i = 0; i < count && cache->resident > target; ++i)
+    {
+      tile_cache_swap_out (cache, tiles[i].image, tiles[i].index);
+    }
+  free (tiles);
+}
+
+/* Take the tiles in memory that were not used since the last look as the
+   next batch to compress, with the lock held. */
+static void
+tile_cache_find_idle (TileCache *cache)
+{
+  const uint32_t before = cache->idle_clock;
+  size_t i;
+  cache->idle_clock = ++cache->clock;
+  cache->batch = cache->batch + 1 ? cache->batch + 1 : 1;
+  cache->packing_count = 0;
+  for (i = 0; i < cache->image_count; ++i)
+    {
+      image_t *image = cache->images[i];
+      const unsigned int n = image->tiles_across * image->tiles_down;
+      unsigned int index;
+      for (index = 0; index < n; ++index)
+        {
+          TileSwap *swap = image->tile_swap + index;
+          if (image->tiles[index] == NULL
+              || (int32_t)(swap->use - before) >= 0)
+            {
+              continue;
+            }
+          if (cache->packing_count == cache->packing_capacity)
+            {
+              cache->packing_capacity = cache->packing_capacity * 2 + 64;
+              cache->packings
+                  = realloc (cache->packings, sizeof (TilePacking)
+                                                  * cache->packing_capacity);
+            }
+          TilePacking *packing = cache->packings + cache->packing_count++;
+          packing->image = image;
+          packing->index = index;
+          packing->packed = NULL;
+          packing->size = 0;
+          packing->is_blank = 0;
+          swap->packing = cache->batch;
+        }
+    }
+  if (cache->packing_count)
+    {
+      cache->pack_step = TILE_PACK_FOUND;
+    }
+}
+
+/* Whether a tile of the batch is still in memory and in the batch. */
+static int
+tile_cache_is_packing (const TileCache *cache, const TilePacking *packing)
+{
+  return packing->image != NULL
+         && packing->image->tiles[packing->index] != NULL
+         && packing->image->tile_swap[packing->index].packing
+                == cache->batch;
+}
+
+/* Compress the next tile of the batch, with the lock held. */
+static void
+tile_cache_encode_next (TileCache *cache)
+{
+  TilePacking *packing = cache->packings + cache->packing_next++;
+  if (tile_cache_is_packing (cache, packing))
+    {
+      const image_t *image = packing->image;
+      const size_t bytes = image_tile_bytes (image);
+      const color *tile = image->tiles[packing->index];
+      if (tile_is_empty (tile, bytes))
+        {
+          packing->is_blank = 1;
+        }
+      else
+        {
+          packing->size = tile_encode ((const uint8_t *)tile,
+                                       bytes / IMAGE_TILE_PIXELS,
+                                       cache->buffer);
+          if (packing->size)
+            {
+              packing->packed = malloc (packing->size);
+              memcpy (packing->packed, cache->buffer, packing->size);
+            }
+        }
+    }
+  if (cache->packing_next == cache->packing_count)
+    {
+      cache->pack_step = TILE_PACK_ENCODED;
+    }
+}
+
+/* Take the batch a step further where only tile_cache_trim can, with the
+   lock held: before compressing, forget the stored copies of the tiles
+   that changed, so that changes from now on show as stale; afterwards,
+   free the tiles that did not change meanwhile. */
+static void
+tile_cache_settle (TileCache *cache)
+{
+  size_t i;
+  for (i = 0; i < cache->packing_count; ++i)
+    {
+      TilePacking *packing = cache->packings + i;
+      image_t *image = packing->image;
+      if (!tile_cache_is_packing (cache, packing))
+        {
+          free (packing->packed);
+          packing->image = NULL;
+          continue;
+        }
+      TileSwap *swap = image->tile_swap + packing->index;
+      uint8_t *flags = image->tile_flags + packing->index;
+      if (cache->pack_step == TILE_PACK_FOUND)
+        {
+          if (!(*flags & IMAGE_TILE_STALE)
+              && (swap->packed != NULL || !swap->slot))
+            { /* Already compressed, blank, or converted from its source
+                 again when it is used. */
+              tile_cache_free_tile (cache, image, packing->index);
+              swap->packing = 0;
+              packing->image = NULL;
+              continue;
+            }
+          *flags &= ~IMAGE_TILE_STALE;
+          tile_cache_drop_source (image, packing->index);
+          tile_cache_release_slot (cache, swap);
+          tile_cache_drop_packed (cache, swap);
+          continue;
+        }
+      swap->packing = 0;
+      if (*flags & IMAGE_TILE_STALE)
+        {
+          free (packing->packed);
+        }
+      else if (packing->packed == NULL && !packing->is_blank)
+        { /* Does not compress, it stays as it is. */
+          *flags |= IMAGE_TILE_STALE;
+          swap->use = cache->clock;
+        }
+      else
+        {
+          tile_cache_free_tile (cache, image, packing->index);
+          if (packing->packed != NULL)
+            {
+              swap->packed = packing->packed;
+              swap->packed_size = packing->size;
+              cache->resident += packing->size;
+              cache->packed_count += 1;
+            }
+        }
+    }
+  if (cache->pack_step == TILE_PACK_FOUND)
+    {
+      cache->pack_step = TILE_PACK_ENCODE;
+      cache->packing_next = 0;
+      pthread_cond_signal (&cache->wake);
+    }
+  else
+    { /* The tiles were freed among smaller blocks, give their pages back
+         to the system. */
+      cache->pack_step = TILE_PACK_NONE;
+      cache->packing_count = 0;
+      malloc_trim (0);
+    }
+}
+
+/* Loads tiles asked for ahead of time and, every so often, compresses the
+   tiles that were idle meanwhile. */
+static void *
+tile_cache_prefetcher (void *data)
+{
+  TileCache *cache = data;
+  struct timespec look;
+  clock_gettime (CLOCK_REALTIME, &look);
+  look.tv_sec += cache->idle_seconds;
+  pthread_mutex_lock (&cache->lock);
+  while (!cache->is_closing)
+    {
+      if (cache->queue_tail != cache->queue_head)
+        {
+          TileRequest request
+              = cache->queue[cache->queue_tail++ & (TILE_CACHE_QUEUE - 1)];
+          if (request.image != NULL)
+            {
+              tile_cache_load (cache, request.image, request.index);
+            }
+        }
+      else if (cache->pack_step == TILE_PACK_ENCODE)
+        {
+          tile_cache_encode_next (cache);
+        }
+      else if (!cache->idle_seconds)
+        {
+          pthread_cond_wait (&cache->wake, &cache->lock);
+          continue;
+        }
+      else
+        {
+          if (pthread_cond_timedwait (&cache->wake, &cache->lock, &look)
+              == ETIMEDOUT)
+            {
+              if (cache->pack_step == TILE_PACK_NONE)
+                {
+                  tile_cache_find_idle (cache);
+                }
+              clock_gettime (CLOCK_REALTIME, &look);
+              look.tv_sec += cache->idle_seconds;
+            }
+          continue;
+        }
+      /* Let painting threads that miss get in between. */
+      pthread_mutex_unlock (&cache->lock);
+      pthread_mutex_lock (&cache->lock);
+    }
+  pthread_mutex_unlock (&cache->lock);
+  return NULL;
+}
+
+/* Caches made for canvases that are in use at the same time. */
+static int tile_cache_sharers = 1;
+
+void
+tile_cache_share_budget (int caches)
+{
+  tile_cache_sharers = caches > 1 ? caches : 1;
+}
+
+TileCache *
+tile_cache_new_for_canvas (int width, int height)
+{
+  const char *megabytes = getenv ("FLOATING_TILE_CACHE_MB");
+  const char *directory = getenv ("TMPDIR");
+  const char *seconds = getenv ("FLOATING_IDLE_SECONDS");
+  const int idle_seconds
+      = seconds != NULL ? atoi (seconds) : TILE_CACHE_IDLE_SECONDS;
+  const size_t memory
+      = (size_t)sysconf (_SC_PHYS_PAGES) * sysconf (_SC_PAGESIZE);
+  const size_t layer = (size_t)((width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT)
+                       * ((height + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT)
+                       * TILE_CACHE_BYTES;
+  size_t budget = memory / 2 / tile_cache_sharers;
+  if (megabytes != NULL)
+    {
+      budget = ((size_t)atol (megabytes) << 20) / tile_cache_sharers;
+    }
+  else if (2 * layer <= budget)
+    { /* In memory, only compressing idle tiles. */
+      return idle_seconds > 0 ? tile_cache_new (0, NULL, idle_seconds)
+                              : NULL;
+    }
+  return tile_cache_new (budget, directory ? directory : "/var/tmp",
+                         idle_seconds);
+}
+
+TileCache *
+tile_cache_new (size_t budget, const char *directory, int idle_seconds)
+{
+  int fd = -1;
+  if (directory != NULL)
+    {
+      char *file_name
+          = malloc (strlen (directory) + sizeof ("/floating-XXXXXX"));
+      sprintf (file_name, "%s/floating-XXXXXX", directory);
+      fd = mkstemp (file_name);
+      if (fd < 0)
+        {
+          perror (file_name);
+          free (file_name);
+          return NULL;
+        }
+      /* The scratch file goes away with the process, even after a crash. */
+      unlink (file_name);
+      free (file_name);
+    }
+  TileCache *cache = calloc (1, sizeof (TileCache));
+  cache->budget = directory != NULL ? budget : SIZE_MAX;
+  if (cache->budget < 64 * TILE_CACHE_BYTES)
+    {
+      cache->budget = 64 * TILE_CACHE_BYTES;
+    }
+  cache->idle_seconds = idle_seconds > 0 ? idle_seconds : 0;
+  cache->fd = fd;
+  cache->buffer = malloc (TILE_CACHE_BYTES);
+  pthread_mutex_init (&cache->lock, NULL);
+  pthread_cond_init (&cache->wake, NULL);
+  pthread_create (&cache->thread, NULL, tile_cache_prefetcher, cache);
+  if (directory != NULL)
+    {
+      printf ("Painting out of core with a %zu MB tile cache\n",
+              cache->budget >> 20);
+    }
+  return cache;
+}
+
+void
+tile_cache_del (TileCache *cache)
+{
+  size_t i;
+  if (cache == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  cache->is_closing = 1;
+  pthread_cond_signal (&cache->wake);
+  pthread_mutex_unlock (&cache->lock);
+  pthread_join (cache->thread, NULL);
+  pthread_cond_destroy (&cache->wake);
+  pthread_mutex_destroy (&cache->lock);
+  if (cache->fd >= 0)
+    {
+      close (cache->fd);
+    }
+  for (i = 0; i < cache->packing_count; ++i)
+    {
+      free (cache->packings[i].packed);
+    }
+  free (cache->packings);
+  free (cache->buffer);
+  free (cache->free_slots);
+  free (cache->images);
+  free (cache);
+}
+
+/* Add an image to those of the cache, with the lock held. */
+static void
+tile_cache_add_locked (TileCache *cache, image_t *image)
+{
+  if (cache->image_count == cache->image_capacity)
+    {
+      cache->image_capacity = cache->image_capacity * 2 + 8;
+      cache->images = realloc (cache->images,
+                               sizeof (image_t *) * cache->image_capacity);
+    }
+  cache->images[cache->image_count++] = image;
+}
+
+void
+tile_cache_add (TileCache *cache, image_t *image)
+{
+  pthread_mutex_lock (&cache->lock);
+  tile_cache_add_locked (cache, image);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+void
+tile_cache_adopt (TileCache *cache, image_t *image)
+{
+  const unsigned int n = image->tiles_across * image->tiles_down;
+  const size_t bytes = image_tile_bytes (image);
+  color **tiles = image->tiles;
+  unsigned int index;
+  if (cache == NULL || image->cache != NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  /* The cache only ever frees tiles it allocated, so the others are
+     copied into tiles of its own as the table is filled again, and the
+     budget kept to meanwhile. */
+  image->tiles = calloc (n, sizeof (color *));
+  image->tile_swap = calloc (n, sizeof (TileSwap));
+  image->cache = cache;
+  tile_cache_add_locked (cache, image);
+  for (index = 0; index < n; ++index)
+    {
+      color *tile = tiles[index];
+      const int is_converted
+          = image->sources != NULL && image->sources[index] != NULL;
+      if (tile == NULL || (is_converted && tile == image->sources[index]))
+        { /* Converted from the source when it is used. */
+          continue;
+        }
+      if (!is_converted)
+        {
+          if (tile_is_empty (tile, bytes))
+            {
+              continue;
+            }
+          tile = aligned_alloc (32, bytes);
+          memcpy ((void *)tile, tiles[index], bytes);
+          image->tile_flags[index] |= IMAGE_TILE_STALE;
+        }
+      image->tile_swap[index].use = cache->clock;
+      cache->resident += bytes;
+      __atomic_store_n (image->tiles + index, tile, __ATOMIC_RELEASE);
+      if (cache->resident > cache->budget)
+        {
+          tile_cache_evict (cache);
+        }
+    }
+  pthread_mutex_unlock (&cache->lock);
+  free (tiles);
+  free (image->storage);
+  image->storage = NULL;
+}
+
+void
+tile_cache_forget (image_t *image)
+{
+  TileCache *cache = image->cache;
+  const unsigned int n = image->tiles_across * image->tiles_down;
+  unsigned int index;
+  size_t i;
+  if (cache == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  for (i = cache->queue_tail; i != cache->queue_head; ++i)
+    {
+      TileRequest *request = cache->queue + (i & (TILE_CACHE_QUEUE - 1));
+      if (request->image == image)
+        {
+          request->image = NULL;
+        }
+    }
+  for (i = 0; i < cache->packing_count; ++i)
+    {
+      if (cache->packings[i].image == image)
+        {
+          cache->packings[i].image = NULL;
+        }
+    }
+  for (index = 0; index < n; ++index)
+    {
+      if (image->tiles[index] != NULL)
+        {
+          free (image->tiles[index]);
+          image->tiles[index] = NULL;
+          cache->resident -= image_tile_bytes (image);
+        }
+      tile_cache_release_slot (cache, image->tile_swap + index);
+      tile_cache_drop_packed (cache, image->tile_swap + index);
+    }
+  for (i = 0; i < cache->image_count; ++i)
+    {
+      if (cache->images[i] == image)
+        {
+          cache->images[i] = cache->images[--cache->image_count];
+          break;
+        }
+    }
+  pthread_mutex_unlock (&cache->lock);
+}
+
+color *
+tile_cache_fault (image_t *image, unsigned int index)
+{
+  TileCache *cache = image->cache;
+  pthread_mutex_lock (&cache->lock);
+  color *tile = tile_cache_load (cache, image, index);
+  pthread_mutex_unlock (&cache->lock);
+  return tile;
+}
+
+void
+tile_cache_trim (TileCache *cache)
+{
+  if (cache == NULL)
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  cache->clock += 1;
+  if (cache->pack_step == TILE_PACK_FOUND
+      || cache->pack_step == TILE_PACK_ENCODED)
+    {
+      tile_cache_settle (cache);
+    }
+  if (cache->resident > cache->budget)
+    {
+      tile_cache_evict (cache);
+    }
+  pthread_mutex_unlock (&cache->lock);
+}
+
+/* Clip an area to the image, in tiles. Returns 0 if nothing is left. */
+static int
+tile_range (const image_t *image, int x, int y, int width, int height,
+            unsigned int *x0, unsigned int *y0, unsigned int *x1,
+            unsigned int *y1)
+{
+  const int left = x > 0 ? x : 0;
+  const int top = y > 0 ? y : 0;
+  const int right = x + width < (int)image->width ? x + width
+                                                  : (int)image->width;
+  const int bottom = y + height < (int)image->height ? y + height
+                                                     : (int)image->height;
+  if (left >= right || top >= bottom)
+    {
+      return 0;
+    }
+  *x0 = left >> IMAGE_TILE_SHIFT;
+  *y0 = top >> IMAGE_TILE_SHIFT;
+  *x1 = (right - 1) >> IMAGE_TILE_SHIFT;
+  *y1 = (bottom - 1) >> IMAGE_TILE_SHIFT;
+  return 1;
+}
+
+void
+tile_cache_touch (image_t *image, int x, int y, int width, int height)
+{
+  TileCache *cache = image->cache;
+  unsigned int x0, y0, x1, y1, i, j;
+  if (cache == NULL || !tile_range (image, x, y, width, height, &x0, &y0,
+                                    &x1, &y1))
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  for (j = y0; j <= y1; ++j)
+    {
+      for (i = x0; i <= x1; ++i)
+        {
+          image->tile_swap[j * image->tiles_across + i].use = cache->clock;
+        }
+    }
+  pthread_mutex_unlock (&cache->lock);
+}
+
+void
+tile_cache_prefetch (image_t *image, int x, int y, int width, int height)
+{
+  TileCache *cache = image->cache;
+  unsigned int x0, y0, x1, y1, i, j;
+  if (cache == NULL || !tile_range (image, x, y, width, height, &x0, &y0,
+                                    &x1, &y1))
+    {
+      return;
+    }
+  pthread_mutex_lock (&cache->lock);
+  for (j = y0; j <= y1; ++j)
+    {
+      for (i = x0; i <= x1; ++i)
+        {
+          const unsigned int index = j * image->tiles_across + i;
+          if (image->tiles[index] == NULL
+              && (image->tile_swap[index].slot
+                  || image->tile_swap[index].packed != NULL)
+              && cache->queue_head - cache->queue_tail < TILE_CACHE_QUEUE)
+            {
+              TileRequest *request
+                  = cache->queue
+                    + (cache->queue_head++ & (TILE_CACHE_QUEUE - 1));
+              request->image = image;
+              request->index = index;
+            }
+        }
+    }
+  pthread_cond_signal (&cache->wake);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+int
+tile_cache_is_blank (const image_t *image, unsigned int index)
+{
+  return image->cache != NULL && image->tiles[index] == NULL
+         && !image->tile_swap[index].slot
+         && image->tile_swap[index].packed == NULL
+         && (image->sources == NULL || image->sources[index] == NULL);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <stddef.h>
+
+#include "image.h"
+
+/* Out of core painting: the tiles of cached images are allocated as they
+   are first used, and the least recently used ones are swapped out to a
+   scratch file once more than the budget is in memory. Tiles are only
+   swapped out by tile_cache_trim, which must be called where no tile
+   pointers are held (between dabs, between bands of update and so on).
+   All functions do nothing for a NULL cache or an image without one.
+
+   Tiles that have not been used for a while are also compressed in memory
+   by a background thread, with the same run length coding as the scratch
+   file, and decompressed again when they are next used. Most of a layer
+   that is not being painted on is transparent or flat, so this shrinks
+   idle layers several times over. The tiles are only freed by
+   tile_cache_trim, for the same reason as above. */
+
+typedef struct TileSwap TileSwap;
+
+struct TileSwap
+{
+  uint8_t *packed; /* Compressed in memory, NULL if not. */
+  uint32_t packed_size;
+  uint32_t slot; /* In the scratch file, 0 if the tile was never stored. */
+  uint32_t size; /* Stored bytes, less than a tile if compressed. */
+  uint32_t use;  /* When it was last used, for the LRU order. */
+  uint32_t packing; /* Of the batch being compressed, 0 if not in it. */
+};
+
+/* A cache for painting a canvas of this size out of core, or only to
+   compress idle tiles if its layers fit in memory. The budget defaults to
+   half of the physical memory and can be set with FLOATING_TILE_CACHE_MB,
+   which also forces swapping on. Tiles are idle after
+   FLOATING_IDLE_SECONDS (30 by default) without being used, 0 turning
+   compression off; NULL is returned if there is nothing left to do. */
+TileCache *tile_cache_new_for_canvas (int width, int height);
+
+/* Split the budget of the caches made for canvases from now on between as
+   many caches in use at the same time, e.g. by threads rendering that many
+   documents. Caches are not shared between threads, as each trims its own
+   whenever it holds no tile pointers, which another thread could. */
+void tile_cache_share_budget (int caches);
+
+/* Without a directory nothing is swapped out and the budget is ignored. */
+TileCache *tile_cache_new (size_t budget, const char *directory,
+                           int idle_seconds);
+void tile_cache_del (TileCache *cache);
+
+/* Register an image whose tiles are managed by the cache. */
+void tile_cache_add (TileCache *cache, image_t *image);
+
+/* Hand the tiles of an image made in memory, loaded from a file or
+   converted from a document, over to the cache, which manages them from
+   then on as it does those of its own images. Tiles still to be converted
+   from their sources are converted when they are first used and, as long
+   as they do not change, dropped again instead of being stored. */
+void tile_cache_adopt (TileCache *cache, image_t *image);
+
+/* Bring a tile of a cached image back, called by image_tile. */
+color *tile_cache_fault (image_t *image, unsigned int index);
+
+/* Swap out tiles until the cache is within its budget. */
+void tile_cache_trim (TileCache *cache);
+
+/* Mark the tiles of an area as used now. */
+void tile_cache_touch (image_t *image, int x, int y, int width, int height);
+
+/* Load the swapped out tiles of an area in the background. */
+void tile_cache_prefetch (image_t *image, int x, int y, int width,
+                          int height);
+
+/* The run length coding of stored tiles, for tiles of pixels of a given
+   size in bytes. Encoding returns 0 if the result would not be smaller
+   than the tile. */
+size_t tile_encode (const uint8_t *tile, size_t pixel, uint8_t *out);
+void tile_decode (const uint8_t *in, size_t size, size_t pixel,
+                  uint8_t *tile);
+
+/* Whether a tile is known to be transparent without loading it. */
+int tile_cache_is_blank (const image_t *image, unsigned int index);
+
+/* Drop everything the cache knows about an image, called by image_del. */
+void tile_cache_forget (image_t *image);
@@ -0,0 +1,55 @@
+/* Turn a recording made with FLOATING_TIMELAPSE back into TIFF frames. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recorder.h"
+#include "tiff_io.h"
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr, "Usage: %s recording.timelapse prefix [every]\n",
+           program);
+}
+
+int
+main (int argc, char **args)
+{
+  const int every = argc > 3 ? atoi (args[3]) : 1;
+  int width, height;
+  double seconds;
+  size_t frame = 0, saved = 0;
+  if (argc < 3 || argc > 4 || every < 1)
+    {
+      usage (args[0]);
+      return 1;
+    }
+  Playback *playback = playback_open (args[1], &width, &height);
+  if (playback == NULL)
+    {
+      return 1;
+    }
+  uint8_t *pixels = malloc (4 * (size_t)width * height);
+  char *file_name = malloc (strlen (args[2]) + 16);
+  while (playback_next (playback, pixels, &seconds))
+    {
+      if (frame++ % every)
+        {
+          continue;
+        }
+      sprintf (file_name, "%s%06zu.tif", args[2], saved);
+      if (!tiff_io_save_rgba8 (file_name, pixels, width, height))
+        {
+          fprintf (stderr, "%s: could not be created\n", file_name);
+          break;
+        }
+      ++saved;
+    }
+  printf ("Saved %zu of %zu frames to %s*.tif\n", saved, frame, args[2]);
+  free (file_name);
+  free (pixels);
+  playback_close (playback);
+  return 0;
+}
@@ -0,0 +1,124 @@
+#include "trace.h"
+#include "io.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_EVENTS 4096
+
+typedef struct TraceRecord TraceRecord;
+typedef struct TraceBuffer TraceBuffer;
+
+struct TraceRecord
+{
+  uint64_t time; /* Nanoseconds. */
+  const char *name;
+  char phase;
+};
+
+/* Events are collected per thread and only written out, under the lock,
+   when a buffer is full or the trace is closed. */
+struct TraceBuffer
+{
+  TraceRecord records[TRACE_BUFFER_EVENTS];
+  unsigned int count;
+  long thread_id;
+  TraceBuffer *next;
+};
+
+int trace_is_enabled = 0;
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic (TraceBuffer *) trace_buffers;
+static _Thread_local TraceBuffer *local_buffer;
+
+static void
+trace_flush (TraceBuffer *buffer)
+{
+  const int pid = getpid ();
+  unsigned int i;
+  pthread_mutex_lock (&trace_lock);
+  if (trace_file != NULL)
+    {
+      for (i = 0; i < buffer->count; ++i)
+        {
+          const TraceRecord *record = buffer->records + i;
+          fprintf (trace_file,
+                   "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                   "\"pid\":%d,\"tid\":%ld},\n",
+                   record->name, record->phase, record->time / 1000.0, pid,
+                   buffer->thread_id);
+        }
+    }
+  buffer->count = 0;
+  pthread_mutex_unlock (&trace_lock);
+}
+
+void
+trace_open (const char *file_name)
+{
+  trace_file = fopen (file_name, "w");
+  if (trace_file == NULL)
+    {
+      perror (file_name);
+      return;
+    }
+  fprintf (trace_file, "[\n");
+  trace_is_enabled = 1;
+  printf ("Tracing to %s\n", file_name);
+}
+
+void
+trace_close (void)
+{
+  TraceBuffer *buffer;
+  if (trace_file == NULL)
+    {
+      return;
+    }
+  trace_is_enabled = 0;
+  for (buffer = atomic_load (&trace_buffers); buffer != NULL;
+       buffer = buffer->next)
+    {
+      trace_flush (buffer);
+    }
+  pthread_mutex_lock (&trace_lock);
+  fprintf (trace_file,
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":\"draw\"}}\n]\n",
+           (int)getpid ());
+  fclose (trace_file);
+  trace_file = NULL;
+  pthread_mutex_unlock (&trace_lock);
+}
+
+void
+trace_event (const char *name, char phase)
+{
+  TraceBuffer *buffer = local_buffer;
+  if (buffer == NULL)
+    {
+      buffer = calloc (1, sizeof (TraceBuffer));
+      buffer->thread_id = syscall (SYS_gettid);
+      buffer->next = atomic_load (&trace_buffers);
+      while (!atomic_compare_exchange_weak (&trace_buffers, &buffer->next,
+                                            buffer))
+        {
+        }
+      local_buffer = buffer;
+    }
+  if (buffer->count == TRACE_BUFFER_EVENTS)
+    {
+      trace_flush (buffer);
+    }
+  TraceRecord *record = buffer->records + buffer->count++;
+  record->time = monotonic_nanoseconds ();
+  record->name = name;
+  record->phase = phase;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+/* Optional tracing of the paint pipeline to a file in the Chrome trace
+   event format (chrome://tracing, ui.perfetto.dev). It is off unless
+   trace_open is called, and then costs a test of a global flag per event.
+   Building with -DTRACE_DISABLED removes even that. Event names must be
+   string literals, they are only written out later. */
+
+extern int trace_is_enabled;
+
+void trace_open (const char *file_name);
+void trace_close (void);
+
+/* Phase 'B' begins and 'E' ends a span on the calling thread. */
+void trace_event (const char *name, char phase);
+
+static inline void
+trace_begin (const char *name)
+{
+#ifndef TRACE_DISABLED
+  if (trace_is_enabled)
+    {
+      trace_event (name, 'B');
+    }
+#endif
+}
+
+static inline void
+trace_end (const char *name)
+{
+#ifndef TRACE_DISABLED
+  if (trace_is_enabled)
+    {
+      trace_event (name, 'E');
+    }
+#endif
+}
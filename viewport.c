@@ -0,0 +1,376 @@
+#include "viewport.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VIEWPORT_LEVEL_MIN 16 /* Smallest level size worth keeping. */
+
+static int
+floor_div (int x, int y)
+{
+  return x >= 0 ? x / y : -((-x + y - 1) / y);
+}
+
+static int
+viewport_level (const Viewport *viewport)
+{
+  return viewport->zoom < 0 ? -viewport->zoom : 0;
+}
+
+/* Put a canvas position at the center of the window, keeping the window
+   origin on a pixel of the current level and some of the canvas in view. */
+static void
+viewport_center (Viewport *viewport, double x, double y)
+{
+  const int step = 1 << viewport_level (viewport);
+  const double visible_width = ldexp (viewport->width, -viewport->zoom);
+  const double visible_height = ldexp (viewport->height, -viewport->zoom);
+  const MipLevel *canvas = viewport->levels;
+  x -= visible_width / 2;
+  y -= visible_height / 2;
+  x = fmax (-visible_width / 2, fmin (x, canvas->width - visible_width / 2));
+  y = fmax (-visible_height / 2,
+            fmin (y, canvas->height - visible_height / 2));
+  viewport->x = floor_div ((int)floor (x), step) * step;
+  viewport->y = floor_div ((int)floor (y), step) * step;
+}
+
+static void
+viewport_window_center (const Viewport *viewport, double *x, double *y)
+{
+  viewport_to_canvas (viewport, viewport->width / 2.0,
+                      viewport->height / 2.0, x, y);
+}
+
+static int
+level_bands (const MipLevel *level)
+{
+  return (level->height + (1 << VIEWPORT_BAND_SHIFT) - 1)
+         >> VIEWPORT_BAND_SHIFT;
+}
+
+/* A row of a level, NULL if its band was not allocated. */
+static uint32_t *
+level_row (const MipLevel *level, int y)
+{
+  uint32_t *band = level->bands[y >> VIEWPORT_BAND_SHIFT];
+  if (band == NULL)
+    {
+      return NULL;
+    }
+  return band + (y & ((1 << VIEWPORT_BAND_SHIFT) - 1)) * level->width;
+}
+
+/* Allocate a band of a level, showing the background until drawn to. */
+static void
+viewport_reserve_band (Viewport *viewport, int level, int band)
+{
+  MipLevel *mip = viewport->levels + level;
+  const int rows = min (1 << VIEWPORT_BAND_SHIFT,
+                        mip->height - (band << VIEWPORT_BAND_SHIFT));
+  int row;
+  if (mip->bands[band] != NULL)
+    {
+      return;
+    }
+  mip->bands[band] = malloc (sizeof (uint32_t) * mip->width * rows);
+  for (row = 0; row < rows; ++row)
+    {
+      memcpy (mip->bands[band] + row * mip->width, viewport->background,
+              sizeof (uint32_t) * mip->width);
+    }
+}
+
+Viewport *
+viewport_new (int canvas_width, int canvas_height, int width, int height,
+              uint8_t background)
+{
+  Viewport *viewport = calloc (1, sizeof (Viewport));
+  int level_width = canvas_width;
+  int level_height = canvas_height;
+  int level;
+  viewport->width = width;
+  viewport->height = height;
+  viewport->level_count = 1;
+  while (max (level_width, level_height) > VIEWPORT_LEVEL_MIN)
+    {
+      level_width = (level_width + 1) / 2;
+      level_height = (level_height + 1) / 2;
+      viewport->level_count += 1;
+    }
+  viewport->levels = malloc (sizeof (MipLevel) * viewport->level_count);
+  viewport->background = malloc (sizeof (uint32_t) * canvas_width);
+  memset ((void *)viewport->background, background,
+          sizeof (uint32_t) * canvas_width);
+  level_width = canvas_width;
+  level_height = canvas_height;
+  for (level = 0; level < viewport->level_count; ++level)
+    {
+      MipLevel *mip = viewport->levels + level;
+      mip->width = level_width;
+      mip->height = level_height;
+      mip->bands = calloc (level_bands (mip), sizeof (uint32_t *));
+      level_width = (level_width + 1) / 2;
+      level_height = (level_height + 1) / 2;
+    }
+  /* Start zoomed out far enough to show the whole canvas. */
+  while (viewport->zoom > 1 - viewport->level_count
+         && (viewport->levels[-viewport->zoom].width > width
+             || viewport->levels[-viewport->zoom].height > height))
+    {
+      viewport->zoom -= 1;
+    }
+  return viewport;
+}
+
+void
+viewport_del (Viewport *viewport)
+{
+  int level, band;
+  for (level = 0; level < viewport->level_count; ++level)
+    {
+      MipLevel *mip = viewport->levels + level;
+      for (band = 0; band < level_bands (mip); ++band)
+        {
+          free (mip->bands[band]);
+        }
+      free (mip->bands);
+    }
+  free (viewport->levels);
+  free (viewport->background);
+  free (viewport);
+}
+
+void
+viewport_reserve (Viewport *viewport, int y, int height)
+{
+  const int y0 = max (y, 0);
+  const int y1 = min (y + height, viewport->levels[0].height);
+  int band;
+  for (band = y0 >> VIEWPORT_BAND_SHIFT;
+       y0 < y1 && band <= (y1 - 1) >> VIEWPORT_BAND_SHIFT; ++band)
+    {
+      viewport_reserve_band (viewport, 0, band);
+    }
+}
+
+uint32_t *
+viewport_canvas_row (Viewport *viewport, int y)
+{
+  return level_row (viewport->levels, y);
+}
+
+const uint32_t *
+viewport_row (const Viewport *viewport, int level, int y)
+{
+  const uint32_t *row = level_row (viewport->levels + level, y);
+  return row != NULL ? row : viewport->background;
+}
+
+/* Average 2x2 blocks of two source rows into one row, exactly, two output
+   pixels at a time. The last pixel of an odd width is its own neighbour. */
+static void
+downsample_row (const uint32_t *a, const uint32_t *b, uint32_t *out, int x0,
+                int x1, int source_width)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i rounding = _mm_set1_epi16 (2);
+  const int even = min (x1, source_width / 2);
+  int x = x0;
+  for (; x + 2 <= even; x += 2)
+    {
+      __m128i va = _mm_loadu_si128 ((const __m128i *)(a + 2 * x));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *)(b + 2 * x));
+      __m128i low = _mm_add_epi16 (_mm_unpacklo_epi8 (va, zero),
+                                   _mm_unpacklo_epi8 (vb, zero));
+      __m128i high = _mm_add_epi16 (_mm_unpackhi_epi8 (va, zero),
+                                    _mm_unpackhi_epi8 (vb, zero));
+      __m128i sum = _mm_add_epi16 (_mm_unpacklo_epi64 (low, high),
+                                   _mm_unpackhi_epi64 (low, high));
+      sum = _mm_srli_epi16 (_mm_add_epi16 (sum, rounding), 2);
+      _mm_storel_epi64 ((__m128i *)(out + x), _mm_packus_epi16 (sum, sum));
+    }
+  for (; x < x1; ++x)
+    {
+      const int right = min (2 * x + 1, source_width - 1);
+      const uint8_t *pa0 = (const uint8_t *)(a + 2 * x);
+      const uint8_t *pa1 = (const uint8_t *)(a + right);
+      const uint8_t *pb0 = (const uint8_t *)(b + 2 * x);
+      const uint8_t *pb1 = (const uint8_t *)(b + right);
+      uint8_t *po = (uint8_t *)(out + x);
+      int c;
+      for (c = 0; c < 4; ++c)
+        {
+          po[c] = (pa0[c] + pa1[c] + pb0[c] + pb1[c] + 2) >> 2;
+        }
+    }
+}
+
+void
+viewport_update_levels (Viewport *viewport, rect area)
+{
+  int x0 = max (area.x, 0);
+  int y0 = max (area.y, 0);
+  int x1 = min (area.x + area.width, viewport->levels[0].width);
+  int y1 = min (area.y + area.height, viewport->levels[0].height);
+  int level, band;
+  for (level = 1; level < viewport->level_count; ++level)
+    {
+      const MipLevel *source = viewport->levels + level - 1;
+      MipLevel *target = viewport->levels + level;
+      int y;
+      x0 >>= 1;
+      y0 >>= 1;
+      x1 = min ((x1 + 1) >> 1, target->width);
+      y1 = min ((y1 + 1) >> 1, target->height);
+      if (x0 >= x1 || y0 >= y1)
+        {
+          return;
+        }
+      /* A band stays the background as long as the two above it do. */
+      for (band = y0 >> VIEWPORT_BAND_SHIFT;
+           band <= (y1 - 1) >> VIEWPORT_BAND_SHIFT; ++band)
+        {
+          if (source->bands[2 * band] != NULL
+              || (2 * band + 1 < level_bands (source)
+                  && source->bands[2 * band + 1] != NULL))
+            {
+              viewport_reserve_band (viewport, level, band);
+            }
+        }
+#pragma omp parallel for
+      for (y = y0; y < y1; ++y)
+        {
+          uint32_t *row = level_row (target, y);
+          if (row == NULL)
+            {
+              continue;
+            }
+          downsample_row (viewport_row (viewport, level - 1, 2 * y),
+                          viewport_row (viewport, level - 1,
+                                        min (2 * y + 1, source->height - 1)),
+                          row, x0, x1, source->width);
+        }
+    }
+}
+
+rect
+viewport_window_area (const Viewport *viewport, rect area)
+{
+  rect window_area;
+  int x0, y0, x1, y1;
+  if (viewport->zoom >= 0)
+    {
+      const int scale = 1 << viewport->zoom;
+      x0 = (area.x - viewport->x) * scale;
+      y0 = (area.y - viewport->y) * scale;
+      x1 = (area.x + area.width - viewport->x) * scale;
+      y1 = (area.y + area.height - viewport->y) * scale;
+    }
+  else
+    {
+      const int step = 1 << -viewport->zoom;
+      x0 = floor_div (area.x - viewport->x, step);
+      y0 = floor_div (area.y - viewport->y, step);
+      x1 = -floor_div (viewport->x - area.x - area.width, step);
+      y1 = -floor_div (viewport->y - area.y - area.height, step);
+    }
+  x0 = max (x0, 0);
+  y0 = max (y0, 0);
+  x1 = min (x1, viewport->width);
+  y1 = min (y1, viewport->height);
+  window_area.x = x0;
+  window_area.y = y0;
+  window_area.width = max (x1 - x0, 0);
+  window_area.height = max (y1 - y0, 0);
+  return window_area;
+}
+
+void
+viewport_render (const Viewport *viewport, rect window_area, uint32_t *pixels)
+{
+  const int level = viewport_level (viewport);
+  const int shift = viewport->zoom > 0 ? viewport->zoom : 0;
+  const MipLevel *source = viewport->levels + level;
+  const int base_x = floor_div (viewport->x, 1 << level);
+  const int base_y = floor_div (viewport->y, 1 << level);
+  int row;
+#pragma omp parallel for
+  for (row = 0; row < window_area.height; ++row)
+    {
+      uint32_t *out = pixels + row * window_area.width;
+      const int sy = base_y + ((window_area.y + row) >> shift);
+      int column;
+      if (sy < 0 || sy >= source->height)
+        {
+          for (column = 0; column < window_area.width; ++column)
+            {
+              out[column] = VIEWPORT_OUTSIDE;
+            }
+          continue;
+        }
+      const uint32_t *in = viewport_row (viewport, level, sy);
+      if (!shift)
+        { /* One to one with the level, copy the part inside the canvas. */
+          const int sx = base_x + window_area.x;
+          const int start = min (max (-sx, 0), window_area.width);
+          const int end = max (min (source->width - sx, window_area.width),
+                               start);
+          for (column = 0; column < start; ++column)
+            {
+              out[column] = VIEWPORT_OUTSIDE;
+            }
+          memcpy (out + start, in + sx + start,
+                  sizeof (uint32_t) * (end - start));
+          for (column = end; column < window_area.width; ++column)
+            {
+              out[column] = VIEWPORT_OUTSIDE;
+            }
+          continue;
+        }
+      for (column = 0; column < window_area.width; ++column)
+        {
+          const int sx = base_x + ((window_area.x + column) >> shift);
+          out[column] = sx >= 0 && sx < source->width ? in[sx]
+                                                      : VIEWPORT_OUTSIDE;
+        }
+    }
+}
+
+void
+viewport_to_canvas (const Viewport *viewport, double x, double y,
+                    double *canvas_x, double *canvas_y)
+{
+  *canvas_x = viewport->x + ldexp (x, -viewport->zoom);
+  *canvas_y = viewport->y + ldexp (y, -viewport->zoom);
+}
+
+void
+viewport_zoom (Viewport *viewport, int zoom)
+{
+  double x, y;
+  viewport_window_center (viewport, &x, &y);
+  viewport->zoom = max (1 - viewport->level_count,
+                        min (zoom, VIEWPORT_ZOOM_MAX));
+  viewport_center (viewport, x, y);
+}
+
+void
+viewport_resize (Viewport *viewport, int width, int height)
+{
+  double x, y;
+  viewport_window_center (viewport, &x, &y);
+  viewport->width = width;
+  viewport->height = height;
+  viewport_center (viewport, x, y);
+}
+
+void
+viewport_pan (Viewport *viewport, int dx, int dy)
+{
+  double x, y;
+  viewport_window_center (viewport, &x, &y);
+  viewport_center (viewport, x + ldexp (dx, -viewport->zoom),
+                   y + ldexp (dy, -viewport->zoom));
+}
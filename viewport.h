@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+
+#include "drawing.h"
+
+/* The window shows the canvas through a viewport, a canvas position and a
+   power of two zoom. The composited canvas is kept as display ready pixels
+   (blended on the background) in a mip pyramid, so a zoomed out view reads
+   a downsampled level and costs as much as the window, not the canvas.
+   Levels are kept in bands of rows that are only allocated once something
+   is drawn to them, so that a large canvas that is mostly empty does not
+   cost a full size level up front. */
+
+#define VIEWPORT_ZOOM_MAX 4
+#define VIEWPORT_OUTSIDE 0x808080
+#define VIEWPORT_BAND_SHIFT IMAGE_TILE_SHIFT /* Rows of a band, as a power. */
+
+typedef struct Viewport Viewport;
+typedef struct MipLevel MipLevel;
+
+struct MipLevel
+{
+  uint32_t **bands; /* NULL where nothing was drawn, the background. */
+  int width, height;
+};
+
+struct Viewport
+{
+  int width, height; /* Of the window. */
+  int x, y;          /* Canvas position shown at the top left corner. */
+  int zoom;          /* The scale is 2^zoom, negative zooms out. */
+  MipLevel *levels;  /* Level 0 is the full size canvas. */
+  int level_count;
+  uint32_t *background; /* A row of it as wide as the canvas. */
+};
+
+Viewport *viewport_new (int canvas_width, int canvas_height, int width,
+                        int height, uint8_t background);
+void viewport_del (Viewport *viewport);
+
+/* Allocate the rows of level 0 from y to y + height, to draw to with
+   viewport_canvas_row, which threads can then do at the same time. */
+void viewport_reserve (Viewport *viewport, int y, int height);
+
+/* A row of level 0 that was reserved. */
+uint32_t *viewport_canvas_row (Viewport *viewport, int y);
+
+/* A row of a level to read, the background where nothing was drawn. */
+const uint32_t *viewport_row (const Viewport *viewport, int level, int y);
+
+/* Downsample an area of level 0 that changed into the smaller levels. */
+void viewport_update_levels (Viewport *viewport, rect area);
+
+/* The part of the window showing an area of the canvas. */
+rect viewport_window_area (const Viewport *viewport, rect area);
+
+/* Fill a window area with what the viewport shows there, row by row. */
+void viewport_render (const Viewport *viewport, rect window_area,
+                      uint32_t *pixels);
+
+void viewport_to_canvas (const Viewport *viewport, double x, double y,
+                         double *canvas_x, double *canvas_y);
+
+/* These keep the center of the window in place. */
+void viewport_zoom (Viewport *viewport, int zoom);
+void viewport_resize (Viewport *viewport, int width, int height);
+
+/* Move by a number of window pixels. */
+void viewport_pan (Viewport *viewport, int dx, int dy);